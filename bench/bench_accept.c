@@ -0,0 +1,115 @@
+/*
+ * Cost of taking connections off the listen queue, one accept + fcntl per connection
+ * (network_accept + network_set_nonblocking, blocking listener) against
+ * network_accept_batch on an edge-triggered epoll listener.
+ *
+ * Each round connects BENCH_BURST clients over loopback, which the kernel completes on its
+ * own, then times only the server accepting all of them.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network.h"
+#include <arpa/inet.h>
+#include <time.h>
+
+#define BENCH_BURST 256
+#define BENCH_ROUNDS 200
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void connect_burst(struct sockaddr_in *addr, socket_t *clients) {
+    for (int i = 0; i < BENCH_BURST; i++) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(clients[i], (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+            printf("connect failed. %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// reset instead of FIN, so neither side is left with TIME_WAIT and ports can be reused
+static void close_burst(socket_t *clients, socket_t *servers) {
+    struct linger abort_close = { 1, 0 };
+    for (int i = 0; i < BENCH_BURST; i++) {
+        setsockopt(clients[i], SOL_SOCKET, SO_LINGER, &abort_close, sizeof(abort_close));
+        close(clients[i]);
+        close(servers[i]);
+    }
+}
+
+static double bench_single(struct sockaddr_in *addr, socket_t listener) {
+    socket_t clients[BENCH_BURST], servers[BENCH_BURST];
+    struct sockaddr_storage storage;
+    double total = 0;
+
+    // keep network_accept's "Client connected." from reaching the terminal, it still gets formatted and written
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        connect_burst(addr, clients);
+        double start = now_ns();
+        for (int i = 0; i < BENCH_BURST; i++) {
+            servers[i] = network_accept(listener, &storage);
+            network_set_nonblocking(servers[i]);
+        }
+        fflush(stdout);
+        total += now_ns() - start;
+        close_burst(clients, servers);
+    }
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(devnull);
+    return total / ((double)BENCH_ROUNDS * BENCH_BURST);
+}
+
+static double bench_batch(struct sockaddr_in *addr, socket_t listener) {
+    socket_t clients[BENCH_BURST], servers[BENCH_BURST];
+    network_accepted conns[64];
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+    double total = 0;
+
+    socket_t epfd = network_epoll_create();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        connect_burst(addr, clients);
+        double start = now_ns();
+        int accepted = 0;
+        while (accepted < BENCH_BURST) {
+            network_epoll_wait(epfd, &ev, 1, -1);
+            int n;
+            do {
+                n = network_accept_batch(listener, conns, 64);
+                for (int i = 0; i < n; i++) {
+                    servers[accepted++] = conns[i].fd;
+                }
+            } while (n == 64);
+        }
+        total += now_ns() - start;
+        close_burst(clients, servers);
+    }
+    network_epoll_close(epfd);
+    return total / ((double)BENCH_ROUNDS * BENCH_BURST);
+}
+
+int main(void) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    socket_t listener = network_listen_ex("127.0.0.1", "0", BENCH_BURST * 2, NETWORK_LISTEN_REUSEADDR);
+    getsockname(listener, (struct sockaddr *)&addr, &addrlen);
+    double single = bench_single(&addr, listener);
+    network_set_nonblocking(listener);
+    double batch = bench_batch(&addr, listener);
+    network_close(listener);
+
+    printf("network_accept + network_set_nonblocking: %7.0f ns/connection\n", single);
+    printf("network_accept_batch (accept4, epoll ET): %7.0f ns/connection (%.2fx)\n", batch, single / batch);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Request-lifetime workload: every request makes a few hundred small allocations of mixed
+ * sizes, touches them and is done with all of them at once. Compares plain malloc/free,
+ * tracked malloc/free, an arena reset after every request and the thread's scratch arena.
+ */
+#include "arena.h"
+#include "memorytracker.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_ALLOCS 256
+#define BENCH_REQUESTS 20000
+#define BENCH_REPEAT 5
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static size_t bench_size(size_t i) {
+    return 16 + (i * 37) % 240;
+}
+
+static double bench_untracked(void) {
+    void *blocks[BENCH_ALLOCS];
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            blocks[i] = (malloc)(bench_size(r + i));
+            *(volatile char *)blocks[i] = 1;
+        }
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            (free)(blocks[i]);
+        }
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+static double bench_tracked(void) {
+    void *blocks[BENCH_ALLOCS];
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            blocks[i] = malloc(bench_size(r + i));
+            *(volatile char *)blocks[i] = 1;
+        }
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            free(blocks[i]);
+        }
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+static struct f_arena *bench_request_arena;
+
+static double bench_arena(void) {
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            char *block = f_arenaAlloc(bench_request_arena, bench_size(r + i));
+            *(volatile char *)block = 1;
+        }
+        f_arenaClear(bench_request_arena);
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+static double bench_scratch(void) {
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        struct f_arena *scratch = f_arenaScratch();
+        struct f_arenaMark mark = f_arenaGetMark(scratch);
+        for (size_t i = 0; i < BENCH_ALLOCS; i++) {
+            char *block = f_arenaAlloc(scratch, bench_size(r + i));
+            *(volatile char *)block = 1;
+        }
+        f_arenaReset(scratch, mark);
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+// best of BENCH_REPEAT runs, the first one also pays for faulting the heap in
+static double bench_best(double (*bench)(void)) {
+    double best = bench();
+    for (int i = 1; i < BENCH_REPEAT; i++) {
+        double t = bench();
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+int main(void) {
+    // smaller than one request, so the arena has to grow and reuse its spare chunks
+    bench_request_arena = f_arenaCreate("request arena", 16 * 1024);
+
+    double untracked = bench_best(bench_untracked);
+    double tracked = bench_best(bench_tracked);
+    double arena = bench_best(bench_arena);
+    double scratch = bench_best(bench_scratch);
+
+    printf("%d allocations per request\n", BENCH_ALLOCS);
+    printf("untracked malloc+free: %8.1f ns/request\n", untracked);
+    printf("tracked malloc+free:   %8.1f ns/request (%.2fx untracked)\n", tracked, tracked / untracked);
+    printf("arena alloc+clear:     %8.1f ns/request (%.2fx untracked)\n", arena, arena / untracked);
+    printf("scratch mark+reset:    %8.1f ns/request (%.2fx untracked)\n", scratch, scratch / untracked);
+
+    f_arenaListArenas();
+    f_trackListSites(0);
+    f_arenaDestroy(bench_request_arena);
+    f_arenaScratchRelease();
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Request-scoped stb_ds containers: every request fills an array, an int hash map and a string
+ * hash map of header-like keys, looks everything up once and is done with them. Compares freeing
+ * each container with arrfree/hmfree/shfree, through untracked realloc/free and through the
+ * tracker, against containers made with f_arenaDs() and one f_arenaClear() per request.
+ */
+#include "arena.h"
+#include "memorytracker.h"
+#include "stb_ds.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_ITEMS 256
+#define BENCH_KEYS 64
+#define BENCH_HEADERS 24
+#define BENCH_REQUESTS 20000
+#define BENCH_REPEAT 5
+
+struct bench_entry
+{
+    int key;
+    int value;
+};
+
+struct bench_header
+{
+    char *key;
+    int value;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// an stbds_allocator on the untracked libc calls, counting them
+static size_t bench_calls;
+
+static void *bench_resize(stbds_allocator *allocator, void *ptr, size_t size) {
+    (void)allocator;
+    bench_calls++;
+    return (realloc)(ptr, size);
+}
+
+static void bench_release(stbds_allocator *allocator, void *ptr) {
+    (void)allocator;
+    bench_calls++;
+    (free)(ptr);
+}
+
+static stbds_allocator bench_libc = { bench_resize, bench_release };
+static char header_names[BENCH_HEADERS][32];
+static struct f_arena *bench_request_arena;
+static volatile int sink;
+
+// one request's worth of work on containers made with context, freeing them when asked to
+static void bench_request(void *context, size_t r, int release) {
+    int *items = NULL;
+    struct bench_entry *map = NULL;
+    struct bench_header *headers = NULL;
+    int sum = 0;
+
+    if (context) {
+        arrinit(items, context);
+        hminit(map, context);
+        shinit(headers, context);
+    } else {
+        sh_new_arena(headers);
+    }
+    for (int i = 0; i < BENCH_ITEMS; i++) {
+        arrput(items, i + (int)r);
+    }
+    for (int i = 0; i < BENCH_KEYS; i++) {
+        hmput(map, i * 7919, i);
+    }
+    for (int i = 0; i < BENCH_HEADERS; i++) {
+        shput(headers, header_names[i], i);
+    }
+    for (int i = 0; i < BENCH_KEYS; i++) {
+        sum += hmget(map, i * 7919) + items[i];
+    }
+    for (int i = 0; i < BENCH_HEADERS; i++) {
+        sum += shget(headers, header_names[i]);
+    }
+    sink = sum;
+    if (release) {
+        arrfree(items);
+        hmfree(map);
+        shfree(headers);
+    }
+}
+
+static double bench_untracked(void) {
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        bench_request(&bench_libc, r, 1);
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+static double bench_tracked(void) {
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        bench_request(NULL, r, 1);
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+static double bench_arena(void) {
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        bench_request(f_arenaDs(bench_request_arena), r, 0);
+        f_arenaClear(bench_request_arena);
+    }
+    return (now_ns() - start) / BENCH_REQUESTS;
+}
+
+// best of BENCH_REPEAT runs, the first one also pays for faulting the heap in
+static double bench_best(double (*bench)(void)) {
+    double best = bench();
+    for (int i = 1; i < BENCH_REPEAT; i++) {
+        double t = bench();
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+int main(void) {
+    for (int i = 0; i < BENCH_HEADERS; i++) {
+        snprintf(header_names[i], sizeof(header_names[i]), "x-request-header-%d", i);
+    }
+    bench_request_arena = f_arenaCreate("request arena", 0);
+
+    bench_calls = 0;
+    bench_request(&bench_libc, 0, 1);
+    size_t calls = bench_calls;
+    double untracked = bench_best(bench_untracked);
+    double tracked = bench_best(bench_tracked);
+    double arena = bench_best(bench_arena);
+
+    printf("%d array items, %d int keys and %d string keys per request, %zu realloc/free calls\n",
+           BENCH_ITEMS, BENCH_KEYS, BENCH_HEADERS, calls);
+    printf("untracked realloc+free: %8.1f ns/request\n", untracked);
+    printf("tracked realloc+free:   %8.1f ns/request (%.2fx untracked)\n", tracked, tracked / untracked);
+    printf("arena context+clear:    %8.1f ns/request (%.2fx untracked)\n", arena, arena / untracked);
+    printf("arena peak:             %8zu bytes/request\n", f_arenaPeak(bench_request_arena));
+
+    f_arenaDestroy(bench_request_arena);
+    f_trackListSites(0);
+    return 0;
+}
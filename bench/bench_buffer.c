@@ -0,0 +1,105 @@
+/*
+ * Many mostly idle connections, each getting a small message now and then: a 16K buffer
+ * per connection, memset after every read like the tests did, against a network_buffer_t
+ * per connection on one shared network_buffer_pool_t.
+ *
+ *   bench_buffer [connections] [rounds]
+ *
+ * Connections are AF_UNIX socketpairs. Every round each connection gets one message of
+ * 64..2048 bytes and is read once. Memory is the receive buffers only: the fixed buffers
+ * never shrink, the pool's is blocks at its peak (and what idle connections still hold).
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_buffer.h"
+#include <time.h>
+
+#define BENCH_CONNECTIONS 1000
+#define BENCH_ROUNDS 200
+#define BENCH_FIXED_SIZE (16 * 1024)
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void send_round(int (*pairs)[2], int n, unsigned *seed, const char *msg) {
+    for (int i = 0; i < n; i++) {
+        size_t len = 64 + rand_r(seed) % (2048 - 64);
+        if (write(pairs[i][0], msg, len) != (ssize_t)len) {
+            perror("write");
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : BENCH_CONNECTIONS;
+    int rounds = argc > 2 ? atoi(argv[2]) : BENCH_ROUNDS;
+    int (*pairs)[2] = calloc((size_t)n, sizeof(*pairs));
+    for (int i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) < 0) {
+            perror("socketpair, raise ulimit -n");
+            return 1;
+        }
+    }
+    static char msg[2048];
+    memset(msg, 'x', sizeof(msg));
+    size_t checksum = 0;
+
+    // a buffer that lives as long as the connection
+    char **fixed = calloc((size_t)n, sizeof(*fixed));
+    for (int i = 0; i < n; i++) {
+        fixed[i] = malloc(BENCH_FIXED_SIZE);
+        memset(fixed[i], 0, BENCH_FIXED_SIZE);
+    }
+    unsigned seed = 1;
+    double start = now_s();
+    for (int r = 0; r < rounds; r++) {
+        send_round(pairs, n, &seed, msg);
+        for (int i = 0; i < n; i++) {
+            ssize_t got = network_recv(pairs[i][1], fixed[i], BENCH_FIXED_SIZE);
+            checksum += (size_t)got;
+            memset(fixed[i], 0, BENCH_FIXED_SIZE);
+        }
+    }
+    double fixed_s = now_s() - start;
+    for (int i = 0; i < n; i++) {
+        free(fixed[i]);
+    }
+    free(fixed);
+
+    network_buffer_pool_t *pool = network_buffer_pool_create(0, 0);
+    network_buffer_t *bufs = calloc((size_t)n, sizeof(*bufs));
+    for (int i = 0; i < n; i++) {
+        network_buffer_init(&bufs[i], pool);
+    }
+    seed = 1;
+    start = now_s();
+    for (int r = 0; r < rounds; r++) {
+        send_round(pairs, n, &seed, msg);
+        for (int i = 0; i < n; i++) {
+            checksum -= (size_t)network_buffer_recv(pairs[i][1], &bufs[i]);
+            network_buffer_consume(&bufs[i], network_buffer_len(&bufs[i]));
+        }
+    }
+    double pool_s = now_s() - start;
+
+    double msgs = (double)n * rounds;
+    printf("%d connections, %d rounds%s\n", n, rounds, checksum ? ", bytes differ!" : "");
+    printf("fixed 16K buffers  %8.0f msgs/s  %8zu KB held\n",
+           msgs / fixed_s, (size_t)n * BENCH_FIXED_SIZE / 1024);
+    printf("buffer pool        %8.0f msgs/s  %8zu KB peak, %zu KB held by idle connections\n",
+           msgs / pool_s, pool->peak * pool->block_size / 1024,
+           (pool->allocated - pool->free_count) * pool->block_size / 1024);
+
+    for (int i = 0; i < n; i++) {
+        network_buffer_free(&bufs[i]);
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    free(bufs);
+    network_buffer_pool_destroy(pool);
+    free(pairs);
+    return 0;
+}
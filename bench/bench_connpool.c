@@ -0,0 +1,126 @@
+/*
+ * Request/response over loopback against an echo server on network_server_t: a new
+ * connection per request (network_connect_timeout, then close) against network_connpool_t
+ * handing the same connections out again.
+ *
+ *   bench_connpool [requests] [message bytes]
+ *
+ * The client is a forked process, so the server's threads don't share its CPU time
+ * accounting; TIME_WAIT sockets of the first run are left to the kernel.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_loop.h"
+#include "network_connpool.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_REQUESTS 10000
+#define BENCH_MSG 64
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void echo(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    network_loop_send(loop, watch, data, len);
+}
+
+static void release(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    (void)err;
+    free(watch);
+}
+
+static void serve(network_loop_t *loop, socket_t fd, const struct sockaddr_storage *addr, void *user) {
+    (void)addr;
+    (void)user;
+    network_watch_t *watch = calloc(1, sizeof(*watch));
+    watch->fd = fd;
+    watch->on_data = echo;
+    watch->on_close = release;
+    network_loop_add(loop, watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+}
+
+static int exchange(socket_t fd, const char *request, size_t len) {
+    char response[BENCH_MSG * 64];
+    if (network_send_all(fd, request, len) != (ssize_t)len) {
+        return -1;
+    }
+    for (size_t got = 0; got < len;) {
+        ssize_t n = recv(fd, response + got, len - got, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+static int run_client(const char *port, int requests, size_t len) {
+    static char request[BENCH_MSG * 64];
+    memset(request, 'x', len);
+
+    int failed = 0;
+    double start = now_s();
+    for (int i = 0; i < requests; i++) {
+        socket_t fd = network_connect_timeout("127.0.0.1", port, 1000);
+        if (fd < 0 || exchange(fd, request, len) < 0) {
+            failed++;
+        }
+        network_close(fd);
+    }
+    double fresh = now_s() - start;
+
+    network_connpool_t *pool = network_connpool_create(0, 0, 1000);
+    start = now_s();
+    for (int i = 0; i < requests; i++) {
+        socket_t fd = network_connpool_get(pool, "127.0.0.1", port);
+        if (fd >= 0 && exchange(fd, request, len) == 0) {
+            network_connpool_put(pool, "127.0.0.1", port, fd);
+        } else {
+            failed++;
+            network_close(fd);
+        }
+    }
+    double pooled = now_s() - start;
+    network_connpool_stats stats;
+    network_connpool_get_stats(pool, &stats);
+    network_connpool_destroy(pool);
+
+    printf("%d requests of %zu bytes%s\n", requests, len, failed ? ", some failed!" : "");
+    printf("connect per request  %8.0f req/s  %6.1f us each\n", requests / fresh, fresh * 1e6 / requests);
+    printf("connection pool      %8.0f req/s  %6.1f us each, hit rate %.4f, %llu connects\n",
+           requests / pooled, pooled * 1e6 / requests, network_connpool_hit_rate(&stats),
+           (unsigned long long)stats.misses);
+    return failed != 0;
+}
+
+int main(int argc, char **argv) {
+    int requests = argc > 1 ? atoi(argv[1]) : BENCH_REQUESTS;
+    size_t len = argc > 2 ? (size_t)atol(argv[2]) : BENCH_MSG;
+    if (len == 0 || len > BENCH_MSG * 64) {
+        fprintf(stderr, "message is 1 to %d bytes\n", BENCH_MSG * 64);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    network_server_t server;
+    memset(&server, 0, sizeof(server));
+    server.port = "0";
+    server.workers = 1;
+    server.on_accept = serve;
+    if (network_server_start(&server) < 0) {
+        return 1;
+    }
+    pid_t client = fork();
+    if (client == 0) {
+        return run_client(server.bound_port, requests, len);
+    }
+    int status = 0;
+    waitpid(client, &status, 0);
+    network_server_stop(&server);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,120 @@
+/*
+ * Small length-prefixed messages over loopback TCP. The sender either writes every frame
+ * with its own network_sendv (prefix + payload), or queues a batch with network_frame_write
+ * and sends it with one network_frame_flush. A forked reader parses them with
+ * network_frame_next and answers with one byte per batch, so both sides stay in step.
+ *
+ *   bench_frame [frames] [payload bytes] [batch]
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_frame.h"
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_FRAMES 1000000
+#define BENCH_PAYLOAD 64
+#define BENCH_BATCH 32
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void reader(socket_t fd, int batch) {
+    network_buffer_pool_t *pool = network_buffer_pool_create(0, 0);
+    network_framer_t framer;
+    network_framer_init(&framer, pool, NETWORK_FRAME_U32, 0);
+    long frames = 0;
+    while (network_frame_recv(fd, &framer) > 0) {
+        data frame;
+        while (network_frame_next(&framer, &frame) == 1) {
+            if (++frames % batch == 0 && write(fd, "k", 1) != 1) {
+                _exit(1);
+            }
+        }
+    }
+    network_framer_free(&framer);
+    network_buffer_pool_destroy(pool);
+    _exit(0);
+}
+
+static socket_t connect_reader(socket_t listener, int batch, pid_t *pid) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+    *pid = fork();
+    if (*pid == 0) {
+        socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+            _exit(1);
+        }
+        reader(fd, batch);
+    }
+    struct sockaddr_storage peer;
+    socket_t fd = network_accept(listener, &peer);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static double run(socket_t listener, int coalesce, long frames, size_t size, int batch) {
+    pid_t pid;
+    socket_t fd = connect_reader(listener, batch, &pid);
+    network_buffer_pool_t *pool = network_buffer_pool_create(0, 0);
+    network_framer_t framer;
+    network_framer_init(&framer, pool, NETWORK_FRAME_U32, 0);
+    char payload[BENCH_PAYLOAD * 64];
+    memset(payload, 'p', sizeof(payload));
+    unsigned char header[4] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+                                (unsigned char)(size >> 8), (unsigned char)size };
+    struct iovec iov[2] = { { header, 4 }, { payload, size } };
+
+    double start = now_s();
+    for (long sent = 0; sent < frames; sent += batch) {
+        for (int i = 0; i < batch; i++) {
+            if (coalesce) {
+                network_frame_write(&framer, payload, size);
+            } else {
+                network_sendv(fd, iov, 2);
+            }
+        }
+        if (coalesce) {
+            network_frame_flush(fd, &framer);
+        }
+        char ack;
+        if (read(fd, &ack, 1) != 1) {
+            break;
+        }
+    }
+    double took = now_s() - start;
+    network_close(fd);
+    waitpid(pid, NULL, 0);
+    network_framer_free(&framer);
+    network_buffer_pool_destroy(pool);
+    return (double)frames / took;
+}
+
+int main(int argc, char **argv) {
+    long frames = argc > 1 ? atol(argv[1]) : BENCH_FRAMES;
+    size_t size = argc > 2 ? (size_t)atol(argv[2]) : BENCH_PAYLOAD;
+    int batch = argc > 3 ? atoi(argv[3]) : BENCH_BATCH;
+    if (size > BENCH_PAYLOAD * 64 || batch < 1) {
+        fprintf(stderr, "payload is at most %d bytes, batch at least 1\n", BENCH_PAYLOAD * 64);
+        return 1;
+    }
+    frames -= frames % batch;
+    socket_t listener = network_listen_on("127.0.0.1", "0");
+    if (listener < 0) {
+        return 1;
+    }
+    double single = run(listener, 0, frames, size, batch);
+    double coalesced = run(listener, 1, frames, size, batch);
+    printf("%ld frames of %zu bytes, %d per batch\n", frames, size, batch);
+    printf("sendv per frame      %10.0f frames/s\n", single);
+    printf("coalesced flush      %10.0f frames/s  (%.1fx)\n", coalesced, coalesced / single);
+    network_close(listener);
+    return 0;
+}
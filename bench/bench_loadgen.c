@@ -0,0 +1,268 @@
+/*
+ * Load generator for any TCP echo server: keeps connections busy with requests of a given size,
+ * pipelining up to depth requests per connection, and reports throughput and latency percentiles.
+ *
+ *   bench_loadgen [host] [port] [connections] [size] [depth] [seconds] [threads]
+ *
+ * Defaults to 100 connections on 127.0.0.1:8080, 64 byte requests, one at a time, for 5 seconds
+ * on one thread; sockets/tests/test_loop_echo_server.c is an echo server on that port. host "self"
+ * forks an echo server on network_loop_t first and runs against that.
+ *
+ * Connections are spread over the threads, each thread runs its own network_loop_t. A request's
+ * latency is from its send to the last byte of its echo, the clock is read once per receive, so
+ * requests that complete in the same read share a time. Everything is connected before the clock
+ * starts. Each connection keeps depth requests' send times in a ring; the echo comes back in order.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_loop.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_CONNS 100
+#define BENCH_MSG 64
+#define BENCH_DEPTH 1
+#define BENCH_SECONDS 5
+#define BENCH_THREADS 1
+
+struct client;
+
+struct conn {
+    network_watch_t watch;
+    struct client *client;
+    size_t received;   // bytes of the oldest request's echo
+    uint64_t *sent_at; // depth send times, oldest at head
+    unsigned head, inflight;
+};
+
+struct client {
+    pthread_t thread;
+    network_loop_t *loop;
+    network_timer_t done;
+    struct conn *conns;
+    int nconns;
+    int opened;        // conns connected, the rest couldn't be
+    int running;
+    uint64_t responses;
+    int errors;
+    network_histogram_t latency; // ns
+};
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static size_t msg_size = BENCH_MSG;
+static unsigned depth = BENCH_DEPTH;
+static int seconds = BENCH_SECONDS;
+static char *request;
+
+static void request_send(network_loop_t *loop, struct conn *conn, uint64_t now) {
+    conn->sent_at[(conn->head + conn->inflight) % depth] = now;
+    conn->inflight++;
+    network_loop_send(loop, &conn->watch, request, msg_size);
+}
+
+static void response(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    (void)data;
+    struct conn *conn = watch->user;
+    struct client *client = conn->client;
+    uint64_t now = network_stats_now_ns();
+    conn->received += len;
+    while (conn->received >= msg_size && conn->inflight > 0) {
+        conn->received -= msg_size;
+        network_hist_add(&client->latency, now - conn->sent_at[conn->head]);
+        conn->head = (conn->head + 1) % depth;
+        conn->inflight--;
+        client->responses++;
+        if (client->running) {
+            request_send(loop, conn, now);
+        }
+    }
+}
+
+static void dropped(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    (void)err;
+    struct conn *conn = watch->user;
+    if (conn->client->running) {
+        conn->client->errors++;
+    }
+}
+
+static void finished(network_loop_t *loop, network_timer_t *timer) {
+    struct client *client = timer->user;
+    client->running = 0;
+    network_loop_stop(loop);
+}
+
+static void *run_client(void *arg) {
+    struct client *client = arg;
+    uint64_t now = network_stats_now_ns();
+    client->running = 1;
+    for (int i = 0; i < client->opened; i++) {
+        struct conn *conn = &client->conns[i];
+        for (unsigned d = 0; d < depth; d++) {
+            request_send(client->loop, conn, now);
+        }
+    }
+    client->done.on_expire = finished;
+    client->done.user = client;
+    network_loop_timer_start(client->loop, &client->done, (uint64_t)seconds * 1000);
+    network_loop_run(client->loop);
+    return NULL;
+}
+
+/* the "self" server, in a child process */
+static void echo(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    network_loop_send(loop, watch, data, len);
+}
+
+static void echo_closed(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    (void)err;
+    free(watch);
+}
+
+static void echo_accept(network_loop_t *loop, network_watch_t *listener, socket_t fd, const struct sockaddr_storage *addr) {
+    (void)listener;
+    (void)addr;
+    network_watch_t *watch = calloc(1, sizeof(*watch));
+    watch->fd = fd;
+    watch->on_data = echo;
+    watch->on_close = echo_closed;
+    network_loop_add(loop, watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+}
+
+static pid_t spawn_echo(char *port, size_t size) {
+    socket_t fd = network_listen_ex("127.0.0.1", "0", 0, NETWORK_LISTEN_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    snprintf(port, size, "%d", ntohs(addr.sin_port));
+    pid_t pid = fork();
+    if (pid == 0) {
+        network_loop_t *loop = network_loop_create(0);
+        network_watch_t listener;
+        memset(&listener, 0, sizeof(listener));
+        listener.fd = fd;
+        listener.on_accept = echo_accept;
+        network_loop_add(loop, &listener, NETWORK_EV_READ);
+        network_loop_run(loop);
+        _exit(0);
+    }
+    close(fd);
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    char port[16];
+    snprintf(port, sizeof(port), "%s", argc > 2 ? argv[2] : "8080");
+    int nconns = argc > 3 ? atoi(argv[3]) : BENCH_CONNS;
+    msg_size = argc > 4 ? (size_t)atol(argv[4]) : BENCH_MSG;
+    depth = argc > 5 ? (unsigned)atoi(argv[5]) : BENCH_DEPTH;
+    seconds = argc > 6 ? atoi(argv[6]) : BENCH_SECONDS;
+    int nthreads = argc > 7 ? atoi(argv[7]) : BENCH_THREADS;
+    if (nconns < 1 || msg_size < 1 || depth < 1 || seconds < 1 || nthreads < 1) {
+        fprintf(stderr, "usage: %s [host] [port] [connections] [size] [depth] [seconds] [threads]\n", argv[0]);
+        return 1;
+    }
+    if (nthreads > nconns) {
+        nthreads = nconns;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server = -1;
+    if (strcmp(host, "self") == 0) {
+        host = "127.0.0.1";
+        server = spawn_echo(port, sizeof(port));
+        if (server < 0) {
+            return 1;
+        }
+    }
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        return 1;
+    }
+    memcpy(&target, res->ai_addr, res->ai_addrlen);
+    target_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    request = malloc(msg_size);
+    memset(request, 'x', msg_size);
+    struct client *clients = calloc((size_t)nthreads, sizeof(*clients));
+    int opened = 0;
+    for (int t = 0; t < nthreads; t++) {
+        struct client *client = &clients[t];
+        client->nconns = nconns / nthreads + (t < nconns % nthreads);
+        client->conns = calloc((size_t)client->nconns, sizeof(*client->conns));
+        client->loop = network_loop_create(1024);
+        for (int i = 0; i < client->nconns; i++) {
+            struct conn *conn = &client->conns[client->opened];
+            socket_t fd = network_connect_addr((struct sockaddr *)&target, target_len, 5000, NETWORK_CONNECT_NONBLOCK);
+            if (fd < 0) {
+                break; // ulimit -n, or the server's backlog
+            }
+            conn->client = client;
+            conn->sent_at = calloc(depth, sizeof(*conn->sent_at));
+            conn->watch.fd = fd;
+            conn->watch.on_data = response;
+            conn->watch.on_close = dropped;
+            conn->watch.user = conn;
+            network_loop_add(client->loop, &conn->watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+            client->opened++;
+        }
+        opened += client->opened;
+    }
+    if (opened == 0) {
+        fprintf(stderr, "no connection to %s:%s\n", host, port);
+        return 1;
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        pthread_create(&clients[t].thread, NULL, run_client, &clients[t]);
+    }
+    network_histogram_t *latency = calloc(1, sizeof(*latency));
+    uint64_t responses = 0;
+    int errors = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(clients[t].thread, NULL);
+        network_hist_merge(latency, &clients[t].latency);
+        responses += clients[t].responses;
+        errors += clients[t].errors;
+    }
+
+    double rate = (double)responses / seconds;
+    printf("%s:%s, %d connections (%d opened), %zu bytes, depth %u, %d threads, %d seconds:\n",
+           host, port, nconns, opened, msg_size, depth, nthreads, seconds);
+    printf("  %.0f req/s, %.1f MB/s each way, %d connections dropped\n", rate, rate * (double)msg_size / 1e6, errors);
+    printf("  latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+           network_hist_percentile(latency, 50) / 1e3, network_hist_percentile(latency, 99) / 1e3,
+           network_hist_percentile(latency, 99.9) / 1e3, latency->max / 1e3,
+           latency->count ? (double)latency->sum / (double)latency->count / 1e3 : 0.0);
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < clients[t].opened; i++) {
+            network_loop_close(clients[t].loop, &clients[t].conns[i].watch, 0);
+            free(clients[t].conns[i].sent_at);
+        }
+        network_loop_destroy(clients[t].loop);
+        free(clients[t].conns);
+    }
+    free(clients);
+    free(latency);
+    free(request);
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    return 0;
+}
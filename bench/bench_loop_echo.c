@@ -0,0 +1,155 @@
+/*
+ * Echo server on network_loop_t, driven by a client process that keeps BENCH_CONNS
+ * connections busy with ping-pong requests of BENCH_MSG bytes over loopback.
+ *
+ *   bench_loop_echo [connections] [seconds] [workers]
+ *
+ * With 1 worker (the default) the server is a single loop on a single thread, more
+ * workers run in server mode, each with its own SO_REUSEPORT listener and loop.
+ * Server and client are separate processes, so each has its own fd limit (ulimit -n).
+ *
+ * bench_loop_echo_uring is the same built with NETWORK_LOOP_IO_URING; NETWORK_LOOP_BACKEND=epoll
+ * runs it on epoll again for a comparison on the same binary.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_loop.h"
+#include "pool.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#define BENCH_CONNS 10000
+#define BENCH_SECONDS 5
+#define BENCH_MSG 64
+
+struct conn {
+    network_watch_t watch;
+    size_t received; // bytes of the current response, client side
+};
+
+static struct f_pool *conns;
+static size_t responses;
+static char request[BENCH_MSG];
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void release(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    (void)err;
+    f_poolFree(conns, watch->user);
+}
+
+/* server */
+static void echo(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    network_loop_send(loop, watch, data, len);
+}
+
+static void serve(network_loop_t *loop, socket_t fd, const struct sockaddr_storage *addr, void *user) {
+    (void)addr;
+    (void)user;
+    struct conn *conn = f_poolAlloc(conns);
+    memset(conn, 0, sizeof(*conn));
+    conn->watch.fd = fd;
+    conn->watch.on_data = echo;
+    conn->watch.on_close = release;
+    conn->watch.user = conn;
+    network_loop_add(loop, &conn->watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+}
+
+/* client */
+static void pong(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    (void)data;
+    struct conn *conn = watch->user;
+    conn->received += len;
+    while (conn->received >= BENCH_MSG) {
+        conn->received -= BENCH_MSG;
+        responses++;
+        network_loop_send(loop, watch, request, BENCH_MSG);
+    }
+}
+
+static void connected(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    (void)events;
+    network_loop_mod(loop, watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+    network_loop_send(loop, watch, request, BENCH_MSG);
+}
+
+static int run_client(struct sockaddr_in *addr, int nconns, int seconds) {
+    network_loop_t *loop = network_loop_create(1024);
+    int opened = 0;
+
+    for (int i = 0; i < nconns; i++) {
+        socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            break;
+        }
+        if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            break;
+        }
+        struct conn *conn = f_poolAlloc(conns);
+        memset(conn, 0, sizeof(*conn));
+        conn->watch.fd = fd;
+        conn->watch.on_data = pong;
+        conn->watch.on_writable = connected;
+        conn->watch.on_close = release;
+        conn->watch.user = conn;
+        network_loop_add(loop, &conn->watch, NETWORK_EV_READ | NETWORK_EV_WRITE | NETWORK_EV_EDGE);
+        opened++;
+    }
+
+    // let every connection get through the handshake before counting
+    double warmup = now_s() + 1;
+    while (now_s() < warmup) {
+        network_loop_run_once(loop, 100);
+    }
+    responses = 0;
+    double start = now_s(), end = start + seconds;
+    while (now_s() < end) {
+        network_loop_run_once(loop, 100);
+    }
+    double elapsed = now_s() - start;
+
+    printf("%s, %d connections, %d seconds: %.0f req/s (%zu still open)\n",
+           network_loop_backend_name(loop), opened, seconds, (double)responses / elapsed, loop->watches);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int nconns = argc > 1 ? atoi(argv[1]) : BENCH_CONNS;
+    int seconds = argc > 2 ? atoi(argv[2]) : BENCH_SECONDS;
+    int workers = argc > 3 ? atoi(argv[3]) : 1;
+    network_server_t server;
+    struct sockaddr_in addr;
+
+    memset(request, 'x', sizeof(request));
+    signal(SIGPIPE, SIG_IGN);
+    conns = f_poolCreate("connections", sizeof(struct conn), 0);
+
+    memset(&server, 0, sizeof(server));
+    server.port = "0";
+    server.backlog = 4096; // a connect storm of BENCH_CONNS
+    server.workers = workers;
+    server.on_accept = serve;
+    if (network_server_start(&server) < 0) {
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(server.bound_port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    pid_t client = fork();
+    if (client == 0) {
+        return run_client(&addr, nconns, seconds);
+    }
+    waitpid(client, NULL, 0);
+    network_server_stop(&server);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Per-operation cost of tracked malloc/free at different numbers of live blocks.
+ *
+ * For every live count it first fills the tracker with that many blocks, then
+ * frees a random live block and allocates a replacement, so the registry stays
+ * at the same size while being measured.
+ */
+#include "memorytracker.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_OPS 200000
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static size_t xorshift(size_t *state) {
+    size_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void bench_live(size_t live) {
+    void **blocks = malloc(live * sizeof(void *));
+    size_t rng = 0x9E3779B97F4A7C15u;
+    size_t i;
+
+    double start = now_ns();
+    for (i = 0; i < live; i++) {
+        blocks[i] = malloc(16 + (i & 63));
+    }
+    double fill = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_OPS; i++) {
+        size_t victim = xorshift(&rng) % live;
+        free(blocks[victim]);
+        blocks[victim] = malloc(16 + (i & 63));
+    }
+    double churn = now_ns() - start;
+
+    printf("%8zu live: malloc %7.1f ns/op, free+malloc %7.1f ns/op (%zu tracked)\n",
+           live, fill / (double)live, churn / BENCH_OPS, f_trackCount());
+
+    for (i = 0; i < live; i++) {
+        free(blocks[i]);
+    }
+    free(blocks);
+}
+
+int main(void) {
+    bench_live(1000);
+    bench_live(100000);
+    bench_live(1000000);
+    return 0;
+}
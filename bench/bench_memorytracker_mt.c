@@ -0,0 +1,67 @@
+/*
+ * Allocation-heavy multi-threaded benchmark for the sharded memorytracker registry.
+ *
+ * Every thread keeps its own set of live blocks and keeps replacing random ones,
+ * so the only shared state is the tracker itself. With the registry sharded the
+ * throughput should grow close to linearly with the number of threads.
+ */
+#include "memorytracker.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_LIVE_PER_THREAD 10000
+#define BENCH_OPS_PER_THREAD 500000
+#define BENCH_MAX_THREADS 16
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *churn(void *arg) {
+    size_t rng = (size_t)arg * 0x9E3779B97F4A7C15u + 1;
+    void **blocks = malloc(BENCH_LIVE_PER_THREAD * sizeof(void *));
+    size_t i;
+
+    for (i = 0; i < BENCH_LIVE_PER_THREAD; i++) {
+        blocks[i] = malloc(32);
+    }
+    for (i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t victim = rng % BENCH_LIVE_PER_THREAD;
+        free(blocks[victim]);
+        blocks[victim] = malloc(16 + (i & 127));
+    }
+    for (i = 0; i < BENCH_LIVE_PER_THREAD; i++) {
+        free(blocks[i]);
+    }
+    free(blocks);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    double base = 0;
+
+    for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+        double start = now_ns();
+        for (int t = 0; t < n; t++) {
+            pthread_create(&threads[t], NULL, churn, (void *)(size_t)(t + 1));
+        }
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double elapsed = now_ns() - start;
+        double mops = (double)n * BENCH_OPS_PER_THREAD / elapsed * 1e3;
+        if (n == 1) {
+            base = mops;
+        }
+        printf("%2d threads: %7.2f M free+malloc/s (%.2fx, %zu still tracked)\n",
+               n, mops, mops / base, f_trackCount());
+    }
+    return 0;
+}
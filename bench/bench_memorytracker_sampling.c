@@ -0,0 +1,89 @@
+/*
+ * Overhead of memorytracker on an allocation microbenchmark, with every allocation
+ * recorded and with sampling at F_TRACK_DEFAULT_SAMPLE_RATE, against plain malloc.
+ *
+ * Each round allocates a window of blocks of mixed sizes, touches them and frees
+ * them again, roughly what a request handler does with its temporaries. The last
+ * line is sampling's overhead over untracked malloc against its target, under 2%.
+ */
+#include "memorytracker.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_WINDOW 64
+#define BENCH_ROUNDS 200000
+#define BENCH_REPEAT 5
+#define BENCH_TARGET 2.0 // percent over untracked malloc that sampling may cost
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static size_t bench_size(size_t i) {
+    return 16 + (i * 37) % 512;
+}
+
+static double bench_untracked(void) {
+    void *blocks[BENCH_WINDOW];
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_ROUNDS; r++) {
+        for (size_t i = 0; i < BENCH_WINDOW; i++) {
+            blocks[i] = (malloc)(bench_size(r + i));
+            *(volatile char *)blocks[i] = 1;
+        }
+        for (size_t i = 0; i < BENCH_WINDOW; i++) {
+            (free)(blocks[i]);
+        }
+    }
+    return (now_ns() - start) / ((double)BENCH_ROUNDS * BENCH_WINDOW);
+}
+
+static double bench_tracked(void) {
+    void *blocks[BENCH_WINDOW];
+    double start = now_ns();
+    for (size_t r = 0; r < BENCH_ROUNDS; r++) {
+        for (size_t i = 0; i < BENCH_WINDOW; i++) {
+            blocks[i] = malloc(bench_size(r + i));
+            *(volatile char *)blocks[i] = 1;
+        }
+        for (size_t i = 0; i < BENCH_WINDOW; i++) {
+            free(blocks[i]);
+        }
+    }
+    return (now_ns() - start) / ((double)BENCH_ROUNDS * BENCH_WINDOW);
+}
+
+// best of BENCH_REPEAT runs, the first one also pays for faulting the heap in
+static double bench_best(double (*bench)(void)) {
+    double best = bench();
+    for (int i = 1; i < BENCH_REPEAT; i++) {
+        double t = bench();
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+int main(void) {
+    double untracked = bench_best(bench_untracked);
+    double tracked = bench_best(bench_tracked);
+    // untracked and sampled runs take turns, so the machine getting busier or quieter
+    // halfway through doesn't land on one side of the comparison
+    f_trackSetSampleRate(F_TRACK_DEFAULT_SAMPLE_RATE);
+    double sampled = bench_tracked();
+    for (int i = 0; i < BENCH_REPEAT * 2; i++) {
+        double u = bench_untracked(), s = bench_tracked();
+        untracked = u < untracked ? u : untracked;
+        sampled = s < sampled ? s : sampled;
+    }
+
+    printf("untracked malloc+free: %6.1f ns/op\n", untracked);
+    printf("tracked malloc+free:   %6.1f ns/op (%+.1f%%)\n", tracked, (tracked / untracked - 1) * 100);
+    double overhead = (sampled / untracked - 1) * 100;
+    printf("sampled malloc+free:   %6.1f ns/op (%+.1f%%, every %d bytes)\n",
+           sampled, overhead, F_TRACK_DEFAULT_SAMPLE_RATE);
+    printf("sampling overhead over untracked: %+.1f%%, target under %.0f%%: %s\n", overhead, BENCH_TARGET,
+           overhead < BENCH_TARGET ? "met" : "missed");
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Request/response round trips where the client writes each request as a 4 byte header
+ * and then the body, the way a naive RPC client does, with TCP_NODELAY off and on.
+ * With Nagle on, the body waits for the ACK of the header, which the server delays.
+ *
+ *   bench_nodelay [round trips] [body bytes]
+ *
+ * Both ends get their options from network_set_sockopts, the server is a forked process.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network.h"
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_ROUNDS 50
+#define BENCH_BODY 60
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int read_full(socket_t fd, char *buf, size_t len) {
+    for (size_t got = 0; got < len;) {
+        ssize_t n = recv(fd, buf + got, len - got, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+static double run(int nodelay, int rounds, size_t body) {
+    network_sockopts opts = network_sockopts_default();
+    opts.nodelay = nodelay;
+    network_set_sockopts(&opts);
+
+    socket_t listener = network_listen_on("127.0.0.1", "0");
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+
+    char buf[4 + 4096];
+    pid_t server = fork();
+    if (server == 0) {
+        struct sockaddr_storage peer;
+        socket_t fd = network_accept(listener, &peer);
+        // answer once the whole request is in, a bare echo would hide the wait
+        while (read_full(fd, buf, 4 + body) == 0 && network_send_all(fd, buf, 4 + body) > 0) {
+        }
+        _exit(0);
+    }
+    network_close(listener);
+
+    socket_t fd = network_connect_timeout("127.0.0.1", port, 1000);
+    if (fd < 0) {
+        return 0;
+    }
+    memset(buf, 'x', sizeof(buf));
+    double start = now_s();
+    for (int i = 0; i < rounds; i++) {
+        network_send_all(fd, buf, 4);
+        network_send_all(fd, buf + 4, body);
+        if (read_full(fd, buf, 4 + body) < 0) {
+            break;
+        }
+    }
+    double took = now_s() - start;
+    network_close(fd);
+    waitpid(server, NULL, 0);
+    return took * 1e6 / rounds;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+    size_t body = argc > 2 ? (size_t)atol(argv[2]) : BENCH_BODY;
+    if (body == 0 || body > 4096) {
+        fprintf(stderr, "body is 1 to 4096 bytes\n");
+        return 1;
+    }
+    double nagle = run(0, rounds, body);
+    double nodelay = run(1, rounds, body);
+    printf("%d round trips, 4 + %zu bytes each\n", rounds, body);
+    printf("TCP_NODELAY off  %10.1f us per round trip\n", nagle);
+    printf("TCP_NODELAY on   %10.1f us per round trip\n", nodelay);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Connection churn: every thread keeps a set of live fixed-size connection structs and keeps
+ * closing random ones and accepting new ones. Compares plain malloc/free, tracked malloc/free
+ * and a pool, with and without its objects registered in memorytracker, for 1 to 8 threads.
+ */
+#include "pool.h"
+#include "memorytracker.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_LIVE_PER_THREAD 1000
+#define BENCH_OPS_PER_THREAD 1000000
+#define BENCH_MAX_THREADS 8
+#define BENCH_CONN_SIZE 192
+
+enum bench_kind { BENCH_UNTRACKED, BENCH_TRACKED, BENCH_POOL, BENCH_POOL_TRACKED };
+
+static const char *bench_names[] = { "untracked malloc", "tracked malloc", "pool", "pool + tracking" };
+static struct f_pool *bench_pool;
+static enum bench_kind bench_kind;
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *conn_new(void) {
+    switch (bench_kind) {
+    case BENCH_UNTRACKED: return (malloc)(BENCH_CONN_SIZE);
+    case BENCH_TRACKED: return malloc(BENCH_CONN_SIZE);
+    default: return f_poolAlloc(bench_pool);
+    }
+}
+
+static void conn_close(void *conn) {
+    switch (bench_kind) {
+    case BENCH_UNTRACKED: (free)(conn); break;
+    case BENCH_TRACKED: free(conn); break;
+    default: f_poolFree(bench_pool, conn); break;
+    }
+}
+
+static void *churn(void *arg) {
+    size_t rng = (size_t)arg * 0x9E3779B97F4A7C15u + 1;
+    void *conns[BENCH_LIVE_PER_THREAD];
+    size_t i;
+
+    for (i = 0; i < BENCH_LIVE_PER_THREAD; i++) {
+        conns[i] = conn_new();
+    }
+    for (i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t victim = rng % BENCH_LIVE_PER_THREAD;
+        conn_close(conns[victim]);
+        conns[victim] = conn_new();
+        *(volatile char *)conns[victim] = 1;
+    }
+    for (i = 0; i < BENCH_LIVE_PER_THREAD; i++) {
+        conn_close(conns[i]);
+    }
+    f_poolThreadFlush();
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[BENCH_MAX_THREADS];
+
+    for (int kind = BENCH_UNTRACKED; kind <= BENCH_POOL_TRACKED; kind++) {
+        bench_kind = kind;
+        if (kind >= BENCH_POOL) {
+            bench_pool = f_poolCreate("connections", BENCH_CONN_SIZE, kind == BENCH_POOL_TRACKED ? F_POOL_TRACK_OBJECTS : 0);
+        }
+        for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+            double start = now_ns();
+            for (int t = 0; t < n; t++) {
+                pthread_create(&threads[t], NULL, churn, (void *)(size_t)(t + 1));
+            }
+            for (int t = 0; t < n; t++) {
+                pthread_join(threads[t], NULL);
+            }
+            double elapsed = now_ns() - start;
+            printf("%-16s %d threads: %7.2f M close+accept/s\n",
+                   bench_names[kind], n, (double)n * BENCH_OPS_PER_THREAD / elapsed * 1e3);
+        }
+        if (bench_pool) {
+            struct f_poolStats stats;
+            f_poolGetStats(bench_pool, &stats);
+            printf("%zu byte objects, %zu slabs with room for %zu, %zu free in the depot\n",
+                   stats.objectSize, stats.slabs, stats.capacity, stats.depot);
+            f_poolDestroy(bench_pool);
+            bench_pool = NULL;
+        }
+    }
+    printf("%zu still tracked\n", f_trackCount());
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Handing pointers from producer threads to an event loop's thread, two ways: network_queue_t
+ * attached to the loop, and a ring under a mutex with an eventfd write on every push, which is
+ * what a loop without a queue of its own ends up with.
+ *
+ *   bench_queue [producers] [items] [batch]
+ *
+ * Every producer pushes items pointers, batch at a time, and spins while the queue is full; the
+ * loop takes them in on_items and stops once all of them came in. Reported are items a second and
+ * how many times the loop was woken for them. A second run pops from consumer threads of its own,
+ * without a loop, to show the queue with several threads on both sides.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_queue.h"
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_PRODUCERS 4
+#define BENCH_ITEMS 2000000
+#define BENCH_BATCH 16
+#define BENCH_CAPACITY 4096
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static long items_each = BENCH_ITEMS;
+static int batch = BENCH_BATCH;
+static long expected;
+static long received;
+static uint64_t checksum;
+
+/* network_queue_t */
+static network_queue_t *queue;
+
+static void *produce(void *arg) {
+    uintptr_t base = (uintptr_t)arg * (uintptr_t)items_each;
+    void *items[256];
+    for (long i = 0; i < items_each; i += batch) {
+        size_t n = (size_t)(items_each - i < batch ? items_each - i : batch);
+        for (size_t j = 0; j < n; j++) {
+            items[j] = (void *)(base + (uintptr_t)i + j + 1);
+        }
+        size_t pushed = 0;
+        unsigned spins = 0;
+        while (pushed < n) {
+            size_t k = network_queue_push_batch(queue, items + pushed, n - pushed);
+            if (k == 0) {
+                network_queue_backoff(&spins);
+            }
+            pushed += k;
+        }
+    }
+    return NULL;
+}
+
+static void arrived(network_loop_t *loop, network_queue_t *q, void **items, size_t count) {
+    (void)q;
+    for (size_t i = 0; i < count; i++) {
+        checksum += (uintptr_t)items[i];
+    }
+    received += (long)count;
+    if (received == expected) {
+        network_loop_stop(loop);
+    }
+}
+
+/* mutex, ring and an eventfd write per push */
+static pthread_mutex_t locked_lock = PTHREAD_MUTEX_INITIALIZER;
+static void **locked_ring;
+static size_t locked_head, locked_tail;
+static network_watch_t locked_wake;
+static uint64_t locked_wakes;
+
+static void *produce_locked(void *arg) {
+    uintptr_t base = (uintptr_t)arg * (uintptr_t)items_each;
+    for (long i = 0; i < items_each; i += batch) {
+        size_t n = (size_t)(items_each - i < batch ? items_each - i : batch);
+        size_t pushed = 0;
+        while (pushed < n) {
+            pthread_mutex_lock(&locked_lock);
+            while (pushed < n && locked_tail - locked_head < BENCH_CAPACITY) {
+                locked_ring[locked_tail++ % BENCH_CAPACITY] = (void *)(base + (uintptr_t)i + pushed + 1);
+                pushed++;
+            }
+            pthread_mutex_unlock(&locked_lock);
+            uint64_t one = 1;
+            if (write(locked_wake.fd, &one, sizeof(one)) < 0) {
+                break;
+            }
+            __atomic_fetch_add(&locked_wakes, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void locked_woken(network_loop_t *loop, network_watch_t *wake, uint32_t events) {
+    (void)events;
+    uint64_t value;
+    if (read(wake->fd, &value, sizeof(value)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&locked_lock);
+    while (locked_head < locked_tail) {
+        checksum += (uintptr_t)locked_ring[locked_head++ % BENCH_CAPACITY];
+        received++;
+    }
+    pthread_mutex_unlock(&locked_lock);
+    if (received == expected) {
+        network_loop_stop(loop);
+    }
+}
+
+/* consumer threads popping themselves */
+static long taken;
+
+static void *consume(void *arg) {
+    (void)arg;
+    void *items[BENCH_BATCH];
+    uint64_t sum = 0;
+    unsigned spins = 0;
+    while (__atomic_load_n(&taken, __ATOMIC_RELAXED) < expected) {
+        size_t n = network_queue_pop_batch(queue, items, BENCH_BATCH);
+        for (size_t i = 0; i < n; i++) {
+            sum += (uintptr_t)items[i];
+        }
+        if (n == 0) {
+            network_queue_backoff(&spins);
+        } else {
+            spins = 0;
+        }
+        __atomic_fetch_add(&taken, (long)n, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&checksum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void report(const char *what, double secs, uint64_t wakes, uint64_t want) {
+    printf("  %-28s %6.1f M items/s  %9llu wakeups  %s\n", what, (double)expected / secs / 1e6,
+           (unsigned long long)wakes, checksum == want ? "ok" : "ITEMS LOST");
+}
+
+int main(int argc, char **argv) {
+    int producers = argc > 1 ? atoi(argv[1]) : BENCH_PRODUCERS;
+    items_each = argc > 2 ? atol(argv[2]) : BENCH_ITEMS;
+    batch = argc > 3 ? atoi(argv[3]) : BENCH_BATCH;
+    if (producers < 1 || producers > 64 || items_each < 1 || batch < 1 || batch > 256) {
+        fprintf(stderr, "usage: %s [producers up to 64] [items] [batch up to 256]\n", argv[0]);
+        return 1;
+    }
+    expected = items_each * producers;
+    uint64_t want = (uint64_t)expected * (uint64_t)(expected + 1) / 2;
+    pthread_t threads[64];
+    printf("%d producers, %ld items each, pushed %d at a time, %d slots:\n", producers, items_each, batch, BENCH_CAPACITY);
+
+    network_loop_t *loop = network_loop_create(64);
+    queue = network_queue_create(BENCH_CAPACITY, NETWORK_QUEUE_SINGLE_CONSUMER);
+    if (loop == NULL || queue == NULL || network_queue_attach(queue, loop, arrived, NULL) < 0) {
+        return 1;
+    }
+    double start = now_s();
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, produce, (void *)(uintptr_t)i);
+    }
+    network_loop_run(loop);
+    double secs = now_s() - start;
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("network_queue_t to a loop", secs, queue->wakes, want);
+    network_queue_destroy(queue);
+
+    locked_ring = malloc(BENCH_CAPACITY * sizeof(*locked_ring));
+    locked_wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    locked_wake.on_readable = locked_woken;
+    network_loop_add(loop, &locked_wake, NETWORK_EV_READ);
+    received = 0;
+    checksum = 0;
+    start = now_s();
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, produce_locked, (void *)(uintptr_t)i);
+    }
+    network_loop_run(loop);
+    secs = now_s() - start;
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("mutex, eventfd per push", secs, locked_wakes, want);
+    network_loop_del(loop, &locked_wake);
+    network_close(locked_wake.fd);
+    free(locked_ring);
+    network_loop_destroy(loop);
+
+    // the same producers against as many consumer threads
+    queue = network_queue_create(BENCH_CAPACITY, 0);
+    pthread_t consumers[64];
+    checksum = 0;
+    start = now_s();
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&consumers[i], NULL, consume, NULL);
+        pthread_create(&threads[i], NULL, produce, (void *)(uintptr_t)i);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    secs = now_s() - start;
+    char what[64];
+    snprintf(what, sizeof(what), "network_queue_t, %d consumers", producers);
+    report(what, secs, 0, want);
+    network_queue_destroy(queue);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * What a lookup costs: getaddrinfo every time, against network_resolve() answering from its
+ * cache after the first one.
+ *
+ *   bench_resolve [host] [lookups]
+ *
+ * Defaults to localhost, which /etc/hosts answers without asking a DNS server, so the
+ * getaddrinfo numbers are its best case; a name that needs a round trip to a resolver costs
+ * that round trip on top, every time.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_resolve.h"
+
+#define BENCH_LOOKUPS 100000
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    long lookups = argc > 2 ? atol(argv[2]) : BENCH_LOOKUPS;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    double start = now_s();
+    long plain = 0;
+    for (long i = 0; i < lookups; i++) {
+        if (getaddrinfo(host, "80", &hints, &res) == 0) {
+            freeaddrinfo(res);
+            plain++;
+        }
+    }
+    double uncached = now_s() - start;
+
+    network_resolved out;
+    long cached = 0;
+    start = now_s();
+    for (long i = 0; i < lookups; i++) {
+        cached += network_resolve(host, "80", &out) == 0;
+    }
+    double hit = now_s() - start;
+
+    printf("%s, %ld lookups:\n", host, lookups);
+    printf("  getaddrinfo    %8.0f ns (%ld resolved)\n", uncached * 1e9 / (double)lookups, plain);
+    printf("  cached         %8.0f ns (%ld resolved)\n", hit * 1e9 / (double)lookups, cached);
+    network_resolve_flush();
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Serving a file over loopback TCP, read() into a buffer + network_send_all against
+ * network_send_file, which leaves the bytes in the page cache.
+ *
+ *   bench_send_file [megabytes] [rounds]
+ *
+ * The file is written once and read once before timing, so both sides serve it from
+ * the page cache. A forked reader drains the connection with a 256K buffer.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network.h"
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_MB 256
+#define BENCH_ROUNDS 5
+#define BENCH_CHUNK (64 * 1024)
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static socket_t connect_reader(socket_t listener, pid_t *reader) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+
+    *reader = fork();
+    if (*reader == 0) {
+        socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+            _exit(1);
+        }
+        static char buf[256 * 1024];
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+        _exit(0);
+    }
+    return accept(listener, NULL, NULL);
+}
+
+static double bench_copy(socket_t listener, int file, size_t size) {
+    static char buf[BENCH_CHUNK];
+    pid_t reader;
+    socket_t fd = connect_reader(listener, &reader);
+    double start = now_s();
+    for (size_t off = 0; off < size; ) {
+        ssize_t n = pread(file, buf, sizeof(buf), (off_t)off);
+        if (n <= 0 || network_send_all(fd, buf, (size_t)n) != n) {
+            break;
+        }
+        off += (size_t)n;
+    }
+    close(fd);
+    waitpid(reader, NULL, 0);
+    return now_s() - start;
+}
+
+static double bench_sendfile(socket_t listener, int file, size_t size) {
+    pid_t reader;
+    socket_t fd = connect_reader(listener, &reader);
+    double start = now_s();
+    network_send_file(fd, file, 0, size);
+    close(fd);
+    waitpid(reader, NULL, 0);
+    return now_s() - start;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : BENCH_MB) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : BENCH_ROUNDS;
+
+    char path[] = "/tmp/bench_send_fileXXXXXX";
+    int file = mkstemp(path);
+    unlink(path);
+    static char block[1 << 20];
+    memset(block, 'x', sizeof(block));
+    for (size_t off = 0; off < size; off += sizeof(block)) {
+        if (write(file, block, sizeof(block)) < 0) {
+            return 1;
+        }
+    }
+    for (size_t off = 0; off < size; off += sizeof(block)) {
+        if (pread(file, block, sizeof(block), (off_t)off) < 0) {
+            return 1;
+        }
+    }
+
+    socket_t listener = network_listen_ex("127.0.0.1", "0", 16, NETWORK_LISTEN_REUSEADDR);
+    double copy = 0, zero = 0;
+    for (int r = 0; r < rounds; r++) {
+        copy += bench_copy(listener, file, size);
+        zero += bench_sendfile(listener, file, size);
+    }
+    double gb = (double)size * rounds / 1e9;
+    printf("pread + network_send_all: %6.2f GB/s\n", gb / copy);
+    printf("network_send_file:        %6.2f GB/s (%.2fx)\n", gb / zero, copy / zero);
+    close(listener);
+    close(file);
+    return 0;
+}
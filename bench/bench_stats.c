@@ -0,0 +1,80 @@
+/*
+ * What network_stats.h costs per event: a counter add and a histogram record on the calling
+ * thread, the clock read every timed callback pays for on top, and a snapshot over BENCH_THREADS
+ * threads that keep counting while it adds them up.
+ *
+ *   bench_stats [iterations] [threads]
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network.h"
+#include <pthread.h>
+
+#define BENCH_ITERATIONS 100000000L
+#define BENCH_THREADS 8
+#define BENCH_SNAPSHOTS 1000
+
+static double now_s(void) {
+    return (double)network_stats_now_ns() * 1e-9;
+}
+
+static volatile int running = 1;
+
+static void *counting(void *arg) {
+    (void)arg;
+    while (running) {
+        network_stats_add(NETWORK_STAT_BYTES_IN, 64);
+        network_stats_record(NETWORK_HIST_CALLBACK, 1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : BENCH_ITERATIONS;
+    int nthreads = argc > 2 ? atoi(argv[2]) : BENCH_THREADS;
+
+    double start = now_s();
+    for (long i = 0; i < iterations; i++) {
+        network_stats_add(NETWORK_STAT_BYTES_OUT, (uint64_t)i);
+    }
+    double add = now_s() - start;
+
+    start = now_s();
+    for (long i = 0; i < iterations; i++) {
+        network_stats_record(NETWORK_HIST_LOOP_ITERATION, (uint64_t)i & 0xfffff);
+    }
+    double record = now_s() - start;
+
+    start = now_s();
+    volatile uint64_t sink;
+    for (long i = 0; i < iterations / 10; i++) {
+        sink = network_stats_now_ns();
+    }
+    (void)sink;
+    double clock = now_s() - start;
+
+    pthread_t *threads = malloc((size_t)nthreads * sizeof(*threads));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, counting, NULL);
+    }
+    network_stats_t *stats = malloc(sizeof(*stats));
+    start = now_s();
+    for (int i = 0; i < BENCH_SNAPSHOTS; i++) {
+        network_stats_snapshot(stats);
+    }
+    double snapshot = now_s() - start;
+    running = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("per call:\n");
+    printf("  counter add        %6.2f ns\n", add * 1e9 / (double)iterations);
+    printf("  histogram record   %6.2f ns\n", record * 1e9 / (double)iterations);
+    printf("  clock read         %6.2f ns\n", clock * 1e9 / (double)(iterations / 10));
+    printf("  snapshot, %d threads counting %8.1f us\n", nthreads, snapshot * 1e6 / BENCH_SNAPSHOTS);
+    printf("  p99 of the loop iterations recorded: %llu\n",
+           (unsigned long long)network_hist_percentile(&stats->hist[NETWORK_HIST_LOOP_ITERATION], 99.0));
+    free(stats);
+    free(threads);
+    return 0;
+}
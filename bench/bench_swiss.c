@@ -0,0 +1,162 @@
+/*
+ * Connection-id keyed lookups: stb_ds's hmput/hmget/hmdel against swiss.h's, from 1K to 10M
+ * entries of a 64 bit key and a pointer. The keys are random, inserted in one order and looked
+ * up, missed and deleted in others, so every operation is a cache miss once the table is bigger
+ * than the caches. Small tables are run many times over to get enough operations to time.
+ *
+ *   bench_swiss [largest]
+ */
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+#include "swiss.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_LARGEST 10000000
+#define BENCH_MIN_OPS 10000000
+
+struct conn_entry {
+    uint64_t key;
+    void *value;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void shuffle(uint64_t *keys, size_t n) {
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = next_rand() % (i + 1);
+        uint64_t t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+}
+
+// ns per operation for insert, hit, miss and delete, and bytes per entry at the end of the inserts
+struct result {
+    double insert, hit, miss, del, bytes;
+};
+
+static struct result bench_stb(const uint64_t *keys, const uint64_t *lookups, const uint64_t *misses, size_t n, size_t rounds) {
+    struct result r = {0};
+    size_t found = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        struct conn_entry *map = NULL;
+        double start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            hmput(map, keys[i], (void *)(uintptr_t)(i + 1));
+        }
+        double t1 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            found += hmget(map, lookups[i]) != NULL;
+        }
+        double t2 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            found += hmget(map, misses[i]) != NULL;
+        }
+        double t3 = now_ns();
+        if (round == 0) {
+            // the entry array and the index of hashes into it; a hash map's array starts one entry early
+            stbds_hash_index *index = (stbds_hash_index *)stbds_header(map - 1)->hash_table;
+            r.bytes = (double)(stbds_arrcap(map - 1) * sizeof(*map) +
+                               index->slot_count / STBDS_BUCKET_LENGTH * sizeof(stbds_hash_bucket)) / (double)n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            (void)hmdel(map, lookups[i]);
+        }
+        double t4 = now_ns();
+        hmfree(map);
+        r.insert += t1 - start;
+        r.hit += t2 - t1;
+        r.miss += t3 - t2;
+        r.del += t4 - t3;
+    }
+    if (found != n * rounds) {
+        printf("stb_ds found %zu of %zu\n", found, n * rounds);
+    }
+    return r;
+}
+
+static struct result bench_swiss(const uint64_t *keys, const uint64_t *lookups, const uint64_t *misses, size_t n, size_t rounds) {
+    struct result r = {0};
+    size_t found = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        struct conn_entry *map = NULL;
+        double start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            f_swissPut(map, keys[i], (void *)(uintptr_t)(i + 1));
+        }
+        double t1 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            found += f_swissGet(map, lookups[i]) != NULL;
+        }
+        double t2 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            found += f_swissGet(map, misses[i]) != NULL;
+        }
+        double t3 = now_ns();
+        if (round == 0) {
+            r.bytes = (double)f_swissBytes(map, sizeof(*map)) / (double)n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            f_swissDel(map, lookups[i]);
+        }
+        double t4 = now_ns();
+        f_swissFree(map);
+        r.insert += t1 - start;
+        r.hit += t2 - t1;
+        r.miss += t3 - t2;
+        r.del += t4 - t3;
+    }
+    if (found != n * rounds) {
+        printf("swiss found %zu of %zu\n", found, n * rounds);
+    }
+    return r;
+}
+
+static void report(const char *name, struct result r, size_t ops) {
+    printf("  %-8s insert %6.1f  hit %6.1f  miss %6.1f  delete %6.1f ns  %5.1f bytes/entry\n", name,
+           r.insert / ops, r.hit / ops, r.miss / ops, r.del / ops, r.bytes);
+}
+
+int main(int argc, char **argv) {
+    size_t largest = argc > 1 ? (size_t)atol(argv[1]) : BENCH_LARGEST;
+    uint64_t *keys = malloc(largest * sizeof(*keys));
+    uint64_t *lookups = malloc(largest * sizeof(*lookups));
+    uint64_t *misses = malloc(largest * sizeof(*misses));
+#ifdef F_SWISS_SSE2
+    printf("swiss probes with SSE2\n");
+#elif defined(F_SWISS_NEON)
+    printf("swiss probes with NEON\n");
+#else
+    printf("swiss probes without SIMD\n");
+#endif
+    for (size_t n = 1000; n <= largest; n *= 10) {
+        // odd keys are in the table, even ones are the misses
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = next_rand() | 1;
+            misses[i] = next_rand() & ~1ull;
+        }
+        memcpy(lookups, keys, n * sizeof(*keys));
+        shuffle(lookups, n);
+        size_t rounds = n < BENCH_MIN_OPS ? BENCH_MIN_OPS / n : 1;
+        printf("%zu entries, %zu rounds:\n", n, rounds);
+        report("stb_ds", bench_stb(keys, lookups, misses, n, rounds), n * rounds);
+        report("swiss", bench_swiss(keys, lookups, misses, n, rounds), n * rounds);
+    }
+    free(keys);
+    free(lookups);
+    free(misses);
+    return 0;
+}
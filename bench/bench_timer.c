@@ -0,0 +1,178 @@
+/*
+ * Idle timeouts for BENCH_CONNS connections, each pushed back on every request the way a
+ * server does it, three ways: the loop's timing wheel, a binary heap indexed by connection
+ * (a decrease/increase-key per request) and no timers at all, just a last-activity time per
+ * connection that every batch scans.
+ *
+ *   bench_timer [connections] [requests]
+ *
+ * Requests go to random connections, BENCH_BATCH of them per batch. The wheel runs a real
+ * network_loop_run_once per batch, the heap and the scan read the clock once per batch, and
+ * the scan makes its pass over every connection then. The wheel and the heap also get a cancel
+ * per connection at the end, which is a close.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_loop.h"
+#include <time.h>
+
+#define BENCH_CONNS 100000
+#define BENCH_REQUESTS 10000000
+#define BENCH_TIMEOUT_MS 30000
+#define BENCH_BATCH 64
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint32_t rng = 12345;
+static uint32_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* wheel */
+static void expired(network_loop_t *loop, network_timer_t *timer) {
+    (void)loop;
+    (void)timer;
+}
+
+/* heap of expiry times, pos[] says where each connection is */
+static uint64_t *keys;
+static int *heap, *pos;
+static int heap_len;
+
+static void heap_swap(int a, int b) {
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    pos[heap[a]] = a;
+    pos[heap[b]] = b;
+}
+
+static void heap_up(int i) {
+    while (i > 0 && keys[heap[(i - 1) / 2]] > keys[heap[i]]) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < heap_len && keys[heap[l]] < keys[heap[m]]) m = l;
+        if (r < heap_len && keys[heap[r]] < keys[heap[m]]) m = r;
+        if (m == i) return;
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void heap_set(int conn, uint64_t key) {
+    keys[conn] = key;
+    heap_up(pos[conn]);
+    heap_down(pos[conn]);
+}
+
+static void heap_remove(int conn) {
+    int i = pos[conn];
+    heap_swap(i, --heap_len);
+    if (i < heap_len) {
+        heap_up(i);
+        heap_down(i);
+    }
+}
+
+int main(int argc, char **argv) {
+    int nconns = argc > 1 ? atoi(argv[1]) : BENCH_CONNS;
+    long requests = argc > 2 ? atol(argv[2]) : BENCH_REQUESTS;
+    network_loop_t *loop = network_loop_create(0);
+    network_timer_t *timers = calloc((size_t)nconns, sizeof(*timers));
+    keys = malloc((size_t)nconns * sizeof(*keys));
+    heap = malloc((size_t)nconns * sizeof(*heap));
+    pos = malloc((size_t)nconns * sizeof(*pos));
+    uint64_t *last = malloc((size_t)nconns * sizeof(*last));
+    uint64_t clock = 0;
+
+    // wheel
+    double start = now_s();
+    for (int i = 0; i < nconns; i++) {
+        timers[i].on_expire = expired;
+        network_loop_timer_start(loop, &timers[i], BENCH_TIMEOUT_MS);
+    }
+    for (long r = 0; r < requests; r++) {
+        if (r % BENCH_BATCH == 0) {
+            network_loop_run_once(loop, 0);
+        }
+        network_loop_timer_start(loop, &timers[next_rand() % (uint32_t)nconns], BENCH_TIMEOUT_MS);
+    }
+    for (int i = 0; i < nconns; i++) {
+        network_loop_timer_stop(loop, &timers[i]);
+    }
+    double wheel = now_s() - start;
+
+    // heap
+    rng = 12345;
+    start = now_s();
+    clock = (uint64_t)network_now_ms();
+    for (int i = 0; i < nconns; i++) {
+        keys[i] = clock + BENCH_TIMEOUT_MS;
+        heap[i] = pos[i] = i;
+    }
+    heap_len = nconns;
+    for (long r = 0; r < requests; r++) {
+        if (r % BENCH_BATCH == 0) {
+            clock = (uint64_t)network_now_ms();
+        }
+        heap_set((int)(next_rand() % (uint32_t)nconns), clock + BENCH_TIMEOUT_MS);
+    }
+    for (int i = 0; i < nconns; i++) {
+        heap_remove(i);
+    }
+    double heaped = now_s() - start;
+
+    // scan, each batch looks at every connection for one that's been idle too long
+    rng = 12345;
+    size_t idle = 0;
+    clock = (uint64_t)network_now_ms();
+    for (int i = 0; i < nconns; i++) {
+        last[i] = clock;
+    }
+    start = now_s();
+    for (long r = 0; r < requests; r++) {
+        if (r % BENCH_BATCH == 0) {
+            clock = (uint64_t)network_now_ms();
+            for (int i = 0; i < nconns; i++) {
+                idle += clock - last[i] > BENCH_TIMEOUT_MS;
+            }
+        }
+        last[next_rand() % (uint32_t)nconns] = clock;
+    }
+    double scanned = now_s() - start;
+
+    printf("%d connections, %ld requests, per request:\n", nconns, requests);
+    printf("  timing wheel  %6.1f ns\n", wheel * 1e9 / (double)requests);
+    printf("  binary heap   %6.1f ns\n", heaped * 1e9 / (double)requests);
+    printf("  scan          %6.1f ns (%zu idle seen)\n", scanned * 1e9 / (double)requests, idle);
+
+    // and what firing costs, every connection timing out in the same batch
+    for (int i = 0; i < nconns; i++) {
+        network_loop_timer_start(loop, &timers[i], 1 + (uint64_t)(i % 8));
+    }
+    usleep(20 * 1000);
+    start = now_s();
+    int fired = network_loop_run_once(loop, 0);
+    double fire = now_s() - start;
+    printf("  fired %d timeouts in one batch, %.1f ns each\n", fired, fire * 1e9 / (double)fired);
+
+    free(timers);
+    free(keys);
+    free(heap);
+    free(pos);
+    free(last);
+    network_loop_destroy(loop);
+    return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * TLS connections on one event loop, the server and its clients in the same process: a reconnect
+ * storm with every handshake a full one, the same with the clients resuming their sessions, and one
+ * connection that a file is sent over with network_tls_send_file.
+ *
+ *   bench_tls [connections] [in flight] [file MB] [tls1.2]
+ *
+ * Every connection of the storm sends a byte and closes once it's echoed back, which is also what
+ * gets the client its TLS 1.3 ticket. Reported are handshakes a second, how many of them resumed, and
+ * for the file MB/s and whether the kernel did the encrypting; the server's certificate is a
+ * self-signed P-256 one made at startup.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_tls.h"
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <time.h>
+
+#define BENCH_CONNS 2000
+#define BENCH_INFLIGHT 32
+#define BENCH_FILE_MB 256
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+struct bench_conn
+{
+    network_tls_conn_t tls;
+    int client;
+};
+
+static network_tls_ctx_t *server_ctx;
+static network_tls_ctx_t *client_ctx;
+static struct sockaddr_in server_addr;
+static int conns_total = BENCH_CONNS;
+static int conns_started, conns_done, conns_resumed, conns_failed;
+static int file_fd = -1;
+static size_t file_size, file_received;
+static int file_ktls;
+
+static void bench_connect(network_loop_t *loop);
+
+static void conn_closed(network_loop_t *loop, network_tls_conn_t *tls, int err) {
+    struct bench_conn *conn = tls->user;
+    if (conn->client) {
+        if (err) {
+            conns_failed++;
+        }
+        if (++conns_done == conns_total) {
+            network_loop_stop(loop);
+        } else if (conns_started < conns_total) {
+            bench_connect(loop);
+        }
+    }
+    free(conn);
+}
+
+static void server_data(network_loop_t *loop, network_tls_conn_t *tls, const char *data, size_t len) {
+    network_tls_send(loop, tls, data, len);
+}
+
+static void client_data(network_loop_t *loop, network_tls_conn_t *tls, const char *data, size_t len) {
+    (void)data;
+    (void)len;
+    conns_resumed += network_tls_resumed(tls);
+    network_tls_close(loop, tls, 0);
+}
+
+static void client_handshake(network_loop_t *loop, network_tls_conn_t *tls) {
+    network_tls_send(loop, tls, "x", 1);
+}
+
+static void bench_connect(network_loop_t *loop) {
+    struct bench_conn *conn = calloc(1, sizeof(*conn));
+    conn->client = 1;
+    conn->tls.user = conn;
+    conn->tls.on_data = client_data;
+    conn->tls.on_handshake = client_handshake;
+    conn->tls.on_close = conn_closed;
+    conns_started++;
+    if (network_tls_connect(loop, &conn->tls, client_ctx, (struct sockaddr *)&server_addr, sizeof(server_addr),
+                            "localhost", 5000) < 0) {
+        free(conn);
+        conns_failed++;
+        conns_done++;
+    }
+}
+
+/* the file: the server sends it right after the handshake, the client counts it */
+static void server_handshake(network_loop_t *loop, network_tls_conn_t *tls) {
+    if (file_fd >= 0) {
+        file_ktls = tls->ktls_send;
+        network_tls_send_file(loop, tls, file_fd, 0, file_size, 0);
+    }
+}
+
+static void file_data(network_loop_t *loop, network_tls_conn_t *tls, const char *data, size_t len) {
+    (void)data;
+    file_received += len;
+    if (file_received == file_size) {
+        network_tls_close(loop, tls, 0);
+    }
+}
+
+static void server_accept(network_loop_t *loop, network_watch_t *listener, socket_t fd, const struct sockaddr_storage *addr) {
+    (void)listener;
+    (void)addr;
+    struct bench_conn *conn = calloc(1, sizeof(*conn));
+    conn->tls.user = conn;
+    conn->tls.on_data = server_data;
+    conn->tls.on_handshake = server_handshake;
+    conn->tls.on_close = conn_closed;
+    if (network_tls_accept(loop, &conn->tls, server_ctx, fd) < 0) {
+        free(conn);
+    }
+}
+
+// a throwaway P-256 key and a certificate for it, signed by itself
+static int bench_certificate(SSL_CTX *ssl) {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (keygen == NULL || EVP_PKEY_keygen_init(keygen) != 1 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1) != 1 || EVP_PKEY_keygen(keygen, &key) != 1) {
+        EVP_PKEY_CTX_free(keygen);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(keygen);
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_set_pubkey(cert, key);
+    int ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ssl, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(ssl, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok ? 0 : -1;
+}
+
+static void bench_storm(network_loop_t *loop, const char *what, int inflight, int flags, int max_version) {
+    client_ctx = network_tls_client(NULL, NETWORK_TLS_NO_VERIFY | flags);
+    if (max_version) {
+        SSL_CTX_set_max_proto_version(client_ctx->ssl, max_version);
+    }
+    conns_started = conns_done = conns_resumed = conns_failed = 0;
+    clock_t cpu = clock();
+    double start = now_s();
+    for (int i = 0; i < inflight && conns_started < conns_total; i++) {
+        bench_connect(loop);
+    }
+    if (conns_done < conns_total) {
+        network_loop_run(loop);
+    }
+    double secs = now_s() - start;
+    double cpu_us = (double)(clock() - cpu) / CLOCKS_PER_SEC * 1e6 / conns_total;
+    printf("  %-22s %8.0f handshakes/s  %7.1f us CPU each, both ends  %5d resumed  %d failed\n", what,
+           conns_total / secs, cpu_us, conns_resumed, conns_failed);
+    network_tls_ctx_free(client_ctx);
+}
+
+int main(int argc, char **argv) {
+    conns_total = argc > 1 ? atoi(argv[1]) : BENCH_CONNS;
+    int inflight = argc > 2 ? atoi(argv[2]) : BENCH_INFLIGHT;
+    size_t file_mb = argc > 3 ? (size_t)atol(argv[3]) : BENCH_FILE_MB;
+    int max_version = argc > 4 && strcmp(argv[4], "tls1.2") == 0 ? TLS1_2_VERSION : 0;
+    if (conns_total < 1 || inflight < 1) {
+        fprintf(stderr, "usage: %s [connections] [in flight] [file MB] [tls1.2]\n", argv[0]);
+        return 1;
+    }
+
+    server_ctx = network_tls_server(NULL, NULL, 0);
+    if (server_ctx == NULL || bench_certificate(server_ctx->ssl) < 0) {
+        fprintf(stderr, "server context setup failed\n");
+        return 1;
+    }
+    socket_t listen_fd = network_listen_ex("127.0.0.1", "0", 1024, NETWORK_LISTEN_NONBLOCK | NETWORK_LISTEN_REUSEADDR);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    socklen_t len = sizeof(server_addr);
+    getsockname(listen_fd, (struct sockaddr *)&server_addr, &len);
+    network_loop_t *loop = network_loop_create(0);
+    network_watch_t listener;
+    memset(&listener, 0, sizeof(listener));
+    listener.fd = listen_fd;
+    listener.on_accept = server_accept;
+    network_loop_add(loop, &listener, NETWORK_EV_READ);
+
+    printf("%d connections, %d in flight, %s loop%s:\n", conns_total, inflight, network_loop_backend_name(loop),
+           max_version ? ", TLS 1.2" : "");
+    bench_storm(loop, "full handshakes", inflight, NETWORK_TLS_NO_RESUME, max_version);
+    bench_storm(loop, "resumed sessions", inflight, 0, max_version);
+
+    if (file_mb > 0) {
+        // a file made of zeroes and a hole, so it's in the page cache without being written
+        char path[] = "/tmp/bench_tls_XXXXXX";
+        file_fd = mkstemp(path);
+        file_size = file_mb << 20;
+        if (file_fd < 0 || ftruncate(file_fd, (off_t)file_size) < 0) {
+            return 1;
+        }
+        unlink(path);
+        client_ctx = network_tls_client(NULL, NETWORK_TLS_NO_VERIFY);
+        if (max_version) {
+            SSL_CTX_set_max_proto_version(client_ctx->ssl, max_version);
+        }
+        struct bench_conn *conn = calloc(1, sizeof(*conn));
+        conn->client = 1;
+        conn->tls.user = conn;
+        conn->tls.on_data = file_data;
+        conn->tls.on_close = conn_closed;
+        conns_total = 1;
+        conns_started = 1;
+        conns_done = conns_failed = 0;
+        double start = now_s();
+        if (network_tls_connect(loop, &conn->tls, client_ctx, (struct sockaddr *)&server_addr, sizeof(server_addr),
+                                "localhost", 5000) == 0) {
+            network_loop_run(loop);
+        }
+        double secs = now_s() - start;
+        printf("  %-22s %8.0f MB/s  %zu of %zu MB  kernel TLS %s\n", "network_tls_send_file", (double)file_received / secs / 1e6,
+               file_received >> 20, file_mb, file_ktls ? "on, sendfile" : "off, read and SSL_write");
+        network_tls_ctx_free(client_ctx);
+        close(file_fd);
+    }
+
+    network_loop_run_once(loop, 100); // the server's ends of the last connections see the close_notify
+    network_loop_del(loop, &listener);
+    network_close(listen_fd);
+    network_loop_destroy(loop);
+    network_tls_ctx_free(server_ctx);
+    return 0;
+}
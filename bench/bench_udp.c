@@ -0,0 +1,155 @@
+/*
+ * Datagrams over loopback three ways: a sendto and a recvfrom per datagram, network_udp_send_batch
+ * and network_udp_recv_batch (sendmmsg/recvmmsg), and the batch with GSO on the send side and GRO
+ * on the receive side, where a whole batch is one buffer through the stack.
+ *
+ *   bench_udp [size] [datagrams]
+ *
+ * One thread sends BENCH_BATCH datagrams and then reads all of them back, so a datagram's time is
+ * what it costs to send and to receive it. Datagrams the kernel dropped are counted and left out.
+ * The GSO batch is capped at 64 segments and 64KB, so big datagrams go out in smaller batches.
+ */
+#define NETWORK_IMPLEMENTATION
+#include "network_udp.h"
+#include <time.h>
+
+#define BENCH_SIZE 256
+#define BENCH_DATAGRAMS 2000000
+#define BENCH_BATCH 64
+#define BENCH_RCVBUF (8 * 1024 * 1024)
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static socket_t rx, tx;
+static struct sockaddr_storage to;
+static socklen_t to_len;
+static network_buffer_pool_t *pool;
+static size_t size = BENCH_SIZE;
+
+// reads until want datagrams came in or the socket is empty, returns how many
+static long drain_single(long want, char *buf) {
+    long got = 0;
+    while (got < want) {
+        ssize_t n = recvfrom(rx, buf, NETWORK_UDP_MAX, MSG_DONTWAIT, NULL, NULL);
+        if (n < 0) {
+            break;
+        }
+        got++;
+    }
+    return got;
+}
+
+static long drain_batch(long want) {
+    network_datagram in[NETWORK_UDP_BATCH];
+    long got = 0;
+    while (got < want) {
+        int n = network_udp_recv_batch(rx, pool, in, NETWORK_UDP_BATCH);
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            got += in[i].segment ? (long)((in[i].len + in[i].segment - 1) / in[i].segment) : 1;
+        }
+        network_udp_release(pool, in, n);
+    }
+    return got;
+}
+
+static void report(const char *what, double secs, long sent, long received) {
+    printf("  %-22s %7.0f ns/datagram  %6.2f Mpps  %5.1f%% received\n", what,
+           secs * 1e9 / (double)received, (double)received / secs / 1e6, 100.0 * (double)received / (double)sent);
+}
+
+int main(int argc, char **argv) {
+    size = argc > 1 ? (size_t)atol(argv[1]) : BENCH_SIZE;
+    long datagrams = argc > 2 ? atol(argv[2]) : BENCH_DATAGRAMS;
+    if (size < 1 || size > 1400 || datagrams < BENCH_BATCH) {
+        fprintf(stderr, "usage: %s [size up to 1400] [datagrams]\n", argv[0]);
+        return 1;
+    }
+    int rcvbuf = BENCH_RCVBUF;
+    char *payload = calloc(BENCH_BATCH, size);
+    char *scratch = malloc(NETWORK_UDP_MAX);
+    long batches = datagrams / BENCH_BATCH;
+    datagrams = batches * BENCH_BATCH;
+    printf("%ld datagrams of %zu bytes, %d per batch:\n", datagrams, size, BENCH_BATCH);
+
+    // one datagram per syscall
+    rx = network_udp_bind("127.0.0.1", "0", 0);
+    tx = network_udp_bind("127.0.0.1", "0", 0);
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    to_len = sizeof(to);
+    getsockname(rx, (struct sockaddr *)&to, &to_len);
+    long received = 0;
+    double start = now_s();
+    for (long b = 0; b < batches; b++) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            sendto(tx, payload + (size_t)i * size, size, 0, (struct sockaddr *)&to, to_len);
+        }
+        received += drain_single(BENCH_BATCH, scratch);
+    }
+    report("sendto/recvfrom", now_s() - start, datagrams, received);
+
+    // sendmmsg/recvmmsg, a block of the pool per datagram
+    pool = network_buffer_pool_create(2048, 0);
+    network_datagram out[BENCH_BATCH];
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        out[i].data = payload + (size_t)i * size;
+        out[i].len = size;
+        memcpy(&out[i].addr, &to, to_len);
+        out[i].addrlen = to_len;
+    }
+    received = 0;
+    start = now_s();
+    for (long b = 0; b < batches; b++) {
+        network_udp_send_batch(tx, out, BENCH_BATCH);
+        received += drain_batch(BENCH_BATCH);
+    }
+    report("sendmmsg/recvmmsg", now_s() - start, datagrams, received);
+    network_buffer_pool_destroy(pool);
+    network_close(rx);
+
+    // GSO and GRO, the batch is one send of segments and, mostly, one coalesced receive
+    rx = network_udp_bind("127.0.0.1", "0", NETWORK_UDP_GRO);
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    to_len = sizeof(to);
+    getsockname(rx, (struct sockaddr *)&to, &to_len);
+    pool = network_buffer_pool_create(NETWORK_UDP_MAX + 1, 0);
+    size_t per_send = 65000 / size < BENCH_BATCH ? 65000 / size : BENCH_BATCH;
+    int sends = (int)((BENCH_BATCH + per_send - 1) / per_send);
+    network_datagram gso[BENCH_BATCH];
+    memset(gso, 0, sizeof(gso));
+    for (int i = 0; i < sends; i++) {
+        size_t first = (size_t)i * per_send;
+        size_t count = BENCH_BATCH - first < per_send ? BENCH_BATCH - first : per_send;
+        gso[i].data = payload + first * size;
+        gso[i].len = count * size;
+        gso[i].segment = size;
+        memcpy(&gso[i].addr, &to, to_len);
+        gso[i].addrlen = to_len;
+    }
+    received = 0;
+    start = now_s();
+    for (long b = 0; b < batches; b++) {
+        if (network_udp_send_batch(tx, gso, sends) < 0) {
+            printf("  GSO not supported here\n");
+            break;
+        }
+        received += drain_batch(BENCH_BATCH);
+    }
+    if (received > 0) {
+        report("GSO/GRO", now_s() - start, datagrams, received);
+    }
+
+    network_buffer_pool_destroy(pool);
+    network_close(rx);
+    network_close(tx);
+    free(payload);
+    free(scratch);
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include "arena.h"
+#include "memorytracker.h"
+#include "stb_ds.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define f_arenaYield() SwitchToThread()
+#else
+#include <sched.h>
+#define f_arenaYield() sched_yield()
+#endif
+
+#ifdef _MSC_VER
+#define F_ARENA_THREAD_LOCAL __declspec(thread)
+#else
+#define F_ARENA_THREAD_LOCAL _Thread_local
+#endif
+
+// chunks are handed out back to front, data is aligned like malloc's
+struct f_arenaChunk
+{
+    struct f_arenaChunk *prev;
+    size_t size; // bytes of data
+    max_align_t data[];
+};
+
+// stb_ds containers' blocks carry their size, so a resize knows how much to copy
+struct f_arenaDsBlock
+{
+    size_t size;
+    max_align_t data[];
+};
+
+struct f_arenaDs
+{
+    stbds_allocator allocator; // must be first, stb_ds is handed a pointer to it
+    struct f_arena *arena;
+};
+
+static atomic_flag arenasLock = ATOMIC_FLAG_INIT;
+static struct f_arena *arenas; // every live arena, for f_arenaListArenas()
+static F_ARENA_THREAD_LOCAL struct f_arena *scratchArena;
+
+static void f_arenaLockList(){
+    while (atomic_flag_test_and_set_explicit(&arenasLock, memory_order_acquire)) {
+        f_arenaYield();
+    }
+}
+
+static void f_arenaUnlockList(){
+    atomic_flag_clear_explicit(&arenasLock, memory_order_release);
+}
+
+static char *f_arenaData(struct f_arenaChunk *chunk){
+    return (char *)chunk->data;
+}
+
+// everything the arena holds, the size of its one object in the tracker
+static size_t f_arenaFootprint(struct f_arena *arena){
+    return sizeof(struct f_arena) + (arena->ds ? sizeof(struct f_arenaDs) : 0) + arena->reserved;
+}
+
+// registers the arena again with what it holds now, only after it grew so it's rare
+static void f_arenaRetrack(struct f_arena *arena){
+    f_trackObjectFree(arena, arena->name, arena->file, arena->line);
+    f_trackObjectAlloc(arena, f_arenaFootprint(arena), arena->name, arena->file, arena->line);
+}
+
+// takes a spare chunk with room for size bytes or allocates one, counted in the arena's tracked object
+static struct f_arenaChunk *f_arenaChunkGet(struct f_arena *arena, size_t size){
+    struct f_arenaChunk **link = &arena->spare;
+
+    for (struct f_arenaChunk *chunk = arena->spare; chunk; chunk = chunk->prev) {
+        if (chunk->size >= size) {
+            *link = chunk->prev;
+            return chunk;
+        }
+        link = &chunk->prev;
+    }
+
+    size = size > arena->chunkSize ? size : arena->chunkSize;
+    if (size > SIZE_MAX - sizeof(struct f_arenaChunk)) {
+        printf("Arena chunk size overflow!\n");
+        return NULL;
+    }
+    struct f_arenaChunk *chunk = (malloc)(sizeof(struct f_arenaChunk) + size);
+    if (chunk == NULL) {
+        printf("Arena chunk allocation failed!\n");
+        return NULL;
+    }
+    chunk->size = size;
+    arena->reserved += sizeof(struct f_arenaChunk) + size;
+    // the first chunk comes before the arena is tracked at all
+    if (arena->chunk) {
+        f_arenaRetrack(arena);
+    }
+    return chunk;
+}
+
+static void f_arenaChunkFree(struct f_arenaChunk *chunk){
+    while (chunk) {
+        struct f_arenaChunk *prev = chunk->prev;
+        (free)(chunk);
+        chunk = prev;
+    }
+}
+
+static void f_arenaUse(struct f_arena *arena, struct f_arenaChunk *chunk){
+    chunk->prev = arena->chunk;
+    arena->chunk = chunk;
+    arena->cursor = f_arenaData(chunk);
+    arena->end = arena->cursor + chunk->size;
+}
+
+// used only grows between resets, so it's enough to look at it whenever arena memory is given back
+static void f_arenaUpdatePeak(struct f_arena *arena){
+    size_t used = f_arenaUsed(arena);
+    if (used > arena->peak) {
+        arena->peak = used;
+    }
+}
+
+struct f_arena *f_arenaCreateAt(const char *name, size_t chunkSize, const char *file, int line){
+    struct f_arena *arena = (malloc)(sizeof(struct f_arena));
+    if (arena == NULL) {
+        printf("Arena allocation failed!\n");
+        return NULL;
+    }
+    memset(arena, 0, sizeof(*arena));
+    arena->chunkSize = chunkSize ? chunkSize : F_ARENA_DEFAULT_CHUNK_SIZE;
+    arena->name = name;
+    arena->file = file;
+    arena->line = line;
+
+    // the first chunk is never given back, so the cursor is always inside one
+    struct f_arenaChunk *chunk = f_arenaChunkGet(arena, arena->chunkSize);
+    if (chunk == NULL) {
+        (free)(arena);
+        return NULL;
+    }
+    f_arenaUse(arena, chunk);
+    f_trackObjectAlloc(arena, f_arenaFootprint(arena), name, file, line);
+
+    f_arenaLockList();
+    arena->next = arenas;
+    if (arenas) {
+        arenas->prev = arena;
+    }
+    arenas = arena;
+    f_arenaUnlockList();
+    return arena;
+}
+
+void f_arenaDestroy(struct f_arena *arena){
+    if (arena == NULL) {
+        return;
+    }
+    f_arenaLockList();
+    if (arena->prev) {
+        arena->prev->next = arena->next;
+    } else {
+        arenas = arena->next;
+    }
+    if (arena->next) {
+        arena->next->prev = arena->prev;
+    }
+    f_arenaUnlockList();
+
+    f_trackObjectFree(arena, arena->name, arena->file, arena->line);
+    f_arenaChunkFree(arena->chunk);
+    f_arenaChunkFree(arena->spare);
+    (free)(arena->ds);
+    (free)(arena);
+}
+
+void *f_arenaAllocSlow(struct f_arena *arena, size_t size, size_t alignment){
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        printf("Alignment %zu is not a power of two!\n", alignment);
+        return NULL;
+    }
+    // chunk data is only aligned like malloc's, bigger alignments may need padding
+    size_t pad = alignment > _Alignof(max_align_t) ? alignment - 1 : 0;
+    if (size > SIZE_MAX - pad) {
+        printf("Arena alloc size overflow!\n");
+        return NULL;
+    }
+
+    struct f_arenaChunk *chunk = f_arenaChunkGet(arena, size + pad);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    // the rest of the current chunk is left unused
+    arena->usedBefore += (size_t)(arena->cursor - f_arenaData(arena->chunk));
+    f_arenaUse(arena, chunk);
+    return f_arenaAllocAligned(arena, size, alignment);
+}
+
+void *f_arenaCalloc(struct f_arena *arena, size_t count, size_t size){
+    if (size != 0 && count > SIZE_MAX / size) {
+        printf("Arena calloc size overflow!\n");
+        return NULL;
+    }
+    void *ptr = f_arenaAlloc(arena, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+char *f_arenaStrdup(struct f_arena *arena, const char *str){
+    size_t len = strlen(str) + 1;
+    char *copy = f_arenaAllocAligned(arena, len, 1);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+void f_arenaReset(struct f_arena *arena, struct f_arenaMark mark){
+    f_arenaUpdatePeak(arena);
+    while (arena->chunk != mark.chunk) {
+        struct f_arenaChunk *chunk = arena->chunk;
+        arena->chunk = chunk->prev;
+        chunk->prev = arena->spare;
+        arena->spare = chunk;
+    }
+    arena->cursor = mark.cursor;
+    arena->end = f_arenaData(mark.chunk) + mark.chunk->size;
+    arena->usedBefore = mark.usedBefore;
+}
+
+void f_arenaClear(struct f_arena *arena){
+    struct f_arenaChunk *first = arena->chunk;
+    while (first->prev) {
+        first = first->prev;
+    }
+    struct f_arenaMark mark = {first, f_arenaData(first), 0};
+    f_arenaReset(arena, mark);
+}
+
+size_t f_arenaUsed(const struct f_arena *arena){
+    return arena->usedBefore + (size_t)(arena->cursor - (char *)arena->chunk->data);
+}
+
+size_t f_arenaReserved(const struct f_arena *arena){
+    return arena->reserved;
+}
+
+size_t f_arenaPeak(struct f_arena *arena){
+    f_arenaUpdatePeak(arena);
+    return arena->peak;
+}
+
+// the block last allocated grows in place when the chunk has room, the others are copied and
+// left behind until the arena is reset, stb_ds doubles so that's at most as much as they hold
+static void *f_arenaDsResize(stbds_allocator *allocator, void *ptr, size_t size){
+    struct f_arena *arena = ((struct f_arenaDs *)allocator)->arena;
+    struct f_arenaDsBlock *block = NULL;
+
+    if (ptr) {
+        block = (struct f_arenaDsBlock *)((char *)ptr - offsetof(struct f_arenaDsBlock, data));
+        if (size <= block->size) {
+            return ptr;
+        }
+        if ((char *)ptr + block->size == arena->cursor && size <= (size_t)(arena->end - (char *)ptr)) {
+            arena->cursor = (char *)ptr + size;
+            block->size = size;
+            return ptr;
+        }
+    }
+    if (size > SIZE_MAX - sizeof(struct f_arenaDsBlock)) {
+        printf("Arena stb_ds size overflow!\n");
+        return NULL;
+    }
+    struct f_arenaDsBlock *grown = f_arenaAlloc(arena, sizeof(struct f_arenaDsBlock) + size);
+    if (grown == NULL) {
+        return NULL;
+    }
+    grown->size = size;
+    if (block) {
+        memcpy(grown->data, ptr, block->size);
+    }
+    return grown->data;
+}
+
+// the memory goes back when the arena is reset
+static void f_arenaDsRelease(stbds_allocator *allocator, void *ptr){
+    (void)allocator;
+    (void)ptr;
+}
+
+void *f_arenaDs(struct f_arena *arena){
+    if (arena->ds == NULL) {
+        struct f_arenaDs *ds = (malloc)(sizeof(struct f_arenaDs));
+        if (ds == NULL) {
+            printf("Arena stb_ds allocator allocation failed!\n");
+            return NULL;
+        }
+        ds->allocator.resize = f_arenaDsResize;
+        ds->allocator.release = f_arenaDsRelease;
+        ds->arena = arena;
+        arena->ds = ds;
+        f_arenaRetrack(arena);
+    }
+    return &arena->ds->allocator;
+}
+
+struct f_arena *f_arenaScratch(){
+    if (scratchArena == NULL) {
+        scratchArena = f_arenaCreate("scratch arena", F_ARENA_SCRATCH_CHUNK_SIZE);
+    }
+    return scratchArena;
+}
+
+void f_arenaScratchRelease(){
+    f_arenaDestroy(scratchArena);
+    scratchArena = NULL;
+}
+
+// arenas of other threads are read without their owners stopping, their numbers are a snapshot at best
+void f_arenaListArenas(){
+    size_t used = 0, reserved = 0, count = 0;
+
+    printf("Arena List start from here:\n");
+    f_arenaLockList();
+    if (arenas == NULL) {
+        printf(">>> EMPTY <<<\n");
+    }
+    for (struct f_arena *arena = arenas; arena; arena = arena->next) {
+        size_t arenaUsed = f_arenaUsed(arena);
+        size_t peak = arena->peak > arenaUsed ? arena->peak : arenaUsed;
+        printf("%zu bytes in use, %zu reserved (peak %zu bytes) in \"%s\" at %s: %d\n",
+               arenaUsed, arena->reserved, peak, arena->name, arena->file, arena->line);
+        used += arenaUsed;
+        reserved += arena->reserved;
+        count++;
+    }
+    f_arenaUnlockList();
+    printf("%zu bytes in use, %zu reserved in %zu arenas.\n", used, reserved, count);
+    printf("Arena List End Here.\n");
+}
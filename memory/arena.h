@@ -0,0 +1,117 @@
+/*
+ * arena v0.01 - Uthowaipru Chowdhury Baiching 2025
+ *
+ * Bump allocator for memory that is all freed at the same time, like the temporaries
+ * of one request. Allocating is a pointer bump, freeing is resetting the arena.
+ *
+ * Usage:
+ * - Include this header and compile with arena.c and memorytracker.c
+ * - struct f_arena *a = f_arenaCreate("request", 0); creates an arena with the default chunk size
+ * - f_arenaAlloc(a, size) returns size bytes aligned like malloc, there is no per-allocation free
+ * - struct f_arenaMark m = f_arenaGetMark(a); ... f_arenaReset(a, m); frees everything allocated
+ *   after the mark, f_arenaClear(a) frees everything, f_arenaDestroy(a) gives the chunks back
+ * - f_arenaScratch() is an arena of the calling thread for short lived temporaries, always
+ *   take a mark before using it and reset to it when done
+ * - Every arena is one object in memorytracker, at the line that created it and as big as all
+ *   it has reserved, so f_trackListAllocations() and f_trackListSites() show one entry per arena;
+ *   f_arenaListArenas() prints each live arena with its bytes in use, reserved and its high-water mark
+ * - arrinit(a, f_arenaDs(arena)), hminit(m, f_arenaDs(arena)) and shinit(m, f_arenaDs(arena))
+ *   make stb_ds containers that allocate from the arena; arrfree/hmfree do nothing on them, they
+ *   go away with the rest of the arena's memory, so don't use them after resetting past them
+ */
+
+#ifndef F_ARENA_H
+#define F_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// chunk size used when f_arenaCreate() is given 0
+#define F_ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+// chunk size of the per-thread scratch arenas
+#define F_ARENA_SCRATCH_CHUNK_SIZE (256 * 1024)
+
+struct f_arenaChunk;
+struct f_arenaDs;
+
+// fields are read by the inline allocation path below, use the functions to look at them
+struct f_arena
+{
+    char *cursor;                // next free byte of the current chunk
+    char *end;                   // end of the current chunk
+    struct f_arenaChunk *chunk;  // current chunk, older ones are linked behind it
+    struct f_arenaChunk *spare;  // chunks given back by resets, reused before allocating new ones
+    size_t usedBefore;           // bytes handed out from the chunks behind the current one
+    size_t reserved;             // bytes of all chunks, spare ones included
+    size_t peak;                 // highest bytes in use seen, brought up to date on reset and query
+    size_t chunkSize;
+    const char *name;            // where the chunks are reported in memorytracker
+    const char *file;
+    int line;
+    struct f_arenaDs *ds;        // stb_ds allocator, made by the first f_arenaDs()
+    struct f_arena *prev, *next; // list of live arenas for f_arenaListArenas()
+};
+
+// position in an arena to reset back to
+struct f_arenaMark
+{
+    struct f_arenaChunk *chunk;
+    char *cursor;
+    size_t usedBefore;
+};
+
+#define f_arenaCreate(name, chunkSize) f_arenaCreateAt(name, chunkSize, __FILE__, __LINE__)
+
+// creates an arena that grabs chunkSize bytes at a time (0 for F_ARENA_DEFAULT_CHUNK_SIZE), NULL when out of memory
+extern struct f_arena *f_arenaCreateAt(const char *name, size_t chunkSize, const char *file, int line);
+// frees every chunk and the arena itself
+extern void f_arenaDestroy(struct f_arena *arena);
+// called by f_arenaAllocAligned when the current chunk is full
+extern void *f_arenaAllocSlow(struct f_arena *arena, size_t size, size_t alignment);
+// zeroed f_arenaAlloc
+extern void *f_arenaCalloc(struct f_arena *arena, size_t count, size_t size);
+// copies a NUL-terminated string into the arena
+extern char *f_arenaStrdup(struct f_arena *arena, const char *str);
+// everything allocated after the mark is freed, its chunks are kept for reuse
+extern void f_arenaReset(struct f_arena *arena, struct f_arenaMark mark);
+// frees everything, keeps the chunks
+extern void f_arenaClear(struct f_arena *arena);
+// bytes handed out and not reset yet, bytes of chunks held and the most bytes ever in use
+extern size_t f_arenaUsed(const struct f_arena *arena);
+extern size_t f_arenaReserved(const struct f_arena *arena);
+extern size_t f_arenaPeak(struct f_arena *arena);
+// stb_ds memory context for arrinit/hminit/shinit that allocates from the arena, NULL when out of memory
+extern void *f_arenaDs(struct f_arena *arena);
+// the calling thread's scratch arena, created on first use; NULL when out of memory
+extern struct f_arena *f_arenaScratch();
+// destroys the calling thread's scratch arena, call before the thread exits
+extern void f_arenaScratchRelease();
+// prints every live arena with its bytes in use, reserved and high-water mark
+extern void f_arenaListArenas();
+
+// size bytes aligned to alignment (a power of two), NULL when out of memory
+static inline void *f_arenaAllocAligned(struct f_arena *arena, size_t size, size_t alignment){
+    // the slow path reports an alignment that isn't a power of two, constant ones fold away
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return f_arenaAllocSlow(arena, size, alignment);
+    }
+    uintptr_t start = ((uintptr_t)arena->cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+    if (start <= (uintptr_t)arena->end && size <= (uintptr_t)arena->end - start) {
+        arena->cursor = (char *)start + size;
+        return (void *)start;
+    }
+    return f_arenaAllocSlow(arena, size, alignment);
+}
+
+// size bytes aligned like malloc's
+static inline void *f_arenaAlloc(struct f_arena *arena, size_t size){
+    return f_arenaAllocAligned(arena, size, _Alignof(max_align_t));
+}
+
+static inline struct f_arenaMark f_arenaGetMark(const struct f_arena *arena){
+    struct f_arenaMark mark = {arena->chunk, arena->cursor, arena->usedBefore};
+    return mark;
+}
+
+#endif
@@ -25,6 +25,7 @@ int main(){
     }
 
     f_trackListAllocations();
+    f_trackListSites(0);
 
     for(; i < 100; i++)
     {
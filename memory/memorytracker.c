@@ -1,47 +1,762 @@
 #define INTERNAL
 #include "memorytracker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#define f_trackYield() SwitchToThread()
+#else
+#include <sched.h>
+#define f_trackYield() sched_yield()
+#endif
+
+#if defined(_WIN32)
+#define F_TRACK_BACKTRACE(frames, max) CaptureStackBackTrace(0, max, frames, NULL)
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#include <malloc.h>
+#define F_TRACK_BACKTRACE(frames, max) backtrace(frames, max)
+#else
+#define F_TRACK_BACKTRACE(frames, max) 0 // no stacks on this platform
+#endif
+
+// address in the code that called into the tracker, used to cut the tracker's own frames off stacks
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define F_TRACK_CALLER() _ReturnAddress()
+#elif defined(__GNUC__)
+#define F_TRACK_CALLER() __builtin_return_address(0)
+#else
+#define F_TRACK_CALLER() NULL
+#endif
+
+// number of independent registries is 2^MEMBLK_SHARD_BITS
+#define MEMBLK_SHARD_BITS 6
+#define MEMBLK_SHARDS (1 << MEMBLK_SHARD_BITS)
+#define MEMBLK_CACHE_LINE 64
+// same for the call site table, and the per-thread site lookup cache
+#define MEMSITE_SHARD_BITS 4
+#define MEMSITE_SHARDS (1 << MEMSITE_SHARD_BITS)
+#define MEMSITE_CACHE_BITS 4
+#define MEMSITE_CACHE_SIZE (1 << MEMSITE_CACHE_BITS)
+// stack table shards
+#define MEMSTACK_SHARD_BITS 4
+#define MEMSTACK_SHARDS (1 << MEMSTACK_SHARD_BITS)
+// frames captured above the ones that are kept, room for the tracker's own frames
+#define MEMSTACK_EXTRA_FRAMES 4
+// site and stack records are kept in chunks of 2^MEMCHUNK_BITS, ids run up to MEMCHUNKS chunks
+#define MEMCHUNK_BITS 8
+#define MEMCHUNKS 16384
+
+#ifdef _MSC_VER
+#define F_TRACK_THREAD_LOCAL __declspec(thread)
+#else
+#define F_TRACK_THREAD_LOCAL _Thread_local
+#endif
+
+// stb_ds.h is compiled here for the whole program. Its growth while the tracker updates its
+// own tables must not be tracked, everyone else's arrays and hash maps are tracked like any
+// other allocation. Every stb_ds free is a call into this file (arrfree is stbds_arrfreef),
+// so containers are freed through the tracker whether their file includes memorytracker.h or not.
+static F_TRACK_THREAD_LOCAL int memtrackInternal; // > 0 while the tracker works on its own tables
+static void *f_trackStbdsRealloc(void *ptr, size_t size);
+static void f_trackStbdsFree(void *ptr);
+
+#define STBDS_REALLOC(context, ptr, size) f_trackStbdsRealloc(ptr, size)
+#define STBDS_FREE(context, ptr) f_trackStbdsFree(ptr)
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 #define STBDS_NO_SHORT_NAMES
-#include <stdio.h>
-#include <stdlib.h>
 
-struct memoryblk
+// totals for a group of blocks, updated on every malloc/free
+struct memstats
+{
+    atomic_size_t count;  // live blocks
+    atomic_size_t bytes;  // live bytes
+    atomic_size_t peak;   // highest value bytes has reached
+    atomic_size_t allocs; // blocks allocated since start, freed or not
+};
+
+// everything allocated from one malloc() call site, blocks refer to it by its id
+struct memsite
 {
-    size_t size;
     const char *file;
     const char *expr;
     int line;
-    struct memoryblk **addr;
-    int padding[3]; // Make it an even 16 byte length (total size=32 bytes in 32-bit mode).
+    unsigned int id;
+    struct memstats stats;
+};
+
+// key of the site table, string literals are compared by address
+struct memsiteKey
+{
+    const char *file;
+    const char *expr;
+    intptr_t line; // pointer sized so the key has no padding bytes to hash
+};
+
+struct memsiteEntry
+{
+    struct memsiteKey key;
+    struct memsite *value;
+};
+
+// return addresses of a call stack, unused frames are NULL
+struct memstackKey
+{
+    void *frames[F_TRACK_MAX_STACK_DEPTH];
+};
+
+// everything allocated from one call stack, blocks refer to it by its id
+struct memstack
+{
+    struct memstackKey key;
+    int depth;
+    struct memstats stats;
+};
+
+struct memstackEntry
+{
+    struct memstackKey key;
+    unsigned int value;
 };
 
-// tracking the original list
-struct memoryblk **memblkList = NULL;
+// Records that get handed out by id. They never move once created, so anyone holding an
+// id can reach the record without a lookup or a lock.
+struct memchunks
+{
+    void *_Atomic chunks[MEMCHUNKS];
+    atomic_uint count;
+};
 
-static void f_trackMemBlkDetails(struct memoryblk *mb){
-    printf("%zu bytes allocated with \"%s\" at %s: %d\n", mb->size, mb->expr, mb->file, mb->line);
+// Sits right in front of every block handed out. It's 16 bytes so the user pointer keeps malloc's
+// max_align_t alignment (16 bytes on 64-bit); everything else about a tracked block lives in the
+// registry, which only has entries for tracked blocks.
+struct memoryblk
+{
+    size_t size;
+    unsigned int site;        // id in the site table, 0 for blocks sampling skipped
+    unsigned short magic;     // MEMBLK_TRACKED or MEMBLK_UNSAMPLED
+    unsigned char alignShift; // log2 of the alignment for aligned blocks, 0 for malloc'd ones
+    unsigned char unused[sizeof(size_t) == 8 ? 1 : 5];
+};
+
+_Static_assert(sizeof(struct memoryblk) == 16, "memoryblk must stay 16 bytes");
+_Static_assert(16 % _Alignof(max_align_t) == 0, "memoryblk would break malloc's alignment");
+
+// blocks in the registry, and blocks sampling skipped that only have size and alignment filled in
+#define MEMBLK_TRACKED 0x7EACu
+#define MEMBLK_UNSAMPLED 0x5A4Du
+
+// what the registry knows about a tracked block beyond its header
+struct memblkInfo
+{
+    size_t weight;      // bytes it stands for in the totals, more than size when it was sampled
+    unsigned int stack; // id in the stack table, 0 when no stack was captured
+};
+
+// address of the user block -> its info, so malloc/free are O(1) instead of a linear scan
+struct memblkEntry
+{
+    void *key;
+    struct memblkInfo value;
+};
+
+// memory the tracker didn't allocate itself but was told about, like objects carved out of a pool
+struct memobjInfo
+{
+    size_t size;
+    unsigned int site;
+    unsigned int stack;
+};
+
+struct memobjEntry
+{
+    void *key;
+    struct memobjInfo value;
+};
+
+// mean number of bytes between two sampled allocations, 0 tracks every one
+static atomic_size_t memsampleRate;
+static F_TRACK_THREAD_LOCAL size_t memsampleCountdown; // bytes left before this thread samples again
+static F_TRACK_THREAD_LOCAL uint64_t memsampleRng;
+
+// Blocks are spread over the shards by address and every shard has its own lock,
+// so threads allocating at the same time rarely touch the same lock or cache line.
+struct memblkShard
+{
+    _Alignas(MEMBLK_CACHE_LINE) atomic_int lock; // 0 = unlocked, zero-initialised is ready to use
+    struct memblkEntry *map;
+    struct memobjEntry *objects; // registered with f_trackObjectAlloc, they have no header
+    // overhead of the blocks in this shard, scaled like the weights, updated under the lock
+    size_t userBytes;
+    size_t headerBytes;
+    size_t slackBytes;
+    size_t blocks;
+};
+
+static struct memblkShard memblkShards[MEMBLK_SHARDS];
+
+struct memsiteShard
+{
+    _Alignas(MEMBLK_CACHE_LINE) atomic_int lock;
+    struct memsiteEntry *map;
+};
+
+static struct memsiteShard memsiteShards[MEMSITE_SHARDS];
+static struct memchunks memsites;
+
+// last sites this thread allocated from, hits don't take any lock
+static F_TRACK_THREAD_LOCAL struct memsite *memsiteCache[MEMSITE_CACHE_SIZE];
+
+struct memstackShard
+{
+    _Alignas(MEMBLK_CACHE_LINE) atomic_int lock;
+    struct memstackEntry *map; // identical stacks share one id
+};
+
+static struct memstackShard memstackShards[MEMSTACK_SHARDS];
+static struct memchunks memstacks;
+// frames to capture per tracked allocation, 0 turns stacks off
+static atomic_int memstackDepth;
+
+static struct memblkShard *f_trackShardOf(void *ptr){
+    // low bits are always zero because of malloc alignment, fibonacci hashing mixes the rest
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull;
+    return &memblkShards[h >> (64 - MEMBLK_SHARD_BITS)];
 }
 
+// every stb_ds call on the tracker's own tables happens while holding one of these locks
+static void f_trackLock(atomic_int *lock){
+    int spins = 0;
+    memtrackInternal++;
+    for (;;) {
+        if (!atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+            return;
+        }
+        // wait on a plain load so the cache line isn't bounced around while it's held
+        while (atomic_load_explicit(lock, memory_order_relaxed)) {
+            if (++spins > 64) {
+                f_trackYield();
+                spins = 0;
+            }
+        }
+    }
+}
 
-void *f_malloc_tracker(size_t size, const char *expr, const char *file, int line){
+static void f_trackUnlock(atomic_int *lock){
+    atomic_store_explicit(lock, 0, memory_order_release);
+    memtrackInternal--;
+}
+
+static void *f_trackChunkAt(struct memchunks *table, unsigned int id, size_t elemsize){
+    char *chunk = atomic_load_explicit(&table->chunks[id >> MEMCHUNK_BITS], memory_order_acquire);
+    return chunk + (id & ((1u << MEMCHUNK_BITS) - 1)) * elemsize;
+}
+
+// hands out the next id (ids start at 1) with zeroed storage, 0 when the table is full
+static unsigned int f_trackChunkNew(struct memchunks *table, size_t elemsize){
+    unsigned int id = atomic_fetch_add_explicit(&table->count, 1, memory_order_relaxed) + 1;
+    unsigned int chunk = id >> MEMCHUNK_BITS;
+    if (chunk >= MEMCHUNKS) {
+        return 0;
+    }
+    if (!atomic_load_explicit(&table->chunks[chunk], memory_order_acquire)) {
+        // whoever loses the race to add the chunk throws theirs away
+        void *fresh = (calloc)((size_t)1 << MEMCHUNK_BITS, elemsize);
+        void *expected = NULL;
+        if (fresh && !atomic_compare_exchange_strong_explicit(&table->chunks[chunk], &expected, fresh,
+                                                              memory_order_acq_rel, memory_order_acquire)) {
+            (free)(fresh);
+        }
+    }
+    return atomic_load_explicit(&table->chunks[chunk], memory_order_acquire) ? id : 0;
+}
+
+static size_t f_trackChunkBytes(struct memchunks *table, size_t elemsize){
+    size_t bytes = 0;
+    for (int c = 0; c < MEMCHUNKS; c++) {
+        if (atomic_load_explicit(&table->chunks[c], memory_order_acquire)) {
+            bytes += ((size_t)1 << MEMCHUNK_BITS) * elemsize;
+        }
+    }
+    return bytes;
+}
+
+static struct memsite *f_trackSiteAt(unsigned int id){
+    return f_trackChunkAt(&memsites, id, sizeof(struct memsite));
+}
+
+static struct memstack *f_trackStackAt(unsigned int id){
+    return f_trackChunkAt(&memstacks, id, sizeof(struct memstack));
+}
+
+// finds the record of a call site, creating it the first time the site allocates
+static struct memsite *f_trackSiteOf(const char *expr, const char *file, int line){
+    uint64_t h = ((uint64_t)(uintptr_t)file ^ (uint64_t)(uintptr_t)expr ^ (uint64_t)line) * 0x9E3779B97F4A7C15ull;
+    struct memsite **cached = &memsiteCache[h >> (64 - MEMSITE_CACHE_BITS)];
+    struct memsite *site = *cached;
+    if (site && site->line == line && site->file == file && site->expr == expr) {
+        return site;
+    }
+
+    struct memsiteShard *shard = &memsiteShards[(h >> 32) & (MEMSITE_SHARDS - 1)];
+    struct memsiteKey key = { .file = file, .expr = expr, .line = line };
+    f_trackLock(&shard->lock);
+    struct memsiteEntry *entry = stbds_hmgetp_null(shard->map, key);
+    if (entry) {
+        site = entry->value;
+    }
+    else {
+        unsigned int id = f_trackChunkNew(&memsites, sizeof(struct memsite));
+        site = id ? f_trackSiteAt(id) : NULL;
+        if (site) {
+            site->file = file;
+            site->expr = expr;
+            site->line = line;
+            site->id = id;
+            stbds_hmput(shard->map, key, site);
+        }
+    }
+    f_trackUnlock(&shard->lock);
+
+    *cached = site;
+    return site;
+}
+
+// a sampled block stands for weight / size blocks, rounded the same way when it's added and removed
+static size_t f_trackBlockCount(size_t size, size_t weight){
+    if (size == 0 || weight <= size) {
+        return 1;
+    }
+    return (weight + size / 2) / size;
+}
+
+static void f_trackStatsAdd(struct memstats *stats, size_t count, size_t size){
+    atomic_fetch_add_explicit(&stats->count, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->allocs, count, memory_order_relaxed);
+    size_t bytes = atomic_fetch_add_explicit(&stats->bytes, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&stats->peak, memory_order_relaxed);
+    while (bytes > peak &&
+           !atomic_compare_exchange_weak_explicit(&stats->peak, &peak, bytes, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void f_trackStatsRemove(struct memstats *stats, size_t count, size_t size){
+    atomic_fetch_sub_explicit(&stats->count, count, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&stats->bytes, size, memory_order_relaxed);
+}
+
+static int f_trackCompareSites(const void *a, const void *b){
+    size_t x = atomic_load_explicit(&(*(struct memsite *const *)a)->stats.bytes, memory_order_relaxed);
+    size_t y = atomic_load_explicit(&(*(struct memsite *const *)b)->stats.bytes, memory_order_relaxed);
+    return (x < y) - (x > y); // biggest first
+}
+
+static int f_trackCompareStacks(const void *a, const void *b){
+    size_t x = atomic_load_explicit(&(*(struct memstack *const *)a)->stats.bytes, memory_order_relaxed);
+    size_t y = atomic_load_explicit(&(*(struct memstack *const *)b)->stats.bytes, memory_order_relaxed);
+    return (x < y) - (x > y);
+}
+
+// captures the current stack, from the tracker's caller down, and returns its id in the stack table
+static unsigned int f_trackStackOf(int depth, void *caller){
+    void *frames[F_TRACK_MAX_STACK_DEPTH + MEMSTACK_EXTRA_FRAMES];
+    int n = F_TRACK_BACKTRACE(frames, depth + MEMSTACK_EXTRA_FRAMES);
+    int first = n > 1 ? 1 : 0; // frame 0 is always the tracker itself
+    for (int i = 0; i < n && i < MEMSTACK_EXTRA_FRAMES; i++) {
+        if (frames[i] == caller) {
+            first = i;
+            break;
+        }
+    }
+
+    struct memstackKey key;
+    memset(&key, 0, sizeof(key));
+    int kept = 0;
+    for (int i = first; i < n && kept < depth; i++) {
+        key.frames[kept++] = frames[i];
+    }
+    if (kept == 0) {
+        return 0;
+    }
+
+    struct memstackShard *shard = &memstackShards[stbds_hash_bytes(&key, sizeof(key), 0) & (MEMSTACK_SHARDS - 1)];
+    unsigned int id = 0;
+    f_trackLock(&shard->lock);
+    struct memstackEntry *entry = stbds_hmgetp_null(shard->map, key);
+    if (entry) {
+        id = entry->value;
+    }
+    else {
+        id = f_trackChunkNew(&memstacks, sizeof(struct memstack));
+        if (id) {
+            struct memstack *stack = f_trackStackAt(id);
+            stack->key = key;
+            stack->depth = kept;
+            stbds_hmput(shard->map, key, id);
+        }
+    }
+    f_trackUnlock(&shard->lock);
+    return id;
+}
+
+static void f_trackMemBlkDetails(void *ptr){
+    struct memoryblk *mb = &((struct memoryblk *)(ptr))[-1];
+    struct memsite *site = mb->site ? f_trackSiteAt(mb->site) : NULL;
+    if (site) {
+        printf("%zu bytes allocated with \"%s\" at %s: %d\n", mb->size, site->expr, site->file, site->line);
+    }
+    else {
+        printf("%zu bytes allocated at an unknown site\n", mb->size);
+    }
+}
+
+static void f_trackObjectDetails(struct memobjInfo *info){
+    struct memsite *site = info->site ? f_trackSiteAt(info->site) : NULL;
+    if (site) {
+        printf("%zu byte object registered with \"%s\" at %s: %d\n", info->size, site->expr, site->file, site->line);
+    }
+    else {
+        printf("%zu byte object registered at an unknown site\n", info->size);
+    }
+}
+
+// the user pointer of an aligned block is this far from the start of what was allocated
+static size_t f_trackHeaderSpace(struct memoryblk *memblk){
+    if (memblk->alignShift == 0) {
+        return sizeof(struct memoryblk);
+    }
+    size_t align = (size_t)1 << memblk->alignShift;
+    return (sizeof(struct memoryblk) + align - 1) & ~(align - 1);
+}
+
+static void *f_trackRawStart(struct memoryblk *memblk){
+    return (char *)&memblk[1] - f_trackHeaderSpace(memblk);
+}
+
+// what the allocator rounded the block up to beyond header and user bytes
+static size_t f_trackSlack(struct memoryblk *memblk){
+    size_t usable = 0;
+#if defined(_WIN32)
+    usable = memblk->alignShift ? _aligned_msize(f_trackRawStart(memblk), (size_t)1 << memblk->alignShift, 0)
+                                : _msize(f_trackRawStart(memblk));
+#elif defined(__GLIBC__)
+    usable = malloc_usable_size(f_trackRawStart(memblk));
+#endif
+    size_t used = f_trackHeaderSpace(memblk) + memblk->size;
+    return usable > used ? usable - used : 0;
+}
+
+static void f_trackRawFree(struct memoryblk *memblk){
+#ifdef _WIN32
+    if (memblk->alignShift) {
+        _aligned_free(f_trackRawStart(memblk));
+        return;
+    }
+#endif
+    (free)(f_trackRawStart(memblk));
+}
+
+// exponentially distributed gap to the next sample, so sampling is a Poisson process over allocated bytes
+static size_t f_trackNextSample(size_t rate){
+    if (memsampleRng == 0) {
+        memsampleRng = ((uint64_t)(uintptr_t)&memsampleRng ^ (uint64_t)time(NULL)) | 1;
+    }
+    memsampleRng ^= memsampleRng << 13;
+    memsampleRng ^= memsampleRng >> 7;
+    memsampleRng ^= memsampleRng << 17;
+    double u = (double)((memsampleRng >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    return (size_t)(-log(u) * (double)rate) + 1;
+}
+
+// decides whether this allocation gets a full record, this is the whole cost of a skipped one
+static int f_trackShouldSample(size_t size, size_t rate){
+    if (size < memsampleCountdown) {
+        memsampleCountdown -= size;
+        return 0;
+    }
+    // a thread starts a gap into the stream too, else every thread's first allocation is sampled
+    if (memsampleRng == 0) {
+        memsampleCountdown = f_trackNextSample(rate);
+        if (size < memsampleCountdown) {
+            memsampleCountdown -= size;
+            return 0;
+        }
+    }
+    memsampleCountdown = f_trackNextSample(rate);
+    return 1;
+}
+
+// adds a block whose header is filled in to its site and stack, and to the registry
+static void f_trackRegister(struct memoryblk *memblk, struct memblkInfo info){
+    size_t count = f_trackBlockCount(memblk->size, info.weight);
+    if (memblk->site) {
+        f_trackStatsAdd(&f_trackSiteAt(memblk->site)->stats, count, info.weight);
+    }
+    if (info.stack) {
+        f_trackStatsAdd(&f_trackStackAt(info.stack)->stats, count, info.weight);
+    }
+    size_t slack = f_trackSlack(memblk);
+
+    struct memblkShard *shard = f_trackShardOf(&memblk[1]);
+    f_trackLock(&shard->lock);
+    stbds_hmput(shard->map, (void *)&memblk[1], info);
+    shard->userBytes += info.weight;
+    shard->headerBytes += count * f_trackHeaderSpace(memblk);
+    shard->slackBytes += count * slack;
+    shard->blocks += count;
+    f_trackUnlock(&shard->lock);
+}
+
+// fills in the header in front of user and starts tracking it, unless sampling skips it
+static void *f_trackInsert(struct memoryblk *memblk, size_t size, unsigned char alignShift, const char *expr, const char *file, int line, void *caller){
+    size_t rate = atomic_load_explicit(&memsampleRate, memory_order_relaxed);
+    struct memblkInfo info = { .weight = size };
+
+    memblk->size = size;
+    memblk->alignShift = alignShift;
+    if (rate)
+    {
+        if (!f_trackShouldSample(size, rate))
+        {
+            memblk->site = 0;
+            memblk->magic = MEMBLK_UNSAMPLED;
+            return (void *)&memblk[1];
+        }
+        // a size byte block is sampled with probability 1 - e^(-size/rate), scale it back up
+        if (size / 64 < rate)
+        {
+            double probability = -expm1(-(double)size / (double)rate);
+            info.weight = probability > 0 ? (size_t)((double)size / probability) : rate;
+        }
+    }
+
+    int depth = atomic_load_explicit(&memstackDepth, memory_order_relaxed);
+    struct memsite *site = f_trackSiteOf(expr, file, line);
+    memblk->site = site ? site->id : 0;
+    memblk->magic = MEMBLK_TRACKED;
+    info.stack = depth ? f_trackStackOf(depth, caller) : 0;
+    f_trackRegister(memblk, info);
+
+    return (void *)&memblk[1];
+}
+
+// stops tracking ptr, returns its header or NULL if the tracker never allocated it
+static struct memoryblk *f_trackRemove(void *ptr, const char *expr, const char *file, int line, struct memblkInfo *info){
+    struct memoryblk *memblk = &((struct memoryblk *)(ptr))[-1];
+    if (memblk->magic == MEMBLK_UNSAMPLED)
+    {
+        return memblk;
+    }
+
+    struct memblkShard *shard = f_trackShardOf(ptr);
+    size_t slack = f_trackSlack(memblk);
+
+    // stbds_hmdel swaps the last entry into the hole, so nothing gets shifted
+    f_trackLock(&shard->lock);
+    struct memblkEntry *entry = stbds_hmgetp_null(shard->map, ptr);
+    if (entry)
+    {
+        *info = entry->value;
+        (void)stbds_hmdel(shard->map, ptr);
+        size_t count = f_trackBlockCount(memblk->size, info->weight);
+        shard->userBytes -= info->weight;
+        shard->headerBytes -= count * f_trackHeaderSpace(memblk);
+        shard->slackBytes -= count * slack;
+        shard->blocks -= count;
+    }
+    f_trackUnlock(&shard->lock);
+    if (!entry)
+    {
+        printf("%s at %s: %d was not allocated by the tracker!\n", expr, file, line);
+        return NULL;
+    }
+
+    size_t count = f_trackBlockCount(memblk->size, info->weight);
+    if (memblk->site) {
+        f_trackStatsRemove(&f_trackSiteAt(memblk->site)->stats, count, info->weight);
+    }
+    if (info->stack) {
+        f_trackStatsRemove(&f_trackStackAt(info->stack)->stats, count, info->weight);
+    }
+    return memblk;
+}
+
+static void *f_trackMalloc(size_t size, const char *expr, const char *file, int line, void *caller){
+    if (size > SIZE_MAX - sizeof(struct memoryblk))
+    {
+        printf("Malloc size overflow!\n");
+        return NULL;
+    }
     struct memoryblk *memblk = (malloc)(size + sizeof(*memblk));
     if (!memblk)
     {
         printf("Malloc failed!\n");
         return NULL;
     }
-    *memblk = (struct memoryblk){
-        .size = size,
-        .file = file,
-        .expr = expr,
-        .line = line,
-        .addr = (void *)&memblk[1]
-    };
+    return f_trackInsert(memblk, size, 0, expr, file, line, caller);
+}
+
+void *f_malloc_tracker(size_t size, const char *expr, const char *file, int line){
+    return f_trackMalloc(size, expr, file, line, F_TRACK_CALLER());
+}
 
-    stbds_arrput(memblkList, memblk);
+void *f_calloc_tracker(size_t count, size_t size, const char *expr, const char *file, int line){
+    if (size && count > (SIZE_MAX - sizeof(struct memoryblk)) / size)
+    {
+        printf("Calloc size overflow!\n");
+        return NULL;
+    }
+    // calloc instead of malloc+memset, fresh pages from the OS are already zeroed
+    struct memoryblk *memblk = (calloc)(1, count * size + sizeof(*memblk));
+    if (!memblk)
+    {
+        printf("Calloc failed!\n");
+        return NULL;
+    }
+    return f_trackInsert(memblk, count * size, 0, expr, file, line, F_TRACK_CALLER());
+}
 
-    return (void *)&memblk[1];
+static void *f_trackAlignedAlloc(size_t alignment, size_t size, const char *expr, const char *file, int line, void *caller){
+    if (alignment == 0 || (alignment & (alignment - 1)))
+    {
+        printf("Alignment %zu is not a power of two!\n", alignment);
+        return NULL;
+    }
+    // malloc and the header already keep this much alignment, nothing special to do
+    if (alignment <= _Alignof(max_align_t)) {
+        return f_trackMalloc(size, expr, file, line, caller);
+    }
+
+    unsigned char shift = 0;
+    while (((size_t)1 << shift) < alignment) {
+        shift++;
+    }
+    size_t space = (sizeof(struct memoryblk) + alignment - 1) & ~(alignment - 1);
+    if (size > SIZE_MAX - space - alignment)
+    {
+        printf("Aligned alloc size overflow!\n");
+        return NULL;
+    }
+    // aligned_alloc wants a multiple of the alignment
+    size_t total = (space + size + alignment - 1) & ~(alignment - 1);
+#ifdef _WIN32
+    char *raw = _aligned_malloc(total, alignment);
+#else
+    char *raw = (aligned_alloc)(alignment, total);
+#endif
+    if (!raw)
+    {
+        printf("Aligned alloc failed!\n");
+        return NULL;
+    }
+    return f_trackInsert(&((struct memoryblk *)(raw + space))[-1], size, shift, expr, file, line, caller);
+}
+
+void *f_aligned_alloc_tracker(size_t alignment, size_t size, const char *expr, const char *file, int line){
+    return f_trackAlignedAlloc(alignment, size, expr, file, line, F_TRACK_CALLER());
+}
+
+int f_posix_memalign_tracker(void **memptr, size_t alignment, size_t size, const char *expr, const char *file, int line){
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1)) || alignment == 0)
+    {
+        return EINVAL;
+    }
+    void *ptr = f_trackAlignedAlloc(alignment, size, expr, file, line, F_TRACK_CALLER());
+    if (!ptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *f_realloc_tracker(void *ptr, size_t size, const char *expr, const char *file, int line){
+    if (!ptr)
+    {
+        return f_trackMalloc(size, expr, file, line, F_TRACK_CALLER());
+    }
+    if (size == 0)
+    {
+        f_track_free(ptr, expr, file, line);
+        return NULL;
+    }
+
+    // the block is taken out before realloc can release its address to another thread
+    struct memblkInfo info = { 0 };
+    struct memoryblk *memblk = f_trackRemove(ptr, expr, file, line, &info);
+    if (!memblk)
+    {
+        return NULL;
+    }
+    size_t oldsize = memblk->size;
+
+    if (memblk->alignShift)
+    {
+        // there is no aligned realloc, move it to a new block with the same alignment
+        void *newptr = f_trackAlignedAlloc((size_t)1 << memblk->alignShift, size, expr, file, line, F_TRACK_CALLER());
+        if (newptr)
+        {
+            memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+            f_trackRawFree(memblk);
+            return newptr;
+        }
+    }
+    else if (size <= SIZE_MAX - sizeof(*memblk))
+    {
+        // grows in place when the allocator can, the header moves along with the data otherwise
+        struct memoryblk *newblk = (realloc)(memblk, size + sizeof(*memblk));
+        if (newblk)
+        {
+            return f_trackInsert(newblk, size, 0, expr, file, line, F_TRACK_CALLER());
+        }
+    }
+
+    // the old block is still valid when realloc fails, keep tracking it where it came from
+    printf("Realloc failed!\n");
+    if (memblk->magic == MEMBLK_TRACKED)
+    {
+        f_trackRegister(memblk, info);
+    }
+    return NULL;
+}
+
+char *f_strdup_tracker(const char *str, const char *expr, const char *file, int line){
+    size_t len = strlen(str) + 1;
+    char *copy = f_trackMalloc(len, expr, file, line, F_TRACK_CALLER());
+    if (copy)
+    {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+static void *f_trackStbdsRealloc(void *ptr, size_t size){
+    if (memtrackInternal) {
+        return (realloc)(ptr, size);
+    }
+    return f_realloc_tracker(ptr, size, "stbds_arrgrowf", "stb_ds.h", 0);
+}
+
+static void f_trackStbdsFree(void *ptr){
+    if (memtrackInternal) {
+        (free)(ptr);
+        return;
+    }
+    if (ptr) {
+        f_track_free(ptr, "stbds_arrfree", "stb_ds.h", 0);
+    }
 }
 
 void f_track_free(void *ptr, const char *expr, const char *file, int line){
@@ -51,30 +766,296 @@ void f_track_free(void *ptr, const char *expr, const char *file, int line){
         return;
     }
     else{
-        struct memoryblk *memblk = &((struct memoryblk *)(ptr))[-1];
-
-        for (int i =0; i < stbds_arrlen(memblkList); i++) {
-            if (memblk->addr == memblkList[i]->addr) {
-                stbds_arrdel(memblkList, i);
-            }
+        struct memblkInfo info;
+        struct memoryblk *memblk = f_trackRemove(ptr, expr, file, line, &info);
+        if (!memblk)
+        {
+            return;
         }
 
-        (free)(memblk);
+        f_trackRawFree(memblk);
     }
-    
+
+}
+
+void f_trackObjectAlloc(void *ptr, size_t size, const char *expr, const char *file, int line){
+    if (!ptr)
+    {
+        return;
+    }
+    // objects are always recorded, sampling would lose the leaks they're registered to find
+    int depth = atomic_load_explicit(&memstackDepth, memory_order_relaxed);
+    struct memsite *site = f_trackSiteOf(expr, file, line);
+    struct memobjInfo info = { .size = size, .site = site ? site->id : 0 };
+    info.stack = depth ? f_trackStackOf(depth, F_TRACK_CALLER()) : 0;
+    if (site) {
+        f_trackStatsAdd(&site->stats, 1, size);
+    }
+    if (info.stack) {
+        f_trackStatsAdd(&f_trackStackAt(info.stack)->stats, 1, size);
+    }
+
+    struct memblkShard *shard = f_trackShardOf(ptr);
+    f_trackLock(&shard->lock);
+    stbds_hmput(shard->objects, ptr, info);
+    f_trackUnlock(&shard->lock);
+}
+
+void f_trackObjectFree(void *ptr, const char *expr, const char *file, int line){
+    if (!ptr)
+    {
+        return;
+    }
+    struct memblkShard *shard = f_trackShardOf(ptr);
+    f_trackLock(&shard->lock);
+    struct memobjEntry *entry = stbds_hmgetp_null(shard->objects, ptr);
+    struct memobjInfo info = { 0 };
+    if (entry)
+    {
+        info = entry->value;
+        (void)stbds_hmdel(shard->objects, ptr);
+    }
+    f_trackUnlock(&shard->lock);
+    if (!entry)
+    {
+        printf("%s at %s: %d was not registered with the tracker!\n", expr, file, line);
+        return;
+    }
+
+    if (info.site) {
+        f_trackStatsRemove(&f_trackSiteAt(info.site)->stats, 1, info.size);
+    }
+    if (info.stack) {
+        f_trackStatsRemove(&f_trackStackAt(info.stack)->stats, 1, info.size);
+    }
+}
+
+void f_trackSetSampleRate(size_t bytes){
+    atomic_store_explicit(&memsampleRate, bytes, memory_order_relaxed);
+}
+
+size_t f_trackSampleRate(){
+    return atomic_load_explicit(&memsampleRate, memory_order_relaxed);
+}
+
+void f_trackSetStackDepth(int depth){
+    if (depth < 0) {
+        depth = 0;
+    }
+    if (depth > F_TRACK_MAX_STACK_DEPTH) {
+        depth = F_TRACK_MAX_STACK_DEPTH;
+    }
+    atomic_store_explicit(&memstackDepth, depth, memory_order_relaxed);
+}
+
+size_t f_trackCount(){
+    size_t count = 0;
+    for (int s = 0; s < MEMBLK_SHARDS; s++) {
+        f_trackLock(&memblkShards[s].lock);
+        count += stbds_hmlenu(memblkShards[s].map) + stbds_hmlenu(memblkShards[s].objects);
+        f_trackUnlock(&memblkShards[s].lock);
+    }
+    return count;
+}
+
+// memory behind one of stb_ds's hash maps: the entries (plus the default one) and the hash index
+static size_t f_trackTableBytes(void *map, size_t elemsize){
+    if (!map) {
+        return 0;
+    }
+    stbds_array_header *header = stbds_header((char *)map - elemsize);
+    size_t bytes = sizeof(*header) + header->capacity * elemsize;
+    stbds_hash_index *index = header->hash_table;
+    if (index) {
+        bytes += sizeof(*index) + (index->slot_count >> STBDS_BUCKET_SHIFT) * sizeof(stbds_hash_bucket);
+    }
+    return bytes;
+}
+
+void f_trackGetOverhead(struct f_trackOverhead *overhead){
+    *overhead = (struct f_trackOverhead){ 0 };
+    for (int s = 0; s < MEMBLK_SHARDS; s++) {
+        struct memblkShard *shard = &memblkShards[s];
+        f_trackLock(&shard->lock);
+        overhead->blocks += shard->blocks;
+        overhead->userBytes += shard->userBytes;
+        overhead->headerBytes += shard->headerBytes;
+        overhead->slackBytes += shard->slackBytes;
+        overhead->tableBytes += f_trackTableBytes(shard->map, sizeof(*shard->map));
+        overhead->tableBytes += f_trackTableBytes(shard->objects, sizeof(*shard->objects));
+        f_trackUnlock(&shard->lock);
+    }
+    for (int s = 0; s < MEMSITE_SHARDS; s++) {
+        f_trackLock(&memsiteShards[s].lock);
+        overhead->tableBytes += f_trackTableBytes(memsiteShards[s].map, sizeof(*memsiteShards[s].map));
+        f_trackUnlock(&memsiteShards[s].lock);
+    }
+    for (int s = 0; s < MEMSTACK_SHARDS; s++) {
+        f_trackLock(&memstackShards[s].lock);
+        overhead->tableBytes += f_trackTableBytes(memstackShards[s].map, sizeof(*memstackShards[s].map));
+        f_trackUnlock(&memstackShards[s].lock);
+    }
+    overhead->tableBytes += f_trackChunkBytes(&memsites, sizeof(struct memsite));
+    overhead->tableBytes += f_trackChunkBytes(&memstacks, sizeof(struct memstack));
+}
+
+void f_trackListOverhead(){
+    struct f_trackOverhead o;
+    f_trackGetOverhead(&o);
+    size_t tracker = o.headerBytes + o.tableBytes;
+
+    printf("Tracker Overhead start from here:\n");
+    printf("%zu user bytes in %zu blocks\n", o.userBytes, o.blocks);
+    printf("%zu header bytes (%zu per block)\n", o.headerBytes, o.blocks ? o.headerBytes / o.blocks : 0);
+    printf("%zu table bytes (registry, sites and stacks)\n", o.tableBytes);
+    printf("%zu bytes of allocator size class rounding\n", o.slackBytes);
+    if (o.userBytes)
+    {
+        printf("tracking costs %.1f%% on top of user bytes\n", 100.0 * (double)tracker / (double)o.userBytes);
+    }
+    if (f_trackSampleRate())
+    {
+        printf("Blocks and bytes estimated from allocations sampled every %zu bytes, tables are exact.\n", f_trackSampleRate());
+    }
+    printf("Tracker Overhead End Here.\n");
 }
 
 void f_trackListAllocations(){
+    size_t count = 0;
     printf("Allocation List start from here:\n");
 
-    if (!memblkList)
+    // shards are merged one at a time, other threads only wait for the shard being printed
+    for (int s = 0; s < MEMBLK_SHARDS; s++) {
+        struct memblkShard *shard = &memblkShards[s];
+        f_trackLock(&shard->lock);
+        for (ptrdiff_t i = 0; i < stbds_hmlen(shard->map); i++) {
+            f_trackMemBlkDetails(shard->map[i].key);
+        }
+        for (ptrdiff_t i = 0; i < stbds_hmlen(shard->objects); i++) {
+            f_trackObjectDetails(&shard->objects[i].value);
+        }
+        count += stbds_hmlenu(shard->map) + stbds_hmlenu(shard->objects);
+        f_trackUnlock(&shard->lock);
+    }
+
+    if (count == 0)
     {
         printf(">>> EMPTY <<<\n");
     }
-    else{
-        for (int i =0; i < stbds_arrlen(memblkList); i++) {
-            f_trackMemBlkDetails(memblkList[i]);
+    printf("Allocation List End Here.\n");
+}
+
+void f_trackListSites(size_t max_sites){
+    struct memsite **sites = NULL;
+    size_t blocks = 0, bytes = 0;
+
+    // the counters are kept up to date by malloc/free, so this only walks the sites
+    for (int s = 0; s < MEMSITE_SHARDS; s++) {
+        struct memsiteShard *shard = &memsiteShards[s];
+        f_trackLock(&shard->lock);
+        for (ptrdiff_t i = 0; i < stbds_hmlen(shard->map); i++) {
+            struct memsite *site = shard->map[i].value;
+            if (atomic_load_explicit(&site->stats.count, memory_order_relaxed) > 0) {
+                stbds_arrput(sites, site);
+            }
         }
+        f_trackUnlock(&shard->lock);
     }
-    printf("Allocation List End Here.\n");
-}
\ No newline at end of file
+
+    memtrackInternal++; // the sorted copy is the tracker's own as well
+    if (stbds_arrlen(sites) > 1) {
+        qsort(sites, stbds_arrlenu(sites), sizeof(*sites), f_trackCompareSites);
+    }
+
+    printf("Allocation Sites start from here:\n");
+    if (stbds_arrlen(sites) == 0)
+    {
+        printf(">>> EMPTY <<<\n");
+    }
+    for (ptrdiff_t i = 0; i < stbds_arrlen(sites); i++) {
+        struct memsite *site = sites[i];
+        size_t count = atomic_load_explicit(&site->stats.count, memory_order_relaxed);
+        size_t live = atomic_load_explicit(&site->stats.bytes, memory_order_relaxed);
+        blocks += count;
+        bytes += live;
+        if (max_sites == 0 || (size_t)i < max_sites) {
+            printf("%zu bytes in %zu blocks (peak %zu bytes, %zu allocations) with \"%s\" at %s: %d\n",
+                   live, count,
+                   atomic_load_explicit(&site->stats.peak, memory_order_relaxed),
+                   atomic_load_explicit(&site->stats.allocs, memory_order_relaxed),
+                   site->expr, site->file, site->line);
+        }
+    }
+    printf("%zu bytes in %zu blocks from %td sites.\n", bytes, blocks, stbds_arrlen(sites));
+    if (f_trackSampleRate())
+    {
+        printf("Estimated from allocations sampled every %zu bytes.\n", f_trackSampleRate());
+    }
+    printf("Allocation Sites End Here.\n");
+
+    stbds_arrfree(sites);
+    memtrackInternal--;
+}
+
+void f_trackListStacks(size_t max_stacks){
+    struct memstack **stacks = NULL;
+    size_t blocks = 0, bytes = 0;
+
+    for (int s = 0; s < MEMSTACK_SHARDS; s++) {
+        struct memstackShard *shard = &memstackShards[s];
+        f_trackLock(&shard->lock);
+        for (ptrdiff_t i = 0; i < stbds_hmlen(shard->map); i++) {
+            struct memstack *stack = f_trackStackAt(shard->map[i].value);
+            if (atomic_load_explicit(&stack->stats.count, memory_order_relaxed) > 0) {
+                stbds_arrput(stacks, stack);
+            }
+        }
+        f_trackUnlock(&shard->lock);
+    }
+
+    memtrackInternal++;
+    if (stbds_arrlen(stacks) > 1) {
+        qsort(stacks, stbds_arrlenu(stacks), sizeof(*stacks), f_trackCompareStacks);
+    }
+
+    printf("Allocation Stacks start from here:\n");
+    if (stbds_arrlen(stacks) == 0)
+    {
+        printf(">>> EMPTY <<<\n");
+    }
+    for (ptrdiff_t i = 0; i < stbds_arrlen(stacks); i++) {
+        struct memstack *stack = stacks[i];
+        size_t count = atomic_load_explicit(&stack->stats.count, memory_order_relaxed);
+        size_t live = atomic_load_explicit(&stack->stats.bytes, memory_order_relaxed);
+        blocks += count;
+        bytes += live;
+        if (max_stacks != 0 && (size_t)i >= max_stacks) {
+            continue;
+        }
+        printf("%zu bytes in %zu blocks (peak %zu bytes, %zu allocations) from:\n",
+               live, count,
+               atomic_load_explicit(&stack->stats.peak, memory_order_relaxed),
+               atomic_load_explicit(&stack->stats.allocs, memory_order_relaxed));
+#ifdef __GLIBC__
+        // names need the program linked with -rdynamic, addresses can go through addr2line otherwise
+        char **symbols = backtrace_symbols(stack->key.frames, stack->depth);
+        for (int f = 0; f < stack->depth; f++) {
+            printf("    #%d %s\n", f, symbols ? symbols[f] : "?");
+        }
+        (free)(symbols);
+#else
+        for (int f = 0; f < stack->depth; f++) {
+            printf("    #%d %p\n", f, stack->key.frames[f]);
+        }
+#endif
+    }
+    printf("%zu bytes in %zu blocks from %td stacks.\n", bytes, blocks, stbds_arrlen(stacks));
+    if (f_trackSampleRate())
+    {
+        printf("Estimated from allocations sampled every %zu bytes.\n", f_trackSampleRate());
+    }
+    printf("Allocation Stacks End Here.\n");
+
+    stbds_arrfree(stacks);
+    memtrackInternal--;
+}
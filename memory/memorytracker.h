@@ -2,28 +2,89 @@
  * memorytracker v0.01 - Uthowaipru Chowdhury Baiching 2025
  *
  * Memory allocation tracker for debugging purposes.
- * Uses dynamic array (via STB_DS) for simpler tracking.
+ * Uses a hash map (via STB_DS) keyed by address, so tracking and freeing are O(1).
  *
  * Usage:
  * - Include this header and compile with memorytracker.c
- * - Use normally - allocations are automatically tracked
+ * - Use normally - malloc, calloc, realloc, strdup, aligned_alloc and posix_memalign are automatically tracked
  * - Call f_trackListAllocations() to see current allocations that haven't been freed yet
+ * - Call f_trackListSites() to see them grouped by the line that allocated them
+ * - Call f_trackSetStackDepth(8) to also record who called the allocating function, and
+ *   f_trackListStacks() to see allocations grouped by call stack
+ * - Call f_trackObjectAlloc()/f_trackObjectFree() for objects handed out by your own allocators,
+ *   so leaked ones show up in the reports too
+ * - Call f_trackListOverhead() to see how much memory tracking itself costs
+ * - Call f_trackSetSampleRate(F_TRACK_DEFAULT_SAMPLE_RATE) to only record a sample of the
+ *   allocations, cheap enough to leave on in production; reports then show estimated totals
  */
 
 #ifndef MEMORY_TRACKER_H
 #define MEMORY_TRACKER_H
 
 #include <stdlib.h>
+#include <string.h>
 
+// average bytes allocated between two sampled allocations, same default as tcmalloc's heap profiler
+#define F_TRACK_DEFAULT_SAMPLE_RATE (512 * 1024)
+// deepest call stack f_trackSetStackDepth() can capture
+#define F_TRACK_MAX_STACK_DEPTH 16
+
+// what tracking costs on top of the live allocations, filled in by f_trackGetOverhead()
+struct f_trackOverhead
+{
+    size_t blocks;      // live tracked blocks
+    size_t userBytes;   // bytes asked for by those blocks
+    size_t headerBytes; // 16 byte headers in front of them, plus padding of aligned blocks
+    size_t slackBytes;  // what the allocator's size classes rounded the blocks up by
+    size_t tableBytes;  // registry, site and stack tables
+};
+
+// memorytracker.c defines INTERNAL so its own (and stb_ds.h's) allocations aren't tracked
+#ifndef INTERNAL
 #define malloc(size) f_malloc_tracker(size, #size, __FILE__, __LINE__) // Replaces malloc
+#define calloc(count, size) f_calloc_tracker(count, size, #count ", " #size, __FILE__, __LINE__)
+#define realloc(ptr, size) f_realloc_tracker(ptr, size, #size, __FILE__, __LINE__)
+#define strdup(str) f_strdup_tracker(str, "strdup(" #str ")", __FILE__, __LINE__)
+#define aligned_alloc(alignment, size) f_aligned_alloc_tracker(alignment, size, #size, __FILE__, __LINE__)
+#define posix_memalign(memptr, alignment, size) f_posix_memalign_tracker(memptr, alignment, size, #size, __FILE__, __LINE__)
 #define free(ptr) f_track_free(ptr, #ptr, __FILE__, __LINE__)
+#endif
 
 // allocates with malloc, adds it to the list to track and returns the allotted address for user
 extern void *f_malloc_tracker(size_t size, const char *expr, const char *file, int line);
+// zeroed allocation of count * size bytes, NULL if that overflows
+extern void *f_calloc_tracker(size_t count, size_t size, const char *expr, const char *file, int line);
+// resizes a tracked block, in place when possible; the block is reported at the realloc's line afterwards
+extern void *f_realloc_tracker(void *ptr, size_t size, const char *expr, const char *file, int line);
+// tracked copy of a NUL-terminated string
+extern char *f_strdup_tracker(const char *str, const char *expr, const char *file, int line);
+// the returned address is a multiple of alignment (a power of two), release it with free() as usual
+extern void *f_aligned_alloc_tracker(size_t alignment, size_t size, const char *expr, const char *file, int line);
+// same as f_aligned_alloc_tracker, returns 0, EINVAL or ENOMEM like posix_memalign
+extern int f_posix_memalign_tracker(void **memptr, size_t alignment, size_t size, const char *expr, const char *file, int line);
 // free's the allocated memory and removes that from tracking list
 extern void f_track_free(void *ptr, const char *expr, const char *file, int line);
+// starts tracking memory the tracker didn't hand out, like an object carved out of a pool, so it shows
+// up in every report until f_trackObjectFree; its bytes are usually counted in a tracked slab already
+extern void f_trackObjectAlloc(void *ptr, size_t size, const char *expr, const char *file, int line);
+extern void f_trackObjectFree(void *ptr, const char *expr, const char *file, int line);
 // returns the list of unfreed malloc's filename and line numbers
 extern void f_trackListAllocations();
+// prints unfreed allocations grouped by call site, biggest first; max_sites = 0 prints every site
+extern void f_trackListSites(size_t max_sites);
+// captures up to depth frames for every tracked allocation, 0 (the default) turns it off
+extern void f_trackSetStackDepth(int depth);
+// prints unfreed allocations grouped by call stack, biggest first; max_stacks = 0 prints every stack
+extern void f_trackListStacks(size_t max_stacks);
+// samples one allocation every bytes allocated on average, 0 (the default) records every allocation
+extern void f_trackSetSampleRate(size_t bytes);
+extern size_t f_trackSampleRate();
+// fills in the tracker's own memory use next to the bytes it's tracking
+extern void f_trackGetOverhead(struct f_trackOverhead *overhead);
+// prints the same numbers
+extern void f_trackListOverhead();
+// returns the number of allocations that haven't been freed yet, only sampled ones when sampling
+extern size_t f_trackCount();
 
 #endif
 
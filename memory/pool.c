@@ -0,0 +1,326 @@
+#include "pool.h"
+#include "memorytracker.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define f_poolYield() SwitchToThread()
+#else
+#include <sched.h>
+#define f_poolYield() sched_yield()
+#endif
+
+#ifdef _MSC_VER
+#define F_POOL_THREAD_LOCAL __declspec(thread)
+#else
+#define F_POOL_THREAD_LOCAL _Thread_local
+#endif
+
+// a free object; only the first one of a batch in the depot uses nextBatch and count
+struct f_poolNode
+{
+    struct f_poolNode *next;
+    struct f_poolNode *nextBatch;
+    size_t count; // objects in this batch, this one included
+};
+
+struct f_poolSlab
+{
+    struct f_poolSlab *next;
+    max_align_t data[];
+};
+
+struct f_pool
+{
+    atomic_int lock;            // guards the depot and the slabs, 0 = unlocked
+    struct f_poolNode *batches; // depot, a stack of batches of free objects
+    size_t depotCount;
+    struct f_poolSlab *slabs;
+    char *carve, *carveEnd;     // objects of the newest slab not handed out yet
+    size_t slabCount;
+    size_t capacity;
+    size_t objectSize;
+    size_t perSlab;
+    int flags;
+    int slot;                   // index of the per-thread caches, -1 when there is none
+    uint64_t id;                // tells caches of this pool from ones of a destroyed pool in the same slot
+    const char *name;
+    const char *file;
+    int line;
+};
+
+// Two lists per pool and thread, Bonwick's magazines: cur is handed out and filled first,
+// prev is either empty or holds a full batch. A thread only goes to the depot when both
+// are empty on alloc or both are full on free, and then moves F_POOL_BATCH objects at once.
+struct f_poolCache
+{
+    uint64_t id;
+    struct f_poolNode *cur, *prev;
+    size_t curCount, prevCount;
+};
+
+static atomic_int poolsLock;
+static struct f_pool *poolSlots[F_POOL_MAX_CACHED];
+static uint64_t poolIds;
+static F_POOL_THREAD_LOCAL struct f_poolCache poolCaches[F_POOL_MAX_CACHED];
+
+static void f_poolLock(atomic_int *lock){
+    int spins = 0;
+    for (;;) {
+        if (!atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+            return;
+        }
+        while (atomic_load_explicit(lock, memory_order_relaxed)) {
+            if (++spins > 64) {
+                f_poolYield();
+                spins = 0;
+            }
+        }
+    }
+}
+
+static void f_poolUnlock(atomic_int *lock){
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+// carves up to n objects out of the slabs into a list, with the pool locked; returns how many
+static size_t f_poolCarve(struct f_pool *pool, size_t n, struct f_poolNode **list){
+    size_t got = 0;
+    *list = NULL;
+    while (got < n) {
+        if (pool->carve == pool->carveEnd) {
+            struct f_poolSlab *slab = f_malloc_tracker(sizeof(struct f_poolSlab) + pool->perSlab * pool->objectSize,
+                                                       pool->name, pool->file, pool->line);
+            if (slab == NULL) {
+                printf("Pool slab allocation failed!\n");
+                break;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->slabCount++;
+            pool->capacity += pool->perSlab;
+            pool->carve = (char *)slab->data;
+            pool->carveEnd = pool->carve + pool->perSlab * pool->objectSize;
+        }
+        struct f_poolNode *node = (struct f_poolNode *)pool->carve;
+        pool->carve += pool->objectSize;
+        node->next = *list;
+        *list = node;
+        got++;
+    }
+    return got;
+}
+
+// puts a list of count objects on the depot as one batch, with the pool locked
+static void f_poolPushBatch(struct f_pool *pool, struct f_poolNode *list, size_t count){
+    list->nextBatch = pool->batches;
+    list->count = count;
+    pool->batches = list;
+    pool->depotCount += count;
+}
+
+// the calling thread's cache for pool, emptied first if it still belongs to a destroyed pool
+static struct f_poolCache *f_poolCacheOf(struct f_pool *pool){
+    struct f_poolCache *cache = &poolCaches[pool->slot];
+    if (cache->id != pool->id) {
+        // whatever was cached went away with the old pool's slabs
+        memset(cache, 0, sizeof(*cache));
+        cache->id = pool->id;
+    }
+    return cache;
+}
+
+struct f_pool *f_poolCreateAt(const char *name, size_t objectSize, int flags, const char *file, int line){
+    size_t align = _Alignof(max_align_t);
+    if (objectSize < sizeof(struct f_poolNode)) {
+        objectSize = sizeof(struct f_poolNode);
+    }
+    if (objectSize > (SIZE_MAX - align) / F_POOL_BATCH) {
+        printf("Pool object size overflow!\n");
+        return NULL;
+    }
+    struct f_pool *pool = f_malloc_tracker(sizeof(struct f_pool), name, file, line);
+    if (pool == NULL) {
+        printf("Pool allocation failed!\n");
+        return NULL;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->objectSize = (objectSize + align - 1) & ~(align - 1);
+    pool->perSlab = (F_POOL_SLAB_SIZE - sizeof(struct f_poolSlab)) / pool->objectSize;
+    if (pool->perSlab < F_POOL_BATCH) {
+        pool->perSlab = F_POOL_BATCH;
+    }
+    pool->flags = flags;
+    pool->name = name;
+    pool->file = file;
+    pool->line = line;
+    pool->slot = -1;
+
+    f_poolLock(&poolsLock);
+    pool->id = ++poolIds;
+    for (int i = 0; i < F_POOL_MAX_CACHED; i++) {
+        if (poolSlots[i] == NULL) {
+            poolSlots[i] = pool;
+            pool->slot = i;
+            break;
+        }
+    }
+    f_poolUnlock(&poolsLock);
+    return pool;
+}
+
+void f_poolDestroy(struct f_pool *pool){
+    if (pool == NULL) {
+        return;
+    }
+    f_poolLock(&poolsLock);
+    if (pool->slot >= 0) {
+        poolSlots[pool->slot] = NULL;
+    }
+    f_poolUnlock(&poolsLock);
+
+    struct f_poolSlab *slab = pool->slabs;
+    while (slab) {
+        struct f_poolSlab *next = slab->next;
+        f_track_free(slab, pool->name, pool->file, pool->line);
+        slab = next;
+    }
+    f_track_free(pool, pool->name, pool->file, pool->line);
+}
+
+void *f_poolAllocAt(struct f_pool *pool, const char *file, int line){
+    struct f_poolNode *node = NULL;
+
+    if (pool->slot >= 0) {
+        struct f_poolCache *cache = f_poolCacheOf(pool);
+        if (cache->curCount == 0) {
+            if (cache->prevCount) {
+                struct f_poolNode *list = cache->cur;
+                cache->cur = cache->prev;
+                cache->curCount = cache->prevCount;
+                cache->prev = list;
+                cache->prevCount = 0;
+            }
+            else {
+                f_poolLock(&pool->lock);
+                if (pool->batches) {
+                    cache->cur = pool->batches;
+                    cache->curCount = pool->batches->count;
+                    pool->batches = pool->batches->nextBatch;
+                    pool->depotCount -= cache->curCount;
+                }
+                else {
+                    cache->curCount = f_poolCarve(pool, F_POOL_BATCH, &cache->cur);
+                }
+                f_poolUnlock(&pool->lock);
+            }
+        }
+        if (cache->curCount) {
+            node = cache->cur;
+            cache->cur = node->next;
+            cache->curCount--;
+        }
+    }
+    else {
+        // no cache, take one object off the top batch
+        f_poolLock(&pool->lock);
+        node = pool->batches;
+        if (node) {
+            if (node->count > 1) {
+                node->next->nextBatch = node->nextBatch;
+                node->next->count = node->count - 1;
+                pool->batches = node->next;
+            }
+            else {
+                pool->batches = node->nextBatch;
+            }
+            pool->depotCount--;
+        }
+        else {
+            f_poolCarve(pool, 1, &node);
+        }
+        f_poolUnlock(&pool->lock);
+    }
+
+    if (node && (pool->flags & F_POOL_TRACK_OBJECTS)) {
+        f_trackObjectAlloc(node, pool->objectSize, pool->name, file, line);
+    }
+    return node;
+}
+
+void f_poolFreeAt(struct f_pool *pool, void *object, const char *file, int line){
+    if (object == NULL) {
+        return;
+    }
+    if (pool->flags & F_POOL_TRACK_OBJECTS) {
+        f_trackObjectFree(object, pool->name, file, line);
+    }
+    struct f_poolNode *node = object;
+
+    if (pool->slot >= 0) {
+        struct f_poolCache *cache = f_poolCacheOf(pool);
+        if (cache->curCount == F_POOL_BATCH) {
+            if (cache->prevCount) {
+                f_poolLock(&pool->lock);
+                f_poolPushBatch(pool, cache->prev, cache->prevCount);
+                f_poolUnlock(&pool->lock);
+            }
+            cache->prev = cache->cur;
+            cache->prevCount = cache->curCount;
+            cache->cur = NULL;
+            cache->curCount = 0;
+        }
+        node->next = cache->cur;
+        cache->cur = node;
+        cache->curCount++;
+        return;
+    }
+
+    // no cache, add it to the top batch while that one isn't full
+    f_poolLock(&pool->lock);
+    struct f_poolNode *top = pool->batches;
+    if (top && top->count < F_POOL_BATCH) {
+        node->next = top;
+        node->nextBatch = top->nextBatch;
+        node->count = top->count + 1;
+        pool->batches = node;
+        pool->depotCount++;
+    }
+    else {
+        node->next = NULL;
+        f_poolPushBatch(pool, node, 1);
+    }
+    f_poolUnlock(&pool->lock);
+}
+
+void f_poolThreadFlush(){
+    f_poolLock(&poolsLock);
+    for (int i = 0; i < F_POOL_MAX_CACHED; i++) {
+        struct f_pool *pool = poolSlots[i];
+        struct f_poolCache *cache = &poolCaches[i];
+        if (pool && cache->id == pool->id) {
+            f_poolLock(&pool->lock);
+            if (cache->curCount) {
+                f_poolPushBatch(pool, cache->cur, cache->curCount);
+            }
+            if (cache->prevCount) {
+                f_poolPushBatch(pool, cache->prev, cache->prevCount);
+            }
+            f_poolUnlock(&pool->lock);
+        }
+        memset(cache, 0, sizeof(*cache));
+    }
+    f_poolUnlock(&poolsLock);
+}
+
+void f_poolGetStats(struct f_pool *pool, struct f_poolStats *stats){
+    f_poolLock(&pool->lock);
+    stats->objectSize = pool->objectSize;
+    stats->slabs = pool->slabCount;
+    stats->capacity = pool->capacity;
+    stats->depot = pool->depotCount;
+    f_poolUnlock(&pool->lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * pool v0.01 - Uthowaipru Chowdhury Baiching 2025
+ *
+ * Allocator for lots of objects of one size that come and go all the time, like
+ * connection state. Freed objects are kept on an intrusive free list and handed
+ * out again, without going back to malloc.
+ *
+ * Usage:
+ * - Include this header and compile with pool.c and memorytracker.c
+ * - struct f_pool *p = f_poolCreate("connections", sizeof(struct conn), 0); makes a pool
+ * - f_poolAlloc(p) and f_poolFree(p, obj) get and give back one object, from any thread
+ * - Every thread keeps a small cache of free objects per pool and only takes the pool's
+ *   lock to move a whole batch to or from the shared depot
+ * - Call f_poolThreadFlush() before a thread exits to give its cached objects back
+ * - Create the pool with F_POOL_TRACK_OBJECTS to register every object with memorytracker,
+ *   so objects never given back show up in f_trackListAllocations()/f_trackListSites()
+ *   under the line that allocated them
+ */
+
+#ifndef F_POOL_H
+#define F_POOL_H
+
+#include <stddef.h>
+
+// objects moved between a thread's cache and the depot at a time
+#define F_POOL_BATCH 32
+// bytes malloc'd at a time for new objects
+#define F_POOL_SLAB_SIZE (64 * 1024)
+// pools that get per-thread caches, the ones created after these go straight to the depot
+#define F_POOL_MAX_CACHED 64
+
+// f_poolCreate flags
+#define F_POOL_TRACK_OBJECTS 1
+
+struct f_pool;
+
+struct f_poolStats
+{
+    size_t objectSize; // size handed out, rounded up to keep malloc's alignment
+    size_t slabs;      // slabs allocated
+    size_t capacity;   // objects the slabs have room for
+    size_t depot;      // free objects in the depot, per-thread caches not included
+};
+
+#define f_poolCreate(name, objectSize, flags) f_poolCreateAt(name, objectSize, flags, __FILE__, __LINE__)
+#define f_poolAlloc(pool) f_poolAllocAt(pool, __FILE__, __LINE__)
+#define f_poolFree(pool, object) f_poolFreeAt(pool, object, __FILE__, __LINE__)
+
+// creates a pool of objectSize byte objects, NULL when out of memory
+extern struct f_pool *f_poolCreateAt(const char *name, size_t objectSize, int flags, const char *file, int line);
+// frees the slabs; every thread must be done with the pool, objects still out are gone too
+extern void f_poolDestroy(struct f_pool *pool);
+// one uninitialised object, NULL when out of memory
+extern void *f_poolAllocAt(struct f_pool *pool, const char *file, int line);
+// gives an object of this pool back
+extern void f_poolFreeAt(struct f_pool *pool, void *object, const char *file, int line);
+// moves the calling thread's cached objects of every pool back to their depots
+extern void f_poolThreadFlush();
+extern void f_poolGetStats(struct f_pool *pool, struct f_poolStats *stats);
+
+#endif
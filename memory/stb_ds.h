@@ -19,6 +19,7 @@ TABLE OF CONTENTS
   Notes
   Notes - Dynamic arrays
   Notes - Hash maps
+  Memory contexts
   Credits
 
 COMPILE-TIME OPTIONS
@@ -48,8 +49,9 @@ COMPILE-TIME OPTIONS
 
      By default stb_ds uses stdlib realloc() and free() for memory management. You can
      substitute your own functions instead by defining these symbols. You must either
-     define both, or neither. Note that at the moment, 'context' will always be NULL.
-     @TODO add an array/hash initialization function that takes a memory context pointer.
+     define both, or neither. 'context' is always NULL here: containers given a context
+     with arrinit/hminit/shinit (see MEMORY CONTEXTS) call that context's own functions
+     instead, whichever file the implementation was compiled in.
 
   #define STBDS_UNIT_TESTS
 
@@ -365,6 +367,31 @@ NOTES - HASH MAP
     use code like 'hmget(T,k)->value = 5' you can accidentally overwrite
     the value stored by hmdefault if 'k' is not present.
 
+MEMORY CONTEXTS
+
+  A container can allocate from a memory context instead of STBDS_REALLOC/STBDS_FREE.
+  The context is a pointer to an stbds_allocator, whose resize works like realloc and
+  release like free; it's kept in the container's header and used for everything the
+  container allocates: the array, the hash index, string keys and string arena blocks.
+
+      arrinit
+        void arrinit(T*, stbds_allocator *context);
+          Overwrites the existing pointer with an empty array that grows
+          through context.
+
+      hminit
+        void hminit(T*, stbds_allocator *context);
+          Overwrites the existing pointer with an empty hashmap whose
+          memory comes from context.
+
+      shinit
+        void shinit(T*, stbds_allocator *context);
+          Like sh_new_arena, but the string arena, the keys and the
+          hashmap itself all come from context.
+
+  A context whose release does nothing, like an arena's, makes arrfree/hmfree/shfree
+  optional: everything goes away when the arena is reset.
+
 CREDITS
 
   Sean Barrett -- library, idea for dynamic array API/implementation
@@ -401,6 +428,7 @@ CREDITS
 #define arrpush     stbds_arrput
 #define arrpop      stbds_arrpop
 #define arrfree     stbds_arrfree
+#define arrinit     stbds_arrinit
 #define arraddn     stbds_arraddn // deprecated, use one of the following instead:
 #define arraddnptr  stbds_arraddnptr
 #define arraddnindex stbds_arraddnindex
@@ -415,6 +443,7 @@ CREDITS
 #define arrsetcap   stbds_arrsetcap
 
 #define hmput       stbds_hmput
+#define hminit      stbds_hminit
 #define hmputs      stbds_hmputs
 #define hmget       stbds_hmget
 #define hmget_ts    stbds_hmget_ts
@@ -447,6 +476,7 @@ CREDITS
 #define shdefaults  stbds_shdefaults
 #define sh_new_arena  stbds_sh_new_arena
 #define sh_new_strdup stbds_sh_new_strdup
+#define shinit      stbds_shinit
 
 #define stralloc    stbds_stralloc
 #define strreset    stbds_strreset
@@ -461,6 +491,10 @@ CREDITS
 #define STBDS_FREE(c,p)      free(p)
 #endif
 
+// containers with a context allocate through it, the others through STBDS_REALLOC/STBDS_FREE
+#define STBDS_CTX_REALLOC(c,p,s) ((c) ? ((stbds_allocator *) (c))->resize((stbds_allocator *) (c),p,s) : STBDS_REALLOC(NULL,p,s))
+#define STBDS_CTX_FREE(c,p)      ((c) ? ((stbds_allocator *) (c))->release((stbds_allocator *) (c),p) : STBDS_FREE(NULL,p))
+
 #ifdef _MSC_VER
 #define STBDS_NOTUSED(v)  (void)(v)
 #else
@@ -483,6 +517,14 @@ typedef struct stbds_string_arena stbds_string_arena;
 extern char * stbds_stralloc(stbds_string_arena *a, char *str);
 extern void   stbds_strreset(stbds_string_arena *a);
 
+// memory context for arrinit/hminit/shinit, resize works like realloc and release like free
+typedef struct stbds_allocator stbds_allocator;
+struct stbds_allocator
+{
+  void * (*resize)(stbds_allocator *self, void *ptr, size_t size);
+  void   (*release)(stbds_allocator *self, void *ptr);
+};
+
 // have to #define STBDS_UNIT_TESTS to call this
 extern void stbds_unit_tests(void);
 
@@ -493,6 +535,8 @@ extern void stbds_unit_tests(void);
 
 extern void * stbds_arrgrowf(void *a, size_t elemsize, size_t addlen, size_t min_cap);
 extern void   stbds_arrfreef(void *a);
+extern void * stbds_arrinitf(size_t elemsize, void *context);
+extern void * stbds_hminit_func(size_t elemsize, int mode, void *context);
 extern void   stbds_hmfree_func(void *p, size_t elemsize);
 extern void * stbds_hmget_key(void *a, size_t elemsize, void *key, size_t keysize, int mode);
 extern void * stbds_hmget_key_ts(void *a, size_t elemsize, void *key, size_t keysize, ptrdiff_t *temp, int mode);
@@ -548,7 +592,8 @@ extern void * stbds_shmode_func(size_t elemsize, int mode);
 #define stbds_arraddnindex(a,n)(stbds_arrmaybegrow(a,n), (n) ? (stbds_header(a)->length += (n), stbds_header(a)->length-(n)) : stbds_arrlen(a))
 #define stbds_arraddnoff       stbds_arraddnindex
 #define stbds_arrlast(a)       ((a)[stbds_header(a)->length-1])
-#define stbds_arrfree(a)       ((void) ((a) ? STBDS_FREE(NULL,stbds_header(a)) : (void)0), (a)=NULL)
+#define stbds_arrfree(a)       ((void) ((a) ? stbds_arrfreef(a) : (void)0), (a)=NULL)
+#define stbds_arrinit(a,c)     ((a) = stbds_arrinitf_wrapper((a), sizeof *(a), (c)))
 #define stbds_arrdel(a,i)      stbds_arrdeln(a,i,1)
 #define stbds_arrdeln(a,i,n)   (memmove(&(a)[i], &(a)[(i)+(n)], sizeof *(a) * (stbds_header(a)->length-(n)-(i))), stbds_header(a)->length -= (n))
 #define stbds_arrdelswap(a,i)  ((a)[i] = stbds_arrlast(a), stbds_header(a)->length -= 1)
@@ -643,6 +688,9 @@ extern void * stbds_shmode_func(size_t elemsize, int mode);
 #define stbds_sh_new_strdup(t) \
     ((t) = stbds_shmode_func_wrapper(t, sizeof *(t), STBDS_SH_STRDUP))
 
+#define stbds_hminit(t,c)      ((t) = stbds_hminit_func_wrapper((t), sizeof *(t), 0, (c)))
+#define stbds_shinit(t,c)      ((t) = stbds_hminit_func_wrapper((t), sizeof *(t), STBDS_SH_ARENA, (c)))
+
 #define stbds_shdefault(t, v)  stbds_hmdefault(t,v)
 #define stbds_shdefaults(t, s) stbds_hmdefaults(t,s)
 
@@ -660,8 +708,17 @@ typedef struct
   size_t      capacity;
   void      * hash_table;
   ptrdiff_t   temp;
+  void      * context;  // stbds_allocator the container allocates from, NULL for STBDS_REALLOC
+  // elements start right after the header, keep them 16-byte aligned
+  char        padding[(16 - (2*sizeof(size_t) + 2*sizeof(void *) + sizeof(ptrdiff_t)) % 16) % 16];
 } stbds_array_header;
 
+#ifdef __cplusplus
+static_assert(sizeof(stbds_array_header) % 16 == 0, "stbds_array_header must keep elements 16-byte aligned");
+#else
+_Static_assert(sizeof(stbds_array_header) % 16 == 0, "stbds_array_header must keep elements 16-byte aligned");
+#endif
+
 typedef struct stbds_string_block
 {
   struct stbds_string_block *next;
@@ -674,6 +731,7 @@ struct stbds_string_arena
   size_t remaining;
   unsigned char block;
   unsigned char mode;  // this isn't used by the string arena itself
+  void *context;       // where the blocks come from, see stbds_allocator
 };
 
 #define STBDS_HM_BINARY         0
@@ -711,6 +769,12 @@ template<class T> static T * stbds_hmdel_key_wrapper(T *a, size_t elemsize, void
 template<class T> static T * stbds_shmode_func_wrapper(T *, size_t elemsize, int mode) {
   return (T*)stbds_shmode_func(elemsize, mode);
 }
+template<class T> static T * stbds_arrinitf_wrapper(T *, size_t elemsize, void *context) {
+  return (T*)stbds_arrinitf(elemsize, context);
+}
+template<class T> static T * stbds_hminit_func_wrapper(T *, size_t elemsize, int mode, void *context) {
+  return (T*)stbds_hminit_func(elemsize, mode, context);
+}
 #else
 #define stbds_arrgrowf_wrapper            stbds_arrgrowf
 #define stbds_hmget_key_wrapper           stbds_hmget_key
@@ -719,6 +783,8 @@ template<class T> static T * stbds_shmode_func_wrapper(T *, size_t elemsize, int
 #define stbds_hmput_key_wrapper           stbds_hmput_key
 #define stbds_hmdel_key_wrapper           stbds_hmdel_key
 #define stbds_shmode_func_wrapper(t,e,m)  stbds_shmode_func(e,m)
+#define stbds_arrinitf_wrapper(a,e,c)     stbds_arrinitf(e,c)
+#define stbds_hminit_func_wrapper(t,e,m,c) stbds_hminit_func(e,m,c)
 #endif
 
 #endif // INCLUDE_STB_DS_H
@@ -782,13 +848,14 @@ void *stbds_arrgrowf(void *a, size_t elemsize, size_t addlen, size_t min_cap)
   //if (num_prev < 65536) if (a) prev_allocs[num_prev++] = (int *) ((char *) a+1);
   //if (num_prev == 2201)
   //  num_prev = num_prev;
-  b = STBDS_REALLOC(NULL, (a) ? stbds_header(a) : 0, elemsize * min_cap + sizeof(stbds_array_header));
+  b = STBDS_CTX_REALLOC(a ? stbds_header(a)->context : NULL, (a) ? stbds_header(a) : 0, elemsize * min_cap + sizeof(stbds_array_header));
   //if (num_prev < 65536) prev_allocs[num_prev++] = (int *) (char *) b;
   b = (char *) b + sizeof(stbds_array_header);
   if (a == NULL) {
     stbds_header(b)->length = 0;
     stbds_header(b)->hash_table = 0;
     stbds_header(b)->temp = 0;
+    stbds_header(b)->context = 0;
   } else {
     STBDS_STATS(++stbds_array_grow);
   }
@@ -799,7 +866,20 @@ void *stbds_arrgrowf(void *a, size_t elemsize, size_t addlen, size_t min_cap)
 
 void stbds_arrfreef(void *a)
 {
-  STBDS_FREE(NULL, stbds_header(a));
+  STBDS_CTX_FREE(stbds_header(a)->context, stbds_header(a));
+}
+
+void *stbds_arrinitf(size_t elemsize, void *context)
+{
+  void *b = STBDS_CTX_REALLOC(context, 0, sizeof(stbds_array_header));
+  (void) elemsize;
+  b = (char *) b + sizeof(stbds_array_header);
+  stbds_header(b)->length = 0;
+  stbds_header(b)->capacity = 0;
+  stbds_header(b)->hash_table = 0;
+  stbds_header(b)->temp = 0;
+  stbds_header(b)->context = context;
+  return b;
 }
 
 //
@@ -881,10 +961,10 @@ static size_t stbds_log2(size_t slot_count)
   return n;
 }
 
-static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_index *ot)
+static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_index *ot, void *context)
 {
   stbds_hash_index *t;
-  t = (stbds_hash_index *) STBDS_REALLOC(NULL,0,(slot_count >> STBDS_BUCKET_SHIFT) * sizeof(stbds_hash_bucket) + sizeof(stbds_hash_index) + STBDS_CACHE_LINE_SIZE-1);
+  t = (stbds_hash_index *) STBDS_CTX_REALLOC(context,0,(slot_count >> STBDS_BUCKET_SHIFT) * sizeof(stbds_hash_bucket) + sizeof(stbds_hash_index) + STBDS_CACHE_LINE_SIZE-1);
   t->storage = (stbds_hash_bucket *) STBDS_ALIGN_FWD((size_t) (t+1), STBDS_CACHE_LINE_SIZE);
   t->slot_count = slot_count;
   t->slot_count_log2 = stbds_log2(slot_count);
@@ -941,6 +1021,7 @@ static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_ind
   } else {
     size_t a,b,temp;
     memset(&t->string, 0, sizeof(t->string));
+    t->string.context = context;
     t->seed = stbds_hash_seed;
     // LCG
     // in 32-bit, a =          2147001325   b =  715136305
@@ -1221,12 +1302,13 @@ void stbds_hmfree_func(void *a, size_t elemsize)
       size_t i;
       // skip 0th element, which is default
       for (i=1; i < stbds_header(a)->length; ++i)
-        STBDS_FREE(NULL, *(char**) ((char *) a + elemsize*i));
+        STBDS_CTX_FREE(stbds_header(a)->context, *(char**) ((char *) a + elemsize*i));
     }
     stbds_strreset(&stbds_hash_table(a)->string);
   }
-  STBDS_FREE(NULL, stbds_header(a)->hash_table);
-  STBDS_FREE(NULL, stbds_header(a));
+  if (stbds_header(a)->hash_table)
+    STBDS_CTX_FREE(stbds_header(a)->context, stbds_header(a)->hash_table);
+  STBDS_CTX_FREE(stbds_header(a)->context, stbds_header(a));
 }
 
 static ptrdiff_t stbds_hm_find_slot(void *a, size_t elemsize, void *key, size_t keysize, size_t keyoffset, int mode)
@@ -1332,7 +1414,7 @@ void * stbds_hmput_default(void *a, size_t elemsize)
   return a;
 }
 
-static char *stbds_strdup(char *str);
+static char *stbds_strdup(char *str, void *context);
 
 void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int mode)
 {
@@ -1359,9 +1441,9 @@ void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int m
     size_t slot_count;
 
     slot_count = (table == NULL) ? STBDS_BUCKET_LENGTH : table->slot_count*2;
-    nt = stbds_make_hash_index(slot_count, table);
+    nt = stbds_make_hash_index(slot_count, table, stbds_header(a)->context);
     if (table)
-      STBDS_FREE(NULL, table);
+      STBDS_CTX_FREE(stbds_header(a)->context, table);
     else
       nt->string.mode = mode >= STBDS_HM_STRING ? STBDS_SH_DEFAULT : 0;
     stbds_header(a)->hash_table = table = nt;
@@ -1448,7 +1530,7 @@ void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int m
       stbds_temp(a) = i-1;
 
       switch (table->string.mode) {
-         case STBDS_SH_STRDUP:  stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_strdup((char*) key); break;
+         case STBDS_SH_STRDUP:  stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_strdup((char*) key, stbds_header(a)->context); break;
          case STBDS_SH_ARENA:   stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = stbds_stralloc(&table->string, (char*)key); break;
          case STBDS_SH_DEFAULT: stbds_temp_key(a) = *(char **) ((char *) a + elemsize*i) = (char *) key; break;
          default:                memcpy((char *) a + elemsize*i, key, keysize); break;
@@ -1464,7 +1546,19 @@ void * stbds_shmode_func(size_t elemsize, int mode)
   stbds_hash_index *h;
   memset(a, 0, elemsize);
   stbds_header(a)->length = 1;
-  stbds_header(a)->hash_table = h = (stbds_hash_index *) stbds_make_hash_index(STBDS_BUCKET_LENGTH, NULL);
+  stbds_header(a)->hash_table = h = (stbds_hash_index *) stbds_make_hash_index(STBDS_BUCKET_LENGTH, NULL, NULL);
+  h->string.mode = (unsigned char) mode;
+  return STBDS_ARR_TO_HASH(a,elemsize);
+}
+
+void * stbds_hminit_func(size_t elemsize, int mode, void *context)
+{
+  void *a = stbds_arrinitf(elemsize, context);
+  stbds_hash_index *h;
+  a = stbds_arrgrowf(a, elemsize, 0, 1);
+  memset(a, 0, elemsize);
+  stbds_header(a)->length = 1;
+  stbds_header(a)->hash_table = h = (stbds_hash_index *) stbds_make_hash_index(STBDS_BUCKET_LENGTH, NULL, context);
   h->string.mode = (unsigned char) mode;
   return STBDS_ARR_TO_HASH(a,elemsize);
 }
@@ -1500,7 +1594,7 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
         b->index[i] = STBDS_INDEX_DELETED;
 
         if (mode == STBDS_HM_STRING && table->string.mode == STBDS_SH_STRDUP)
-          STBDS_FREE(NULL, *(char**) ((char *) a+elemsize*old_index));
+          STBDS_CTX_FREE(stbds_header(raw_a)->context, *(char**) ((char *) a+elemsize*old_index));
 
         // if indices are the same, memcpy is a no-op, but back-pointer-fixup will fail, so skip
         if (old_index != final_index) {
@@ -1521,12 +1615,12 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
         stbds_header(raw_a)->length -= 1;
 
         if (table->used_count < table->used_count_shrink_threshold && table->slot_count > STBDS_BUCKET_LENGTH) {
-          stbds_header(raw_a)->hash_table = stbds_make_hash_index(table->slot_count>>1, table);
-          STBDS_FREE(NULL, table);
+          stbds_header(raw_a)->hash_table = stbds_make_hash_index(table->slot_count>>1, table, stbds_header(raw_a)->context);
+          STBDS_CTX_FREE(stbds_header(raw_a)->context, table);
           STBDS_STATS(++stbds_hash_shrink);
         } else if (table->tombstone_count > table->tombstone_count_threshold) {
-          stbds_header(raw_a)->hash_table = stbds_make_hash_index(table->slot_count   , table);
-          STBDS_FREE(NULL, table);
+          stbds_header(raw_a)->hash_table = stbds_make_hash_index(table->slot_count   , table, stbds_header(raw_a)->context);
+          STBDS_CTX_FREE(stbds_header(raw_a)->context, table);
           STBDS_STATS(++stbds_hash_rebuild);
         }
 
@@ -1537,12 +1631,12 @@ void * stbds_hmdel_key(void *a, size_t elemsize, void *key, size_t keysize, size
   /* NOTREACHED */
 }
 
-static char *stbds_strdup(char *str)
+static char *stbds_strdup(char *str, void *context)
 {
   // to keep replaceable allocator simple, we don't want to use strdup.
   // rolling our own also avoids problem of strdup vs _strdup
   size_t len = strlen(str)+1;
-  char *p = (char*) STBDS_REALLOC(NULL, 0, len);
+  char *p = (char*) STBDS_CTX_REALLOC(context, 0, len);
   memmove(p, str, len);
   return p;
 }
@@ -1575,7 +1669,7 @@ char *stbds_stralloc(stbds_string_arena *a, char *str)
       // note that we still advance string_block so block size will continue
       // increasing, so e.g. if somebody only calls this with 1000-long strings,
       // eventually the arena will start doubling and handling those as well
-      stbds_string_block *sb = (stbds_string_block *) STBDS_REALLOC(NULL, 0, sizeof(*sb)-8 + len);
+      stbds_string_block *sb = (stbds_string_block *) STBDS_CTX_REALLOC(a->context, 0, sizeof(*sb)-8 + len);
       memmove(sb->storage, str, len);
       if (a->storage) {
         // insert it after the first element, so that we don't waste the space there
@@ -1588,7 +1682,7 @@ char *stbds_stralloc(stbds_string_arena *a, char *str)
       }
       return sb->storage;
     } else {
-      stbds_string_block *sb = (stbds_string_block *) STBDS_REALLOC(NULL, 0, sizeof(*sb)-8 + blocksize);
+      stbds_string_block *sb = (stbds_string_block *) STBDS_CTX_REALLOC(a->context, 0, sizeof(*sb)-8 + blocksize);
       sb->next = a->storage;
       a->storage = sb;
       a->remaining = blocksize;
@@ -1605,13 +1699,15 @@ char *stbds_stralloc(stbds_string_arena *a, char *str)
 void stbds_strreset(stbds_string_arena *a)
 {
   stbds_string_block *x,*y;
+  void *context = a->context;
   x = a->storage;
   while (x) {
     y = x->next;
-    STBDS_FREE(NULL, x);
+    STBDS_CTX_FREE(context, x);
     x = y;
   }
   memset(a, 0, sizeof(*a));
+  a->context = context;
 }
 
 #endif
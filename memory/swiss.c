@@ -0,0 +1,105 @@
+#include "swiss.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// room in front of the default entry, the header sits at its end; keeps the entries aligned like malloc's
+#define F_SWISS_HEADER_SPACE \
+    ((sizeof(struct f_swissHeader) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+static struct f_swissHeader *f_swissHeaderOf(void *m, size_t elemSize){
+    return (struct f_swissHeader *)((char *)m - elemSize) - 1;
+}
+
+static char *f_swissBase(void *m, size_t elemSize){
+    return (char *)m - elemSize - F_SWISS_HEADER_SPACE;
+}
+
+// slots for n entries at 7/8 full, a power of two
+static size_t f_swissCapacityFor(size_t n){
+    size_t capacity = F_SWISS_GROUP;
+    while (capacity / 8 * 7 < n) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static void *f_swissAllocate(size_t elemSize, size_t capacity){
+    char *base = malloc(F_SWISS_HEADER_SPACE + elemSize * (capacity + 1) + capacity);
+    if (base == NULL) {
+        printf("Swiss table allocation of %zu slots failed!\n", capacity);
+        abort();
+    }
+    void *m = base + F_SWISS_HEADER_SPACE + elemSize;
+    struct f_swissHeader *hdr = f_swissHeaderOf(m, elemSize);
+    hdr->ctrl = (uint8_t *)m + elemSize * capacity;
+    hdr->capacity = capacity;
+    hdr->count = 0;
+    hdr->growthLeft = capacity / 8 * 7;
+    hdr->temp = -1;
+    memset(hdr->ctrl, F_SWISS_EMPTY, capacity);
+    return m;
+}
+
+void *f_swissCreate(size_t elemSize, size_t n){
+    void *m = f_swissAllocate(elemSize, f_swissCapacityFor(n));
+    memset((char *)m - elemSize, 0, elemSize);
+    return m;
+}
+
+// first slot without an entry on the probe path of hash, in a table without tombstones
+static size_t f_swissVacant(struct f_swissHeader *hdr, uint64_t hash){
+    size_t groupMask = hdr->capacity / F_SWISS_GROUP - 1;
+    size_t group = (size_t)(hash >> 7) & groupMask;
+    for (size_t step = 1;; step++) {
+        uint32_t open = f_swissMatchFree(hdr->ctrl + group * F_SWISS_GROUP);
+        if (open) {
+            return group * F_SWISS_GROUP + f_swissLowestBit(open);
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+void *f_swissGrow(void *m, size_t elemSize, size_t keyOffset, size_t keySize){
+    struct f_swissHeader *old = f_swissHeaderOf(m, elemSize);
+    // mostly tombstones, a table of the same size without them does
+    size_t capacity = old->count < old->capacity / 16 * 7 ? old->capacity : old->capacity * 2;
+    void *grown = f_swissAllocate(elemSize, capacity);
+    struct f_swissHeader *hdr = f_swissHeaderOf(grown, elemSize);
+    memcpy((char *)grown - elemSize, (char *)m - elemSize, elemSize);
+    for (size_t i = 0; i < old->capacity; i++) {
+        if (old->ctrl[i] & 0x80) {
+            continue;
+        }
+        char *entry = (char *)m + i * elemSize;
+        uint64_t hash = f_swissHash(entry + keyOffset, keySize);
+        size_t slot = f_swissVacant(hdr, hash);
+        hdr->ctrl[slot] = (uint8_t)(hash & 0x7F);
+        memcpy((char *)grown + slot * elemSize, entry, elemSize);
+    }
+    hdr->count = old->count;
+    hdr->growthLeft -= old->count;
+    free(f_swissBase(m, elemSize));
+    return grown;
+}
+
+ptrdiff_t f_swissNextSlot(void *m, size_t elemSize, ptrdiff_t i){
+    struct f_swissHeader *hdr = f_swissHeaderOf(m, elemSize);
+    for (size_t slot = (size_t)(i + 1); slot < hdr->capacity; slot++) {
+        if (!(hdr->ctrl[slot] & 0x80)) {
+            return (ptrdiff_t)slot;
+        }
+    }
+    return -1;
+}
+
+void f_swissRelease(void *m, size_t elemSize){
+    free(f_swissBase(m, elemSize));
+}
+
+size_t f_swissBytes(void *m, size_t elemSize){
+    if (m == NULL) {
+        return 0;
+    }
+    size_t capacity = f_swissHeaderOf(m, elemSize)->capacity;
+    return F_SWISS_HEADER_SPACE + elemSize * (capacity + 1) + capacity;
+}
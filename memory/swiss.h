@@ -0,0 +1,276 @@
+/*
+ * swiss v0.01 - Uthowaipru Chowdhury Baiching 2025
+ *
+ * Hash map for fixed-size keys, like fds and connection ids, laid out like Abseil's Swiss
+ * table: one control byte per slot with 7 bits of the key's hash, and the key/value entries
+ * themselves in the slots. A lookup loads the 16 control bytes of a group and compares all
+ * of them to the hash bits at once (SSE2 on x86, NEON on ARM64, two 64 bit words elsewhere), so
+ * the slots it touches are nearly always only the one holding the key. A group with an empty
+ * slot ends the probe, tables are grown at 7/8 full.
+ *
+ * Usage:
+ * - Include this header and compile with swiss.c
+ * - The map is a pointer to a struct with a key and a value field, NULL is an empty map, the
+ *   same as stb_ds's hmput/hmget:
+ *     struct { int key; struct conn *value; } *conns = NULL;
+ *     f_swissPut(conns, fd, conn);
+ *     struct conn *c = f_swissGet(conns, fd); // the default value (zeroed) when fd isn't there
+ *     f_swissDel(conns, fd);
+ *     f_swissFree(conns);
+ * - Keys are compared as bytes, so a struct key must have its padding zeroed; strings need a
+ *   map of their own (stb_ds's sh* maps)
+ * - Entries don't move until the table grows, f_swissGetPtr() is valid until the next put
+ * - for (ptrdiff_t i = f_swissNext(m, -1); i >= 0; i = f_swissNext(m, i)) visits every entry as
+ *   m[i], in no particular order; deleting m[i] while doing it is fine
+ * - The macros evaluate the map more than once, pass a plain variable
+ * - Running out of memory prints a message and aborts, a put has no way to report it
+ * - -DF_SWISS_NO_SIMD uses the 64 bit words everywhere, to compare the two
+ */
+
+#ifndef F_SWISS_H
+#define F_SWISS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(F_SWISS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define F_SWISS_SSE2
+#elif !defined(F_SWISS_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define F_SWISS_NEON
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// slots per group, the control bytes one probe compares at once
+#define F_SWISS_GROUP 16
+// control bytes of slots without an entry; full slots have the low 7 hash bits, so the top bit is clear
+#define F_SWISS_EMPTY ((uint8_t)0x80)
+#define F_SWISS_DELETED ((uint8_t)0xFE)
+
+// sits right in front of the map's default entry, which is right in front of slot 0
+struct f_swissHeader
+{
+    uint8_t *ctrl;       // one control byte per slot
+    size_t capacity;     // slots, a power of two, at least F_SWISS_GROUP
+    size_t count;        // entries
+    size_t growthLeft;   // entries that still fit in empty slots before the table grows
+    ptrdiff_t temp;      // slot the last lookup ended on, -1 for none
+};
+
+#define f_swissHdr(m) ((struct f_swissHeader *)((char *)(m) - sizeof *(m)) - 1)
+#define F_SWISS_KEY(m) ((size_t)((char *)&(m)->key - (char *)(m)))
+// the key of a macro call goes into the default entry's key, which is never looked at otherwise
+#define F_SWISS_SET(m, k) ((m) = (m) ? (m) : f_swissCreate(sizeof *(m), 0), (m)[-1].key = (k))
+
+// sets value for key, adding the key when it isn't there
+#define f_swissPut(m, k, v) \
+    (F_SWISS_SET(m, k), (m) = f_swissInsert((m), sizeof *(m), F_SWISS_KEY(m), sizeof (m)->key), \
+     (m)[f_swissHdr(m)->temp].value = (v))
+// the value of key, or the default value when it isn't there
+#define f_swissGet(m, k) \
+    (F_SWISS_SET(m, k), (m)[f_swissFind((m), sizeof *(m), F_SWISS_KEY(m), sizeof (m)->key)].value)
+// the entry of key, NULL when it isn't there
+#define f_swissGetPtr(m, k) \
+    (F_SWISS_SET(m, k), f_swissFind((m), sizeof *(m), F_SWISS_KEY(m), sizeof (m)->key) < 0 ? NULL : \
+     &(m)[f_swissHdr(m)->temp])
+// removes key, returns 1 or 0 when it wasn't there
+#define f_swissDel(m, k) \
+    (F_SWISS_SET(m, k), f_swissDelete((m), sizeof *(m), F_SWISS_KEY(m), sizeof (m)->key))
+// value f_swissGet returns for keys that aren't there, zeroed until this is called
+#define f_swissDefault(m, v) ((m) = (m) ? (m) : f_swissCreate(sizeof *(m), 0), (m)[-1].value = (v))
+// an empty map with room for n entries before it grows, for a map that's still NULL
+#define f_swissInit(m, n) ((m) = f_swissCreate(sizeof *(m), (n)))
+#define f_swissLen(m) ((m) ? f_swissHdr(m)->count : 0)
+// index of the next entry after slot i, -1 after the last one; start with i = -1
+#define f_swissNext(m, i) ((m) ? f_swissNextSlot((m), sizeof *(m), (i)) : -1)
+#define f_swissFree(m) ((m) ? f_swissRelease((m), sizeof *(m)) : (void)0, (m) = NULL)
+
+// empty table with room for n entries, returns the map pointer (the address of slot 0)
+extern void *f_swissCreate(size_t elemSize, size_t n);
+// called by f_swissInsert when there's no room left, returns the map in its new table
+extern void *f_swissGrow(void *m, size_t elemSize, size_t keyOffset, size_t keySize);
+extern ptrdiff_t f_swissNextSlot(void *m, size_t elemSize, ptrdiff_t i);
+extern void f_swissRelease(void *m, size_t elemSize);
+// bytes the table takes, header, slots and control bytes
+extern size_t f_swissBytes(void *m, size_t elemSize);
+
+static inline uint64_t f_swissHash(const void *key, size_t size){
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h;
+    if (size == 8) {
+        memcpy(&h, p, 8);
+    } else if (size == 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h = v;
+    } else {
+        h = size;
+        for (; size >= 8; size -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        }
+        for (; size > 0; size--, p++) {
+            h = (h ^ *p) * 0x100000001B3ull;
+        }
+    }
+    // murmur3's finalizer, every key bit ends up in the low 7 bits and in the group index
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+#if !defined(F_SWISS_SSE2) && !defined(F_SWISS_NEON)
+// without SIMD a group is two 64 bit words: the top bit of every byte that's 0, exactly, no borrows
+static inline uint64_t f_swissZeroBytes(uint64_t x){
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7Full;
+    return ~(((x & low7) + low7) | x | low7);
+}
+
+// the top bits of the 8 bytes of x packed into the low 8 bits
+static inline uint32_t f_swissGather(uint64_t x){
+    return (uint32_t)(((x >> 7) * 0x0102040810204080ull) >> 56);
+}
+#endif
+
+// bit i set for every control byte i of the group equal to byte
+static inline uint32_t f_swissMatch(const uint8_t *group, uint8_t byte){
+#if defined(F_SWISS_SSE2)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#elif defined(F_SWISS_NEON)
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)), vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(eq)) | (uint32_t)vaddv_u8(vget_high_u8(eq)) << 8;
+#else
+    uint64_t lo, hi, ones = 0x0101010101010101ull * byte;
+    memcpy(&lo, group, 8);
+    memcpy(&hi, group + 8, 8);
+    return f_swissGather(f_swissZeroBytes(lo ^ ones)) | f_swissGather(f_swissZeroBytes(hi ^ ones)) << 8;
+#endif
+}
+
+// bit i set for every slot i of the group without an entry, empty or deleted
+static inline uint32_t f_swissMatchFree(const uint8_t *group){
+#if defined(F_SWISS_SSE2)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#elif defined(F_SWISS_NEON)
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t top = vandq_u8(vcltzq_s8(vreinterpretq_s8_u8(vld1q_u8(group))), vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(top)) | (uint32_t)vaddv_u8(vget_high_u8(top)) << 8;
+#else
+    uint64_t lo, hi;
+    memcpy(&lo, group, 8);
+    memcpy(&hi, group + 8, 8);
+    return f_swissGather(lo & 0x8080808080808080ull) | f_swissGather(hi & 0x8080808080808080ull) << 8;
+#endif
+}
+
+static inline unsigned f_swissLowestBit(uint32_t mask){
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+// Groups are probed triangularly, 1, 2, 3... groups on from the one the hash picks, which
+// visits every group of a power-of-two table once. h2 is the hash's low 7 bits, the group
+// index comes from the bits above them. Returns the slot of the key, -1 when it isn't there,
+// and the first slot without an entry on the way in *vacant (when vacant isn't NULL).
+static inline ptrdiff_t f_swissProbe(void *m, size_t elemSize, size_t keyOffset, size_t keySize,
+                                     const void *key, uint64_t hash, ptrdiff_t *vacant){
+    struct f_swissHeader *hdr = (struct f_swissHeader *)((char *)m - elemSize) - 1;
+    size_t groupMask = hdr->capacity / F_SWISS_GROUP - 1;
+    size_t group = (size_t)(hash >> 7) & groupMask;
+    uint8_t h2 = (uint8_t)(hash & 0x7F);
+    if (vacant) {
+        *vacant = -1;
+    }
+    for (size_t step = 1;; step++) {
+        const uint8_t *ctrl = hdr->ctrl + group * F_SWISS_GROUP;
+        for (uint32_t match = f_swissMatch(ctrl, h2); match; match &= match - 1) {
+            size_t slot = group * F_SWISS_GROUP + f_swissLowestBit(match);
+            if (memcmp((char *)m + slot * elemSize + keyOffset, key, keySize) == 0) {
+                return (ptrdiff_t)slot;
+            }
+        }
+        uint32_t open = f_swissMatchFree(ctrl);
+        if (vacant && *vacant < 0 && open) {
+            *vacant = (ptrdiff_t)(group * F_SWISS_GROUP + f_swissLowestBit(open));
+        }
+        // a group with an empty slot was never full, nothing was pushed past it
+        if (f_swissMatch(ctrl, F_SWISS_EMPTY)) {
+            return -1;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+// slot of the key in the default entry, or -1; the slot is also left in the header's temp
+static inline ptrdiff_t f_swissFind(void *m, size_t elemSize, size_t keyOffset, size_t keySize){
+    const char *key = (char *)m - elemSize + keyOffset;
+    ptrdiff_t slot = f_swissProbe(m, elemSize, keyOffset, keySize, key, f_swissHash(key, keySize), NULL);
+    ((struct f_swissHeader *)((char *)m - elemSize) - 1)->temp = slot;
+    return slot;
+}
+
+// finds the key in the default entry or adds it, copying the default entry into the new slot;
+// the slot is left in the header's temp, returns the map, which moved when the table grew
+static inline void *f_swissInsert(void *m, size_t elemSize, size_t keyOffset, size_t keySize){
+    struct f_swissHeader *hdr = (struct f_swissHeader *)((char *)m - elemSize) - 1;
+    const char *key = (char *)m - elemSize + keyOffset;
+    uint64_t hash = f_swissHash(key, keySize);
+    ptrdiff_t vacant;
+    ptrdiff_t slot = f_swissProbe(m, elemSize, keyOffset, keySize, key, hash, &vacant);
+    if (slot >= 0) {
+        hdr->temp = slot;
+        return m;
+    }
+    // a deleted slot can be taken again any time, an empty one only while there's room
+    if (hdr->ctrl[vacant] == F_SWISS_EMPTY && hdr->growthLeft == 0) {
+        m = f_swissGrow(m, elemSize, keyOffset, keySize);
+        hdr = (struct f_swissHeader *)((char *)m - elemSize) - 1;
+        key = (char *)m - elemSize + keyOffset;
+        f_swissProbe(m, elemSize, keyOffset, keySize, key, hash, &vacant);
+    }
+    if (hdr->ctrl[vacant] == F_SWISS_EMPTY) {
+        hdr->growthLeft--;
+    }
+    hdr->ctrl[vacant] = (uint8_t)(hash & 0x7F);
+    hdr->count++;
+    memcpy((char *)m + (size_t)vacant * elemSize, (char *)m - elemSize, elemSize);
+    hdr->temp = vacant;
+    return m;
+}
+
+static inline int f_swissDelete(void *m, size_t elemSize, size_t keyOffset, size_t keySize){
+    ptrdiff_t slot = f_swissFind(m, elemSize, keyOffset, keySize);
+    if (slot < 0) {
+        return 0;
+    }
+    struct f_swissHeader *hdr = (struct f_swissHeader *)((char *)m - elemSize) - 1;
+    // probes stop at a group with an empty slot anyway, in such a group the slot can be empty again;
+    // in a full one it has to stay a tombstone for the keys probed past it
+    const uint8_t *group = hdr->ctrl + ((size_t)slot & ~(size_t)(F_SWISS_GROUP - 1));
+    if (f_swissMatch(group, F_SWISS_EMPTY)) {
+        hdr->ctrl[slot] = F_SWISS_EMPTY;
+        hdr->growthLeft++;
+    } else {
+        hdr->ctrl[slot] = F_SWISS_DELETED;
+    }
+    hdr->count--;
+    return 1;
+}
+
+#endif
@@ -9,28 +9,61 @@
  * Server:
  *   • network_listen(const char *port) - Listen on port (all interfaces). the value of parameter port is a string
  *   • network_listen_on()    - Listen on specific IP and port  
+ *   • network_listen_ex()    - Listen with a chosen backlog, SO_REUSEADDR/SO_REUSEPORT and non-blocking
  *   • network_accept()       - Accept incoming connections
+ *   • network_accept_batch() - Accept every pending connection of a non-blocking listener at once
  * 
  * Client:
  *   • network_connect()      - Connect to server using addrinfo
+ *   • network_connect_timeout() - Resolve and connect with a deadline, non-blocking connect underneath
+ *   • network_connect_addr() - Same for an address that's resolved already, network_connpool.h reuses connections
+ *   • network_resolve.h      - getaddrinfo on worker threads with results delivered to an event loop,
+ *     and a process-wide cache of resolved names with a TTL
  * 
  * Data Transfer:
  *   • network_send()         - Send null-terminated string
- *   • network_recv()         - Receive data into buffer
+ *   • network_send_all()     - Send a buffer of any bytes, retries partial writes
+ *   • network_sendv()        - Send several buffers with one syscall, e.g. header and body
+ *   • network_send_file()    - Send part of an open file straight from the page cache (sendfile/TransmitFile)
+ *   • network_send_path()    - Same for a file by name
+ *   • network_recv()         - Receive data into buffer, network_buffer.h has pooled per-connection buffers
+ *     and network_frame.h length-prefixed messages on top of them
  *   • network_close()        - Close socket connection
+ *   • network_udp.h          - UDP: datagrams in and out by the batch with recvmmsg/sendmmsg, GSO/GRO on Linux
+ *   • network_tls.h          - Optional TLS on event loop connections with OpenSSL/BoringSSL, kernel TLS on Linux
+ *     so sends and sendfile stay zero-copy, and session resumption for cheap reconnects
+ *
+ * Socket options:
+ *   • network_set_sockopts() - Options every listener, accepted and connected socket gets, TCP_NODELAY by default
+ *   • network_apply_sockopts() - Applies a network_sockopts to one socket
  *
  * Concurrency:
+ *   • network_queue.h        - Lock-free bounded queue of pointers between threads, e.g. connections handed
+ *     from one loop to another, with a wakeup for the receiving loop only when it's idle
  *
- * 
+ * Statistics:
+ *   • network_stats.h, included here - Per-thread counters of everything above and latency histograms of
+ *     the event loop, added up on demand and written out as text or JSON
+ *
+ * Errors and logging:
+ *   • network_last_result()  - What the last failed call on this thread failed with, network_last_errno() for the OS error
+ *   • network_set_log_level() / network_set_logger() - Nothing is printed by default except errors and warnings,
+ *     through a callback that can be replaced; -DNETWORK_LOG_COMPILE_LEVEL=NETWORK_LOG_OFF compiles every message out
  */
 
 #ifndef NETWORK_H
 #define NETWORK_H
 
+// accept4, SO_REUSEPORT and friends; only has an effect when this header is included first
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 
 #if defined(_WIN32) || defined(__MINGW32__)
 #define WINSOCK_IMPL
@@ -48,22 +81,94 @@ extern "C" {
 #ifdef WINSOCK_IMPL
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <mswsock.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 typedef SOCKET socket_t;
+#ifdef _MSC_VER
+#include <BaseTsd.h>
+typedef SSIZE_T ssize_t;
+#endif
+
+// same layout as POSIX, so network_sendv takes the same arrays everywhere
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#define MSG_NOSIGNAL 0 // winsock never raises SIGPIPE
+struct epoll_event; // only named by the network_epoll_* prototypes, which aren't supported here
 #elif defined(LINUX_SOCKETS_IMPL)
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+
+// glibc only declares accept4 under _GNU_SOURCE, which is too late when a libc header came before this one
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+extern int accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+#endif
 
 typedef int socket_t;
 #endif
 
-#define BACKLOG 10 //only accepts upto 10 connections
+#include "network_stats.h"
+
+// buffers network_sendv hands to one sendmsg call, longer arrays take more calls
+#define NETWORK_IOV_BATCH 64
+
+// pending connections network_listen/network_listen_on queue up, the kernel caps it at net.core.somaxconn
+#ifndef BACKLOG
+#define BACKLOG SOMAXCONN
+#endif
+
+// network_listen_ex flags
+#define NETWORK_LISTEN_REUSEADDR 0x1 // rebind right after a restart, while old connections are in TIME_WAIT
+#define NETWORK_LISTEN_REUSEPORT 0x2 // several sockets on one port, the kernel spreads connections over them
+#define NETWORK_LISTEN_NONBLOCK  0x4 // for listeners in an event loop
+
+// network_connect_addr flags
+#define NETWORK_CONNECT_NONBLOCK 0x1 // leave the connected socket non-blocking, for an event loop
+
+/**
+ * Socket options, 0 leaves an option at what the kernel picks. network_sockopts_default()
+ * has TCP_NODELAY on, so a small response doesn't wait for the ACK of the last one (up to
+ * 40ms with delayed ACKs), and keepalive probes after a minute of silence; the rest is 0.
+ * Options the platform doesn't have are skipped.
+ *
+ * On Linux a connection accepted on a listener starts with the listener's options,
+ * so accepting only sets quickack again, the one option that doesn't stick.
+ */
+typedef struct network_sockopts {
+    int nodelay;        // TCP_NODELAY, send small writes right away instead of coalescing them (Nagle)
+    int sndbuf;         // SO_SNDBUF bytes, setting it turns off the kernel's autotuning
+    int rcvbuf;         // SO_RCVBUF bytes, same; on a listener it has to be set before listen() for window scaling
+    int fastopen;       // listener: TCP_FASTOPEN queue of pending data-in-SYN connections;
+                        // client: TCP_FASTOPEN_CONNECT, the first write goes out with the SYN (Linux 4.11)
+    int quickack;       // TCP_QUICKACK, ACK right away instead of delaying; the kernel turns it off again on its own
+    int busy_poll_us;   // SO_BUSY_POLL, spin on the device queue for this long on blocking reads
+    int defer_accept_s; // TCP_DEFER_ACCEPT, listener only: accept only once data arrived, within this many seconds
+    int keepalive;      // SO_KEEPALIVE
+    int keepidle_s;     // TCP_KEEPIDLE, silence before the first probe
+    int keepintvl_s;    // TCP_KEEPINTVL, between probes
+    int keepcnt;        // TCP_KEEPCNT, unanswered probes before the connection is dropped
+} network_sockopts;
+
+// network_apply_sockopts roles, which options make sense depends on what the socket is
+#define NETWORK_SOCKOPTS_LISTENER 1 // after socket(), before bind and listen
+#define NETWORK_SOCKOPTS_CLIENT   2 // after socket(), before connect
+#define NETWORK_SOCKOPTS_ACCEPTED 3 // right after accept
 
 // To store buffer better, this way makes the buffer more flexible
 typedef struct {
@@ -71,12 +176,20 @@ typedef struct {
     size_t size;
 } data;
 
+// a connection network_accept_batch took off the listen queue
+typedef struct {
+    socket_t fd; // non-blocking and close-on-exec already
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} network_accepted;
+
 // it'll be used for epoll event to store users data
 struct client_event_data {
     int efd; // epoll_fd: fd of the current epoll
     int op; // type of operation needed to perform: EPOLL_CTL_ADD, EPOLL_CTL_MOD, EPOLL_CTL_DEL
     int clientfd; // the socket this event will be monitoring
     uint32_t event; // the type of event that should be looked out for
+    void *user; // stored in epoll_data.ptr so events lead straight to the connection, NULL stores clientfd instead
 };
 
 // return codes
@@ -91,8 +204,59 @@ typedef enum {
     SOCKET_CONNECT_FAILED,
     SOCKET_INVALID,
     SOCKET_UNKNOWN_ERROR,
+    SOCKET_SEND_FAILED,
+    SOCKET_RECV_FAILED,
+    SOCKET_OPTION_FAILED,
+    NETWORK_ADDRESS_FAILED,   // getaddrinfo couldn't resolve it
+    NETWORK_EPOLL_FAILED,
+    NETWORK_INVALID_ARGUMENT,
+    NETWORK_OUT_OF_MEMORY,
+    NETWORK_NOT_SUPPORTED,    // not available on this platform
+    NETWORK_THREAD_FAILED,
+    NETWORK_URING_FAILED,     // io_uring setup or io_uring_enter
+    NETWORK_FRAME_INVALID,    // bad length prefix or a frame over the limit
+    NETWORK_IOCP_FAILED,      // completion port setup or wait, Windows
+    NETWORK_TLS_FAILED,       // OpenSSL context or connection setup, network_tls.h
 } network_result;
 
+// what the last call that failed on this thread failed with, and the errno (WSAGetLastError() on Windows) behind it
+network_result network_last_result(void);
+int network_last_errno(void);
+const char *network_result_str(network_result result);
+
+// log levels, a message goes out when its level is at or below the runtime level
+#define NETWORK_LOG_OFF   0
+#define NETWORK_LOG_ERROR 1
+#define NETWORK_LOG_WARN  2
+#define NETWORK_LOG_INFO  3
+#define NETWORK_LOG_DEBUG 4
+
+// messages above this level aren't compiled in at all, neither the call nor its arguments
+#ifndef NETWORK_LOG_COMPILE_LEVEL
+#define NETWORK_LOG_COMPILE_LEVEL NETWORK_LOG_INFO
+#endif
+
+// gets the formatted message without a trailing newline, from whichever thread logged it
+typedef void (*network_log_fn)(int level, const char *file, int line, const char *message, void *user);
+
+// NETWORK_LOG_WARN by default; meant to be set at startup, threads read it without a lock
+void network_set_log_level(int level);
+// replaces the default logger (stderr), NULL puts it back
+void network_set_logger(network_log_fn fn, void *user);
+void network_log_write(int level, const char *file, int line, const char *fmt, ...);
+extern int network_log_level;
+
+// the level check happens before any argument is evaluated or formatted
+#define NETWORK_LOG(level, ...) \
+    do { \
+        if ((level) <= NETWORK_LOG_COMPILE_LEVEL && (level) <= network_log_level) \
+            network_log_write((level), __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+#define NETWORK_ERROR(...) NETWORK_LOG(NETWORK_LOG_ERROR, __VA_ARGS__)
+#define NETWORK_WARN(...) NETWORK_LOG(NETWORK_LOG_WARN, __VA_ARGS__)
+#define NETWORK_INFO(...) NETWORK_LOG(NETWORK_LOG_INFO, __VA_ARGS__)
+#define NETWORK_DEBUG(...) NETWORK_LOG(NETWORK_LOG_DEBUG, __VA_ARGS__)
+
 // windows only cycle
 int network_init(void);
 
@@ -104,32 +268,100 @@ void network_cleanup(void);
 // server side
 socket_t network_listen(const char *port);
 socket_t network_listen_on(const char *ip, const char *port); // specific interface
+/**
+ * @param ip : NULL listens on all interfaces
+ * @param backlog : pending connections to queue, 0 for BACKLOG
+ * @param flags : NETWORK_LISTEN_* or'd together
+ * @return the listening socket, -1 on failure
+ */
+socket_t network_listen_ex(const char *ip, const char *port, int backlog, int flags);
 socket_t network_accept(socket_t socktfd, struct sockaddr_storage *client_storage); // accept connection
+/**
+ * Accepts pending connections of a non-blocking listener until the queue is empty or max
+ * of them are in out. With an edge-triggered listener, call it again while it returns max.
+ *
+ * When the process is out of file descriptors (EMFILE/ENFILE) the pending connections
+ * are accepted on a reserve descriptor and closed right away, so clients get a reset
+ * instead of hanging in the queue and an edge-triggered listener isn't left undrained.
+ * Without a reserve, because not even it could be reopened, they stay queued, and the
+ * caller has to try again later; network_loop's listeners do that from a timer.
+ *
+ * @return connections in out, -1 when accept failed for another reason
+ */
+int network_accept_batch(socket_t listener, network_accepted *out, int max);
+// connections network_accept_batch had to close because there were no descriptors left
+size_t network_accept_shed_count(void);
 
 // client side
+// connects to the first address that takes it, NULL or an empty addrinfo means port 8080 on this machine;
+// server_address stays the caller's to free
 socket_t network_connect(struct addrinfo *server_address);
-network_result network_connect_timeout(const char *ip, int port, int timeout_ms);
+/**
+ * Resolves host and port and tries each address with a non-blocking connect until one
+ * takes it or timeout_ms have passed, all addresses together. The time getaddrinfo took
+ * counts too, though a lookup that takes longer can't be cut short.
+ *
+ * @param timeout_ms : -1 waits as long as the kernel does (minutes on an unanswered SYN)
+ * @return a connected, blocking socket, -1 on failure; SOCKET_CONNECT_FAILED with ETIMEDOUT when time ran out
+ */
+socket_t network_connect_timeout(const char *host, const char *port, int timeout_ms);
+// same for one resolved address, flags NETWORK_CONNECT_* or'd together
+socket_t network_connect_addr(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms, int flags);
 
 // data transfer
 socket_t network_send(socket_t socket, const void *data);
 socket_t network_recv(socket_t socketfd, void *data, size_t buffer_size);
 
 // Guaranteed Delivery
-socket_t network_send_all(socket_t sockfd, void *data, size_t buffer_size); // TODO
+/**
+ * Sends all len bytes of data, retrying partial writes and writes interrupted by signals.
+ * A broken connection returns an error (EPIPE) instead of raising SIGPIPE.
+ *
+ * @return len when everything was sent, -1 on error. On a non-blocking socket that
+ * fills up it returns the bytes sent so far with errno set to EAGAIN/EWOULDBLOCK;
+ * wait until the socket is writable and send the rest from that offset.
+ */
+ssize_t network_send_all(socket_t sockfd, const void *data, size_t len);
+/**
+ * Same as network_send_all for iovcnt buffers, sent one after the other with as few
+ * sendmsg calls as possible, so e.g. a header and its body go out in one syscall.
+ * The array itself is left untouched.
+ *
+ * @return total bytes sent, see network_send_all for errors and non-blocking sockets
+ */
+ssize_t network_sendv(socket_t sockfd, const struct iovec *iov, int iovcnt);
+/**
+ * Sends len bytes of the file fd from offset without copying them through user space,
+ * sendfile on Linux and TransmitFile on Windows. The file position of fd is left alone on Linux.
+ *
+ * @return bytes sent, see network_send_all for errors and non-blocking sockets; a file that
+ * ends before offset + len returns what it had, or -1 when nothing was left at offset
+ */
+ssize_t network_send_file(socket_t sockfd, int fd, int64_t offset, size_t len);
+// opens path and sends len bytes from offset, len 0 for the rest of the file
+ssize_t network_send_path(socket_t sockfd, const char *path, int64_t offset, size_t len);
 
 // closing socket
 void network_close(socket_t socket);
 
+// socket options
+network_sockopts network_sockopts_default(void);
+// options network_listen*, network_accept*, network_connect* and the event loop use from now on, NULL for the defaults
+void network_set_sockopts(const network_sockopts *opts);
+void network_get_sockopts(network_sockopts *opts);
+// sets what opts asks for on sockfd for the role (NETWORK_SOCKOPTS_*), returns 0, or -1 when an option failed (the rest are still set)
+int network_apply_sockopts(socket_t sockfd, const network_sockopts *opts, int role);
+
 // Utilities
 #ifdef WINSOCK_IMPL
 static void network_win_errmsg(DWORD errcode);
 #endif
-void network_set_nonblocking(socket_t sock); // sets the file descriptor of the socket as non-blocking, returns nothing
-void network_would_block(socket_t sock); // sets the file descriptor of the socket as blocking, returns nothing
+int network_set_nonblocking(socket_t sock); // sets the file descriptor of the socket as non-blocking, returns 0 or -1
+int network_would_block(socket_t sock); // sets the file descriptor of the socket as blocking, returns 0 or -1
 
 // EPOLL events
 socket_t network_epoll_create(void); // creates a new epoll and returns epoll_fd which is an integer
-void network_epoll_ctl(struct client_event_data *cdata); // adds the clients fd in the event to monitor
+int network_epoll_ctl(struct client_event_data *cdata); // adds the clients fd in the event to monitor, returns 0 or -1
 /**
  *
  * @param epollfd : The efd of the current event
@@ -146,35 +378,183 @@ void network_epoll_ctl(struct client_event_data *cdata); // adds the clients fd
  * // for heap
  * struct epoll_event *events = malloc(maxevents * sizeof(struct epoll_event));
  */
-int network_epoll_wait(socket_t epollfd, struct epoll_event *events, int maxevents, int timeout); // returns the number of fd's are ready for I/O operations
+int network_epoll_wait(socket_t epollfd, struct epoll_event *events, int maxevents, int timeout); // returns the number of fd's are ready for I/O operations, -1 on error
 void network_epoll_close(socket_t epollfd); // Should close the event gracefully, after closing all the sockets it's managing
 
 #ifdef NETWORK_IMPLEMENTATION
 
-static void network_win_errmsg(DWORD errcode) {
+#include <stdarg.h>
+
+#ifdef __cplusplus
+#define NETWORK_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define NETWORK_THREAD_LOCAL __declspec(thread)
+#else
+#define NETWORK_THREAD_LOCAL _Thread_local
+#endif
+
+int network_log_level = NETWORK_LOG_WARN;
+static network_log_fn network_logger;
+static void *network_logger_user;
+static NETWORK_THREAD_LOCAL network_result network_result_last;
+static NETWORK_THREAD_LOCAL int network_errno_last;
+
+static const char *const network_log_names[] = { "off", "error", "warn", "info", "debug" };
+
+// what network_sockopts_default() returns, in field order
+static network_sockopts network_opts = { 1, 0, 0, 0, 0, 0, 0, 1, 60, 10, 5 };
+
+inline void network_set_log_level(int level) {
+    network_log_level = level;
+}
+
+inline void network_set_logger(network_log_fn fn, void *user) {
+    network_logger_user = user;
+    network_logger = fn;
+}
+
+inline void network_log_write(int level, const char *file, int line, const char *fmt, ...) {
+    char message[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    if (network_logger) {
+        network_logger(level, file, line, message, network_logger_user);
+        return;
+    }
+    // one fprintf per message, so lines from different threads don't interleave
+    fprintf(stderr, "network %s: %s (%s:%d)\n",
+            network_log_names[level >= NETWORK_LOG_OFF && level <= NETWORK_LOG_DEBUG ? level : NETWORK_LOG_OFF],
+            message, file, line);
+}
+
+// errno, or the winsock error on Windows
+static inline int network_os_error(void) {
+#ifdef WINSOCK_IMPL
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+// true when a failed send only means the socket buffer is full
+static inline int network_send_would_block(void) {
 #ifdef WINSOCK_IMPL
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// true when a failed send or recv only means the peer reset or closed the connection
+static inline int network_peer_gone(int err) {
+#ifdef WINSOCK_IMPL
+    return err == WSAECONNRESET || err == WSAECONNABORTED || err == WSAESHUTDOWN;
+#else
+    return err == ECONNRESET || err == EPIPE || err == ECONNABORTED;
+#endif
+}
+
+// logs a failed send or recv; peers going away is ordinary for a server and only logged at debug level
+#define NETWORK_IO_ERROR(err, ...) \
+    do { \
+        if (network_peer_gone(err)) NETWORK_DEBUG(__VA_ARGS__); \
+        else NETWORK_ERROR(__VA_ARGS__); \
+    } while (0)
+
+// counts a recv, readv or WSARecv that returned n, with errno still from it
+static inline void network_count_recv(ssize_t n) {
+    network_stats_add(NETWORK_STAT_RECV_CALLS, 1);
+    if (n > 0) {
+        network_stats_add(NETWORK_STAT_BYTES_IN, (uint64_t)n);
+    } else if (n < 0) {
+        network_stats_add(network_send_would_block() ? NETWORK_STAT_WOULD_BLOCK : NETWORK_STAT_ERRORS, 1);
+    }
+}
+
+// counts a send of want bytes that returned n, with errno still from it
+static inline void network_count_send(ssize_t n, size_t want) {
+    network_stats_add(NETWORK_STAT_SEND_CALLS, 1);
+    if (n >= 0) {
+        network_stats_add(NETWORK_STAT_BYTES_OUT, (uint64_t)n);
+        if ((size_t)n < want) {
+            network_stats_add(NETWORK_STAT_PARTIAL_WRITES, 1);
+        }
+    } else {
+#ifndef WINSOCK_IMPL
+        if (errno == EINTR) {
+            return;
+        }
+#endif
+        network_stats_add(network_send_would_block() ? NETWORK_STAT_WOULD_BLOCK : NETWORK_STAT_ERRORS, 1);
+    }
+}
+
+// records why a call failed for network_last_result(), returns -1 for the caller to pass on
+static inline int network_fail(network_result result, int err) {
+    network_result_last = result;
+    network_errno_last = err;
+    return -1;
+}
+
+inline network_result network_last_result(void) {
+    return network_result_last;
+}
+
+inline int network_last_errno(void) {
+    return network_errno_last;
+}
+
+inline const char *network_result_str(network_result result) {
+    switch (result) {
+    case NETWORK_SUCCESS: return "success";
+    case SOCKET_CREATE_FAILED: return "socket creation failed";
+    case SOCKET_BIND_FAILED: return "bind failed";
+    case SOCKET_LISTEN_FAILED: return "listen failed";
+    case SOCKET_ACCEPT_FAILED: return "accept failed";
+    case SOCKET_CONNECT_FAILED: return "connect failed";
+    case SOCKET_INVALID: return "invalid socket";
+    case SOCKET_UNKNOWN_ERROR: return "unknown error";
+    case SOCKET_SEND_FAILED: return "send failed";
+    case SOCKET_RECV_FAILED: return "recv failed";
+    case SOCKET_OPTION_FAILED: return "socket option failed";
+    case NETWORK_ADDRESS_FAILED: return "address lookup failed";
+    case NETWORK_EPOLL_FAILED: return "epoll failed";
+    case NETWORK_INVALID_ARGUMENT: return "invalid argument";
+    case NETWORK_OUT_OF_MEMORY: return "out of memory";
+    case NETWORK_NOT_SUPPORTED: return "not supported on this platform";
+    case NETWORK_THREAD_FAILED: return "thread creation failed";
+    case NETWORK_URING_FAILED: return "io_uring failed";
+    case NETWORK_IOCP_FAILED: return "completion port failed";
+    case NETWORK_TLS_FAILED: return "TLS setup failed";
+    case NETWORK_FRAME_INVALID: return "invalid frame";
+    }
+    return "unknown result";
+}
+
+#ifdef WINSOCK_IMPL
+static void network_win_errmsg(DWORD errcode) {
     // Buffer to store the error message
-    LPWSTR errormsg = NULL;
+    char errormsg[256];
 
-    FormatMessage(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER |
+    if (FormatMessageA(
             FORMAT_MESSAGE_FROM_SYSTEM |
             FORMAT_MESSAGE_IGNORE_INSERTS,
             NULL,
             errcode,
             MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-            (LPWSTR)&errormsg,
-            0,
+            errormsg,
+            sizeof(errormsg),
             NULL
-        );
-
-    wprintf(L"%lu: %s\n", errcode, errormsg);
-    if (errormsg) LocalFree(errormsg);
-#else
-    printf("It's a windows only function.\n");
-#endif
+        ) == 0) {
+        errormsg[0] = '\0';
+    }
 
+    NETWORK_ERROR("%lu: %s", errcode, errormsg);
 }
+#endif
 
 inline int network_init(void) {
 #ifdef WINSOCK_IMPL
@@ -187,11 +567,12 @@ inline int network_init(void) {
     err = WSAStartup(wVersionRequested, &wsaData);
 
     if (err != 0 ) {
-        printf("WSAStartup failed with error: %d\n", err);
+        NETWORK_ERROR("WSAStartup failed with error: %d", err);
+        network_fail(SOCKET_UNKNOWN_ERROR, err);
         return 1;
     }
-#elif LINUX_SOCKETS_IMPL
-    printf("This function is for Windows only, it's not needed in linux.\n");
+#elif defined(LINUX_SOCKETS_IMPL)
+    NETWORK_DEBUG("network_init is for Windows only, it's not needed in linux.");
 #endif
 
 
@@ -201,57 +582,150 @@ inline int network_init(void) {
 inline void network_cleanup(void) {
 #ifdef WINSOCK_IMPL
     if (WSACleanup() != 0) {
-        printf("WSACleanup failed with error: %d\n", WSAGetLastError());
+        NETWORK_ERROR("WSACleanup failed with error: %d", WSAGetLastError());
+        network_fail(SOCKET_UNKNOWN_ERROR, WSAGetLastError());
+        return;
     }
-    printf("cleanup successful!\n");
-#elif LINUX_SOCKETS_IMPL
-    printf("Please use network_close(socket_fd), this function is windows only.\n");
+    NETWORK_DEBUG("cleanup successful!");
+#elif defined(LINUX_SOCKETS_IMPL)
+    NETWORK_DEBUG("network_cleanup is windows only, use network_close(socket_fd).");
 #endif
 
 }
 
-inline socket_t network_listen(const char *port) {
-    struct addrinfo hints, *res;
-    socket_t sockfd;
+inline network_sockopts network_sockopts_default(void) {
+    network_sockopts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.nodelay = 1;
+    opts.keepalive = 1;
+    opts.keepidle_s = 60;
+    opts.keepintvl_s = 10;
+    opts.keepcnt = 5;
+    return opts;
+}
 
-    // clearnig the memory to load by getaddrinfo
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET; // ipv4
-    hints.ai_socktype = SOCK_STREAM; // Since TCP, we'll be using streaming to transfer the data
-    hints.ai_flags = AI_PASSIVE; // fill up any available ip
+// set once at startup, before the threads that open sockets; it isn't locked
+inline void network_set_sockopts(const network_sockopts *opts) {
+    network_opts = opts ? *opts : network_sockopts_default();
+}
 
-    getaddrinfo(NULL, port, &hints, &res);
+inline void network_get_sockopts(network_sockopts *opts) {
+    *opts = network_opts;
+}
 
-    // bind the socket to the ip and port
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    // check if socket is created
-    if(sockfd < 0) {
-        printf("Socket creation failed at Listen API.\n");
-        freeaddrinfo(res);
+static inline int network_sockopt(socket_t sockfd, int level, int name, int value, const char *what) {
+    if (setsockopt(sockfd, level, name, (const char *)&value, sizeof(value)) < 0) {
+        NETWORK_WARN("setsockopt %s failed. %s", what, strerror(network_os_error()));
         return -1;
     }
-    if(bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-        printf("Bind has failed!\n");
-        freeaddrinfo(res);
-        network_close(sockfd);
-        return -1;
+    return 0;
+}
+
+// options the platform doesn't have, only asked for ones are mentioned
+#define NETWORK_SOCKOPT_MISSING(what) NETWORK_DEBUG("%s is not supported on this platform.", what)
+
+inline int network_apply_sockopts(socket_t sockfd, const network_sockopts *opts, int role) {
+    int failed = 0;
+    if (opts == NULL) {
+        return 0;
+    }
+    if (role == NETWORK_SOCKOPTS_ACCEPTED) {
+        // everything else came with the listener; Windows copies it just the same
+#ifdef TCP_QUICKACK
+        if (opts->quickack) {
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+        }
+#endif
+        return failed ? -1 : 0;
     }
 
-    if(listen(sockfd, BACKLOG) < 0) {
-        printf("Listen has failed!\n");
-        freeaddrinfo(res);
-        network_close(sockfd);
-        return -1;
+    if (opts->nodelay) {
+        failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (opts->sndbuf > 0) {
+        failed |= network_sockopt(sockfd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+    }
+    if (opts->rcvbuf > 0) {
+        failed |= network_sockopt(sockfd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+    }
+    if (opts->keepalive) {
+        failed |= network_sockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        if (opts->keepidle_s > 0) {
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepidle_s, "TCP_KEEPIDLE");
+        }
+#endif
+#ifdef TCP_KEEPINTVL
+        if (opts->keepintvl_s > 0) {
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, opts->keepintvl_s, "TCP_KEEPINTVL");
+        }
+#endif
+#ifdef TCP_KEEPCNT
+        if (opts->keepcnt > 0) {
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepcnt, "TCP_KEEPCNT");
+        }
+#endif
+    }
+    if (opts->busy_poll_us > 0) {
+#ifdef SO_BUSY_POLL
+        failed |= network_sockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll_us, "SO_BUSY_POLL");
+#else
+        NETWORK_SOCKOPT_MISSING("SO_BUSY_POLL");
+#endif
     }
 
-    freeaddrinfo(res);
+    if (role == NETWORK_SOCKOPTS_LISTENER) {
+        if (opts->fastopen > 0) {
+#ifdef TCP_FASTOPEN
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen, "TCP_FASTOPEN");
+#else
+            NETWORK_SOCKOPT_MISSING("TCP_FASTOPEN");
+#endif
+        }
+        if (opts->defer_accept_s > 0) {
+#ifdef TCP_DEFER_ACCEPT
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept_s, "TCP_DEFER_ACCEPT");
+#else
+            NETWORK_SOCKOPT_MISSING("TCP_DEFER_ACCEPT");
+#endif
+        }
+    } else {
+        if (opts->fastopen > 0) {
+#ifdef TCP_FASTOPEN_CONNECT
+            // connect() returns right away, the SYN waits for the first write and carries it
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+#else
+            NETWORK_SOCKOPT_MISSING("TCP_FASTOPEN_CONNECT");
+#endif
+        }
+#ifdef TCP_QUICKACK
+        if (opts->quickack) {
+            failed |= network_sockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+        }
+#endif
+    }
+    return failed ? -1 : 0;
+}
 
-    return sockfd;
+// what an accepted connection doesn't get from its listener
+static inline void network_accepted_sockopts(socket_t sockfd) {
+    if (network_opts.quickack) {
+        network_apply_sockopts(sockfd, &network_opts, NETWORK_SOCKOPTS_ACCEPTED);
+    }
+}
+
+inline socket_t network_listen(const char *port) {
+    return network_listen_ex(NULL, port, BACKLOG, NETWORK_LISTEN_REUSEADDR);
 }
 
 inline socket_t network_listen_on(const char *ip, const char *port) {
+    return network_listen_ex(ip, port, BACKLOG, NETWORK_LISTEN_REUSEADDR);
+}
+
+inline socket_t network_listen_ex(const char *ip, const char *port, int backlog, int flags) {
     struct addrinfo hints, *res;
     socket_t sockfd;
+    int on = 1;
 
     // clearing the memory to load by getaddrinfo
     memset(&hints, 0, sizeof hints);
@@ -259,56 +733,180 @@ inline socket_t network_listen_on(const char *ip, const char *port) {
     hints.ai_socktype = SOCK_STREAM; // Since TCP, we'll be using streaming to transfer the data
     hints.ai_flags = AI_PASSIVE; // fill up any available ip
 
-    getaddrinfo(ip, port, &hints, &res);
+    int err = getaddrinfo(ip, port, &hints, &res);
+    if (err != 0) {
+        NETWORK_ERROR("getaddrinfo failed at Listen API. %s", gai_strerror(err));
+        return network_fail(NETWORK_ADDRESS_FAILED, err);
+    }
 
-    // bind the socket to the ip and port
     sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    // check if socket is created
-     if(sockfd < 0) {
-        printf("Socket creation failed at Listen API.\n");
+    if(sockfd < 0) {
+        int err = network_os_error();
+        NETWORK_ERROR("Socket creation failed at Listen API. %s", strerror(err));
         freeaddrinfo(res);
-        return -1;
+        return network_fail(SOCKET_CREATE_FAILED, err);
     }
-    if(bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-        printf("Bind has failed!\n");
+
+    // options have to be set before bind to have any effect
+    if ((flags & NETWORK_LISTEN_REUSEADDR) &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on)) < 0) {
+        NETWORK_WARN("setsockopt SO_REUSEADDR failed. %s", strerror(network_os_error()));
+    }
+    if (flags & NETWORK_LISTEN_REUSEPORT) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on)) < 0) {
+            int err = network_os_error();
+            NETWORK_ERROR("setsockopt SO_REUSEPORT failed. %s", strerror(err));
+            freeaddrinfo(res);
+            network_close(sockfd);
+            return network_fail(SOCKET_OPTION_FAILED, err);
+        }
+#else
+        NETWORK_ERROR("SO_REUSEPORT is not supported on this platform.");
         freeaddrinfo(res);
         network_close(sockfd);
-        return -1;
+        return network_fail(NETWORK_NOT_SUPPORTED, 0);
+#endif
     }
+    network_apply_sockopts(sockfd, &network_opts, NETWORK_SOCKOPTS_LISTENER); // a failed one is only a warning
 
-    if(listen(sockfd, BACKLOG) < 0) {
-        printf("Listen has failed!\n");
+    if(bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+        int err = network_os_error();
+        NETWORK_ERROR("Bind has failed! %s", strerror(err));
         freeaddrinfo(res);
         network_close(sockfd);
-        return -1;
+        return network_fail(SOCKET_BIND_FAILED, err);
     }
-
     freeaddrinfo(res);
 
+    if(listen(sockfd, backlog > 0 ? backlog : BACKLOG) < 0) {
+        int err = network_os_error();
+        NETWORK_ERROR("Listen has failed! %s", strerror(err));
+        network_close(sockfd);
+        return network_fail(SOCKET_LISTEN_FAILED, err);
+    }
+
+    if ((flags & NETWORK_LISTEN_NONBLOCK) && network_set_nonblocking(sockfd) < 0) {
+        network_close(sockfd);
+        return -1;
+    }
     return sockfd;
 }
 
 inline socket_t network_accept(socket_t socktfd, struct sockaddr_storage *client_storage) {
     if (socktfd < 0) {
-        printf("socket file descriptor is NULL.\n");
-        return -1;
+        NETWORK_ERROR("socket file descriptor is invalid.");
+        return network_fail(SOCKET_INVALID, 0);
     }
     if (client_storage == NULL) {
-        printf("Address is NULL.\n");
-        return -1;
+        NETWORK_ERROR("Address is NULL.");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
     }
     socklen_t address_len = sizeof(*client_storage);
     socket_t newfd = accept(socktfd, (struct sockaddr *) client_storage, &address_len);
 
     if (newfd < 0) {
-        printf("Accept has failed.\n");
-        return -1;
+        int err = network_os_error();
+        NETWORK_ERROR("Accept has failed. %s", strerror(err));
+        network_stats_add(NETWORK_STAT_ERRORS, 1);
+        return network_fail(SOCKET_ACCEPT_FAILED, err);
     }
-    printf("Client connected.\n");
+    NETWORK_DEBUG("Client connected.");
+    network_stats_add(NETWORK_STAT_ACCEPTS, 1);
+    network_accepted_sockopts(newfd);
     return newfd;
 }
 
+#ifdef LINUX_SOCKETS_IMPL
+// one spare descriptor per thread, given up to make room for accepting a connection when out of fds
+static NETWORK_THREAD_LOCAL int network_reserve_fd = -1;
+static size_t network_shed; // only ever counted, a torn read is fine
+#endif
+
+// takes every pending connection off the queue and closes it, with the reserve fd as the room to do it
+static inline void network_accept_shed(socket_t listener) {
+#ifdef LINUX_SOCKETS_IMPL
+    if (network_reserve_fd < 0) {
+        return; // no reserve, the error stays with the caller
+    }
+    close(network_reserve_fd);
+    network_reserve_fd = -1;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        close(fd);
+        __atomic_fetch_add(&network_shed, 1, __ATOMIC_RELAXED);
+    }
+    network_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+inline int network_accept_batch(socket_t listener, network_accepted *out, int max) {
+    int count = 0;
+#ifdef LINUX_SOCKETS_IMPL
+    if (network_reserve_fd < 0) {
+        network_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+#endif
+    while (count < max) {
+        network_accepted *conn = &out[count];
+        conn->addrlen = sizeof(conn->addr);
+#ifdef WINSOCK_IMPL
+        conn->fd = accept(listener, (struct sockaddr *)&conn->addr, &conn->addrlen);
+        if (conn->fd == INVALID_SOCKET) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                network_stats_add(NETWORK_STAT_WOULD_BLOCK, 1);
+                break;
+            }
+            int err = WSAGetLastError();
+            NETWORK_ERROR("accept failed. %d", err);
+            return count ? count : network_fail(SOCKET_ACCEPT_FAILED, err);
+        }
+        u_long on = 1;
+        ioctlsocket(conn->fd, FIONBIO, &on);
+#else
+        // one syscall for accept and O_NONBLOCK instead of accept + two fcntl calls
+        conn->fd = accept4(listener, (struct sockaddr *)&conn->addr, &conn->addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn->fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                network_stats_add(NETWORK_STAT_WOULD_BLOCK, 1);
+                break;
+            }
+            // the client gave up while queued, move on to the next one
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                network_accept_shed(listener);
+                break;
+            }
+            int err = errno;
+            NETWORK_ERROR("accept failed. %s", strerror(err));
+            return count ? count : network_fail(SOCKET_ACCEPT_FAILED, err);
+        }
+#endif
+        network_accepted_sockopts(conn->fd);
+        count++;
+    }
+    network_stats_add(NETWORK_STAT_ACCEPTS, (uint64_t)count);
+    return count;
+}
+
+inline size_t network_accept_shed_count(void) {
+#ifdef LINUX_SOCKETS_IMPL
+    return __atomic_load_n(&network_shed, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
 inline socket_t network_connect(struct addrinfo *server_address) {
+    struct addrinfo *resolved = NULL;
     // if user sends and empty addrinfo, load the data here
     if (server_address == NULL || server_address->ai_family == 0) {
         struct addrinfo hint;
@@ -317,149 +915,469 @@ inline socket_t network_connect(struct addrinfo *server_address) {
         hint.ai_socktype = SOCK_STREAM;
         hint.ai_flags = AI_PASSIVE;
 
-        getaddrinfo(NULL, "8080", &hint, &server_address);
+        int err = getaddrinfo(NULL, "8080", &hint, &resolved);
+        if (err != 0) {
+            NETWORK_ERROR("getaddrinfo failed at Connect API. %s", gai_strerror(err));
+            return network_fail(NETWORK_ADDRESS_FAILED, err);
+        }
+        server_address = resolved;
     }
 
-    socket_t client_socket = socket(server_address->ai_family,
-        server_address->ai_socktype,
-        server_address->ai_protocol);
+    // a failed address leaves its error as the last result, the next one can still connect
+    socket_t client_socket = (socket_t)-1;
+    for (struct addrinfo *ai = server_address; ai != NULL; ai = ai->ai_next) {
+        client_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (client_socket == (socket_t)-1) {
+            int err = network_os_error();
+            NETWORK_ERROR("Socket creation failed. %s", strerror(err));
+            network_fail(SOCKET_CREATE_FAILED, err);
+            continue;
+        }
+        network_apply_sockopts(client_socket, &network_opts, NETWORK_SOCKOPTS_CLIENT);
+
+        if (connect(client_socket, ai->ai_addr, ai->ai_addrlen) == 0) {
+            NETWORK_DEBUG("Socket successfully connected.");
+            network_stats_add(NETWORK_STAT_CONNECTS, 1);
+            break;
+        }
+        int err = network_os_error();
+#ifdef WINSOCK_IMPL
+        network_win_errmsg(err); // logs the exact error
 
-    if (client_socket < 0) {
-        printf("Socket creation failed. %s\n", strerror(errno));
-        return -1;
+#elif defined(LINUX_SOCKETS_IMPL)
+        NETWORK_ERROR("Connection failed. %s", strerror(err));
+#endif
+        network_close(client_socket);
+        client_socket = (socket_t)-1;
+        network_fail(SOCKET_CONNECT_FAILED, err);
     }
 
-    if (connect(client_socket, server_address->ai_addr, server_address->ai_addrlen) == 0) {
-        printf("Socket successfully connected.\n");
-        freeaddrinfo(server_address);
-        return client_socket;
+    if (resolved) {
+        freeaddrinfo(resolved);
     }
-    else {
+    return client_socket;
+}
+
+// milliseconds on a clock that doesn't jump with the wall clock
+static inline int64_t network_now_ms(void) {
 #ifdef WINSOCK_IMPL
-        network_win_errmsg(GetLastError()); // prints the exact error
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
 
-#elif LINUX_IMPL
-        printf("Connection failed. %s\n", strerror(errno));
+// waits for a connect in progress, 1 when it finished one way or the other, 0 on timeout, -1 on errors
+static inline int network_connect_wait(socket_t sockfd, int timeout_ms) {
+#ifdef WINSOCK_IMPL
+    fd_set writable, failed;
+    FD_ZERO(&writable);
+    FD_ZERO(&failed);
+    FD_SET(sockfd, &writable);
+    FD_SET(sockfd, &failed); // a refused connect only shows up here on Windows
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    return select(0, NULL, &writable, &failed, timeout_ms < 0 ? NULL : &tv) == SOCKET_ERROR ? -1 : FD_ISSET(sockfd, &writable) || FD_ISSET(sockfd, &failed);
+#else
+    struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+    int64_t deadline = network_now_ms() + timeout_ms;
+    for (;;) {
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n >= 0 || errno != EINTR) {
+            return n;
+        }
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - network_now_ms();
+            timeout_ms = left > 0 ? (int)left : 0;
+        }
+    }
 #endif
+}
 
-        freeaddrinfo(server_address);
-        network_close(client_socket);
+inline socket_t network_connect_addr(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms, int flags) {
+#ifdef WINSOCK_IMPL
+    socket_t sockfd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sockfd == INVALID_SOCKET) {
+        int err = network_os_error();
+        NETWORK_ERROR("Socket creation failed. %d", err);
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+    if (network_set_nonblocking(sockfd) < 0) {
+        network_close(sockfd);
+        return -1;
+    }
+#else
+    // non-blocking from the start, saves the fcntl calls
+    socket_t sockfd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        int err = errno;
+        NETWORK_ERROR("Socket creation failed. %s", strerror(err));
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+#endif
+    network_apply_sockopts(sockfd, &network_opts, NETWORK_SOCKOPTS_CLIENT);
+
+    if (connect(sockfd, addr, addrlen) != 0) {
+        int err = network_os_error();
+#ifdef WINSOCK_IMPL
+        int pending = err == WSAEWOULDBLOCK;
+#else
+        int pending = err == EINPROGRESS || err == EINTR; // an interrupted connect carries on in the background
+#endif
+        if (!pending) {
+            NETWORK_ERROR("Connection failed. %s", strerror(err));
+            network_close(sockfd);
+            return network_fail(SOCKET_CONNECT_FAILED, err);
+        }
+
+        int ready = network_connect_wait(sockfd, timeout_ms);
+        if (ready <= 0) {
+            err = ready == 0 ? ETIMEDOUT : network_os_error();
+            NETWORK_ERROR("Connection failed. %s", strerror(err));
+            network_close(sockfd);
+            return network_fail(SOCKET_CONNECT_FAILED, err);
+        }
+        socklen_t len = sizeof(err);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0) {
+            err = network_os_error();
+        }
+        if (err != 0) {
+            NETWORK_ERROR("Connection failed. %s", strerror(err));
+            network_close(sockfd);
+            return network_fail(SOCKET_CONNECT_FAILED, err);
+        }
+    }
+
+    if (!(flags & NETWORK_CONNECT_NONBLOCK) && network_would_block(sockfd) < 0) {
+        network_close(sockfd);
         return -1;
     }
+    NETWORK_DEBUG("Socket successfully connected.");
+    network_stats_add(NETWORK_STAT_CONNECTS, 1);
+    return sockfd;
+}
+
+inline socket_t network_connect_timeout(const char *host, const char *port, int timeout_ms) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int64_t deadline = network_now_ms() + timeout_ms;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        NETWORK_ERROR("getaddrinfo failed at Connect API. %s", gai_strerror(err));
+        return network_fail(NETWORK_ADDRESS_FAILED, err);
+    }
+
+    socket_t sockfd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        int left = -1;
+        if (timeout_ms >= 0) {
+            int64_t remaining = deadline - network_now_ms();
+            if (remaining <= 0) {
+                NETWORK_ERROR("Connection to %s:%s timed out.", host ? host : "localhost", port);
+                network_fail(SOCKET_CONNECT_FAILED, ETIMEDOUT);
+                break;
+            }
+            left = remaining > INT_MAX ? INT_MAX : (int)remaining;
+        }
+        sockfd = network_connect_addr(ai->ai_addr, (socklen_t)ai->ai_addrlen, left, 0);
+        if (sockfd != (socket_t)-1) {
+            break;
+        }
+    }
+    freeaddrinfo(res);
+    return sockfd;
 }
 
 inline socket_t network_send(socket_t socketfd, const void *data) {
     if (socketfd < 0) {
-        printf("Invalid socket descriptor: %d\n", socketfd);
-        exit(EXIT_FAILURE);
-        //return -1;
+        NETWORK_ERROR("Invalid socket descriptor: %d", (int)socketfd);
+        return network_fail(SOCKET_INVALID, 0);
     }
 
     if (data == NULL) {
-        printf("Data pointer is NULL\n");
-        return -1;
+        NETWORK_ERROR("Data pointer is NULL");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
     }
 
-    int len = strlen(data);
+    size_t len = strlen(data);
     if (len == 0) {
-        printf("Attempting to send empty string\n");
+        NETWORK_DEBUG("Attempting to send empty string");
         return 0;
     }
 
-    int bytes_sent = send(socketfd, data, len, 0);
+    ssize_t bytes_sent = network_send_all(socketfd, data, len);
     if(bytes_sent < 0) {
-        printf("send failed.\n");
-        return -1;
+        return -1; // network_send_all logged it
     }
-    return bytes_sent;
+    return (socket_t)bytes_sent;
 }
 
 inline socket_t network_recv(socket_t socketfd, void *data, size_t buffer_size){
     if (socketfd < 0) {
-        printf("Invalid socket descriptor: %d\n", socketfd);
-        //return -1;
-        exit(EXIT_FAILURE);
+        NETWORK_ERROR("Invalid socket descriptor: %d", (int)socketfd);
+        return network_fail(SOCKET_INVALID, 0);
     }
 
     if (data == NULL) {
-        printf("Buffer pointer is NULL, no place to put the data\n");
-        return -1;
+        NETWORK_ERROR("Buffer pointer is NULL, no place to put the data");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
     }
 
     if (buffer_size == 0) {
-        printf("Buffer size is zero, no space for data insertion.\n");
-        return -1;
+        NETWORK_ERROR("Buffer size is zero, no space for data insertion.");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
     }
     int bytes_recv = recv(socketfd, data, buffer_size, 0);
+    network_count_recv(bytes_recv);
     if(bytes_recv < 0) {
+        int err = network_os_error();
 #ifdef WINSOCK_IMPL
-        network_win_errmsg(GetLastError()); // prints the exact error
+        network_win_errmsg(err); // logs the exact error
 
-#elif LINUX_IMPL
-        printf("Connection failed. %s\n", strerror(errno));
+#elif defined(LINUX_SOCKETS_IMPL)
+        NETWORK_IO_ERROR(err, "recv failed. %s", strerror(err));
 #endif
-        return -1;
+        return network_fail(SOCKET_RECV_FAILED, err);
     }
     return bytes_recv;
 
 }
 
-inline socket_t network_send_all(socket_t sockfd, void *data, size_t buffer_size) {
-    printf("don't use it, it's haven't been implemented yet!\n");
-    exit(EXIT_FAILURE);
-    return 1;
-}
-// Concurrency
-inline void network_set_nonblocking(socket_t sock) {
+inline ssize_t network_send_all(socket_t sockfd, const void *data, size_t len) {
+    const char *buffer = data;
+    size_t sent = 0;
+
+    while (sent < len) {
 #ifdef WINSOCK_IMPL
-    printf("Windows doesn't support epoll unfortunately!.\n");
-    return;
-#elif LINUX_IMPL
-    int originslflags = fcntl(sock, F_GETFL, 0);
-    if (fcntl(sock, F_SETFL, originslflags | O_NONBLOCK) < 0) {
-        printf("fcntl F_SETFL O_NONBLOCK failed.\n");
-        exit(EXIT_FAILURE);
+        int chunk = len - sent > INT_MAX ? INT_MAX : (int)(len - sent);
+        int n = send(sockfd, buffer + sent, chunk, 0);
+#else
+        ssize_t n = send(sockfd, buffer + sent, len - sent, MSG_NOSIGNAL);
+#endif
+        network_count_send(n, len - sent);
+        if (n >= 0) {
+            sent += (size_t)n;
+            continue;
+        }
+#ifndef WINSOCK_IMPL
+        if (errno == EINTR) {
+            continue;
+        }
+#endif
+        if (network_send_would_block()) {
+            return (ssize_t)sent; // caller waits for the socket to be writable and sends the rest
+        }
+        int err = network_os_error();
+        NETWORK_IO_ERROR(err, "send failed. %s", strerror(err));
+        return network_fail(SOCKET_SEND_FAILED, err);
     }
+    return (ssize_t)sent;
+}
+
+inline ssize_t network_sendv(socket_t sockfd, const struct iovec *iov, int iovcnt) {
+    size_t sent = 0;
+    size_t offset = 0; // bytes of iov[0] already sent
+
+    while (iovcnt > 0) {
+        // the first buffer may be partly sent, so send from a copy of a window of the array
+        int count = iovcnt < NETWORK_IOV_BATCH ? iovcnt : NETWORK_IOV_BATCH;
+#ifdef WINSOCK_IMPL
+        WSABUF bufs[NETWORK_IOV_BATCH];
+        for (int i = 0; i < count; i++) {
+            bufs[i].buf = (char *)iov[i].iov_base;
+            bufs[i].len = (ULONG)iov[i].iov_len;
+        }
+        bufs[0].buf += offset;
+        bufs[0].len -= (ULONG)offset;
+        DWORD written = 0;
+        ssize_t n = WSASend(sockfd, bufs, (DWORD)count, &written, 0, NULL, NULL) == 0 ? (ssize_t)written : -1;
+#else
+        struct iovec window[NETWORK_IOV_BATCH];
+        memcpy(window, iov, (size_t)count * sizeof(*iov));
+        window[0].iov_base = (char *)window[0].iov_base + offset;
+        window[0].iov_len -= offset;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = window;
+        msg.msg_iovlen = (size_t)count;
+        ssize_t n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+#endif
+        size_t want = 0;
+        for (int i = 0; i < count; i++) {
+            want += iov[i].iov_len;
+        }
+        network_count_send(n, want - offset);
+        if (n < 0) {
+#ifndef WINSOCK_IMPL
+            if (errno == EINTR) {
+                continue;
+            }
 #endif
+            if (network_send_would_block()) {
+                return (ssize_t)sent;
+            }
+            int err = network_os_error();
+            NETWORK_IO_ERROR(err, "sendmsg failed. %s", strerror(err));
+            return network_fail(SOCKET_SEND_FAILED, err);
+        }
+
+        // skip the buffers that went out completely
+        sent += (size_t)n;
+        size_t left = (size_t)n + offset;
+        while (iovcnt > 0 && left >= iov[0].iov_len) {
+            left -= iov[0].iov_len;
+            iov++;
+            iovcnt--;
+        }
+        offset = left;
+    }
+    return (ssize_t)sent;
+}
+inline ssize_t network_send_file(socket_t sockfd, int fd, int64_t offset, size_t len) {
+    size_t sent = 0;
 
+    while (sent < len) {
+#ifdef WINSOCK_IMPL
+        HANDLE file = (HANDLE)_get_osfhandle(fd);
+        LARGE_INTEGER pos;
+        pos.QuadPart = offset + (int64_t)sent;
+        // TransmitFile takes at most 2GB - 1 per call
+        DWORD chunk = len - sent > INT_MAX - 1 ? INT_MAX - 1 : (DWORD)(len - sent);
+        if (file == INVALID_HANDLE_VALUE || !SetFilePointerEx(file, pos, NULL, FILE_BEGIN) ||
+            !TransmitFile(sockfd, file, chunk, 0, NULL, NULL, 0)) {
+            network_count_send(-1, chunk);
+            if (network_send_would_block()) {
+                return (ssize_t)sent;
+            }
+            int err = network_os_error();
+            NETWORK_IO_ERROR(err, "TransmitFile failed. %d", err);
+            return network_fail(SOCKET_SEND_FAILED, err);
+        }
+        network_count_send((ssize_t)chunk, chunk);
+        sent += chunk;
+#else
+        off_t off = (off_t)(offset + (int64_t)sent);
+        ssize_t n = sendfile(sockfd, fd, &off, len - sent);
+        network_count_send(n, len - sent);
+        if (n > 0) {
+            sent += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            // the file is shorter than offset + len
+            if (sent == 0) {
+                NETWORK_ERROR("sendfile found no data at offset %lld.", (long long)offset);
+                return network_fail(SOCKET_SEND_FAILED, EIO);
+            }
+            return (ssize_t)sent;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (network_send_would_block()) {
+            return (ssize_t)sent;
+        }
+        int err = errno;
+        NETWORK_IO_ERROR(err, "sendfile failed. %s", strerror(err));
+        return network_fail(SOCKET_SEND_FAILED, err);
+#endif
+    }
+    return (ssize_t)sent;
+}
 
+inline ssize_t network_send_path(socket_t sockfd, const char *path, int64_t offset, size_t len) {
+#ifdef WINSOCK_IMPL
+    int fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        int err = errno;
+        NETWORK_ERROR("Opening %s failed. %s", path, strerror(err));
+        return network_fail(NETWORK_INVALID_ARGUMENT, err);
+    }
+    if (len == 0) {
+#ifdef WINSOCK_IMPL
+        struct _stat64 st;
+        int failed = _fstat64(fd, &st);
+#else
+        struct stat st;
+        int failed = fstat(fd, &st);
+#endif
+        if (failed == 0 && st.st_size > offset) {
+            len = (size_t)(st.st_size - offset);
+        }
+    }
+    ssize_t sent = len ? network_send_file(sockfd, fd, offset, len) : 0;
+#ifdef WINSOCK_IMPL
+    _close(fd);
+#else
+    close(fd);
+#endif
+    return sent;
 }
 
-inline void network_would_block(socket_t sock) {
+// Concurrency
+inline int network_set_nonblocking(socket_t sock) {
 #ifdef WINSOCK_IMPL
-    printf("Windows doesn't support epoll unfortunately!.\n");
-    return;
-#elif LINUX_IMPL
+    u_long on = 1;
+    if (ioctlsocket(sock, FIONBIO, &on) != 0) {
+        NETWORK_ERROR("ioctlsocket FIONBIO failed. %d", WSAGetLastError());
+        return network_fail(SOCKET_OPTION_FAILED, WSAGetLastError());
+    }
+#elif defined(LINUX_SOCKETS_IMPL)
     int originslflags = fcntl(sock, F_GETFL, 0);
-    if (fcntl(sock, F_SETFL, originslflags & O_NONBLOCK) < 0) {
-        printf("fcntl F_SETFL O_NONBLOCK failed.\n");
-        exit(EXIT_FAILURE);
+    if (originslflags < 0 || fcntl(sock, F_SETFL, originslflags | O_NONBLOCK) < 0) {
+        NETWORK_ERROR("fcntl F_SETFL O_NONBLOCK failed. %s", strerror(errno));
+        return network_fail(SOCKET_OPTION_FAILED, errno);
     }
 #endif
+    return 0;
+}
 
+inline int network_would_block(socket_t sock) {
+#ifdef WINSOCK_IMPL
+    u_long off = 0;
+    if (ioctlsocket(sock, FIONBIO, &off) != 0) {
+        NETWORK_ERROR("ioctlsocket FIONBIO failed. %d", WSAGetLastError());
+        return network_fail(SOCKET_OPTION_FAILED, WSAGetLastError());
+    }
+#elif defined(LINUX_SOCKETS_IMPL)
+    int originslflags = fcntl(sock, F_GETFL, 0);
+    if (originslflags < 0 || fcntl(sock, F_SETFL, originslflags & ~O_NONBLOCK) < 0) {
+        NETWORK_ERROR("fcntl F_SETFL ~O_NONBLOCK failed. %s", strerror(errno));
+        return network_fail(SOCKET_OPTION_FAILED, errno);
+    }
+#endif
+    return 0;
 }
 
 /* Epoll events */
 inline socket_t network_epoll_create(void) {
 #ifdef WINSOCK_IMPL
-    printf("Windows doesn't support epoll unfortunately!.\n");
-    return -1;
-#elif LINUX_IMPL
-    int epollfd = epoll_create(1);
+    NETWORK_ERROR("Windows doesn't support epoll unfortunately!.");
+    return network_fail(NETWORK_NOT_SUPPORTED, 0);
+#elif defined(LINUX_SOCKETS_IMPL)
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
     if (epollfd < 0) {
-        printf("epoll_create failed.\n");
-        exit(EXIT_FAILURE);
+        NETWORK_ERROR("epoll_create failed. %s", strerror(errno));
+        return network_fail(NETWORK_EPOLL_FAILED, errno);
     }
     return epollfd;
 #endif
 
 }
 
-inline void network_epoll_ctl(struct client_event_data *cdata) {
+inline int network_epoll_ctl(struct client_event_data *cdata) {
 #ifdef WINSOCK_IMPL
-    printf("Windows doesn't support epoll unfortunately!.\n");
-    return;
-#elif LINUX_IMPL
+    NETWORK_ERROR("Windows doesn't support epoll unfortunately!.");
+    return network_fail(NETWORK_NOT_SUPPORTED, 0);
+#elif defined(LINUX_SOCKETS_IMPL)
     struct epoll_event ev;
 
     int epollfd = cdata->efd;
@@ -467,50 +1385,52 @@ inline void network_epoll_ctl(struct client_event_data *cdata) {
     int fd = cdata->clientfd;
 
     ev.events = cdata->event;
-    ev.data.fd = cdata->clientfd;
-
-    if (cdata->op == EPOLL_CTL_DEL) {
-        epoll_ctl(epollfd, op, fd, NULL);
-        printf("DELETED EVENT\n");
-        return;
+    if (cdata->user) {
+        ev.data.ptr = cdata->user;
+    } else {
+        ev.data.fd = cdata->clientfd;
     }
 
-    if (epoll_ctl(epollfd, op, fd, &ev) < 0) {
-        printf("epoll_ctl failed.\n");
-        exit(EXIT_FAILURE);
+    if (epoll_ctl(epollfd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev) < 0) {
+        NETWORK_ERROR("epoll_ctl failed. %s", strerror(errno));
+        return network_fail(NETWORK_EPOLL_FAILED, errno);
     }
-    printf("ADDED EVENT\n");
-    return;
+    NETWORK_DEBUG(op == EPOLL_CTL_DEL ? "DELETED EVENT" : "ADDED EVENT");
+    return 0;
 #endif
 }
 
 inline int network_epoll_wait(socket_t epollfd, struct epoll_event *events, int maxevents, int timeout) {
 
 #ifdef WINSOCK_IMPL
-    printf("Windows doesn't support epoll unfortunately!.\n");
-    return -1;
-#elif LINUX_IMPL
+    NETWORK_ERROR("Windows doesn't support epoll unfortunately!.");
+    return network_fail(NETWORK_NOT_SUPPORTED, 0);
+#elif defined(LINUX_SOCKETS_IMPL)
     int nfds = epoll_wait(epollfd, events, maxevents, timeout);
     if (nfds < 0) {
-        printf("epoll_wait failed.%s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        if (errno == EINTR) {
+            return 0; // a signal, nothing is ready
+        }
+        NETWORK_ERROR("epoll_wait failed. %s", strerror(errno));
+        return network_fail(NETWORK_EPOLL_FAILED, errno);
     }
     return nfds;
 #endif
 }
 
-void network_epoll_close(socket_t epollfd) {
+inline void network_epoll_close(socket_t epollfd) {
 #ifdef WINSOCK_IMPL
-    closesocket(socket);
-#elif LINUX_IMPL
-    close(socket);
+    NETWORK_ERROR("Windows doesn't support epoll unfortunately!.");
+#elif defined(LINUX_SOCKETS_IMPL)
+    close(epollfd);
 #endif
 }
 
 inline void network_close(socket_t socket) {
+    network_stats_add(NETWORK_STAT_CLOSES, 1);
 #ifdef WINSOCK_IMPL
     closesocket(socket);
-#elif LINUX_IMPL
+#elif defined(LINUX_SOCKETS_IMPL)
     close(socket);
 #endif
 }
@@ -0,0 +1,413 @@
+/**
+ * @file network_buffer.h
+ * @brief Receive buffers shared through a pool, and a chain buffer per connection
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * A connection doesn't own a buffer, it owns a network_buffer_t: a chain of fixed-size blocks
+ * taken from a network_buffer_pool_t when bytes arrive and given back as soon as they're consumed.
+ * An idle connection holds no memory at all. network_buffer_recv() reads straight into the free
+ * space at the end of the chain and network_buffer_consume() only moves an offset, bytes are never
+ * moved to the front.
+ *
+ * A pool isn't locked, keep one per thread or per event loop.
+ *
+ * Available APIs:
+ *   • network_buffer_pool_create()  - Pool of block_size byte blocks, keeps at most max_free unused ones
+ *   • network_buffer_init()         - Empty chain on a pool, network_buffer_free() gives every block back
+ *   • network_buffer_recv()         - One readv into the free space of the chain, plus a new block if needed
+ *   • network_buffer_peek()         - The first contiguous bytes, as a data struct
+ *   • network_buffer_pullup()       - Makes the first n bytes contiguous, for a header that straddles two blocks
+ *   • network_buffer_consume()      - Drops n bytes from the front
+ *   • network_buffer_append()       - Copies bytes in, e.g. to collect output
+ *   • network_buffer_truncate()     - Drops bytes from the end
+ *   • network_buffer_send()         - Sends the chain with one sendmsg and drops what went out
+ *
+ * @example
+ * network_buffer_t in;
+ * network_buffer_init(&in, pool);
+ * while (network_buffer_recv(fd, &in) > 0) {
+ *     data chunk = network_buffer_peek(&in);
+ *     size_t used = parse(chunk.buffer, chunk.size);
+ *     network_buffer_consume(&in, used);
+ * }
+ */
+
+#ifndef NETWORK_BUFFER_H
+#define NETWORK_BUFFER_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_BUFFER_BLOCK_SIZE (16 * 1024) // block size when network_buffer_pool_create gets 0
+#define NETWORK_BUFFER_MAX_FREE 1024          // unused blocks a pool keeps when it gets 0
+#define NETWORK_BUFFER_IOV 16                 // blocks network_buffer_send hands to one sendmsg
+
+typedef struct network_buffer_block {
+    struct network_buffer_block *next;
+    size_t start, end;           // bytes in use are data[start, end)
+    char data[];
+} network_buffer_block;
+
+typedef struct network_buffer_pool {
+    size_t block_size;           // bytes of data per block
+    size_t max_free;
+    network_buffer_block *free;  // blocks given back, handed out again first
+    size_t free_count;
+    size_t allocated;            // blocks from malloc that aren't freed yet, in chains or on the free list
+    size_t peak;                 // most blocks allocated at once
+} network_buffer_pool_t;
+
+typedef struct network_buffer {
+    network_buffer_pool_t *pool;
+    network_buffer_block *head;  // bytes are consumed from here
+    network_buffer_block *tail;  // and added here
+    size_t len;                  // bytes in the chain
+} network_buffer_t;
+
+// NULL when out of memory; block_size/max_free 0 for the defaults
+network_buffer_pool_t *network_buffer_pool_create(size_t block_size, size_t max_free);
+// frees the unused blocks and the pool, free every chain on it first
+void network_buffer_pool_destroy(network_buffer_pool_t *pool);
+
+void network_buffer_init(network_buffer_t *buf, network_buffer_pool_t *pool);
+// gives every block back to the pool, the chain is empty and can be used again
+void network_buffer_free(network_buffer_t *buf);
+size_t network_buffer_len(const network_buffer_t *buf);
+/**
+ * Reads whatever the socket has, up to the free space of the last block plus one new block.
+ *
+ * @return bytes read, 0 when the peer closed, -1 on errors. A non-blocking socket with nothing to
+ * read returns -1 with errno EAGAIN/EWOULDBLOCK and logs nothing; the block taken for it goes back.
+ */
+ssize_t network_buffer_recv(socket_t sockfd, network_buffer_t *buf);
+// first contiguous bytes of the chain, size 0 when it's empty; valid until the chain changes
+data network_buffer_peek(const network_buffer_t *buf);
+// the first n bytes in one piece, copying only when they straddle blocks; NULL when fewer
+// than n bytes are buffered or n is more than a block holds
+const char *network_buffer_pullup(network_buffer_t *buf, size_t n);
+// drops n bytes from the front, emptied blocks go back to the pool
+void network_buffer_consume(network_buffer_t *buf, size_t n);
+// copies len bytes to the end of the chain, returns 0 or -1 when out of memory
+int network_buffer_append(network_buffer_t *buf, const void *bytes, size_t len);
+// keeps the first len bytes, blocks after them go back to the pool
+void network_buffer_truncate(network_buffer_t *buf, size_t len);
+// fills iov with up to max pieces of the chain, in order, returns how many
+int network_buffer_iov(const network_buffer_t *buf, struct iovec *iov, int max);
+// sends as much of the chain as the socket takes and consumes it, see network_sendv for the return value
+ssize_t network_buffer_send(socket_t sockfd, network_buffer_t *buf);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+inline network_buffer_pool_t *network_buffer_pool_create(size_t block_size, size_t max_free) {
+    network_buffer_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        NETWORK_ERROR("Buffer pool allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    pool->block_size = block_size ? block_size : NETWORK_BUFFER_BLOCK_SIZE;
+    pool->max_free = max_free ? max_free : NETWORK_BUFFER_MAX_FREE;
+    return pool;
+}
+
+inline void network_buffer_pool_destroy(network_buffer_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    while (pool->free) {
+        network_buffer_block *block = pool->free;
+        pool->free = block->next;
+        free(block);
+    }
+    free(pool);
+}
+
+static inline network_buffer_block *network_buffer_block_get(network_buffer_pool_t *pool) {
+    network_buffer_block *block = pool->free;
+    if (block) {
+        pool->free = block->next;
+        pool->free_count--;
+    } else {
+        block = malloc(sizeof(*block) + pool->block_size);
+        if (block == NULL) {
+            NETWORK_ERROR("Buffer block allocation failed.");
+            network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+            return NULL;
+        }
+        if (++pool->allocated > pool->peak) {
+            pool->peak = pool->allocated;
+        }
+    }
+    block->next = NULL;
+    block->start = block->end = 0;
+    return block;
+}
+
+static inline void network_buffer_block_put(network_buffer_pool_t *pool, network_buffer_block *block) {
+    if (pool->free_count >= pool->max_free) {
+        free(block);
+        pool->allocated--;
+        return;
+    }
+    block->next = pool->free;
+    pool->free = block;
+    pool->free_count++;
+}
+
+static inline void network_buffer_link(network_buffer_t *buf, network_buffer_block *block) {
+    if (buf->tail) {
+        buf->tail->next = block;
+    } else {
+        buf->head = block;
+    }
+    buf->tail = block;
+}
+
+inline void network_buffer_init(network_buffer_t *buf, network_buffer_pool_t *pool) {
+    buf->pool = pool;
+    buf->head = buf->tail = NULL;
+    buf->len = 0;
+}
+
+inline void network_buffer_free(network_buffer_t *buf) {
+    while (buf->head) {
+        network_buffer_block *block = buf->head;
+        buf->head = block->next;
+        network_buffer_block_put(buf->pool, block);
+    }
+    buf->tail = NULL;
+    buf->len = 0;
+}
+
+inline size_t network_buffer_len(const network_buffer_t *buf) {
+    return buf->len;
+}
+
+inline ssize_t network_buffer_recv(socket_t sockfd, network_buffer_t *buf) {
+    network_buffer_pool_t *pool = buf->pool;
+    network_buffer_block *tail = buf->tail;
+    size_t room = tail ? pool->block_size - tail->end : 0;
+    // a new block is only linked in when the read got that far
+    network_buffer_block *extra = network_buffer_block_get(pool);
+    if (extra == NULL && room == 0) {
+        return -1;
+    }
+
+#ifdef WINSOCK_IMPL
+    WSABUF bufs[2];
+    DWORD count = 0, got = 0, flags = 0;
+    if (room) {
+        bufs[count].buf = tail->data + tail->end;
+        bufs[count++].len = (ULONG)room;
+    }
+    if (extra) {
+        bufs[count].buf = extra->data;
+        bufs[count++].len = (ULONG)pool->block_size;
+    }
+    ssize_t n = WSARecv(sockfd, bufs, count, &got, &flags, NULL, NULL) == 0 ? (ssize_t)got : -1;
+#else
+    struct iovec iov[2];
+    int count = 0;
+    if (room) {
+        iov[count].iov_base = tail->data + tail->end;
+        iov[count++].iov_len = room;
+    }
+    if (extra) {
+        iov[count].iov_base = extra->data;
+        iov[count++].iov_len = pool->block_size;
+    }
+    ssize_t n;
+    do {
+        n = readv(sockfd, iov, count);
+    } while (n < 0 && errno == EINTR);
+#endif
+    network_count_recv(n);
+
+    if (n <= 0) {
+        if (extra) {
+            network_buffer_block_put(pool, extra);
+        }
+        if (n < 0 && !network_send_would_block()) {
+            int err = network_os_error();
+            NETWORK_IO_ERROR(err, "recv failed. %s", strerror(err));
+            return network_fail(SOCKET_RECV_FAILED, err);
+        }
+        return n;
+    }
+
+    size_t left = (size_t)n;
+    if (room) {
+        size_t used = left < room ? left : room;
+        tail->end += used;
+        left -= used;
+    }
+    if (extra && left) {
+        extra->end = left;
+        network_buffer_link(buf, extra);
+    } else if (extra) {
+        network_buffer_block_put(pool, extra);
+    }
+    buf->len += (size_t)n;
+    return n;
+}
+
+inline data network_buffer_peek(const network_buffer_t *buf) {
+    data chunk = { NULL, 0 };
+    if (buf->head) {
+        chunk.buffer = buf->head->data + buf->head->start;
+        chunk.size = buf->head->end - buf->head->start;
+    }
+    return chunk;
+}
+
+inline void network_buffer_consume(network_buffer_t *buf, size_t n) {
+    if (n > buf->len) {
+        n = buf->len;
+    }
+    buf->len -= n;
+    while (buf->head) {
+        network_buffer_block *block = buf->head;
+        size_t avail = block->end - block->start;
+        if (n < avail) {
+            block->start += n;
+            return;
+        }
+        n -= avail;
+        // emptied, even the last block goes back so an idle connection holds nothing
+        buf->head = block->next;
+        if (buf->head == NULL) {
+            buf->tail = NULL;
+        }
+        network_buffer_block_put(buf->pool, block);
+        if (n == 0 && buf->head && buf->head->start != buf->head->end) {
+            return;
+        }
+    }
+}
+
+inline const char *network_buffer_pullup(network_buffer_t *buf, size_t n) {
+    if (n > buf->len || n > buf->pool->block_size) {
+        return NULL;
+    }
+    network_buffer_block *head = buf->head;
+    if (n == 0 || head->end - head->start >= n) {
+        return head ? head->data + head->start : NULL;
+    }
+    // make room at the end of the first block, then pull the rest in from the ones after it
+    if (buf->pool->block_size - head->start < n) {
+        memmove(head->data, head->data + head->start, head->end - head->start);
+        head->end -= head->start;
+        head->start = 0;
+    }
+    while (head->end - head->start < n) {
+        network_buffer_block *next = head->next;
+        size_t want = n - (head->end - head->start);
+        size_t avail = next->end - next->start;
+        size_t take = want < avail ? want : avail;
+        memcpy(head->data + head->end, next->data + next->start, take);
+        head->end += take;
+        next->start += take;
+        if (next->start == next->end) {
+            head->next = next->next;
+            if (buf->tail == next) {
+                buf->tail = head;
+            }
+            network_buffer_block_put(buf->pool, next);
+        }
+    }
+    return head->data + head->start;
+}
+
+inline int network_buffer_append(network_buffer_t *buf, const void *bytes, size_t len) {
+    const char *src = bytes;
+    while (len > 0) {
+        network_buffer_block *tail = buf->tail;
+        if (tail == NULL || tail->end == buf->pool->block_size) {
+            tail = network_buffer_block_get(buf->pool);
+            if (tail == NULL) {
+                return -1;
+            }
+            network_buffer_link(buf, tail);
+        }
+        size_t room = buf->pool->block_size - tail->end;
+        size_t take = len < room ? len : room;
+        memcpy(tail->data + tail->end, src, take);
+        tail->end += take;
+        buf->len += take;
+        src += take;
+        len -= take;
+    }
+    return 0;
+}
+
+inline void network_buffer_truncate(network_buffer_t *buf, size_t len) {
+    if (len >= buf->len) {
+        return;
+    }
+    if (len == 0) {
+        network_buffer_free(buf);
+        return;
+    }
+    buf->len = len;
+    network_buffer_block *block = buf->head;
+    while (len > block->end - block->start) {
+        len -= block->end - block->start;
+        block = block->next;
+    }
+    block->end = block->start + len;
+    network_buffer_block *rest = block->next;
+    block->next = NULL;
+    buf->tail = block;
+    while (rest) {
+        network_buffer_block *next = rest->next;
+        network_buffer_block_put(buf->pool, rest);
+        rest = next;
+    }
+}
+
+inline int network_buffer_iov(const network_buffer_t *buf, struct iovec *iov, int max) {
+    int count = 0;
+    for (network_buffer_block *block = buf->head; block && count < max; block = block->next) {
+        if (block->end > block->start) {
+            iov[count].iov_base = block->data + block->start;
+            iov[count].iov_len = block->end - block->start;
+            count++;
+        }
+    }
+    return count;
+}
+
+inline ssize_t network_buffer_send(socket_t sockfd, network_buffer_t *buf) {
+    size_t total = 0;
+    while (buf->len > 0) {
+        struct iovec iov[NETWORK_BUFFER_IOV];
+        int count = network_buffer_iov(buf, iov, NETWORK_BUFFER_IOV);
+        size_t want = 0;
+        for (int i = 0; i < count; i++) {
+            want += iov[i].iov_len;
+        }
+        ssize_t sent = network_sendv(sockfd, iov, count);
+        if (sent < 0) {
+            return total ? (ssize_t)total : -1;
+        }
+        network_buffer_consume(buf, (size_t)sent);
+        total += (size_t)sent;
+        if ((size_t)sent < want) {
+            break; // the socket is full
+        }
+    }
+    return (ssize_t)total;
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_BUFFER_H
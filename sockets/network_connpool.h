@@ -0,0 +1,312 @@
+/**
+ * @file network_connpool.h
+ * @brief Reuses client connections, keyed by host and port
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * network_connpool_get() hands out an idle connection to host:port when there is one, and
+ * connects with network_connect_addr() when there isn't. Every host:port keeps the addresses
+ * getaddrinfo returned for addr_ttl_ms, so a miss doesn't resolve again either. Give a
+ * connection back with network_connpool_put() once the response is read; one that broke or
+ * is in the middle of a response is closed with network_close() instead.
+ *
+ * Connections get the options of network_set_sockopts(), keepalive probes included by
+ * default, so a dead peer of an idle connection is noticed. Before one is handed out again
+ * it's checked with a non-blocking peek: one the server closed (or that has unread bytes)
+ * is dropped and the next one is tried. A server can still close a connection right after
+ * the check, so requests that are safe to repeat should be retried once on a fresh connection.
+ *
+ * A pool isn't locked, keep one per thread.
+ *
+ * Available APIs:
+ *   • network_connpool_create()     - Pool with at most max_idle idle connections per host:port
+ *   • network_connpool_get()        - An idle connection or a new one, -1 when connecting failed
+ *   • network_connpool_put()        - Gives a connection back for reuse
+ *   • network_connpool_get_stats()  - Hits, misses, dropped connections; network_connpool_hit_rate()
+ *   • network_connpool_destroy()    - Closes the idle connections and frees the pool
+ *
+ * @example
+ * socket_t fd = network_connpool_get(pool, "10.0.0.7", "9000");
+ * if (fd != (socket_t)-1 && network_send_all(fd, req, len) == (ssize_t)len && read_response(fd) == 0) {
+ *     network_connpool_put(pool, "10.0.0.7", "9000", fd);
+ * } else if (fd != (socket_t)-1) {
+ *     network_close(fd);
+ * }
+ */
+
+#ifndef NETWORK_CONNPOOL_H
+#define NETWORK_CONNPOOL_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_CONNPOOL_MAX_IDLE 8          // idle connections kept per host:port when create gets 0
+#define NETWORK_CONNPOOL_IDLE_MS 60000       // idle connections older than this are closed instead of reused
+#define NETWORK_CONNPOOL_CONNECT_MS 3000     // connect timeout, all addresses together; resolving isn't counted
+#define NETWORK_CONNPOOL_ADDR_TTL_MS 30000   // how long resolved addresses are used before resolving again
+#define NETWORK_CONNPOOL_ADDRS 8             // addresses kept per host:port
+#define NETWORK_CONNPOOL_BUCKETS 64
+
+typedef struct network_connpool_stats {
+    uint64_t hits;     // network_connpool_get calls that got an idle connection
+    uint64_t misses;   // and the ones that had to connect
+    uint64_t failed;   // misses where no address took the connection
+    uint64_t resolves; // getaddrinfo calls, the other misses used cached addresses
+    uint64_t dropped;  // idle connections closed because they expired, the server closed them, or the pool was full
+    size_t idle;       // connections waiting to be reused right now
+} network_connpool_stats;
+
+struct network_connpool_idle {
+    socket_t fd;
+    int64_t since; // network_now_ms() when it was put back
+};
+
+struct network_connpool_host {
+    struct network_connpool_host *next;
+    char *host, *port;                   // host NULL is this machine, like getaddrinfo
+    struct sockaddr_storage addrs[NETWORK_CONNPOOL_ADDRS];
+    socklen_t addrlens[NETWORK_CONNPOOL_ADDRS];
+    int naddrs;                          // 0 until resolved, and again once a connect failed on all of them
+    int preferred;                       // address the last connect went through, tried first
+    int64_t resolved_at;
+    int nidle;                           // idle[0] was put back longest ago
+    struct network_connpool_idle idle[]; // max_idle of them
+};
+
+typedef struct network_connpool {
+    int max_idle;
+    int idle_timeout_ms;
+    int connect_timeout_ms;
+    int addr_ttl_ms;
+    struct network_connpool_host *buckets[NETWORK_CONNPOOL_BUCKETS];
+    network_connpool_stats stats;
+} network_connpool_t;
+
+// 0 for any of them picks the default, NULL when out of memory
+network_connpool_t *network_connpool_create(int max_idle, int idle_timeout_ms, int connect_timeout_ms);
+void network_connpool_destroy(network_connpool_t *pool);
+// a connected blocking socket to host:port, reused when possible; -1 when connecting failed
+socket_t network_connpool_get(network_connpool_t *pool, const char *host, const char *port);
+// gives fd back to the host:port it came from, it's closed when that one has max_idle already
+void network_connpool_put(network_connpool_t *pool, const char *host, const char *port, socket_t fd);
+void network_connpool_get_stats(const network_connpool_t *pool, network_connpool_stats *stats);
+// hits over all get calls, 0 before the first one
+double network_connpool_hit_rate(const network_connpool_stats *stats);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+inline network_connpool_t *network_connpool_create(int max_idle, int idle_timeout_ms, int connect_timeout_ms) {
+    network_connpool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        NETWORK_ERROR("Connection pool allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    pool->max_idle = max_idle > 0 ? max_idle : NETWORK_CONNPOOL_MAX_IDLE;
+    pool->idle_timeout_ms = idle_timeout_ms > 0 ? idle_timeout_ms : NETWORK_CONNPOOL_IDLE_MS;
+    pool->connect_timeout_ms = connect_timeout_ms > 0 ? connect_timeout_ms : NETWORK_CONNPOOL_CONNECT_MS;
+    pool->addr_ttl_ms = NETWORK_CONNPOOL_ADDR_TTL_MS;
+    return pool;
+}
+
+inline void network_connpool_destroy(network_connpool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    for (int i = 0; i < NETWORK_CONNPOOL_BUCKETS; i++) {
+        struct network_connpool_host *h = pool->buckets[i];
+        while (h) {
+            struct network_connpool_host *next = h->next;
+            for (int j = 0; j < h->nidle; j++) {
+                network_close(h->idle[j].fd);
+            }
+            free(h->host);
+            free(h->port);
+            free(h);
+            h = next;
+        }
+    }
+    free(pool);
+}
+
+static inline int network_connpool_same(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static inline char *network_connpool_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = malloc(len);
+    if (copy) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+// the entry of host:port, made when create is set; NULL when there is none or out of memory
+static inline struct network_connpool_host *network_connpool_find(network_connpool_t *pool, const char *host,
+                                                                  const char *port, int create) {
+    uint32_t hash = 2166136261u; // FNV-1a over host, a separator and port
+    for (const char *p = host ? host : ""; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    hash = (hash ^ ':') * 16777619u;
+    for (const char *p = port; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    struct network_connpool_host **bucket = &pool->buckets[hash % NETWORK_CONNPOOL_BUCKETS];
+    for (struct network_connpool_host *h = *bucket; h; h = h->next) {
+        if (network_connpool_same(h->host, host) && strcmp(h->port, port) == 0) {
+            return h;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    struct network_connpool_host *h = calloc(1, sizeof(*h) + (size_t)pool->max_idle * sizeof(h->idle[0]));
+    if (h) {
+        h->host = host ? network_connpool_strdup(host) : NULL;
+        h->port = network_connpool_strdup(port);
+    }
+    if (h == NULL || (host && h->host == NULL) || h->port == NULL) {
+        if (h) {
+            free(h->host);
+            free(h);
+        }
+        NETWORK_ERROR("Connection pool allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    h->next = *bucket;
+    *bucket = h;
+    return h;
+}
+
+static inline int network_connpool_resolve(network_connpool_t *pool, struct network_connpool_host *h) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    pool->stats.resolves++;
+    int err = getaddrinfo(h->host, h->port, &hints, &res);
+    if (err != 0) {
+        NETWORK_ERROR("getaddrinfo failed for %s:%s. %s", h->host ? h->host : "localhost", h->port, gai_strerror(err));
+        return network_fail(NETWORK_ADDRESS_FAILED, err);
+    }
+    h->naddrs = 0;
+    h->preferred = 0;
+    for (struct addrinfo *ai = res; ai && h->naddrs < NETWORK_CONNPOOL_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen <= sizeof(h->addrs[0])) {
+            memcpy(&h->addrs[h->naddrs], ai->ai_addr, ai->ai_addrlen);
+            h->addrlens[h->naddrs++] = (socklen_t)ai->ai_addrlen;
+        }
+    }
+    freeaddrinfo(res);
+    h->resolved_at = network_now_ms();
+    return 0;
+}
+
+// true while the server hasn't closed fd and there are no stray bytes waiting on it
+static inline int network_connpool_alive(socket_t fd) {
+#ifdef WINSOCK_IMPL
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(fd, &readable);
+    struct timeval tv = { 0, 0 };
+    return select(0, &readable, NULL, NULL, &tv) == 0;
+#else
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+}
+
+inline socket_t network_connpool_get(network_connpool_t *pool, const char *host, const char *port) {
+    struct network_connpool_host *h = network_connpool_find(pool, host, port, 1);
+    if (h == NULL) {
+        return -1;
+    }
+
+    int64_t now = network_now_ms();
+    while (h->nidle > 0) {
+        // the one put back last is the least likely to have been closed by the server
+        struct network_connpool_idle idle = h->idle[--h->nidle];
+        pool->stats.idle--;
+        if (now - idle.since < pool->idle_timeout_ms && network_connpool_alive(idle.fd)) {
+            pool->stats.hits++;
+            return idle.fd;
+        }
+        network_close(idle.fd);
+        pool->stats.dropped++;
+    }
+
+    pool->stats.misses++;
+    if ((h->naddrs == 0 || now - h->resolved_at >= pool->addr_ttl_ms) && network_connpool_resolve(pool, h) < 0) {
+        pool->stats.failed++;
+        return -1;
+    }
+
+    // from here, a slow getaddrinfo above doesn't use up the connect's time
+    int64_t deadline = network_now_ms() + pool->connect_timeout_ms;
+    for (int i = 0; i < h->naddrs; i++) {
+        int64_t left = deadline - network_now_ms();
+        if (left <= 0) {
+            break;
+        }
+        int at = (h->preferred + i) % h->naddrs;
+        socket_t fd = network_connect_addr((struct sockaddr *)&h->addrs[at], h->addrlens[at], (int)left, 0);
+        if (fd != (socket_t)-1) {
+            h->preferred = at;
+            return fd;
+        }
+    }
+    // resolve again next time, the addresses may have moved
+    h->naddrs = 0;
+    pool->stats.failed++;
+    return -1;
+}
+
+inline void network_connpool_put(network_connpool_t *pool, const char *host, const char *port, socket_t fd) {
+    if (fd == (socket_t)-1) {
+        return;
+    }
+    struct network_connpool_host *h = network_connpool_find(pool, host, port, 1);
+    if (h == NULL) {
+        network_close(fd);
+        return;
+    }
+    if (h->nidle == pool->max_idle) {
+        // full, the one idle the longest goes
+        network_close(h->idle[0].fd);
+        memmove(&h->idle[0], &h->idle[1], (size_t)(h->nidle - 1) * sizeof(h->idle[0]));
+        h->nidle--;
+        pool->stats.idle--;
+        pool->stats.dropped++;
+    }
+    h->idle[h->nidle].fd = fd;
+    h->idle[h->nidle].since = network_now_ms();
+    h->nidle++;
+    pool->stats.idle++;
+}
+
+inline void network_connpool_get_stats(const network_connpool_t *pool, network_connpool_stats *stats) {
+    *stats = pool->stats;
+}
+
+inline double network_connpool_hit_rate(const network_connpool_stats *stats) {
+    uint64_t calls = stats->hits + stats->misses;
+    return calls ? (double)stats->hits / (double)calls : 0.0;
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_CONNPOOL_H
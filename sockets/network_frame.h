@@ -0,0 +1,257 @@
+/**
+ * @file network_frame.h
+ * @brief Length-prefixed messages on a TCP stream
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * TCP doesn't keep message boundaries, one recv can hold half a message or several. Every frame
+ * here starts with its payload length, either 4 bytes big-endian or a varint (7 bits per byte,
+ * low bits first, the high bit set on all but the last byte, like protobuf).
+ *
+ * Frames are parsed out of a network_buffer_t and handed out as views into its blocks, a frame is
+ * only copied when it straddles two blocks (into the first one) or doesn't fit in a block at all
+ * (into a scratch buffer of the framer). Outgoing frames are collected in a second chain and
+ * network_frame_flush() sends all of them with one sendmsg.
+ *
+ * Available APIs:
+ *   • network_framer_init()    - Framer on a buffer pool, network_framer_free() gives everything back
+ *   • network_frame_recv()     - One read from the socket into the framer
+ *   • network_frame_next()     - The next complete frame, as many as one read brought in
+ *   • network_frame_write()    - Queues a frame
+ *   • network_frame_flush()    - Sends the queued frames, what the socket doesn't take stays queued
+ *
+ * @example
+ * while (network_frame_recv(fd, &framer) > 0) {
+ *     data frame;
+ *     while (network_frame_next(&framer, &frame) == 1) {
+ *         network_frame_write(&framer, frame.buffer, frame.size); // echo
+ *     }
+ *     network_frame_flush(fd, &framer);
+ * }
+ */
+
+#ifndef NETWORK_FRAME_H
+#define NETWORK_FRAME_H
+
+#include <stdint.h>
+#include "network_buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_FRAME_MAX (16 * 1024 * 1024) // largest payload by default, a bigger length is a bad frame
+#define NETWORK_FRAME_VARINT_MAX 10          // bytes of a varint prefix of a 64 bit length
+
+typedef enum {
+    NETWORK_FRAME_U32,    // 4 bytes, big-endian
+    NETWORK_FRAME_VARINT, // 1 byte up to 127 bytes of payload, 2 up to 16383, ...
+} network_frame_prefix;
+
+typedef struct network_framer {
+    network_buffer_t in;
+    network_buffer_t out;
+    network_frame_prefix prefix;
+    size_t max_frame;
+    size_t handed;        // bytes of in behind the frame network_frame_next handed out last
+    char *scratch;        // frames that don't fit in a block are put together here
+    size_t scratch_size;
+} network_framer_t;
+
+// max_frame 0 for NETWORK_FRAME_MAX
+void network_framer_init(network_framer_t *framer, network_buffer_pool_t *pool, network_frame_prefix prefix, size_t max_frame);
+void network_framer_free(network_framer_t *framer);
+// network_buffer_recv into the framer, same return values
+ssize_t network_frame_recv(socket_t sockfd, network_framer_t *framer);
+/**
+ * Takes the next complete frame out of the received bytes.
+ *
+ * @param frame set to the payload, valid until the next network_frame_next/recv or network_framer_free
+ * @return 1 with a frame, 0 when the next one isn't complete yet, -1 on a bad prefix or one over max_frame
+ * (NETWORK_FRAME_INVALID), after which the stream can't be parsed any more and should be closed
+ */
+int network_frame_next(network_framer_t *framer, data *frame);
+// queues the prefix and a copy of the payload, returns 0 or -1 when out of memory
+int network_frame_write(network_framer_t *framer, const void *payload, size_t len);
+// bytes queued by network_frame_write and not sent yet
+size_t network_frame_pending(const network_framer_t *framer);
+// sends the queued frames, see network_buffer_send for the return value
+ssize_t network_frame_flush(socket_t sockfd, network_framer_t *framer);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+inline void network_framer_init(network_framer_t *framer, network_buffer_pool_t *pool, network_frame_prefix prefix, size_t max_frame) {
+    memset(framer, 0, sizeof(*framer));
+    network_buffer_init(&framer->in, pool);
+    network_buffer_init(&framer->out, pool);
+    framer->prefix = prefix;
+    framer->max_frame = max_frame ? max_frame : NETWORK_FRAME_MAX;
+}
+
+inline void network_framer_free(network_framer_t *framer) {
+    network_buffer_free(&framer->in);
+    network_buffer_free(&framer->out);
+    free(framer->scratch);
+    framer->scratch = NULL;
+    framer->scratch_size = 0;
+    framer->handed = 0;
+}
+
+static inline void network_frame_release(network_framer_t *framer) {
+    if (framer->handed) {
+        network_buffer_consume(&framer->in, framer->handed);
+        framer->handed = 0;
+    }
+}
+
+inline ssize_t network_frame_recv(socket_t sockfd, network_framer_t *framer) {
+    network_frame_release(framer);
+    return network_buffer_recv(sockfd, &framer->in);
+}
+
+// copies up to n bytes from the front of the chain, without consuming them; returns how many
+static inline size_t network_frame_copy(const network_buffer_t *buf, void *dst, size_t n) {
+    size_t copied = 0;
+    for (network_buffer_block *block = buf->head; block && copied < n; block = block->next) {
+        size_t avail = block->end - block->start;
+        size_t take = n - copied < avail ? n - copied : avail;
+        memcpy((char *)dst + copied, block->data + block->start, take);
+        copied += take;
+    }
+    return copied;
+}
+
+// reads the prefix: 1 with the payload length and prefix size, 0 when it isn't all there, -1 when it's bad
+static inline int network_frame_header(const network_framer_t *framer, uint64_t *len, size_t *header) {
+    unsigned char bytes[NETWORK_FRAME_VARINT_MAX];
+    data chunk = network_buffer_peek(&framer->in);
+    const unsigned char *p = (const unsigned char *)chunk.buffer;
+    size_t have = chunk.size;
+    size_t want = framer->prefix == NETWORK_FRAME_U32 ? 4 : NETWORK_FRAME_VARINT_MAX;
+    if (have < want && have < framer->in.len) {
+        have = network_frame_copy(&framer->in, bytes, want);
+        p = bytes;
+    }
+
+    if (framer->prefix == NETWORK_FRAME_U32) {
+        if (have < 4) {
+            return 0;
+        }
+        *len = (uint64_t)p[0] << 24 | (uint64_t)p[1] << 16 | (uint64_t)p[2] << 8 | (uint64_t)p[3];
+        *header = 4;
+        return 1;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < have && i < NETWORK_FRAME_VARINT_MAX; i++) {
+        // the 10th byte only has room for the top bit of a 64 bit value
+        if (i == NETWORK_FRAME_VARINT_MAX - 1 && p[i] > 1) {
+            return -1;
+        }
+        value |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *len = value;
+            *header = i + 1;
+            return 1;
+        }
+    }
+    return have < NETWORK_FRAME_VARINT_MAX ? 0 : -1;
+}
+
+inline int network_frame_next(network_framer_t *framer, data *frame) {
+    network_frame_release(framer);
+
+    uint64_t len = 0;
+    size_t header = 0;
+    int got = network_frame_header(framer, &len, &header);
+    if (got <= 0) {
+        if (got < 0) {
+            NETWORK_ERROR("Bad frame length prefix.");
+            return network_fail(NETWORK_FRAME_INVALID, 0);
+        }
+        return 0;
+    }
+    if (len > framer->max_frame) {
+        NETWORK_ERROR("Frame of %llu bytes is over the limit of %zu.", (unsigned long long)len, framer->max_frame);
+        return network_fail(NETWORK_FRAME_INVALID, 0);
+    }
+    size_t total = header + (size_t)len;
+    if (framer->in.len < total) {
+        return 0;
+    }
+
+    data chunk = network_buffer_peek(&framer->in);
+    if (chunk.size >= total) {
+        frame->buffer = chunk.buffer + header;
+    } else if (total <= framer->in.pool->block_size) {
+        frame->buffer = (char *)network_buffer_pullup(&framer->in, total) + header;
+    } else {
+        if (framer->scratch_size < len) {
+            char *grown = realloc(framer->scratch, len);
+            if (grown == NULL) {
+                NETWORK_ERROR("Frame buffer allocation failed.");
+                return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+            }
+            framer->scratch = grown;
+            framer->scratch_size = len;
+        }
+        network_buffer_consume(&framer->in, header);
+        network_frame_copy(&framer->in, framer->scratch, len);
+        frame->buffer = framer->scratch;
+        total = len;
+    }
+    frame->size = (size_t)len;
+    framer->handed = total;
+    return 1;
+}
+
+inline int network_frame_write(network_framer_t *framer, const void *payload, size_t len) {
+    unsigned char header[NETWORK_FRAME_VARINT_MAX];
+    size_t header_len = 0;
+    if (framer->prefix == NETWORK_FRAME_U32) {
+        if ((uint64_t)len > UINT32_MAX) {
+            NETWORK_ERROR("Frame of %zu bytes doesn't fit a 4 byte prefix.", len);
+            return network_fail(NETWORK_FRAME_INVALID, 0);
+        }
+        header[0] = (unsigned char)(len >> 24);
+        header[1] = (unsigned char)(len >> 16);
+        header[2] = (unsigned char)(len >> 8);
+        header[3] = (unsigned char)len;
+        header_len = 4;
+    } else {
+        uint64_t value = len;
+        do {
+            header[header_len] = (unsigned char)(value & 0x7f);
+            value >>= 7;
+            if (value) {
+                header[header_len] |= 0x80;
+            }
+            header_len++;
+        } while (value);
+    }
+
+    size_t queued = framer->out.len;
+    if (network_buffer_append(&framer->out, header, header_len) < 0 ||
+        network_buffer_append(&framer->out, payload, len) < 0) {
+        network_buffer_truncate(&framer->out, queued); // no half-written frame
+        return -1;
+    }
+    return 0;
+}
+
+inline size_t network_frame_pending(const network_framer_t *framer) {
+    return framer->out.len;
+}
+
+inline ssize_t network_frame_flush(socket_t sockfd, network_framer_t *framer) {
+    return network_buffer_send(sockfd, &framer->out);
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_FRAME_H
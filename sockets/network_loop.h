@@ -0,0 +1,2800 @@
+/**
+ * @file network_loop.h
+ * @brief Reactor style event loop on top of network.h's sockets
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ * Linux and Windows, three backends behind the same API:
+ *   • epoll    - Linux, always there, readiness events and a recv/send syscall per socket per batch
+ *   • io_uring - Linux, with -DNETWORK_LOOP_IO_URING, see network_uring.h. Multishot accept, multishot recv
+ *                into a ring of provided buffers and queued sends all go through the one io_uring_enter
+ *                a batch waits in, so a request costs no syscalls of its own. network_loop_create()
+ *                prefers it and falls back to epoll on kernels without it; NETWORK_LOOP_BACKEND=epoll
+ *                in the environment or network_loop_create_backend() picks one at runtime.
+ *   • iocp     - Windows, a completion port per loop. A zero-byte overlapped WSARecv completes once a
+ *                socket has data, which is then read without blocking like on epoll, so an idle connection
+ *                pins no buffer; queued bytes go out with one overlapped WSASend or TransmitFile at a time,
+ *                listeners keep NETWORK_IOCP_ACCEPTS AcceptEx calls in flight and network_loop_connect()
+ *                uses ConnectEx. Listeners need on_accept, a listening socket has no zero-byte recv. A socket
+ *                stays tied to the first loop it was added to. Link ws2_32 and mswsock.
+ *
+ * Every socket is watched through a network_watch_t the caller owns, usually embedded in its
+ * connection struct. The loop stores a pointer to it in epoll_data.ptr, so an event leads
+ * straight to the connection without looking the fd up anywhere.
+ *
+ * Available APIs:
+ *   • network_loop_create()   - New loop, maxevents is how many events one batch handles at most
+ *   • network_loop_create_backend() - Same, with the backend chosen by the caller
+ *   • network_loop_add()      - Start watching a socket, network_loop_mod()/del() to change or stop
+ *   • network_loop_run()      - Dispatch events until network_loop_stop(), or run_once() for one batch
+ *   • network_loop_send()     - Send now, queue what the socket can't take and send it when writable
+ *   • network_loop_send_file() - Queue part of a file, sent with sendfile behind the bytes queued before it
+ *   • network_loop_close()    - Stop watching, close the socket and call on_close
+ *   • network_loop_connect()  - Non-blocking connect driven by the loop, with a deadline, on_connect once it's up
+ *   Every loop counts into network_stats.h: bytes and calls, connection lifetimes and, after
+ *   network_stats_set_timing(1), how long each batch and each event in it took; watch->stats has a
+ *   socket's own bytes.
+ *
+ * Timers:
+ *   • network_loop_timer_start() - Calls on_expire after ms, starting it again moves it; network_loop_timer_stop()
+ *   • network_loop_set_timeout() - A watch's own deadline, e.g. an idle timeout pushed back on every request
+ *   • network_loop_now()      - The loop's clock in ms, read once per batch
+ *   Timers sit in a hierarchical timing wheel (64 slots per level, 1ms ticks at the bottom), so starting,
+ *   moving and stopping one is O(1) however many there are, and each batch waits until the nearest one.
+ *
+ * Server mode:
+ *   • network_server_start()  - N worker threads, each with its own SO_REUSEPORT listener and its own loop,
+ *                               so the kernel spreads connections over them and nothing is shared on accept;
+ *                               Windows has no SO_REUSEPORT, the first worker accepts for all of them and
+ *                               posts every connection to the next worker's completion port in turn
+ *   • network_server_stop()   - Wakes every worker, waits for them and closes the listeners
+ *
+ * Callbacks:
+ *   • on_accept   - set on a listener to have the loop accept for you, every new non-blocking connection
+ *                   is handed over with its peer address
+ *   • on_readable - called when the socket is readable; when it's NULL the loop reads itself and hands
+ *                   every chunk to on_data
+ *   • on_data     - bytes received, valid until the callback returns
+ *   • on_writable - the socket is writable and whatever network_loop_send queued is sent; on io_uring an
+ *                   edge-triggered watch gets it once after add/mod and after each drained queue
+ *   • on_close    - peer closed (err 0), or an error (err is the errno, a WSA error code on Windows);
+ *                   the socket is already closed and the loop is done with the watch, so it can be freed here
+ *   • on_connect  - network_loop_connect() got through, the watch is watched for its events from now on
+ *   • on_timeout  - the network_loop_set_timeout() deadline passed; when it's NULL the watch is closed
+ *                   with NETWORK_LOOP_TIMEDOUT instead
+ *
+ * @example
+ * struct conn { network_watch_t watch; ... };
+ * conn->watch.fd = fd; conn->watch.on_data = echo; conn->watch.on_close = release;
+ * network_loop_add(loop, &conn->watch, NETWORK_EV_READ | NETWORK_EV_EDGE);
+ */
+
+#ifndef NETWORK_LOOP_H
+#define NETWORK_LOOP_H
+
+#include "network.h"
+
+#ifdef WINSOCK_IMPL
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef LINUX_SOCKETS_IMPL
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#ifdef NETWORK_LOOP_IO_URING
+#include <poll.h>
+#include "network_uring.h"
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000 // only declared with _GNU_SOURCE
+#endif
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_LOOP_MAX_EVENTS 256 // events per epoll_wait when network_loop_create gets 0
+#define NETWORK_LOOP_READ_SIZE (64 * 1024) // bytes read per recv while draining
+#define NETWORK_LOOP_ACCEPT_BATCH 64 // connections taken per network_accept_batch for on_accept
+#define NETWORK_LOOP_ACCEPT_RETRY_MS 100 // out of descriptors without a reserve, accept is tried again after this
+
+// network_loop_create_backend()
+#define NETWORK_BACKEND_AUTO     0 // io_uring when compiled in and the kernel has it, else epoll
+#define NETWORK_BACKEND_EPOLL    1
+#define NETWORK_BACKEND_IO_URING 2
+#define NETWORK_BACKEND_IOCP     3 // the one backend on Windows, AUTO picks it there
+
+// what to watch for, network_loop_add()/mod()
+#define NETWORK_EV_READ  0x01u
+#define NETWORK_EV_WRITE 0x02u
+#define NETWORK_EV_EDGE  0x04u // edge-triggered, a callback is only called again after the socket hit EAGAIN
+// only ever reported to on_readable
+#define NETWORK_EV_HUP   0x08u
+#define NETWORK_EV_ERROR 0x10u
+// io_uring only: queues of NETWORK_LOOP_ZEROCOPY_MIN bytes and more go out with IORING_OP_SEND_ZC,
+// worth it for big responses to real NICs, loopback copies anyway; ignored on epoll
+#define NETWORK_EV_ZEROCOPY 0x20u
+#define NETWORK_LOOP_ZEROCOPY_MIN (64 * 1024)
+
+// on_close err when a network_loop_set_timeout or network_loop_connect deadline passed
+#ifdef WINSOCK_IMPL
+#define NETWORK_LOOP_TIMEDOUT WSAETIMEDOUT
+#else
+#define NETWORK_LOOP_TIMEDOUT ETIMEDOUT
+#endif
+
+// network_loop_send_file flags
+#define NETWORK_FILE_CLOSE 0x1 // the loop closes the fd once it's sent or the watch is closed
+
+// timing wheel: 5 levels of 64 slots, 1ms per slot at level 0, 64 times more per level up,
+// 2^30 ms (12 days) in all; timers further out wait at the top and are placed again on the way
+#define NETWORK_TIMER_LEVELS 5
+#define NETWORK_TIMER_BITS 6
+#define NETWORK_TIMER_SLOTS (1 << NETWORK_TIMER_BITS)
+
+typedef struct network_loop network_loop_t;
+typedef struct network_watch network_watch_t;
+typedef struct network_timer network_timer_t;
+
+typedef void (*network_timer_cb)(network_loop_t *loop, network_timer_t *timer);
+
+// embedded in whatever it times and zeroed before the first start, like a watch
+struct network_timer {
+    network_timer_cb on_expire;
+    void *user;
+
+    // owned by the loop
+    uint64_t expires;        // network_loop_now() it's due at
+    network_timer_t *next;
+    network_timer_t **pprev; // NULL while it isn't running
+    int slot;                // level * NETWORK_TIMER_SLOTS + slot it was put in
+};
+
+struct network_timer_wheel {
+    uint64_t now;                                    // ms of network_now_ms(), everything up to it has fired
+    size_t count;                                    // timers running
+    uint64_t occupied[NETWORK_TIMER_LEVELS];         // a bit per slot that isn't empty, finds the next one fast
+    network_timer_t *slots[NETWORK_TIMER_LEVELS * NETWORK_TIMER_SLOTS]; // level by level
+};
+
+typedef void (*network_event_cb)(network_loop_t *loop, network_watch_t *watch, uint32_t events);
+typedef void (*network_data_cb)(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len);
+typedef void (*network_close_cb)(network_loop_t *loop, network_watch_t *watch, int err);
+typedef void (*network_watch_accept_cb)(network_loop_t *loop, network_watch_t *listener, socket_t fd,
+                                        const struct sockaddr_storage *addr);
+
+struct network_uring_ref;
+struct network_uring_loop;
+struct network_iocp_ref;
+struct network_iocp_loop;
+
+// a network_loop_send_file request waiting in a watch's queue
+struct network_file_segment {
+    int fd;
+    int flags;
+    int64_t offset;
+    size_t left;                       // bytes still to send
+    size_t ahead;                      // queued bytes that go out between the previous segment and this one
+    struct network_file_segment *next;
+};
+
+struct network_watch {
+    socket_t fd;
+    network_event_cb on_readable;
+    network_data_cb on_data;
+    network_event_cb on_writable;
+    network_close_cb on_close;
+    network_watch_accept_cb on_accept;
+    network_event_cb on_connect;
+    network_event_cb on_timeout;
+    void *user;
+
+    // owned by the loop
+    network_timer_t timer;  // network_loop_set_timeout and the network_loop_connect deadline
+    int connecting;         // network_loop_connect is waiting for the socket to become writable
+    uint32_t events;        // what was asked for in network_loop_add/mod
+    int write_armed;        // EV_WRITE was added only until the queue drains
+    int closed;             // network_loop_close was called, on_close may wait for the end of the batch
+    int added;              // counted in the loop's watches, network_loop_del only takes out what was added
+    int close_err;
+    char *out;              // bytes network_loop_send couldn't send yet, from out_off to out_len
+    size_t out_off, out_len, out_cap;
+    struct network_file_segment *files; // network_loop_send_file segments, in order with the bytes in out
+    network_watch_t *next_closed;
+    struct network_uring_ref *ref; // io_uring backend, what the kernel's requests for this watch point at
+    struct network_iocp_ref *overlapped; // IOCP backend, the same for its overlapped requests
+    network_watch_stats stats;      // bytes the loop moved for this socket and when it was added
+};
+
+struct network_loop {
+    int backend;                  // NETWORK_BACKEND_EPOLL, NETWORK_BACKEND_IO_URING or NETWORK_BACKEND_IOCP
+    socket_t epfd;
+    int running;
+    int dispatching;              // watches closed while set get on_close after the batch
+    int maxevents;
+    size_t watches;               // sockets being watched
+#ifdef LINUX_SOCKETS_IMPL
+    struct epoll_event *events;
+#else
+    void *events;                 // OVERLAPPED_ENTRY on Windows
+#endif
+    char *read_buf;
+    network_watch_t *closed;      // closed during this batch, waiting for on_close
+    void *user;                   // free for the caller, e.g. per-worker state in server mode
+    struct network_uring_loop *uring; // io_uring backend state, NULL on epoll
+    struct network_iocp_loop *iocp;   // IOCP backend state, Windows
+    struct network_timer_wheel timers;
+};
+
+// server mode callbacks, both run on the worker thread that owns loop
+typedef void (*network_accept_cb)(network_loop_t *loop, socket_t fd, const struct sockaddr_storage *addr, void *user);
+typedef void (*network_worker_cb)(network_loop_t *loop, int worker, void *user);
+
+// network_server_start flags
+#define NETWORK_SERVER_PIN_CPUS 0x1 // pins worker i to CPU i % CPUs
+
+struct network_server_worker;
+
+// fill in the settings, then network_server_start()
+typedef struct network_server {
+    const char *ip;               // NULL for all interfaces
+    const char *port;             // NULL for 8080, "0" picks a free port shared by all workers, see bound_port
+    int backlog;                  // per listener, 0 for BACKLOG
+    int workers;                  // 0 for one per online CPU
+    int flags;
+    int backend;                  // NETWORK_BACKEND_*, 0 lets every worker's loop pick
+    network_accept_cb on_accept;  // new non-blocking connection, add it to loop to serve it there
+    network_worker_cb on_start;   // optional, runs once per worker before it starts accepting
+    network_worker_cb on_stop;    // optional, runs once per worker after its loop stopped
+    void *user;
+
+    // owned by the server
+    struct network_server_worker *worker_state;
+    int running;
+    char bound_port[8];           // port the listeners are bound to
+} network_server_t;
+
+// returns NULL on failure, maxevents = 0 uses NETWORK_LOOP_MAX_EVENTS
+network_loop_t *network_loop_create(int maxevents);
+// NETWORK_BACKEND_AUTO also reads NETWORK_LOOP_BACKEND=epoll|io_uring from the environment;
+// asking for io_uring explicitly fails when it isn't compiled in or the kernel turns it down.
+// Windows only has NETWORK_BACKEND_IOCP, which AUTO picks
+network_loop_t *network_loop_create_backend(int maxevents, int backend);
+// "epoll", "io_uring" or "iocp"
+const char *network_loop_backend_name(const network_loop_t *loop);
+// the watches still added are left alone, close them first
+void network_loop_destroy(network_loop_t *loop);
+// watch->fd should be non-blocking, returns 0 or -1
+int network_loop_add(network_loop_t *loop, network_watch_t *watch, uint32_t events);
+int network_loop_mod(network_loop_t *loop, network_watch_t *watch, uint32_t events);
+// stops watching without closing the socket, unsent bytes are dropped
+int network_loop_del(network_loop_t *loop, network_watch_t *watch);
+// waits up to timeout_ms (-1 forever) for one batch of events, returns how many were handled or -1
+int network_loop_run_once(network_loop_t *loop, int timeout_ms);
+// runs batches until network_loop_stop() is called from a callback, returns 0 or -1 if waiting failed
+int network_loop_run(network_loop_t *loop);
+void network_loop_stop(network_loop_t *loop);
+// sends or queues all len bytes, returns 0 or -1 when the connection failed and got closed
+int network_loop_send(network_loop_t *loop, network_watch_t *watch, const void *data, size_t len);
+// bytes queued by network_loop_send and network_loop_send_file that haven't gone out yet
+size_t network_loop_pending(const network_watch_t *watch);
+// queues len bytes of fd from offset, returns 0 or -1 when the connection failed and got closed;
+// fd has to stay open until it's sent unless flags has NETWORK_FILE_CLOSE
+int network_loop_send_file(network_loop_t *loop, network_watch_t *watch, int fd, int64_t offset, size_t len, int flags);
+void network_loop_close(network_loop_t *loop, network_watch_t *watch, int err);
+/**
+ * Opens a non-blocking socket to addr and watches it while it connects. on_connect is called
+ * once it's connected, then the watch gets events like after network_loop_add(); a connect
+ * that fails or doesn't get through within timeout_ms (0 for none) closes the watch with the
+ * error, NETWORK_LOOP_TIMEDOUT for the deadline. Sends before that are queued and go out once it's up.
+ *
+ * @return 0, or -1 when it failed right away (on_close isn't called then)
+ */
+int network_loop_connect(network_loop_t *loop, network_watch_t *watch, const struct sockaddr *addr,
+                         socklen_t addrlen, uint32_t events, int timeout_ms);
+// starts timer to fire ms after network_loop_now(), moving it if it was running already; at least 1ms
+void network_loop_timer_start(network_loop_t *loop, network_timer_t *timer, uint64_t ms);
+// stops it if it's running, it can be freed afterwards
+void network_loop_timer_stop(network_loop_t *loop, network_timer_t *timer);
+int network_loop_timer_active(const network_timer_t *timer);
+// calls on_timeout, or closes the watch with NETWORK_LOOP_TIMEDOUT, ms from now; 0 takes the deadline away
+void network_loop_set_timeout(network_loop_t *loop, network_watch_t *watch, uint64_t ms);
+// ms on the monotonic clock as of the start of the current batch, what timers count from
+uint64_t network_loop_now(const network_loop_t *loop);
+// binds every worker's listener and starts the workers, returns 0 or -1 with nothing left running
+int network_server_start(network_server_t *server);
+// stops and joins the workers; connections still in their loops are the caller's to close in on_stop
+void network_server_stop(network_server_t *server);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+inline size_t network_loop_pending(const network_watch_t *watch) {
+    size_t pending = watch->out_len - watch->out_off;
+    for (const struct network_file_segment *file = watch->files; file; file = file->next) {
+        pending += file->left;
+    }
+    return pending;
+}
+
+// queued bytes that can go out before the first file segment has to
+static inline size_t network_loop_sendable(const network_watch_t *watch) {
+    return watch->files ? watch->files->ahead : watch->out_len - watch->out_off;
+}
+
+// bytes sent from out, which also counts down toward the first file segment
+static inline void network_loop_sent(network_watch_t *watch, size_t sent) {
+    watch->stats.bytes_out += sent;
+    watch->out_off += sent;
+    if (watch->files) {
+        watch->files->ahead -= sent;
+    }
+    if (watch->out_off == watch->out_len) {
+        watch->out_off = watch->out_len = 0;
+    }
+}
+
+static inline void network_loop_file_pop(network_watch_t *watch) {
+    struct network_file_segment *file = watch->files;
+    watch->files = file->next;
+    if (file->flags & NETWORK_FILE_CLOSE) {
+#ifdef WINSOCK_IMPL
+        _close(file->fd);
+#else
+        close(file->fd);
+#endif
+    }
+    free(file);
+}
+
+// calls on_close for everything closed during the batch, nothing in it can refer to them anymore
+static inline void network_loop_closed(network_loop_t *loop) {
+    while (loop->closed) {
+        network_watch_t *watch = loop->closed;
+        loop->closed = watch->next_closed;
+        if (watch->on_close) {
+            watch->on_close(loop, watch, watch->close_err);
+        }
+    }
+}
+
+static inline unsigned network_timers_ctz(uint64_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(bits);
+#endif
+}
+
+// A timer at level L waits in the slot of its expiry's L-th group of 6 bits, L being the highest
+// group where it differs from now. When now enters a slot above level 0 the timers in it are
+// placed again and drop a level or more, so each one moves at most NETWORK_TIMER_LEVELS times.
+static inline void network_timers_link(struct network_timer_wheel *wheel, network_timer_t *timer) {
+    uint64_t expires = timer->expires < wheel->now ? wheel->now : timer->expires;
+    uint64_t diff = expires ^ wheel->now;
+    int level = 0;
+    while (level < NETWORK_TIMER_LEVELS - 1 && (diff >> (NETWORK_TIMER_BITS * (level + 1))) != 0) {
+        level++;
+    }
+    unsigned shift = NETWORK_TIMER_BITS * (unsigned)level;
+    unsigned index;
+    if ((diff >> (NETWORK_TIMER_BITS * NETWORK_TIMER_LEVELS)) != 0) {
+        // further out than the wheel reaches, into the top slot that comes round last
+        index = (unsigned)((wheel->now >> shift) - 1) & (NETWORK_TIMER_SLOTS - 1);
+    } else {
+        index = (unsigned)(expires >> shift) & (NETWORK_TIMER_SLOTS - 1);
+    }
+    timer->slot = level * NETWORK_TIMER_SLOTS + (int)index;
+    network_timer_t **head = &wheel->slots[timer->slot];
+    timer->next = *head;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+static inline void network_timers_unlink(struct network_timer_wheel *wheel, network_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (wheel->slots[timer->slot] == NULL) {
+        wheel->occupied[timer->slot / NETWORK_TIMER_SLOTS] &= ~((uint64_t)1 << (timer->slot % NETWORK_TIMER_SLOTS));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+// when the wheel next has something to do, a timer to fire or a slot to place again
+static inline uint64_t network_timers_next(const struct network_timer_wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < NETWORK_TIMER_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+        unsigned shift = NETWORK_TIMER_BITS * level;
+        unsigned index = (unsigned)(wheel->now >> shift) & (NETWORK_TIMER_SLOTS - 1);
+        uint64_t lap = wheel->now >> (shift + NETWORK_TIMER_BITS) << (shift + NETWORK_TIMER_BITS);
+        uint64_t ahead = index == NETWORK_TIMER_SLOTS - 1 ? 0 : bits >> (index + 1) << (index + 1);
+        if (ahead == 0) {
+            // only slots behind now, which are the ones far out timers wait in at the top
+            lap += (uint64_t)1 << (shift + NETWORK_TIMER_BITS);
+            ahead = bits;
+        }
+        uint64_t at = lap + ((uint64_t)network_timers_ctz(ahead) << shift);
+        if (at < next) {
+            next = at;
+        }
+    }
+    return next;
+}
+
+static inline void network_timers_cascade(struct network_timer_wheel *wheel, unsigned level, unsigned index) {
+    network_timer_t *list = wheel->slots[level * NETWORK_TIMER_SLOTS + index];
+    wheel->slots[level * NETWORK_TIMER_SLOTS + index] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+    while (list) {
+        network_timer_t *timer = list;
+        list = timer->next;
+        network_timers_link(wheel, timer);
+    }
+}
+
+// takes a level 0 slot off the wheel first, so callbacks can stop and start any timer, these included
+static inline int network_timers_fire(network_loop_t *loop, unsigned index) {
+    struct network_timer_wheel *wheel = &loop->timers;
+    network_timer_t *due = wheel->slots[index];
+    wheel->slots[index] = NULL;
+    wheel->occupied[0] &= ~((uint64_t)1 << index);
+    if (due) due->pprev = &due;
+    int fired = 0;
+    while (due) {
+        network_timer_t *timer = due;
+        network_timers_unlink(wheel, timer);
+        timer->on_expire(loop, timer);
+        fired++;
+    }
+    return fired;
+}
+
+// fires the timers due by now, jumping straight from one thing to do to the next; returns how many
+static inline int network_loop_expire(network_loop_t *loop) {
+    struct network_timer_wheel *wheel = &loop->timers;
+    uint64_t target = (uint64_t)network_now_ms();
+    int fired = 0;
+    while (wheel->count) {
+        uint64_t next = network_timers_next(wheel);
+        if (next > target) {
+            break;
+        }
+        wheel->now = next;
+        for (unsigned level = NETWORK_TIMER_LEVELS - 1; level > 0; level--) {
+            unsigned shift = NETWORK_TIMER_BITS * level;
+            if ((next & (((uint64_t)1 << shift) - 1)) == 0) {
+                network_timers_cascade(wheel, level, (unsigned)(next >> shift) & (NETWORK_TIMER_SLOTS - 1));
+            }
+        }
+        fired += network_timers_fire(loop, (unsigned)next & (NETWORK_TIMER_SLOTS - 1));
+    }
+    if (wheel->now < target) {
+        wheel->now = target;
+    }
+    return fired;
+}
+
+// timeout_ms cut short to when the wheel has something to do next
+static inline int network_loop_wait_ms(network_loop_t *loop, int timeout_ms) {
+    if (loop->timers.count == 0) {
+        return timeout_ms;
+    }
+    uint64_t next = network_timers_next(&loop->timers);
+    uint64_t now = (uint64_t)network_now_ms();
+    int wait = next <= now ? 0 : next - now > INT_MAX ? INT_MAX : (int)(next - now);
+    return timeout_ms < 0 || wait < timeout_ms ? wait : timeout_ms;
+}
+
+inline uint64_t network_loop_now(const network_loop_t *loop) {
+    return loop->timers.now;
+}
+
+inline int network_loop_timer_active(const network_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+inline void network_loop_timer_start(network_loop_t *loop, network_timer_t *timer, uint64_t ms) {
+    struct network_timer_wheel *wheel = &loop->timers;
+    if (timer->pprev) {
+        network_timers_unlink(wheel, timer);
+    }
+    if (wheel->count == 0) {
+        // nothing to fire on the way, the wheel can catch up with the clock
+        wheel->now = (uint64_t)network_now_ms();
+    }
+    // the slot of now itself has been fired already
+    timer->expires = wheel->now + (ms ? ms : 1);
+    network_timers_link(wheel, timer);
+    wheel->count++;
+}
+
+inline void network_loop_timer_stop(network_loop_t *loop, network_timer_t *timer) {
+    if (timer->pprev) {
+        network_timers_unlink(&loop->timers, timer);
+    }
+}
+
+static inline void network_loop_watch_expired(network_loop_t *loop, network_timer_t *timer) {
+    network_watch_t *watch = timer->user;
+    if (watch->on_timeout && !watch->connecting) {
+        watch->on_timeout(loop, watch, 0);
+    } else {
+        network_loop_close(loop, watch, NETWORK_LOOP_TIMEDOUT);
+    }
+}
+
+inline void network_loop_set_timeout(network_loop_t *loop, network_watch_t *watch, uint64_t ms) {
+    if (ms == 0 || watch->closed) {
+        network_loop_timer_stop(loop, &watch->timer);
+        return;
+    }
+    watch->timer.on_expire = network_loop_watch_expired;
+    watch->timer.user = watch;
+    network_loop_timer_start(loop, &watch->timer, ms);
+}
+
+// appends len bytes to the send queue, returns -1 after closing the watch when out of memory;
+// the kernel may be reading the front of the queue while an io_uring or overlapped send is in
+// flight, hold is then where the buffer it reads from goes when the queue has to move, else NULL
+static inline int network_loop_queue(network_loop_t *loop, network_watch_t *watch, const void *data, size_t len,
+                                     char **hold) {
+    // move what's left of the queue to the front first
+    if (hold == NULL && watch->out_off > 0) {
+        memmove(watch->out, watch->out + watch->out_off, watch->out_len - watch->out_off);
+        watch->out_len -= watch->out_off;
+        watch->out_off = 0;
+    }
+    if (watch->out_len + len > watch->out_cap) {
+        size_t cap = watch->out_cap ? watch->out_cap * 2 : 4096;
+        while (cap < watch->out_len + len) {
+            cap *= 2;
+        }
+        char *out;
+        if (hold && *hold == NULL) {
+            // a copy, the old buffer stays put until the send completes
+            out = malloc(cap);
+            if (out) {
+                memcpy(out, watch->out, watch->out_len);
+                *hold = watch->out;
+            }
+        } else {
+            out = realloc(watch->out, cap);
+        }
+        if (out == NULL) {
+            NETWORK_ERROR("Send queue allocation failed.");
+            network_loop_close(loop, watch, ENOMEM);
+            return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        }
+        watch->out = out;
+        watch->out_cap = cap;
+    }
+    memcpy(watch->out + watch->out_len, data, len);
+    watch->out_len += len;
+    return 0;
+}
+
+// resets what the loop owns in a watch that's about to be added
+static inline void network_loop_watch_init(network_watch_t *watch, uint32_t events) {
+    watch->events = events;
+    watch->write_armed = 0;
+    watch->closed = 0;
+    watch->added = 0;
+    watch->out = NULL;
+    watch->out_off = watch->out_len = watch->out_cap = 0;
+    watch->files = NULL;
+    watch->next_closed = NULL;
+    watch->ref = NULL;
+    watch->overlapped = NULL;
+    watch->timer.next = NULL;
+    watch->timer.pprev = NULL;
+    watch->connecting = 0;
+    watch->stats.bytes_in = watch->stats.bytes_out = 0;
+    watch->stats.opened_ns = network_stats_clock();
+}
+
+// puts a file segment behind everything queued, returns -1 after closing the watch when out of memory
+static inline int network_loop_file_push(network_loop_t *loop, network_watch_t *watch, int fd, int64_t offset, size_t len, int flags) {
+    struct network_file_segment *file = malloc(sizeof(*file));
+    if (file == NULL) {
+        NETWORK_ERROR("File segment allocation failed.");
+        if (flags & NETWORK_FILE_CLOSE) {
+#ifdef WINSOCK_IMPL
+            _close(fd);
+#else
+            close(fd);
+#endif
+        }
+        network_loop_close(loop, watch, ENOMEM);
+        return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+    }
+    file->fd = fd;
+    file->flags = flags;
+    file->offset = offset;
+    file->left = len;
+    file->next = NULL;
+    // goes behind everything queued, so ahead is what's queued after the last segment
+    file->ahead = watch->out_len - watch->out_off;
+    struct network_file_segment **link = &watch->files;
+    while (*link) {
+        file->ahead -= (*link)->ahead;
+        link = &(*link)->next;
+    }
+    *link = file;
+    return 0;
+}
+
+#ifdef NETWORK_LOOP_IO_URING
+static inline void network_uring_close_fd(network_loop_t *loop, int fd); // with the rest of the backend, below
+#endif
+
+inline void network_loop_close(network_loop_t *loop, network_watch_t *watch, int err) {
+    if (watch->closed) {
+        return;
+    }
+    network_loop_del(loop, watch);
+    network_stats_add(NETWORK_STAT_CLOSES, 1);
+    if (watch->stats.opened_ns && !watch->on_accept) {
+        network_stats_record(NETWORK_HIST_CONN_LIFETIME, network_stats_clock() - watch->stats.opened_ns);
+    }
+#ifdef WINSOCK_IMPL
+    closesocket(watch->fd); // anything still in flight on it comes back cancelled
+    watch->fd = INVALID_SOCKET;
+#else
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        network_uring_close_fd(loop, watch->fd);
+    } else
+#endif
+    close(watch->fd);
+    watch->fd = -1;
+#endif
+    watch->closed = 1;
+    watch->close_err = err;
+    if (loop->dispatching) {
+        // events for it may still be further down this batch, so it can't be freed yet
+        watch->next_closed = loop->closed;
+        loop->closed = watch;
+        return;
+    }
+    if (watch->on_close) {
+        watch->on_close(loop, watch, err);
+    }
+}
+
+inline const char *network_loop_backend_name(const network_loop_t *loop) {
+    switch (loop->backend) {
+    case NETWORK_BACKEND_IO_URING: return "io_uring";
+    case NETWORK_BACKEND_IOCP: return "iocp";
+    }
+    return "epoll";
+}
+
+inline int network_loop_run(network_loop_t *loop) {
+    loop->running = 1;
+    while (loop->running) {
+        if (network_loop_run_once(loop, -1) < 0) {
+            loop->running = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+inline void network_loop_stop(network_loop_t *loop) {
+    loop->running = 0;
+}
+
+#ifdef LINUX_SOCKETS_IMPL
+
+static inline uint32_t network_loop_epoll_events(uint32_t events) {
+    uint32_t ev = EPOLLRDHUP;
+    if (events & NETWORK_EV_READ) ev |= EPOLLIN;
+    if (events & NETWORK_EV_WRITE) ev |= EPOLLOUT;
+    if (events & NETWORK_EV_EDGE) ev |= EPOLLET;
+    return ev;
+}
+
+static inline int network_loop_epoll_ctl(network_loop_t *loop, int op, network_watch_t *watch, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = network_loop_epoll_events(events);
+    ev.data.ptr = watch;
+    if (epoll_ctl(loop->epfd, op, watch->fd, &ev) < 0) {
+        int err = errno;
+        NETWORK_ERROR("epoll_ctl failed. %s", strerror(err));
+        return network_fail(NETWORK_EPOLL_FAILED, err);
+    }
+    return 0;
+}
+
+// sends the file segments at the front of the queue, returns -1 once the watch got closed
+static inline int network_loop_send_files(network_loop_t *loop, network_watch_t *watch) {
+    while (watch->files && watch->files->ahead == 0) {
+        struct network_file_segment *file = watch->files;
+        ssize_t sent = network_send_file(watch->fd, file->fd, file->offset, file->left);
+        if (sent < 0) {
+            network_loop_close(loop, watch, network_last_errno());
+            return -1;
+        }
+        file->offset += sent;
+        file->left -= (size_t)sent;
+        watch->stats.bytes_out += (size_t)sent;
+        if (file->left > 0) {
+            return 0; // socket full, or the file was shorter than asked and the next call fails
+        }
+        network_loop_file_pop(watch);
+    }
+    return 0;
+}
+
+// the socket of a network_loop_connect became writable, it's connected or it failed
+static inline void network_loop_connected(network_loop_t *loop, network_watch_t *watch) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err) {
+        network_loop_close(loop, watch, err);
+        return;
+    }
+    watch->connecting = 0;
+    network_loop_timer_stop(loop, &watch->timer);
+    network_stats_add(NETWORK_STAT_CONNECTS, 1);
+    // what was queued meanwhile goes out from here on
+    if (network_loop_mod(loop, watch, watch->events) < 0) {
+        network_loop_close(loop, watch, network_last_errno());
+        return;
+    }
+    if (watch->on_connect) {
+        watch->on_connect(loop, watch, NETWORK_EV_WRITE);
+    }
+}
+
+#ifdef NETWORK_LOOP_IO_URING
+
+#ifndef NETWORK_URING_ENTRIES
+#define NETWORK_URING_ENTRIES 4096     // SQEs per loop, the CQ gets four times as many
+#endif
+#ifndef NETWORK_URING_BUFFERS
+#define NETWORK_URING_BUFFERS 2048     // provided buffers multishot recv picks from, a power of two
+#endif
+#ifndef NETWORK_URING_BUFFER_SIZE
+#define NETWORK_URING_BUFFER_SIZE 4096 // most one recv completion hands to on_data
+#endif
+
+// what a request is for, in the low bits of its user_data; user_data 0 is a cancel nobody waits for
+#define NETWORK_URING_RECV     1u
+#define NETWORK_URING_POLL_IN  2u
+#define NETWORK_URING_POLL_OUT 3u
+#define NETWORK_URING_SEND     4u
+#define NETWORK_URING_ACCEPT   5u
+#define NETWORK_URING_OP_MASK  7u
+
+// Requests point at this and not at the watch, so the watch can be freed in on_close while
+// the kernel still has to hand back its cancelled requests. Freed once the last one is back.
+struct network_uring_ref {
+    network_watch_t *watch;        // NULL once the watch was deleted
+    unsigned ops;                  // requests in flight
+    unsigned armed;                // 1 << op for every kind in flight
+    unsigned cancelling;           // kinds a cancel was sent for
+    int write_fired;               // edge-triggered EV_WRITE was reported since add/mod
+    int file_wait;                 // sendfile filled the socket, POLL_OUT says when to go on
+    int zerocopy;                  // the send in flight is a SEND_ZC, done at its notification
+    int zc_res;                    // its result, which comes before the notification
+    int dirty;                     // on the loop's list of queues to send
+    size_t sending;                // bytes of the send in flight, the queue doesn't move while set
+    char *send_buf;                // what the send in flight reads from once watch->out moved or went away
+    struct network_uring_ref *next_dirty;
+    struct network_uring_ref *prev, *next; // deleted refs still waiting for requests
+};
+
+struct network_uring_loop {
+    network_uring_t ring;
+    network_uring_bufs_t bufs;
+    int recv_multishot;            // cleared when the kernel turns down IORING_RECV_MULTISHOT (before 6.0)
+    int send_zc;                   // cleared when it turns down IORING_OP_SEND_ZC (before 6.0)
+    struct network_uring_ref *dirty;
+    struct network_uring_ref *orphans;
+};
+
+static inline void network_uring_ref_release(struct network_uring_loop *uring, struct network_uring_ref *ref) {
+    if (ref->watch || ref->ops || ref->dirty) {
+        return;
+    }
+    if (ref->prev) {
+        ref->prev->next = ref->next;
+    } else {
+        uring->orphans = ref->next;
+    }
+    if (ref->next) {
+        ref->next->prev = ref->prev;
+    }
+    free(ref->send_buf);
+    free(ref);
+}
+
+static inline struct io_uring_sqe *network_uring_sqe(network_loop_t *loop) {
+    network_uring_t *ring = &loop->uring->ring;
+    struct io_uring_sqe *sqe = network_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        // SQ full, hand it to the kernel without waiting to free the slots
+        if (network_uring_submit(ring, 0, 0) < 0) {
+            int err = errno;
+            NETWORK_ERROR("io_uring_enter failed. %s", strerror(err));
+            network_fail(NETWORK_URING_FAILED, err);
+            return NULL;
+        }
+        sqe = network_uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+// requests for fd still in the SQ would find whatever socket gets its number next, so with any
+// waiting the close goes in behind them and the kernel does it once it took them
+static inline void network_uring_close_fd(network_loop_t *loop, int fd) {
+    struct io_uring_sqe *sqe = NULL;
+    if (network_uring_sq_ready(&loop->uring->ring) > 0 && (sqe = network_uring_sqe(loop)) != NULL) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        return;
+    }
+    close(fd);
+}
+
+static inline struct io_uring_sqe *network_uring_prep(network_loop_t *loop, struct network_uring_ref *ref,
+                                                      unsigned op, int opcode, int fd) {
+    struct io_uring_sqe *sqe = network_uring_sqe(loop);
+    if (sqe == NULL) {
+        return NULL;
+    }
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)ref | op;
+    ref->ops++;
+    ref->armed |= 1u << op;
+    return sqe;
+}
+
+static inline void network_uring_cancel(network_loop_t *loop, struct network_uring_ref *ref, unsigned op) {
+    if (ref->cancelling & (1u << op)) {
+        return;
+    }
+    ref->cancelling |= 1u << op;
+    struct io_uring_sqe *sqe = network_uring_sqe(loop);
+    if (sqe == NULL) {
+        return; // it stays armed and is dropped when the ring goes away
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ref | op;
+}
+
+// the kinds of request a watch should have in flight, sends aside
+static inline unsigned network_uring_wanted(const network_watch_t *watch) {
+    unsigned want = 0;
+    if (watch->connecting) {
+        return 1u << NETWORK_URING_POLL_OUT;
+    }
+    if (watch->events & NETWORK_EV_READ) {
+        if (watch->on_accept) {
+            want |= 1u << NETWORK_URING_ACCEPT;
+        } else if (watch->on_readable) {
+            want |= 1u << NETWORK_URING_POLL_IN;
+        } else {
+            want |= 1u << NETWORK_URING_RECV;
+        }
+    }
+    if ((watch->events & NETWORK_EV_WRITE) && watch->on_writable &&
+        !((watch->events & NETWORK_EV_EDGE) && watch->ref->write_fired)) {
+        want |= 1u << NETWORK_URING_POLL_OUT;
+    }
+    if (watch->ref->file_wait) {
+        want |= 1u << NETWORK_URING_POLL_OUT;
+    }
+    return want;
+}
+
+// brings the requests in flight in line with what the watch wants, returns 0 or -1
+static inline int network_uring_arm(network_loop_t *loop, network_watch_t *watch) {
+    struct network_uring_ref *ref = watch->ref;
+    unsigned want = network_uring_wanted(watch);
+    unsigned missing = want & ~ref->armed;
+    struct io_uring_sqe *sqe;
+
+    if (missing & (1u << NETWORK_URING_RECV)) {
+        if ((sqe = network_uring_prep(loop, ref, NETWORK_URING_RECV, IORING_OP_RECV, watch->fd)) == NULL) {
+            return -1;
+        }
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = loop->uring->bufs.bgid;
+        if (loop->uring->recv_multishot) {
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+        }
+    }
+    if (missing & (1u << NETWORK_URING_POLL_IN)) {
+        if ((sqe = network_uring_prep(loop, ref, NETWORK_URING_POLL_IN, IORING_OP_POLL_ADD, watch->fd)) == NULL) {
+            return -1;
+        }
+        sqe->poll32_events = POLLIN | POLLRDHUP;
+        // one-shot polls are armed again after the callback, which is what makes them level-triggered
+        if (watch->events & NETWORK_EV_EDGE) {
+            sqe->len = IORING_POLL_ADD_MULTI;
+        }
+    }
+    if (missing & (1u << NETWORK_URING_POLL_OUT)) {
+        if ((sqe = network_uring_prep(loop, ref, NETWORK_URING_POLL_OUT, IORING_OP_POLL_ADD, watch->fd)) == NULL) {
+            return -1;
+        }
+        sqe->poll32_events = POLLOUT;
+    }
+    if (missing & (1u << NETWORK_URING_ACCEPT)) {
+        if ((sqe = network_uring_prep(loop, ref, NETWORK_URING_ACCEPT, IORING_OP_ACCEPT, watch->fd)) == NULL) {
+            return -1;
+        }
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+
+    // kinds not wanted anymore after a network_loop_mod
+    unsigned extra = ref->armed & ~want & ~(1u << NETWORK_URING_SEND);
+    for (unsigned op = NETWORK_URING_RECV; op <= NETWORK_URING_ACCEPT; op++) {
+        if (extra & (1u << op)) {
+            network_uring_cancel(loop, ref, op);
+        }
+    }
+    return 0;
+}
+
+static inline void network_uring_mark_dirty(network_loop_t *loop, struct network_uring_ref *ref) {
+    if (!ref->dirty && ref->sending == 0) {
+        ref->dirty = 1;
+        ref->next_dirty = loop->uring->dirty;
+        loop->uring->dirty = ref;
+    }
+}
+
+// file segments at the front go out with sendfile right away, io_uring has no op for it; the bytes
+// up to the next segment become the watch's one send in flight
+static inline void network_uring_flush_watch(network_loop_t *loop, network_watch_t *watch) {
+    struct network_uring_ref *ref = watch->ref;
+    int had_files = watch->files != NULL;
+    if (network_loop_send_files(loop, watch) < 0) {
+        return;
+    }
+    if (watch->files && watch->files->ahead == 0) {
+        ref->file_wait = 1;
+        if (network_uring_arm(loop, watch) < 0) {
+            network_loop_close(loop, watch, ENOMEM);
+        }
+        return;
+    }
+    size_t len = network_loop_sendable(watch);
+    if (len == 0) {
+        if (had_files && (watch->events & NETWORK_EV_WRITE) && watch->on_writable) {
+            watch->on_writable(loop, watch, NETWORK_EV_WRITE);
+        }
+        return;
+    }
+    if (len > (1u << 30)) {
+        len = 1u << 30;
+    }
+    int zerocopy = (watch->events & NETWORK_EV_ZEROCOPY) && len >= NETWORK_LOOP_ZEROCOPY_MIN && loop->uring->send_zc;
+    struct io_uring_sqe *sqe = network_uring_prep(loop, ref, NETWORK_URING_SEND,
+                                                  zerocopy ? IORING_OP_SEND_ZC : IORING_OP_SEND, watch->fd);
+    if (sqe == NULL) {
+        network_loop_close(loop, watch, ENOMEM);
+        return;
+    }
+    // the kernel waits for room in the socket itself, a short send only comes with an error
+    sqe->addr = (uint64_t)(uintptr_t)(watch->out + watch->out_off);
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    ref->sending = len;
+    ref->zerocopy = zerocopy;
+}
+
+// one send per dirty queue, they all go out with the next io_uring_enter
+static inline void network_uring_flush(network_loop_t *loop) {
+    while (loop->uring->dirty) {
+        struct network_uring_ref *ref = loop->uring->dirty;
+        loop->uring->dirty = ref->next_dirty;
+        ref->dirty = 0;
+        if (ref->watch == NULL) {
+            network_uring_ref_release(loop->uring, ref);
+            continue;
+        }
+        // a connecting socket is marked again once it's connected
+        if (!ref->sending && !ref->file_wait && !ref->watch->connecting) {
+            network_uring_flush_watch(loop, ref->watch);
+        }
+    }
+}
+
+// cancels everything in flight and lets go of the watch; the send queue goes too, unless the kernel
+// is still reading it
+static inline void network_uring_del(network_loop_t *loop, network_watch_t *watch) {
+    struct network_uring_ref *ref = watch->ref;
+    watch->ref = NULL;
+    if (ref == NULL) {
+        return;
+    }
+    for (unsigned op = NETWORK_URING_RECV; op <= NETWORK_URING_ACCEPT; op++) {
+        if (ref->armed & (1u << op)) {
+            network_uring_cancel(loop, ref, op);
+        }
+    }
+    if (ref->sending && ref->send_buf == NULL) {
+        ref->send_buf = watch->out;
+    } else {
+        free(watch->out);
+    }
+    watch->out = NULL;
+    watch->out_off = watch->out_len = watch->out_cap = 0;
+
+    ref->watch = NULL;
+    ref->prev = NULL;
+    ref->next = loop->uring->orphans;
+    if (ref->next) ref->next->prev = ref;
+    loop->uring->orphans = ref;
+    network_uring_ref_release(loop->uring, ref);
+}
+
+static inline int network_uring_add(network_loop_t *loop, network_watch_t *watch) {
+    watch->ref = calloc(1, sizeof(*watch->ref));
+    if (watch->ref == NULL) {
+        NETWORK_ERROR("Watch allocation failed.");
+        return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+    }
+    watch->ref->watch = watch;
+    if (network_uring_arm(loop, watch) < 0) {
+        // whatever did get armed comes back cancelled
+        network_uring_del(loop, watch);
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint32_t network_uring_poll_events(int mask) {
+    uint32_t events = 0;
+    if (mask & (POLLIN | POLLRDHUP)) events |= NETWORK_EV_READ;
+    if (mask & POLLOUT) events |= NETWORK_EV_WRITE;
+    if (mask & (POLLHUP | POLLRDHUP)) events |= NETWORK_EV_HUP;
+    if (mask & POLLERR) events |= NETWORK_EV_ERROR;
+    return events;
+}
+
+static inline void network_uring_complete(network_loop_t *loop, const struct io_uring_cqe *cqe) {
+    struct network_uring_loop *uring = loop->uring;
+    if (cqe->user_data == 0) {
+        return;
+    }
+    struct network_uring_ref *ref = (struct network_uring_ref *)(uintptr_t)(cqe->user_data & ~(uint64_t)NETWORK_URING_OP_MASK);
+    unsigned op = (unsigned)(cqe->user_data & NETWORK_URING_OP_MASK);
+    int res = cqe->res;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (!more) {
+        // ops only goes down at the end, so a callback can't free ref from under us
+        ref->armed &= ~(1u << op);
+        ref->cancelling &= ~(1u << op);
+    }
+    network_watch_t *watch = ref->watch;
+
+    switch (op) {
+    case NETWORK_URING_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (watch && res > 0) {
+                network_stats_add(NETWORK_STAT_RECV_CALLS, 1);
+                network_stats_add(NETWORK_STAT_BYTES_IN, (uint64_t)res);
+                watch->stats.bytes_in += (size_t)res;
+                if (watch->on_data) {
+                    watch->on_data(loop, watch, network_uring_bufs_get(&uring->bufs, bid), (size_t)res);
+                }
+            }
+            network_uring_bufs_put(&uring->bufs, bid);
+        }
+        watch = ref->watch;
+        if (watch == NULL) {
+            break;
+        }
+        if (res == 0) {
+            network_loop_close(loop, watch, 0);
+        } else if (res == -EINVAL && uring->recv_multishot) {
+            // a kernel without multishot recv, one recv per completion from now on
+            uring->recv_multishot = 0;
+        } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+            network_loop_close(loop, watch, -res);
+        }
+        break;
+
+    case NETWORK_URING_POLL_IN:
+        if (watch && res != -ECANCELED && watch->on_readable) {
+            watch->on_readable(loop, watch, res < 0 ? NETWORK_EV_ERROR : network_uring_poll_events(res));
+        }
+        break;
+
+    case NETWORK_URING_POLL_OUT:
+        if (watch && res != -ECANCELED && watch->connecting) {
+            network_loop_connected(loop, watch);
+        } else if (watch && res != -ECANCELED && ref->file_wait) {
+            ref->file_wait = 0; // picked up by the flush below
+        } else if (watch && res != -ECANCELED) {
+            ref->write_fired = 1;
+            // with a queue the writable callback waits until the send completes
+            if (network_loop_pending(watch) == 0 && watch->on_writable) {
+                watch->on_writable(loop, watch, res < 0 ? NETWORK_EV_ERROR : network_uring_poll_events(res));
+            }
+        }
+        break;
+
+    case NETWORK_URING_SEND:
+        if (more) {
+            // zero-copy, the buffer is the kernel's until the notification that follows
+            ref->zc_res = res;
+            break;
+        }
+        if (cqe->flags & IORING_CQE_F_NOTIF) {
+            res = ref->zc_res;
+        }
+        ref->sending = 0;
+        free(ref->send_buf);
+        ref->send_buf = NULL;
+        if (watch == NULL) {
+            break;
+        }
+        if (res == -EINVAL && ref->zerocopy && uring->send_zc) {
+            uring->send_zc = 0; // sent again without zero-copy by the flush below
+            break;
+        }
+        network_stats_add(NETWORK_STAT_SEND_CALLS, 1);
+        if (res < 0) {
+            network_stats_add(NETWORK_STAT_ERRORS, 1);
+            network_loop_close(loop, watch, -res);
+            break;
+        }
+        network_stats_add(NETWORK_STAT_BYTES_OUT, (uint64_t)res);
+        network_loop_sent(watch, (size_t)res);
+        if (network_loop_pending(watch) == 0 && (watch->events & NETWORK_EV_WRITE) && watch->on_writable) {
+            watch->on_writable(loop, watch, NETWORK_EV_WRITE);
+        }
+        break;
+
+    case NETWORK_URING_ACCEPT:
+        if (res >= 0) {
+            if (watch == NULL) {
+                close(res);
+                break;
+            }
+            // multishot accept can't fill in a peer address, every completion would share one
+            struct sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            if (getpeername(res, (struct sockaddr *)&addr, &len) < 0) {
+                memset(&addr, 0, sizeof(addr));
+            }
+            if (network_reserve_fd < 0) {
+                network_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            network_accepted_sockopts(res);
+            network_stats_add(NETWORK_STAT_ACCEPTS, 1);
+            watch->on_accept(loop, watch, res, &addr);
+        } else if (watch && (res == -EMFILE || res == -ENFILE)) {
+            network_accept_shed(watch->fd);
+        } else if (watch && res != -ECANCELED && res != -EINTR && res != -ECONNABORTED) {
+            NETWORK_WARN("accept failed. %s", strerror(-res));
+        }
+        break;
+    }
+
+    watch = ref->watch;
+    if (watch) {
+        if (network_loop_pending(watch)) {
+            network_uring_mark_dirty(loop, ref);
+        }
+        if (network_uring_arm(loop, watch) < 0) {
+            network_loop_close(loop, watch, ENOMEM);
+        }
+    }
+    if (!more) {
+        ref->ops--;
+        network_uring_ref_release(uring, ref);
+    }
+}
+
+static inline void network_uring_loop_free(struct network_uring_loop *uring) {
+    // the closes still queued, then closing the ring ends every request, nothing comes back after this
+    if (network_uring_sq_ready(&uring->ring) > 0) {
+        network_uring_submit(&uring->ring, 0, 0);
+    }
+    network_uring_exit(&uring->ring);
+    network_uring_bufs_exit(&uring->bufs);
+    while (uring->orphans) {
+        struct network_uring_ref *ref = uring->orphans;
+        uring->orphans = ref->next;
+        free(ref->send_buf);
+        free(ref);
+    }
+    free(uring);
+}
+
+static inline struct network_uring_loop *network_uring_loop_create(void) {
+    struct network_uring_loop *uring = calloc(1, sizeof(*uring));
+    if (uring == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // the ring starts disabled so the worker thread that first submits becomes its single issuer
+    unsigned flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                     IORING_SETUP_R_DISABLED;
+    if (network_uring_init(&uring->ring, NETWORK_URING_ENTRIES, NETWORK_URING_ENTRIES * 4, flags) < 0 &&
+        (errno != EINVAL || network_uring_init(&uring->ring, NETWORK_URING_ENTRIES, NETWORK_URING_ENTRIES * 4, 0) < 0)) {
+        free(uring);
+        return NULL;
+    }
+    if (network_uring_bufs_init(&uring->ring, &uring->bufs, 0, NETWORK_URING_BUFFERS, NETWORK_URING_BUFFER_SIZE) < 0) {
+        int err = errno;
+        network_uring_exit(&uring->ring);
+        free(uring);
+        errno = err;
+        return NULL;
+    }
+    for (unsigned i = 0; i < NETWORK_URING_BUFFERS; i++) {
+        network_uring_bufs_put(&uring->bufs, (uint16_t)i);
+    }
+    network_uring_bufs_publish(&uring->bufs);
+    uring->recv_multishot = 1;
+    uring->send_zc = 1;
+    return uring;
+}
+
+static inline int network_uring_run_once(network_loop_t *loop, int timeout_ms) {
+    struct network_uring_loop *uring = loop->uring;
+    network_uring_flush(loop);
+    // submitting and waiting is the one syscall of a batch
+    unsigned wait = network_uring_peek_cqe(&uring->ring) == NULL && timeout_ms != 0;
+    if (network_uring_submit(&uring->ring, wait, timeout_ms) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        int err = errno;
+        NETWORK_ERROR("io_uring_enter failed. %s", strerror(err));
+        return network_fail(NETWORK_URING_FAILED, err);
+    }
+
+    int n = 0;
+    struct io_uring_cqe *cqe;
+    uint64_t started = network_stats_start(), lap = started;
+    loop->dispatching = 1;
+    int fired = network_loop_expire(loop);
+    if (fired) {
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap); // the timers that ran, as one
+    }
+    while (n < loop->maxevents && (cqe = network_uring_peek_cqe(&uring->ring)) != NULL) {
+        struct io_uring_cqe done = *cqe;
+        network_uring_cqe_seen(&uring->ring);
+        network_uring_complete(loop, &done);
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap);
+        n++;
+    }
+    network_uring_bufs_publish(&uring->bufs);
+    loop->dispatching = 0;
+    network_loop_closed(loop);
+    network_stats_add(NETWORK_STAT_LOOP_ITERATIONS, 1);
+    network_stats_lap(NETWORK_HIST_LOOP_ITERATION, &started);
+    return n + fired;
+}
+
+#endif // NETWORK_LOOP_IO_URING
+
+inline network_loop_t *network_loop_create_backend(int maxevents, int backend) {
+    network_loop_t *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        NETWORK_ERROR("Loop allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    loop->maxevents = maxevents > 0 ? maxevents : NETWORK_LOOP_MAX_EVENTS;
+    loop->epfd = -1;
+    loop->timers.now = (uint64_t)network_now_ms();
+
+    if (backend == NETWORK_BACKEND_AUTO) {
+        const char *env = getenv("NETWORK_LOOP_BACKEND");
+        if (env && strcmp(env, "epoll") == 0) {
+            backend = NETWORK_BACKEND_EPOLL;
+        } else if (env && strcmp(env, "io_uring") == 0) {
+            backend = NETWORK_BACKEND_IO_URING;
+        }
+    }
+    if (backend != NETWORK_BACKEND_EPOLL) {
+#ifdef NETWORK_LOOP_IO_URING
+        loop->uring = network_uring_loop_create();
+        if (loop->uring) {
+            loop->backend = NETWORK_BACKEND_IO_URING;
+            return loop;
+        }
+        if (backend == NETWORK_BACKEND_IO_URING) {
+            int err = errno;
+            NETWORK_ERROR("io_uring setup failed. %s", strerror(err));
+            network_fail(NETWORK_URING_FAILED, err);
+            free(loop);
+            return NULL;
+        }
+        NETWORK_INFO("io_uring setup failed, using epoll. %s", strerror(errno));
+#else
+        if (backend == NETWORK_BACKEND_IO_URING) {
+            NETWORK_ERROR("io_uring backend not compiled in, build with -DNETWORK_LOOP_IO_URING.");
+            network_fail(NETWORK_NOT_SUPPORTED, 0);
+            free(loop);
+            return NULL;
+        }
+#endif
+    }
+
+    loop->backend = NETWORK_BACKEND_EPOLL;
+    loop->events = malloc((size_t)loop->maxevents * sizeof(struct epoll_event));
+    loop->read_buf = malloc(NETWORK_LOOP_READ_SIZE);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->events == NULL || loop->read_buf == NULL || loop->epfd < 0) {
+        int err = errno;
+        NETWORK_ERROR("Loop creation failed. %s", strerror(err));
+        network_fail(loop->epfd < 0 ? NETWORK_EPOLL_FAILED : NETWORK_OUT_OF_MEMORY, err);
+        if (loop->epfd >= 0) close(loop->epfd);
+        free(loop->events);
+        free(loop->read_buf);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+inline network_loop_t *network_loop_create(int maxevents) {
+    return network_loop_create_backend(maxevents, NETWORK_BACKEND_AUTO);
+}
+
+inline void network_loop_destroy(network_loop_t *loop) {
+    if (loop == NULL) {
+        return;
+    }
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        network_uring_loop_free(loop->uring);
+    }
+#endif
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+    }
+    free(loop->events);
+    free(loop->read_buf);
+    free(loop);
+}
+
+inline int network_loop_add(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    network_loop_watch_init(watch, events);
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        if (network_uring_add(loop, watch) < 0) {
+            return -1;
+        }
+        loop->watches++;
+        watch->added = 1;
+        return 0;
+    }
+#endif
+    if (network_loop_epoll_ctl(loop, EPOLL_CTL_ADD, watch, events) < 0) {
+        return -1;
+    }
+    loop->watches++;
+    watch->added = 1;
+    return 0;
+}
+
+inline int network_loop_mod(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    watch->events = events;
+    watch->write_armed = 0;
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        watch->ref->write_fired = 0;
+        return network_uring_arm(loop, watch);
+    }
+#endif
+    // keep EV_WRITE while there is something queued
+    if (network_loop_pending(watch) && !(events & NETWORK_EV_WRITE)) {
+        events |= NETWORK_EV_WRITE;
+        watch->write_armed = 1;
+    }
+    return network_loop_epoll_ctl(loop, EPOLL_CTL_MOD, watch, events);
+}
+
+inline int network_loop_del(network_loop_t *loop, network_watch_t *watch) {
+    if (watch->added) {
+        watch->added = 0;
+        loop->watches--;
+    }
+    network_loop_timer_stop(loop, &watch->timer);
+    watch->connecting = 0;
+    while (watch->files) {
+        network_loop_file_pop(watch);
+    }
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        network_uring_del(loop, watch);
+        return 0;
+    }
+#endif
+    free(watch->out);
+    watch->out = NULL;
+    watch->out_off = watch->out_len = watch->out_cap = 0;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL) < 0) {
+        int err = errno;
+        NETWORK_ERROR("epoll_ctl failed. %s", strerror(err));
+        return network_fail(NETWORK_EPOLL_FAILED, err);
+    }
+    return 0;
+}
+
+inline int network_loop_connect(network_loop_t *loop, network_watch_t *watch, const struct sockaddr *addr,
+                                socklen_t addrlen, uint32_t events, int timeout_ms) {
+    socket_t fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        int err = errno;
+        NETWORK_ERROR("Socket creation failed. %s", strerror(err));
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+    network_apply_sockopts(fd, &network_opts, NETWORK_SOCKOPTS_CLIENT);
+    if (connect(fd, addr, addrlen) < 0 && errno != EINPROGRESS && errno != EINTR) {
+        int err = errno;
+        NETWORK_ERROR("Connection failed. %s", strerror(err));
+        close(fd);
+        return network_fail(SOCKET_CONNECT_FAILED, err);
+    }
+
+    // even a connect that got through right away is reported from the loop, never from in here;
+    // added waiting for nothing, a recv armed on io_uring would see the refused connect as EOF
+    watch->fd = fd;
+    if (network_loop_add(loop, watch, 0) < 0) {
+        close(fd);
+        watch->fd = -1;
+        return -1;
+    }
+    watch->events = events;
+    watch->connecting = 1;
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        network_uring_arm(loop, watch);
+    } else
+#endif
+    {
+        // only writable while connecting, write_armed keeps sends from changing that
+        watch->write_armed = 1;
+        if (network_loop_epoll_ctl(loop, EPOLL_CTL_MOD, watch, NETWORK_EV_WRITE) < 0) {
+            network_loop_del(loop, watch);
+            close(fd);
+            watch->fd = -1;
+            return -1;
+        }
+    }
+    if (timeout_ms > 0) {
+        network_loop_set_timeout(loop, watch, (uint64_t)timeout_ms);
+    }
+    return 0;
+}
+
+// sends as much of the queue as the socket takes, returns -1 after closing the watch on errors
+static inline int network_loop_flush(network_loop_t *loop, network_watch_t *watch) {
+    if (watch->connecting) {
+        return 0; // network_loop_connected takes it from here
+    }
+    for (;;) {
+        size_t len = network_loop_sendable(watch);
+        if (len > 0) {
+            ssize_t sent = network_send_all(watch->fd, watch->out + watch->out_off, len);
+            if (sent < 0) {
+                network_loop_close(loop, watch, network_last_errno());
+                return -1;
+            }
+            network_loop_sent(watch, (size_t)sent);
+            if ((size_t)sent < len) {
+                return 0; // full, EV_WRITE stays on
+            }
+        }
+        if (watch->files == NULL) {
+            break;
+        }
+        if (network_loop_send_files(loop, watch) < 0) {
+            return -1;
+        }
+        if (watch->files && watch->files->ahead == 0) {
+            return 0;
+        }
+    }
+    if (watch->write_armed) {
+        watch->write_armed = 0;
+        network_loop_epoll_ctl(loop, EPOLL_CTL_MOD, watch, watch->events);
+    }
+    return 0;
+}
+
+// adds EV_WRITE until the queue drains, returns -1 after closing the watch on errors
+static inline int network_loop_want_write(network_loop_t *loop, network_watch_t *watch) {
+    if (network_loop_pending(watch) && !(watch->events & NETWORK_EV_WRITE) && !watch->write_armed) {
+        watch->write_armed = 1;
+        if (network_loop_epoll_ctl(loop, EPOLL_CTL_MOD, watch, watch->events | NETWORK_EV_WRITE) < 0) {
+            network_loop_close(loop, watch, network_last_errno());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+inline int network_loop_send(network_loop_t *loop, network_watch_t *watch, const void *data, size_t len) {
+    if (watch->closed) {
+        return -1;
+    }
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        // copied into the queue, one send per socket goes out with the batch's io_uring_enter
+        if (network_loop_queue(loop, watch, data, len, watch->ref->sending ? &watch->ref->send_buf : NULL) < 0) {
+            return -1;
+        }
+        network_uring_mark_dirty(loop, watch->ref);
+        return 0;
+    }
+#endif
+    // nothing queued, try the socket directly so the common case never copies
+    if (watch->out_len == watch->out_off && watch->files == NULL && !watch->connecting) {
+        ssize_t sent = network_send_all(watch->fd, data, len);
+        if (sent < 0) {
+            network_loop_close(loop, watch, network_last_errno());
+            return -1;
+        }
+        watch->stats.bytes_out += (size_t)sent;
+        if ((size_t)sent == len) {
+            return 0;
+        }
+        data = (const char *)data + sent;
+        len -= (size_t)sent;
+    }
+
+    if (network_loop_queue(loop, watch, data, len, NULL) < 0) {
+        return -1;
+    }
+    return network_loop_want_write(loop, watch);
+}
+
+inline int network_loop_send_file(network_loop_t *loop, network_watch_t *watch, int fd, int64_t offset, size_t len, int flags) {
+    if (watch->closed || len == 0) {
+        if (flags & NETWORK_FILE_CLOSE) {
+            close(fd);
+        }
+        return watch->closed ? -1 : 0;
+    }
+    if (network_loop_file_push(loop, watch, fd, offset, len, flags) < 0) {
+        return -1;
+    }
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        network_uring_mark_dirty(loop, watch->ref);
+        return 0;
+    }
+#endif
+    if (network_loop_flush(loop, watch) < 0) {
+        return -1;
+    }
+    return network_loop_want_write(loop, watch);
+}
+
+static inline void network_loop_accept(network_loop_t *loop, network_watch_t *listener);
+
+static inline void network_loop_accept_retry(network_loop_t *loop, network_timer_t *timer) {
+    network_loop_accept(loop, timer->user);
+}
+
+// takes connections off a listener until its queue is empty and hands each to on_accept
+static inline void network_loop_accept(network_loop_t *loop, network_watch_t *listener) {
+    network_accepted conns[NETWORK_LOOP_ACCEPT_BATCH];
+    int n;
+    // a full batch means there may be more, which an edge-triggered listener won't report again
+    do {
+        n = network_accept_batch(listener->fd, conns, NETWORK_LOOP_ACCEPT_BATCH);
+        for (int i = 0; i < n; i++) {
+            if (listener->closed) {
+                close(conns[i].fd);
+                continue;
+            }
+            listener->on_accept(loop, listener, conns[i].fd, &conns[i].addr);
+        }
+    } while (n == NETWORK_LOOP_ACCEPT_BATCH && !listener->closed);
+    // no reserve fd could be opened, so connections may be left in the queue unshed, and an
+    // edge-triggered listener isn't told about them again; the listener's timer has another go,
+    // unless network_loop_set_timeout has it
+    if (network_reserve_fd < 0 && !listener->closed && !network_loop_timer_active(&listener->timer)) {
+        listener->timer.on_expire = network_loop_accept_retry;
+        listener->timer.user = listener;
+        network_loop_timer_start(loop, &listener->timer, NETWORK_LOOP_ACCEPT_RETRY_MS);
+    }
+}
+
+// reads until the socket is empty, so an edge-triggered socket is ready for its next edge
+static inline void network_loop_drain(network_loop_t *loop, network_watch_t *watch) {
+    for (;;) {
+        ssize_t n = recv(watch->fd, loop->read_buf, NETWORK_LOOP_READ_SIZE, 0);
+        network_count_recv(n);
+        if (n > 0) {
+            watch->stats.bytes_in += (size_t)n;
+            if (watch->on_data) {
+                watch->on_data(loop, watch, loop->read_buf, (size_t)n);
+            }
+            if (watch->closed) {
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            network_loop_close(loop, watch, 0);
+            return;
+        }
+        int err = errno;
+        if (err == EINTR) {
+            continue;
+        }
+        if (err != EAGAIN && err != EWOULDBLOCK) {
+            network_loop_close(loop, watch, err);
+        }
+        return;
+    }
+}
+
+static inline void network_loop_dispatch(network_loop_t *loop, network_watch_t *watch, uint32_t ev) {
+    if (watch->connecting) {
+        network_loop_connected(loop, watch);
+        return;
+    }
+    uint32_t events = 0;
+    if (ev & (EPOLLIN | EPOLLRDHUP)) events |= NETWORK_EV_READ;
+    if (ev & EPOLLOUT) events |= NETWORK_EV_WRITE;
+    if (ev & (EPOLLHUP | EPOLLRDHUP)) events |= NETWORK_EV_HUP;
+    if (ev & EPOLLERR) events |= NETWORK_EV_ERROR;
+
+    if (events & (NETWORK_EV_READ | NETWORK_EV_HUP | NETWORK_EV_ERROR)) {
+        if (watch->on_accept) {
+            network_loop_accept(loop, watch);
+        } else if (watch->on_readable) {
+            watch->on_readable(loop, watch, events);
+        } else {
+            network_loop_drain(loop, watch);
+        }
+        if (watch->closed) {
+            return;
+        }
+    }
+    if (events & NETWORK_EV_WRITE) {
+        if (network_loop_flush(loop, watch) < 0) {
+            return;
+        }
+        if (network_loop_pending(watch) == 0 && (watch->events & NETWORK_EV_WRITE) && watch->on_writable) {
+            watch->on_writable(loop, watch, events);
+        }
+        if (watch->closed) {
+            return;
+        }
+    }
+    if ((events & NETWORK_EV_ERROR) && !watch->on_readable && !watch->on_accept) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        network_loop_close(loop, watch, err ? err : ECONNRESET);
+    }
+}
+
+inline int network_loop_run_once(network_loop_t *loop, int timeout_ms) {
+    timeout_ms = network_loop_wait_ms(loop, timeout_ms);
+#ifdef NETWORK_LOOP_IO_URING
+    if (loop->uring) {
+        return network_uring_run_once(loop, timeout_ms);
+    }
+#endif
+    int n = epoll_wait(loop->epfd, loop->events, loop->maxevents, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        int err = errno;
+        NETWORK_ERROR("epoll_wait failed. %s", strerror(err));
+        return network_fail(NETWORK_EPOLL_FAILED, err);
+    }
+
+    uint64_t started = network_stats_start(), lap = started;
+    loop->dispatching = 1;
+    // timers first, an idle timeout that runs out now wins over data that arrived just in time
+    int fired = network_loop_expire(loop);
+    if (fired) {
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap); // the timers that ran, as one
+    }
+    for (int i = 0; i < n; i++) {
+        network_watch_t *watch = loop->events[i].data.ptr;
+        if (!watch->closed) {
+            network_loop_dispatch(loop, watch, loop->events[i].events);
+        }
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap);
+    }
+    loop->dispatching = 0;
+    network_loop_closed(loop);
+    network_stats_add(NETWORK_STAT_LOOP_ITERATIONS, 1);
+    network_stats_lap(NETWORK_HIST_LOOP_ITERATION, &started);
+    return n + fired;
+}
+
+struct network_server_worker {
+    network_server_t *server;
+    int index;
+    pthread_t thread;
+    network_loop_t *loop;
+    network_watch_t listener;
+    network_watch_t wake;         // eventfd, network_server_stop writes to it to get the loop out of epoll_wait
+};
+
+static inline void network_server_accepted(network_loop_t *loop, network_watch_t *listener, socket_t fd,
+                                           const struct sockaddr_storage *addr) {
+    struct network_server_worker *worker = listener->user;
+    worker->server->on_accept(loop, fd, addr, worker->server->user);
+}
+
+static inline void network_server_wake(network_loop_t *loop, network_watch_t *wake, uint32_t events) {
+    (void)events;
+    uint64_t value;
+    if (read(wake->fd, &value, sizeof(value)) < 0) {
+        // EAGAIN, somebody else already read it
+    }
+    network_loop_stop(loop);
+}
+
+static inline void *network_server_run(void *arg) {
+    struct network_server_worker *worker = arg;
+    network_server_t *server = worker->server;
+
+    if (server->flags & NETWORK_SERVER_PIN_CPUS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->index % (cpus > 0 ? cpus : 1), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (server->on_start) {
+        server->on_start(worker->loop, worker->index, server->user);
+    }
+    network_loop_run(worker->loop);
+    if (server->on_stop) {
+        server->on_stop(worker->loop, worker->index, server->user);
+    }
+    return NULL;
+}
+
+// undoes what network_server_start did for the first count workers
+static inline void network_server_free(network_server_t *server, int count) {
+    for (int i = 0; i < count; i++) {
+        struct network_server_worker *worker = &server->worker_state[i];
+        if (worker->loop) {
+            network_loop_destroy(worker->loop);
+        }
+        if (worker->listener.fd >= 0) {
+            close(worker->listener.fd);
+        }
+        if (worker->wake.fd >= 0) {
+            close(worker->wake.fd);
+        }
+    }
+    free(server->worker_state);
+    server->worker_state = NULL;
+}
+
+inline int network_server_start(network_server_t *server) {
+    if (server->on_accept == NULL) {
+        NETWORK_ERROR("Server needs an on_accept callback.");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
+    }
+    if (server->workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server->workers = cpus > 0 ? (int)cpus : 1;
+    }
+    server->worker_state = calloc((size_t)server->workers, sizeof(struct network_server_worker));
+    if (server->worker_state == NULL) {
+        NETWORK_ERROR("Server allocation failed.");
+        return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+    }
+
+    // every listener is bound before any worker runs, so a port in use fails here and not in a thread
+    snprintf(server->bound_port, sizeof(server->bound_port), "%s", server->port ? server->port : "8080");
+    for (int i = 0; i < server->workers; i++) {
+        struct network_server_worker *worker = &server->worker_state[i];
+        worker->server = server;
+        worker->index = i;
+        worker->listener.fd = network_listen_ex(server->ip, server->bound_port, server->backlog,
+                                                NETWORK_LISTEN_REUSEADDR | NETWORK_LISTEN_REUSEPORT | NETWORK_LISTEN_NONBLOCK);
+        if (i == 0 && worker->listener.fd >= 0) {
+            // the rest join whatever port the first one got
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            getsockname(worker->listener.fd, (struct sockaddr *)&addr, &len);
+            snprintf(server->bound_port, sizeof(server->bound_port), "%d", ntohs(addr.sin_port));
+        }
+        worker->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->loop = network_loop_create_backend(0, server->backend);
+        if (worker->listener.fd < 0 || worker->wake.fd < 0 || worker->loop == NULL) {
+            network_server_free(server, i + 1);
+            return -1;
+        }
+        worker->listener.on_accept = network_server_accepted;
+        worker->listener.user = worker;
+        worker->wake.on_readable = network_server_wake;
+        worker->wake.user = worker;
+        if (network_loop_add(worker->loop, &worker->listener, NETWORK_EV_READ | NETWORK_EV_EDGE) < 0 ||
+            network_loop_add(worker->loop, &worker->wake, NETWORK_EV_READ) < 0) {
+            network_server_free(server, i + 1);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < server->workers; i++) {
+        int rc = pthread_create(&server->worker_state[i].thread, NULL, network_server_run, &server->worker_state[i]);
+        if (rc != 0) {
+            NETWORK_ERROR("Worker thread creation failed. %s", strerror(rc));
+            uint64_t one = 1;
+            for (int j = 0; j < i; j++) {
+                if (write(server->worker_state[j].wake.fd, &one, sizeof(one)) < 0) {
+                    NETWORK_WARN("Waking worker %d failed. %s", j, strerror(errno));
+                }
+                pthread_join(server->worker_state[j].thread, NULL);
+            }
+            network_server_free(server, server->workers);
+            return network_fail(NETWORK_THREAD_FAILED, rc);
+        }
+    }
+    server->running = 1;
+    return 0;
+}
+
+inline void network_server_stop(network_server_t *server) {
+    if (!server->running) {
+        return;
+    }
+    uint64_t one = 1;
+    for (int i = 0; i < server->workers; i++) {
+        if (write(server->worker_state[i].wake.fd, &one, sizeof(one)) < 0) {
+            NETWORK_WARN("Waking worker %d failed. %s", i, strerror(errno));
+        }
+    }
+    for (int i = 0; i < server->workers; i++) {
+        pthread_join(server->worker_state[i].thread, NULL);
+    }
+    network_server_free(server, server->workers);
+    server->running = 0;
+}
+
+#endif // LINUX_SOCKETS_IMPL
+
+#ifdef WINSOCK_IMPL
+
+#ifndef NETWORK_IOCP_ACCEPTS
+#define NETWORK_IOCP_ACCEPTS 32 // AcceptEx calls every listener keeps in flight
+#endif
+#ifndef WSA_FLAG_NO_HANDLE_INHERIT
+#define WSA_FLAG_NO_HANDLE_INHERIT 0x80 // older SDK headers lack it
+#endif
+
+// completion keys; sockets are tied to the port with key 0, anything else was posted to it
+#define NETWORK_IOCP_KEY_WAKE    1 // stops the loop, network_server_stop sends it
+#define NETWORK_IOCP_KEY_HANDOFF 2 // server mode, a connection the accepting worker passed on
+
+// what a request is for
+#define NETWORK_IOCP_RECV    0 // zero-byte WSARecv, completes once there is something to read
+#define NETWORK_IOCP_WRITE   1 // posted straight to the port, overlapped sends never have to wait for room
+#define NETWORK_IOCP_SEND    2 // WSASend of the queue
+#define NETWORK_IOCP_FILE    3 // TransmitFile of the segment at the front of the queue
+#define NETWORK_IOCP_CONNECT 4 // ConnectEx
+#define NETWORK_IOCP_ACCEPT  5 // AcceptEx, one of a listener's NETWORK_IOCP_ACCEPTS
+
+#define NETWORK_IOCP_ADDR_SIZE (sizeof(struct sockaddr_storage) + 16) // room AcceptEx wants per address
+
+struct network_iocp_op {
+    OVERLAPPED ov;                 // first, the OVERLAPPED a completion hands back is the op
+    struct network_iocp_ref *ref;
+    int kind;
+};
+
+struct network_iocp_accept {
+    struct network_iocp_op op;
+    socket_t fd;                   // the socket AcceptEx accepts into, INVALID_SOCKET while not in flight
+    char addrs[2 * NETWORK_IOCP_ADDR_SIZE];
+};
+
+// Requests point at this and not at the watch, the same as network_uring_ref, so the watch can be
+// freed in on_close while cancelled requests still have to come back. Freed once the last one is back.
+struct network_iocp_ref {
+    network_watch_t *watch;        // NULL once the watch was deleted
+    unsigned ops;                  // requests in flight
+    unsigned armed;                // 1 << kind for every kind in flight, accepts aside
+    int write_fired;               // edge-triggered EV_WRITE was reported since add/mod
+    size_t sending;                // bytes of the WSASend in flight, the queue doesn't move while set
+    char *send_buf;                // what it reads from once watch->out moved or went away
+    struct network_iocp_op recv, write, send, file, connect;
+    struct network_iocp_accept *accepts; // a listener's NETWORK_IOCP_ACCEPTS
+    int family;                    // a listener's address family, for the sockets AcceptEx accepts into
+    struct network_iocp_ref *prev, *next; // deleted refs still waiting for requests
+};
+
+struct network_iocp_loop {
+    HANDLE port;
+    LPFN_ACCEPTEX accept_ex;       // extension functions, looked up once per loop
+    LPFN_GETACCEPTEXSOCKADDRS accept_addrs;
+    LPFN_CONNECTEX connect_ex;
+    network_server_t *server;      // server mode, whose on_accept gets the connections handed over
+    struct network_iocp_ref *orphans;
+};
+
+// a connection the accepting worker of network_server_start posts to another worker
+struct network_iocp_handoff {
+    socket_t fd;
+    struct sockaddr_storage addr;
+};
+
+static inline void network_iocp_ref_release(struct network_iocp_loop *iocp, struct network_iocp_ref *ref) {
+    if (ref->watch || ref->ops) {
+        return;
+    }
+    if (ref->prev) {
+        ref->prev->next = ref->next;
+    } else {
+        iocp->orphans = ref->next;
+    }
+    if (ref->next) {
+        ref->next->prev = ref->prev;
+    }
+    free(ref->send_buf);
+    free(ref->accepts);
+    free(ref);
+}
+
+// counts a request that was just issued, returns 0 or the error it failed with right away
+static inline int network_iocp_issued(struct network_iocp_ref *ref, int kind, BOOL ok) {
+    if (!ok) {
+        int err = WSAGetLastError();
+        if (err != WSA_IO_PENDING) {
+            return err;
+        }
+    }
+    // a request that succeeded right away still completes through the port
+    ref->ops++;
+    if (kind != NETWORK_IOCP_ACCEPT) {
+        ref->armed |= 1u << kind;
+    }
+    return 0;
+}
+
+// the error a request came back with, 0 if it didn't fail
+static inline int network_iocp_error(const struct network_iocp_op *op, socket_t fd) {
+    if (op->ov.Internal == 0) {
+        return 0;
+    }
+    DWORD bytes = 0, flags = 0;
+    if (!WSAGetOverlappedResult(fd, (LPWSAOVERLAPPED)&op->ov, &bytes, FALSE, &flags)) {
+        return WSAGetLastError();
+    }
+    return 0;
+}
+
+static inline int network_iocp_post_recv(network_watch_t *watch) {
+    struct network_iocp_ref *ref = watch->overlapped;
+    WSABUF buf;
+    DWORD flags = 0;
+    buf.buf = NULL;
+    buf.len = 0;
+    memset(&ref->recv.ov, 0, sizeof(ref->recv.ov));
+    return network_iocp_issued(ref, NETWORK_IOCP_RECV,
+                               WSARecv(watch->fd, &buf, 1, NULL, &flags, (LPWSAOVERLAPPED)&ref->recv.ov, NULL) == 0);
+}
+
+static inline int network_iocp_post_accept(network_loop_t *loop, network_watch_t *listener, struct network_iocp_accept *accept) {
+    struct network_iocp_ref *ref = listener->overlapped;
+    accept->fd = WSASocketW(ref->family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+    if (accept->fd == INVALID_SOCKET) {
+        return WSAGetLastError();
+    }
+    DWORD bytes = 0;
+    memset(&accept->op.ov, 0, sizeof(accept->op.ov));
+    int err = network_iocp_issued(ref, NETWORK_IOCP_ACCEPT,
+                                  loop->iocp->accept_ex(listener->fd, accept->fd, accept->addrs, 0, NETWORK_IOCP_ADDR_SIZE,
+                                                        NETWORK_IOCP_ADDR_SIZE, &bytes, &accept->op.ov));
+    if (err) {
+        closesocket(accept->fd);
+        accept->fd = INVALID_SOCKET;
+    }
+    return err;
+}
+
+// the kinds of request a watch should have in flight, sends aside
+static inline unsigned network_iocp_wanted(const network_watch_t *watch) {
+    unsigned want = 0;
+    if (watch->connecting) {
+        return 0; // the ConnectEx comes first
+    }
+    if (watch->events & NETWORK_EV_READ) {
+        want |= 1u << (watch->on_accept ? NETWORK_IOCP_ACCEPT : NETWORK_IOCP_RECV);
+    }
+    if ((watch->events & NETWORK_EV_WRITE) && watch->on_writable &&
+        !((watch->events & NETWORK_EV_EDGE) && watch->overlapped->write_fired)) {
+        want |= 1u << NETWORK_IOCP_WRITE;
+    }
+    return want;
+}
+
+// brings the requests in flight in line with what the watch wants, returns 0 or the error
+static inline int network_iocp_arm(network_loop_t *loop, network_watch_t *watch) {
+    struct network_iocp_ref *ref = watch->overlapped;
+    unsigned want = network_iocp_wanted(watch);
+    int err = 0;
+
+    if ((want & (1u << NETWORK_IOCP_RECV)) && !(ref->armed & (1u << NETWORK_IOCP_RECV))) {
+        err = network_iocp_post_recv(watch);
+    }
+    // with a queue, the writable callback waits for the send to complete
+    if (!err && (want & (1u << NETWORK_IOCP_WRITE)) && !(ref->armed & (1u << NETWORK_IOCP_WRITE)) &&
+        network_loop_pending(watch) == 0) {
+        memset(&ref->write.ov, 0, sizeof(ref->write.ov));
+        err = network_iocp_issued(ref, NETWORK_IOCP_WRITE, PostQueuedCompletionStatus(loop->iocp->port, 0, 0, &ref->write.ov));
+    }
+    if (!err && (want & (1u << NETWORK_IOCP_ACCEPT))) {
+        if (ref->accepts == NULL) {
+            struct sockaddr_storage addr;
+            int len = sizeof(addr);
+            if (getsockname(watch->fd, (struct sockaddr *)&addr, &len) != 0) {
+                return WSAGetLastError();
+            }
+            ref->family = addr.ss_family;
+            ref->accepts = calloc(NETWORK_IOCP_ACCEPTS, sizeof(*ref->accepts));
+            if (ref->accepts == NULL) {
+                return WSAENOBUFS;
+            }
+            for (int i = 0; i < NETWORK_IOCP_ACCEPTS; i++) {
+                ref->accepts[i].op.ref = ref;
+                ref->accepts[i].op.kind = NETWORK_IOCP_ACCEPT;
+                ref->accepts[i].fd = INVALID_SOCKET;
+            }
+        }
+        for (int i = 0; i < NETWORK_IOCP_ACCEPTS && !err; i++) {
+            if (ref->accepts[i].fd == INVALID_SOCKET) {
+                err = network_iocp_post_accept(loop, watch, &ref->accepts[i]);
+                if (err == WSAECONNRESET) {
+                    err = 0; // that connection is gone, the next arm tries again
+                }
+            }
+        }
+    }
+
+    // kinds not wanted anymore after a network_loop_mod; a posted WRITE can't be taken back,
+    // it's ignored when it comes
+    if ((ref->armed & (1u << NETWORK_IOCP_RECV)) && !(want & (1u << NETWORK_IOCP_RECV))) {
+        CancelIoEx((HANDLE)watch->fd, &ref->recv.ov);
+    }
+    if (ref->accepts && !(want & (1u << NETWORK_IOCP_ACCEPT))) {
+        for (int i = 0; i < NETWORK_IOCP_ACCEPTS; i++) {
+            if (ref->accepts[i].fd != INVALID_SOCKET) {
+                CancelIoEx((HANDLE)watch->fd, &ref->accepts[i].op.ov);
+            }
+        }
+    }
+    return err;
+}
+
+// keeps one send in flight while something is queued: the file segment at the front with
+// TransmitFile, else the bytes up to the next segment with WSASend; returns 0 or the error
+static inline int network_iocp_flush(network_watch_t *watch) {
+    struct network_iocp_ref *ref = watch->overlapped;
+    if (watch->connecting || (ref->armed & ((1u << NETWORK_IOCP_SEND) | (1u << NETWORK_IOCP_FILE)))) {
+        return 0;
+    }
+    if (watch->files && watch->files->ahead == 0) {
+        struct network_file_segment *file = watch->files;
+        HANDLE handle = (HANDLE)_get_osfhandle(file->fd);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return ERROR_INVALID_HANDLE;
+        }
+        // TransmitFile takes at most 2GB - 1 per call, and the offset from the OVERLAPPED
+        DWORD chunk = file->left > INT_MAX - 1 ? INT_MAX - 1 : (DWORD)file->left;
+        memset(&ref->file.ov, 0, sizeof(ref->file.ov));
+        ref->file.ov.Offset = (DWORD)((uint64_t)file->offset & 0xffffffffu);
+        ref->file.ov.OffsetHigh = (DWORD)((uint64_t)file->offset >> 32);
+        return network_iocp_issued(ref, NETWORK_IOCP_FILE, TransmitFile(watch->fd, handle, chunk, 0, &ref->file.ov, NULL, 0));
+    }
+    size_t len = network_loop_sendable(watch);
+    if (len == 0) {
+        return 0;
+    }
+    // the kernel holds on to the bytes until it completes, which is what the queue is there for
+    WSABUF buf;
+    buf.buf = watch->out + watch->out_off;
+    buf.len = len > INT_MAX ? INT_MAX : (ULONG)len;
+    memset(&ref->send.ov, 0, sizeof(ref->send.ov));
+    int err = network_iocp_issued(ref, NETWORK_IOCP_SEND,
+                                  WSASend(watch->fd, &buf, 1, NULL, 0, (LPWSAOVERLAPPED)&ref->send.ov, NULL) == 0);
+    if (err == 0) {
+        ref->sending = buf.len;
+    }
+    return err;
+}
+
+// reads until the socket is empty, like network_loop_drain on epoll
+static inline void network_iocp_drain(network_loop_t *loop, network_watch_t *watch) {
+    for (;;) {
+        int n = recv(watch->fd, loop->read_buf, NETWORK_LOOP_READ_SIZE, 0);
+        network_count_recv(n);
+        if (n > 0) {
+            watch->stats.bytes_in += (size_t)n;
+            if (watch->on_data) {
+                watch->on_data(loop, watch, loop->read_buf, (size_t)n);
+            }
+            if (watch->closed) {
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            network_loop_close(loop, watch, 0);
+            return;
+        }
+        int err = WSAGetLastError();
+        if (err != WSAEWOULDBLOCK) {
+            network_loop_close(loop, watch, err);
+        }
+        return;
+    }
+}
+
+static inline void network_iocp_accepted(network_loop_t *loop, network_watch_t *listener, struct network_iocp_accept *accept, int err) {
+    socket_t fd = accept->fd;
+    accept->fd = INVALID_SOCKET; // issued again by the arm after the completion
+    if (listener == NULL || err) {
+        closesocket(fd);
+        if (listener && err != WSA_OPERATION_ABORTED && err != WSAECONNRESET) {
+            NETWORK_WARN("AcceptEx failed. %d", err);
+        }
+        return;
+    }
+    // gives it the listener's options and makes getpeername and shutdown work on it
+    if (setsockopt(fd, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char *)&listener->fd, sizeof(listener->fd)) != 0 ||
+        network_set_nonblocking(fd) < 0) {
+        NETWORK_WARN("Setting up an accepted socket failed. %d", WSAGetLastError());
+        closesocket(fd);
+        return;
+    }
+    struct sockaddr *local = NULL, *peer = NULL;
+    int local_len = 0, peer_len = 0;
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    loop->iocp->accept_addrs(accept->addrs, 0, NETWORK_IOCP_ADDR_SIZE, NETWORK_IOCP_ADDR_SIZE,
+                             &local, &local_len, &peer, &peer_len);
+    if (peer && peer_len > 0 && (size_t)peer_len <= sizeof(addr)) {
+        memcpy(&addr, peer, (size_t)peer_len);
+    }
+    network_accepted_sockopts(fd);
+    network_stats_add(NETWORK_STAT_ACCEPTS, 1);
+    listener->on_accept(loop, listener, fd, &addr);
+}
+
+static inline void network_iocp_complete(network_loop_t *loop, const OVERLAPPED_ENTRY *entry) {
+    struct network_iocp_loop *iocp = loop->iocp;
+    if (entry->lpCompletionKey == NETWORK_IOCP_KEY_WAKE) {
+        network_loop_stop(loop);
+        return;
+    }
+    if (entry->lpCompletionKey == NETWORK_IOCP_KEY_HANDOFF) {
+        struct network_iocp_handoff *handoff = (struct network_iocp_handoff *)entry->lpOverlapped;
+        iocp->server->on_accept(loop, handoff->fd, &handoff->addr, iocp->server->user);
+        free(handoff);
+        return;
+    }
+    struct network_iocp_op *op = (struct network_iocp_op *)entry->lpOverlapped;
+    struct network_iocp_ref *ref = op->ref;
+    network_watch_t *watch = ref->watch;
+    DWORD bytes = entry->dwNumberOfBytesTransferred;
+    int err = watch ? network_iocp_error(op, watch->fd) : WSA_OPERATION_ABORTED;
+    // ops only goes down at the end, so a callback can't free ref from under us
+    if (op->kind != NETWORK_IOCP_ACCEPT) {
+        ref->armed &= ~(1u << op->kind);
+    }
+
+    switch (op->kind) {
+    case NETWORK_IOCP_RECV:
+        if (watch == NULL || err == WSA_OPERATION_ABORTED) {
+            break;
+        }
+        if (watch->on_readable) {
+            watch->on_readable(loop, watch, err ? NETWORK_EV_ERROR : NETWORK_EV_READ);
+        } else if (err) {
+            network_loop_close(loop, watch, err);
+        } else {
+            network_iocp_drain(loop, watch);
+        }
+        break;
+
+    case NETWORK_IOCP_WRITE:
+        if (watch == NULL) {
+            break;
+        }
+        ref->write_fired = 1;
+        if ((watch->events & NETWORK_EV_WRITE) && watch->on_writable && network_loop_pending(watch) == 0) {
+            watch->on_writable(loop, watch, NETWORK_EV_WRITE);
+        }
+        break;
+
+    case NETWORK_IOCP_SEND:
+        ref->sending = 0;
+        free(ref->send_buf);
+        ref->send_buf = NULL;
+        if (watch == NULL) {
+            break;
+        }
+        network_stats_add(NETWORK_STAT_SEND_CALLS, 1);
+        if (err) {
+            network_stats_add(NETWORK_STAT_ERRORS, 1);
+            network_loop_close(loop, watch, err);
+            break;
+        }
+        network_stats_add(NETWORK_STAT_BYTES_OUT, bytes);
+        network_loop_sent(watch, (size_t)bytes);
+        if (network_loop_pending(watch) == 0 && (watch->events & NETWORK_EV_WRITE) && watch->on_writable) {
+            watch->on_writable(loop, watch, NETWORK_EV_WRITE);
+        }
+        break;
+
+    case NETWORK_IOCP_FILE:
+        if (watch == NULL) {
+            break;
+        }
+        network_stats_add(NETWORK_STAT_SEND_CALLS, 1);
+        if (err || bytes == 0) {
+            // nothing sent means the file is shorter than asked, sendfile fails the same on Linux
+            network_stats_add(NETWORK_STAT_ERRORS, 1);
+            network_loop_close(loop, watch, err ? err : ERROR_HANDLE_EOF);
+            break;
+        }
+        network_stats_add(NETWORK_STAT_BYTES_OUT, bytes);
+        watch->stats.bytes_out += bytes;
+        watch->files->offset += bytes;
+        watch->files->left -= bytes;
+        if (watch->files->left == 0) {
+            network_loop_file_pop(watch);
+        }
+        if (network_loop_pending(watch) == 0 && (watch->events & NETWORK_EV_WRITE) && watch->on_writable) {
+            watch->on_writable(loop, watch, NETWORK_EV_WRITE);
+        }
+        break;
+
+    case NETWORK_IOCP_CONNECT:
+        if (watch == NULL || !watch->connecting) {
+            break;
+        }
+        if (err) {
+            network_loop_close(loop, watch, err);
+            break;
+        }
+        setsockopt(watch->fd, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+        watch->connecting = 0;
+        network_loop_timer_stop(loop, &watch->timer);
+        network_stats_add(NETWORK_STAT_CONNECTS, 1);
+        if (watch->on_connect) {
+            watch->on_connect(loop, watch, NETWORK_EV_WRITE);
+        }
+        break;
+
+    case NETWORK_IOCP_ACCEPT:
+        network_iocp_accepted(loop, watch, (struct network_iocp_accept *)op, err);
+        break;
+    }
+
+    watch = ref->watch;
+    if (watch) {
+        err = network_iocp_flush(watch);
+        if (err == 0) {
+            err = network_iocp_arm(loop, watch);
+        }
+        if (err) {
+            network_loop_close(loop, watch, err);
+        }
+    }
+    ref->ops--;
+    network_iocp_ref_release(iocp, ref);
+}
+
+static inline int network_iocp_extension(socket_t sock, GUID guid, void *fn, size_t size) {
+    DWORD bytes = 0;
+    return WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), fn, (DWORD)size,
+                    &bytes, NULL, NULL) == 0 ? 0 : -1;
+}
+
+static inline void network_iocp_loop_free(network_loop_t *loop) {
+    if (loop->iocp && loop->iocp->port) {
+        CloseHandle(loop->iocp->port);
+    }
+    free(loop->iocp);
+    free(loop->events);
+    free(loop->read_buf);
+    free(loop);
+}
+
+inline network_loop_t *network_loop_create_backend(int maxevents, int backend) {
+    if (backend == NETWORK_BACKEND_EPOLL || backend == NETWORK_BACKEND_IO_URING) {
+        NETWORK_ERROR("Windows only has the IOCP backend.");
+        network_fail(NETWORK_NOT_SUPPORTED, 0);
+        return NULL;
+    }
+    network_loop_t *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        NETWORK_ERROR("Loop allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    loop->maxevents = maxevents > 0 ? maxevents : NETWORK_LOOP_MAX_EVENTS;
+    loop->epfd = INVALID_SOCKET;
+    loop->backend = NETWORK_BACKEND_IOCP;
+    loop->timers.now = (uint64_t)network_now_ms();
+    loop->events = malloc((size_t)loop->maxevents * sizeof(OVERLAPPED_ENTRY));
+    loop->read_buf = malloc(NETWORK_LOOP_READ_SIZE);
+    loop->iocp = calloc(1, sizeof(*loop->iocp));
+    if (loop->events == NULL || loop->read_buf == NULL || loop->iocp == NULL) {
+        NETWORK_ERROR("Loop allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        network_iocp_loop_free(loop);
+        return NULL;
+    }
+
+    // only the loop's own thread waits on it
+    struct network_iocp_loop *iocp = loop->iocp;
+    iocp->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    int err = iocp->port == NULL ? (int)GetLastError() : 0;
+    if (err == 0) {
+        GUID accept_guid = WSAID_ACCEPTEX, addrs_guid = WSAID_GETACCEPTEXSOCKADDRS, connect_guid = WSAID_CONNECTEX;
+        socket_t probe = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+        if (probe == INVALID_SOCKET ||
+            network_iocp_extension(probe, accept_guid, &iocp->accept_ex, sizeof(iocp->accept_ex)) < 0 ||
+            network_iocp_extension(probe, addrs_guid, &iocp->accept_addrs, sizeof(iocp->accept_addrs)) < 0 ||
+            network_iocp_extension(probe, connect_guid, &iocp->connect_ex, sizeof(iocp->connect_ex)) < 0) {
+            err = WSAGetLastError();
+        }
+        if (probe != INVALID_SOCKET) {
+            closesocket(probe);
+        }
+    }
+    if (err) {
+        NETWORK_ERROR("Completion port setup failed. %d", err);
+        network_fail(NETWORK_IOCP_FAILED, err);
+        network_iocp_loop_free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+inline network_loop_t *network_loop_create(int maxevents) {
+    return network_loop_create_backend(maxevents, NETWORK_BACKEND_AUTO);
+}
+
+inline void network_loop_destroy(network_loop_t *loop) {
+    if (loop == NULL) {
+        return;
+    }
+    // cancelled requests of deleted watches still write to their refs, so wait for those to come
+    // back; connections handed over and not picked up yet are closed
+    OVERLAPPED_ENTRY *entries = loop->events;
+    ULONG n = 0;
+    while (GetQueuedCompletionStatusEx(loop->iocp->port, entries, (ULONG)loop->maxevents, &n,
+                                       loop->iocp->orphans ? 1000 : 0, FALSE)) {
+        for (ULONG i = 0; i < n; i++) {
+            if (entries[i].lpCompletionKey == NETWORK_IOCP_KEY_HANDOFF) {
+                struct network_iocp_handoff *handoff = (struct network_iocp_handoff *)entries[i].lpOverlapped;
+                closesocket(handoff->fd);
+                free(handoff);
+            } else if (entries[i].lpCompletionKey == 0 &&
+                       ((struct network_iocp_op *)entries[i].lpOverlapped)->ref->watch == NULL) {
+                network_iocp_complete(loop, &entries[i]);
+            }
+        }
+    }
+    // refs still waiting after that are left to the process, the kernel may write to them yet
+    network_iocp_loop_free(loop);
+}
+
+// gives the watch its ref and ties the socket to the loop's port
+static inline int network_iocp_add(network_loop_t *loop, network_watch_t *watch) {
+    struct network_iocp_ref *ref = calloc(1, sizeof(*ref));
+    if (ref == NULL) {
+        NETWORK_ERROR("Watch allocation failed.");
+        return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+    }
+    struct network_iocp_op *ops[] = {&ref->recv, &ref->write, &ref->send, &ref->file, &ref->connect};
+    for (int kind = NETWORK_IOCP_RECV; kind <= NETWORK_IOCP_CONNECT; kind++) {
+        ops[kind]->ref = ref;
+        ops[kind]->kind = kind;
+    }
+    // a socket is tied to a port for good, one added again after network_loop_del already is
+    if (CreateIoCompletionPort((HANDLE)watch->fd, loop->iocp->port, 0, 0) == NULL &&
+        GetLastError() != ERROR_INVALID_PARAMETER) {
+        int err = (int)GetLastError();
+        NETWORK_ERROR("Adding the socket to the completion port failed. %d", err);
+        free(ref);
+        return network_fail(NETWORK_IOCP_FAILED, err);
+    }
+    ref->watch = watch;
+    watch->overlapped = ref;
+    return 0;
+}
+
+// cancels everything in flight and lets go of the watch; the send queue goes too, unless the kernel
+// is still reading it
+static inline void network_iocp_del(network_loop_t *loop, network_watch_t *watch) {
+    struct network_iocp_ref *ref = watch->overlapped;
+    watch->overlapped = NULL;
+    if (ref->ops) {
+        CancelIoEx((HANDLE)watch->fd, NULL);
+    }
+    if (ref->sending && ref->send_buf == NULL) {
+        ref->send_buf = watch->out;
+    } else {
+        free(watch->out);
+    }
+    watch->out = NULL;
+    watch->out_off = watch->out_len = watch->out_cap = 0;
+
+    ref->watch = NULL;
+    ref->prev = NULL;
+    ref->next = loop->iocp->orphans;
+    if (ref->next) ref->next->prev = ref;
+    loop->iocp->orphans = ref;
+    network_iocp_ref_release(loop->iocp, ref);
+}
+
+inline int network_loop_add(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    network_loop_watch_init(watch, events);
+    if (network_iocp_add(loop, watch) < 0) {
+        return -1;
+    }
+    int err = network_iocp_arm(loop, watch);
+    if (err) {
+        NETWORK_ERROR("Watching the socket failed. %d", err);
+        network_iocp_del(loop, watch);
+        return network_fail(NETWORK_IOCP_FAILED, err);
+    }
+    loop->watches++;
+    watch->added = 1;
+    return 0;
+}
+
+inline int network_loop_mod(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    watch->events = events;
+    watch->write_armed = 0;
+    watch->overlapped->write_fired = 0;
+    int err = network_iocp_arm(loop, watch);
+    if (err) {
+        NETWORK_ERROR("Watching the socket failed. %d", err);
+        return network_fail(NETWORK_IOCP_FAILED, err);
+    }
+    return 0;
+}
+
+inline int network_loop_del(network_loop_t *loop, network_watch_t *watch) {
+    if (watch->added) {
+        watch->added = 0;
+        loop->watches--;
+    }
+    network_loop_timer_stop(loop, &watch->timer);
+    watch->connecting = 0;
+    while (watch->files) {
+        network_loop_file_pop(watch);
+    }
+    network_iocp_del(loop, watch);
+    return 0;
+}
+
+inline int network_loop_send(network_loop_t *loop, network_watch_t *watch, const void *data, size_t len) {
+    if (watch->closed) {
+        return -1;
+    }
+    // nothing queued, try the socket directly so the common case never copies
+    if (watch->out_len == watch->out_off && watch->files == NULL && !watch->connecting) {
+        ssize_t sent = network_send_all(watch->fd, data, len);
+        if (sent < 0) {
+            network_loop_close(loop, watch, network_last_errno());
+            return -1;
+        }
+        watch->stats.bytes_out += (size_t)sent;
+        if ((size_t)sent == len) {
+            return 0;
+        }
+        data = (const char *)data + sent;
+        len -= (size_t)sent;
+    }
+
+    struct network_iocp_ref *ref = watch->overlapped;
+    if (network_loop_queue(loop, watch, data, len, ref->sending ? &ref->send_buf : NULL) < 0) {
+        return -1;
+    }
+    int err = network_iocp_flush(watch);
+    if (err) {
+        network_loop_close(loop, watch, err);
+        return -1;
+    }
+    return 0;
+}
+
+inline int network_loop_send_file(network_loop_t *loop, network_watch_t *watch, int fd, int64_t offset, size_t len, int flags) {
+    if (watch->closed || len == 0) {
+        if (flags & NETWORK_FILE_CLOSE) {
+            _close(fd);
+        }
+        return watch->closed ? -1 : 0;
+    }
+    if (network_loop_file_push(loop, watch, fd, offset, len, flags) < 0) {
+        return -1;
+    }
+    int err = network_iocp_flush(watch);
+    if (err) {
+        network_loop_close(loop, watch, err);
+        return -1;
+    }
+    return 0;
+}
+
+inline int network_loop_connect(network_loop_t *loop, network_watch_t *watch, const struct sockaddr *addr,
+                                socklen_t addrlen, uint32_t events, int timeout_ms) {
+    socket_t fd = WSASocketW(addr->sa_family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+    if (fd == INVALID_SOCKET) {
+        int err = WSAGetLastError();
+        NETWORK_ERROR("Socket creation failed. %d", err);
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+    network_apply_sockopts(fd, &network_opts, NETWORK_SOCKOPTS_CLIENT);
+    // ConnectEx only takes a bound socket
+    struct sockaddr_storage local;
+    memset(&local, 0, sizeof(local));
+    local.ss_family = addr->sa_family;
+    int local_len = addr->sa_family == AF_INET6 ? (int)sizeof(struct sockaddr_in6) : (int)sizeof(struct sockaddr_in);
+    if (network_set_nonblocking(fd) < 0 || bind(fd, (struct sockaddr *)&local, local_len) != 0) {
+        int err = WSAGetLastError();
+        NETWORK_ERROR("Binding the connecting socket failed. %d", err);
+        closesocket(fd);
+        return network_fail(SOCKET_BIND_FAILED, err);
+    }
+
+    watch->fd = fd;
+    network_loop_watch_init(watch, events);
+    watch->connecting = 1;
+    if (network_iocp_add(loop, watch) < 0) {
+        closesocket(fd);
+        watch->fd = INVALID_SOCKET;
+        return -1;
+    }
+    struct network_iocp_ref *ref = watch->overlapped;
+    memset(&ref->connect.ov, 0, sizeof(ref->connect.ov));
+    int err = network_iocp_issued(ref, NETWORK_IOCP_CONNECT,
+                                  loop->iocp->connect_ex(fd, addr, (int)addrlen, NULL, 0, NULL, &ref->connect.ov));
+    if (err) {
+        NETWORK_ERROR("Connection failed. %d", err);
+        network_iocp_del(loop, watch);
+        closesocket(fd);
+        watch->fd = INVALID_SOCKET;
+        return network_fail(SOCKET_CONNECT_FAILED, err);
+    }
+    loop->watches++;
+    watch->added = 1;
+    if (timeout_ms > 0) {
+        network_loop_set_timeout(loop, watch, (uint64_t)timeout_ms);
+    }
+    return 0;
+}
+
+inline int network_loop_run_once(network_loop_t *loop, int timeout_ms) {
+    timeout_ms = network_loop_wait_ms(loop, timeout_ms);
+    OVERLAPPED_ENTRY *entries = loop->events;
+    ULONG n = 0;
+    if (!GetQueuedCompletionStatusEx(loop->iocp->port, entries, (ULONG)loop->maxevents, &n,
+                                     timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms, FALSE)) {
+        int err = (int)GetLastError();
+        if (err != WAIT_TIMEOUT) {
+            NETWORK_ERROR("GetQueuedCompletionStatusEx failed. %d", err);
+            return network_fail(NETWORK_IOCP_FAILED, err);
+        }
+        n = 0;
+    }
+
+    uint64_t started = network_stats_start(), lap = started;
+    loop->dispatching = 1;
+    int fired = network_loop_expire(loop);
+    if (fired) {
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap); // the timers that ran, as one
+    }
+    for (ULONG i = 0; i < n; i++) {
+        network_iocp_complete(loop, &entries[i]);
+        network_stats_lap(NETWORK_HIST_CALLBACK, &lap);
+    }
+    loop->dispatching = 0;
+    network_loop_closed(loop);
+    network_stats_add(NETWORK_STAT_LOOP_ITERATIONS, 1);
+    network_stats_lap(NETWORK_HIST_LOOP_ITERATION, &started);
+    return (int)n + fired;
+}
+
+struct network_server_worker {
+    network_server_t *server;
+    int index;
+    HANDLE thread;
+    network_loop_t *loop;
+    network_watch_t listener;     // the first worker's only, it accepts for all of them
+    unsigned next;                // the first worker's, who gets the next connection
+};
+
+// on the first worker: the connection goes to the next worker in turn, through its completion port
+static inline void network_server_accepted(network_loop_t *loop, network_watch_t *listener, socket_t fd,
+                                           const struct sockaddr_storage *addr) {
+    struct network_server_worker *worker = listener->user;
+    network_server_t *server = worker->server;
+    struct network_server_worker *target = &server->worker_state[worker->next++ % (unsigned)server->workers];
+    if (target == worker) {
+        server->on_accept(loop, fd, addr, server->user);
+        return;
+    }
+    struct network_iocp_handoff *handoff = malloc(sizeof(*handoff));
+    if (handoff == NULL) {
+        NETWORK_WARN("Handoff allocation failed, connection dropped.");
+        closesocket(fd);
+        return;
+    }
+    handoff->fd = fd;
+    handoff->addr = *addr;
+    if (!PostQueuedCompletionStatus(target->loop->iocp->port, 0, NETWORK_IOCP_KEY_HANDOFF, (LPOVERLAPPED)handoff)) {
+        NETWORK_WARN("Handing a connection to worker %d failed. %lu", target->index, GetLastError());
+        closesocket(fd);
+        free(handoff);
+    }
+}
+
+static inline DWORD WINAPI network_server_run(LPVOID arg) {
+    struct network_server_worker *worker = arg;
+    network_server_t *server = worker->server;
+
+    if (server->flags & NETWORK_SERVER_PIN_CPUS) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        DWORD cpus = info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+        if (cpus > 8 * sizeof(DWORD_PTR)) {
+            cpus = 8 * sizeof(DWORD_PTR); // one processor group
+        }
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (worker->index % cpus));
+    }
+    if (server->on_start) {
+        server->on_start(worker->loop, worker->index, server->user);
+    }
+    network_loop_run(worker->loop);
+    if (server->on_stop) {
+        server->on_stop(worker->loop, worker->index, server->user);
+    }
+    return 0;
+}
+
+// undoes what network_server_start did for the first count workers
+static inline void network_server_free(network_server_t *server, int count) {
+    for (int i = 0; i < count; i++) {
+        struct network_server_worker *worker = &server->worker_state[i];
+        if (worker->loop && worker->listener.overlapped) {
+            network_loop_del(worker->loop, &worker->listener); // the accepts in flight come back cancelled
+        }
+        if (worker->loop) {
+            network_loop_destroy(worker->loop);
+        }
+        if (worker->listener.fd != INVALID_SOCKET) {
+            closesocket(worker->listener.fd);
+        }
+    }
+    free(server->worker_state);
+    server->worker_state = NULL;
+}
+
+inline int network_server_start(network_server_t *server) {
+    if (server->on_accept == NULL) {
+        NETWORK_ERROR("Server needs an on_accept callback.");
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
+    }
+    if (server->workers <= 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        server->workers = info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+    }
+    server->worker_state = calloc((size_t)server->workers, sizeof(struct network_server_worker));
+    if (server->worker_state == NULL) {
+        NETWORK_ERROR("Server allocation failed.");
+        return network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+    }
+
+    snprintf(server->bound_port, sizeof(server->bound_port), "%s", server->port ? server->port : "8080");
+    for (int i = 0; i < server->workers; i++) {
+        struct network_server_worker *worker = &server->worker_state[i];
+        worker->server = server;
+        worker->index = i;
+        worker->listener.fd = INVALID_SOCKET;
+        worker->loop = network_loop_create_backend(0, server->backend);
+        if (worker->loop == NULL) {
+            network_server_free(server, i + 1);
+            return -1;
+        }
+        worker->loop->iocp->server = server;
+    }
+
+    // no SO_REUSEADDR, on Windows it lets another socket take the port over
+    struct network_server_worker *first = &server->worker_state[0];
+    first->listener.fd = network_listen_ex(server->ip, server->bound_port, server->backlog, NETWORK_LISTEN_NONBLOCK);
+    if (first->listener.fd == INVALID_SOCKET) {
+        network_server_free(server, server->workers);
+        return -1;
+    }
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(first->listener.fd, (struct sockaddr *)&addr, &len);
+    snprintf(server->bound_port, sizeof(server->bound_port), "%d", ntohs(addr.sin_port));
+    first->listener.on_accept = network_server_accepted;
+    first->listener.user = first;
+    if (network_loop_add(first->loop, &first->listener, NETWORK_EV_READ) < 0) {
+        network_server_free(server, server->workers);
+        return -1;
+    }
+
+    for (int i = 0; i < server->workers; i++) {
+        struct network_server_worker *worker = &server->worker_state[i];
+        worker->thread = CreateThread(NULL, 0, network_server_run, worker, 0, NULL);
+        if (worker->thread == NULL) {
+            int err = (int)GetLastError();
+            NETWORK_ERROR("Worker thread creation failed. %d", err);
+            for (int j = 0; j < i; j++) {
+                PostQueuedCompletionStatus(server->worker_state[j].loop->iocp->port, 0, NETWORK_IOCP_KEY_WAKE, NULL);
+                WaitForSingleObject(server->worker_state[j].thread, INFINITE);
+                CloseHandle(server->worker_state[j].thread);
+            }
+            network_server_free(server, server->workers);
+            return network_fail(NETWORK_THREAD_FAILED, err);
+        }
+    }
+    server->running = 1;
+    return 0;
+}
+
+inline void network_server_stop(network_server_t *server) {
+    if (!server->running) {
+        return;
+    }
+    for (int i = 0; i < server->workers; i++) {
+        if (!PostQueuedCompletionStatus(server->worker_state[i].loop->iocp->port, 0, NETWORK_IOCP_KEY_WAKE, NULL)) {
+            NETWORK_WARN("Waking worker %d failed. %lu", i, GetLastError());
+        }
+    }
+    for (int i = 0; i < server->workers; i++) {
+        WaitForSingleObject(server->worker_state[i].thread, INFINITE);
+        CloseHandle(server->worker_state[i].thread);
+    }
+    network_server_free(server, server->workers);
+    server->running = 0;
+}
+
+#endif // WINSOCK_IMPL
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_LOOP_H
@@ -0,0 +1,396 @@
+/**
+ * @file network_queue.h
+ * @brief Bounded lock-free queue of pointers between threads, with a wakeup for an event loop
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * One loop per core still needs to hand things to other threads: an accepted connection to the
+ * worker that should serve it, finished work back to the loop that asked for it, a message for a
+ * connection another loop owns. A network_queue_t is a ring of capacity pointers (a power of two)
+ * that any number of threads push to and pop from without a lock. Producers reserve slots by moving
+ * a head counter with one compare-and-swap per batch and publish them by moving a tail counter, in
+ * the order they reserved; consumers do the same on their side, and with NETWORK_QUEUE_SINGLE_CONSUMER
+ * the one consumer needs no compare-and-swap at all. The four counters sit on cache lines of their
+ * own, so producers and the consumer don't invalidate each other's lines on every push and pop.
+ *
+ * network_queue_attach() makes it the queue of a loop: an eventfd (a loopback socket pair on
+ * Windows) the loop watches, and on_items called on the loop's thread with what was pushed, up to
+ * NETWORK_QUEUE_BATCH at a time. Only the push that finds the consumer idle writes the eventfd, every
+ * other push is just the ring, so a burst costs one wakeup however many threads take part in it,
+ * and the consumer isn't woken to find nothing. A wakeup handles at most NETWORK_QUEUE_DRAIN items,
+ * then lets the loop's other events run before it carries on.
+ *
+ * Available APIs:
+ *   • network_queue_create()     - Queue of at least capacity pointers, network_queue_destroy() frees it
+ *   • network_queue_push()       - One pointer in, network_queue_push_batch() as many of n as there's room for
+ *   • network_queue_pop()        - One pointer out, network_queue_pop_batch() up to max of them
+ *   • network_queue_attach()     - Deliver to a loop's thread through on_items, woken only when it's idle
+ *   • network_queue_count()      - Pointers in the queue, a snapshot
+ *
+ * @example
+ * network_queue_t *inbox = network_queue_create(4096, NETWORK_QUEUE_SINGLE_CONSUMER);
+ * network_queue_attach(inbox, worker_loop, adopt_connections, NULL);   // on the worker's thread
+ * network_queue_push(inbox, conn);                                     // from the accepting thread
+ */
+
+#ifndef NETWORK_QUEUE_H
+#define NETWORK_QUEUE_H
+
+#include "network_loop.h"
+
+#ifdef LINUX_SOCKETS_IMPL
+#include <sched.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_QUEUE_CACHE_LINE 64
+#define NETWORK_QUEUE_BATCH 64         // items handed to on_items at a time
+#define NETWORK_QUEUE_DRAIN 1024       // items one wakeup handles before the loop's other events get a turn
+#define NETWORK_QUEUE_MAX (1u << 31)   // capacity at most, the counters wrap at 2^32
+#define NETWORK_QUEUE_SPINS 64         // pauses before a waiting thread gives up its time slice
+
+// network_queue_create flags
+#define NETWORK_QUEUE_SINGLE_CONSUMER 0x1 // only one thread ever pops, e.g. the attached loop
+
+typedef struct network_queue network_queue_t;
+
+// items are only valid for the call, the pointers themselves are the callback's to keep
+typedef void (*network_queue_cb)(network_loop_t *loop, network_queue_t *queue, void **items, size_t count);
+
+struct network_queue {
+    void **ring;
+    uint32_t mask;                 // capacity - 1
+    uint32_t capacity;
+    int flags;
+    network_loop_t *loop;          // set by network_queue_attach
+    network_watch_t wake;          // eventfd, readable once a push found the consumer idle
+#ifdef WINSOCK_IMPL
+    socket_t wake_tx;              // the other end of the pair, producers write here
+#endif
+    network_queue_cb on_items;
+    void *user;
+    uint64_t wakes;                // eventfd writes, how often the loop was woken
+    char pad0[NETWORK_QUEUE_CACHE_LINE];
+
+    // producers
+    uint32_t prod_head;            // next slot to reserve
+    uint32_t prod_tail;            // slots before it are published
+    char pad1[NETWORK_QUEUE_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    // consumers
+    uint32_t cons_head;
+    uint32_t cons_tail;            // slots before it are free again
+    char pad2[NETWORK_QUEUE_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    int idle;                      // the attached loop drained the queue and waits for a wakeup
+    char pad3[NETWORK_QUEUE_CACHE_LINE - sizeof(int)];
+};
+
+// capacity is rounded up to a power of two; NULL on error, network_last_result() has why
+network_queue_t *network_queue_create(size_t capacity, int flags);
+// detaches from the loop and frees the queue, whatever is still in it is the caller's
+void network_queue_destroy(network_queue_t *queue);
+// pushes the first of count items there's room for, returns how many; never blocks
+size_t network_queue_push_batch(network_queue_t *queue, void *const *items, size_t count);
+// 0 once item is in, -1 when the queue is full
+int network_queue_push(network_queue_t *queue, void *item);
+// pops up to max items in the order they were pushed, returns how many
+size_t network_queue_pop_batch(network_queue_t *queue, void **items, size_t max);
+// 1 and *item set, 0 when the queue is empty
+int network_queue_pop(network_queue_t *queue, void **item);
+// pushes are delivered to on_items on the loop's thread; call it there, before anything is pushed
+int network_queue_attach(network_queue_t *queue, network_loop_t *loop, network_queue_cb on_items, void *user);
+size_t network_queue_count(network_queue_t *queue);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+#if defined(__GNUC__) || defined(__clang__)
+#define network_queue_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define network_queue_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define network_queue_cas(p, expected, v) \
+    __atomic_compare_exchange_n((p), &(expected), (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define network_queue_exchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define network_queue_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define network_queue_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+// MSVC's volatile accesses are acquire loads and release stores, Interlocked* are full barriers
+#define network_queue_load(p) (*(volatile uint32_t *)(p))
+#define network_queue_store(p, v) (*(volatile uint32_t *)(p) = (v))
+#define network_queue_cas(p, expected, v) \
+    ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), (LONG)(v), (LONG)(expected)) == (expected))
+#define network_queue_exchange(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define network_queue_fence() MemoryBarrier()
+#define network_queue_add(p, v) InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#endif
+
+// while waiting for a thread that reserved slots before this one to publish them; that thread may
+// have been preempted, with more threads than cores spinning on would only keep it from running
+static inline void network_queue_backoff(unsigned *spins) {
+    if (++*spins > NETWORK_QUEUE_SPINS) {
+#ifdef WINSOCK_IMPL
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+        return;
+    }
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void network_queue_signal(network_queue_t *queue) {
+    network_queue_add(&queue->wakes, 1);
+#ifdef WINSOCK_IMPL
+    char one = 1;
+    if (send(queue->wake_tx, &one, 1, 0) < 0) {
+        NETWORK_WARN("Waking the queue's loop failed. %d", WSAGetLastError());
+    }
+#else
+    uint64_t one = 1;
+    if (write(queue->wake.fd, &one, sizeof(one)) < 0) {
+        NETWORK_WARN("Waking the queue's loop failed. %s", strerror(errno));
+    }
+#endif
+}
+
+// the push is published before idle is read and the loop sets idle before it looks at the ring
+// again, so one of the two sees the other: either this push wakes it or the loop finds the items
+static inline void network_queue_notify(network_queue_t *queue) {
+    network_queue_fence();
+    if (network_queue_load(&queue->idle) && network_queue_exchange(&queue->idle, 0)) {
+        network_queue_signal(queue);
+    }
+}
+
+// the loop's side of the same: idle first, then one more look at the ring
+static inline void network_queue_rest(network_queue_t *queue) {
+    network_queue_store(&queue->idle, 1);
+    network_queue_fence();
+    if (network_queue_count(queue) > 0 && network_queue_exchange(&queue->idle, 0)) {
+        network_queue_signal(queue); // a push slipped in before it could see idle
+    }
+}
+
+inline network_queue_t *network_queue_create(size_t capacity, int flags) {
+    if (capacity == 0 || capacity > NETWORK_QUEUE_MAX) {
+        NETWORK_ERROR("Queue capacity %zu is out of range.", capacity);
+        network_fail(NETWORK_INVALID_ARGUMENT, EINVAL);
+        return NULL;
+    }
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    network_queue_t *queue = calloc(1, sizeof(*queue));
+    if (queue == NULL || (queue->ring = malloc(size * sizeof(*queue->ring))) == NULL) {
+        NETWORK_ERROR("Queue allocation failed.");
+        free(queue);
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    queue->capacity = size;
+    queue->mask = size - 1;
+    queue->flags = flags;
+    queue->wake.fd = -1;
+#ifdef WINSOCK_IMPL
+    queue->wake_tx = INVALID_SOCKET;
+#endif
+    return queue;
+}
+
+inline void network_queue_destroy(network_queue_t *queue) {
+    if (queue == NULL) {
+        return;
+    }
+    if (queue->loop) {
+        network_loop_del(queue->loop, &queue->wake);
+    }
+#ifdef WINSOCK_IMPL
+    if (queue->wake_tx != INVALID_SOCKET) {
+        closesocket(queue->wake_tx);
+    }
+#endif
+    if (queue->wake.fd != (socket_t)-1) {
+        network_close(queue->wake.fd);
+    }
+    free(queue->ring);
+    free(queue);
+}
+
+inline size_t network_queue_push_batch(network_queue_t *queue, void *const *items, size_t count) {
+    uint32_t head, n;
+    do {
+        // head is read first, so cons_tail is at least what the producer that moved head last saw
+        head = network_queue_load(&queue->prod_head);
+        uint32_t room = queue->capacity - (head - network_queue_load(&queue->cons_tail));
+        n = count < room ? (uint32_t)count : room;
+        if (n == 0) {
+            return 0;
+        }
+    } while (!network_queue_cas(&queue->prod_head, head, head + n));
+
+    for (uint32_t i = 0; i < n; i++) {
+        queue->ring[(head + i) & queue->mask] = items[i];
+    }
+    // producers that reserved before this one publish first, the consumer reads the ring in order
+    unsigned spins = 0;
+    while (network_queue_load(&queue->prod_tail) != head) {
+        network_queue_backoff(&spins);
+    }
+    network_queue_store(&queue->prod_tail, head + n);
+    network_queue_notify(queue);
+    return n;
+}
+
+inline int network_queue_push(network_queue_t *queue, void *item) {
+    return network_queue_push_batch(queue, &item, 1) == 1 ? 0 : -1;
+}
+
+inline size_t network_queue_pop_batch(network_queue_t *queue, void **items, size_t max) {
+    uint32_t head, n;
+    if (queue->flags & NETWORK_QUEUE_SINGLE_CONSUMER) {
+        head = queue->cons_head;
+        uint32_t ready = network_queue_load(&queue->prod_tail) - head;
+        n = max < ready ? (uint32_t)max : ready;
+        if (n == 0) {
+            return 0;
+        }
+        queue->cons_head = head + n;
+    } else {
+        do {
+            head = network_queue_load(&queue->cons_head);
+            uint32_t ready = network_queue_load(&queue->prod_tail) - head;
+            n = max < ready ? (uint32_t)max : ready;
+            if (n == 0) {
+                return 0;
+            }
+        } while (!network_queue_cas(&queue->cons_head, head, head + n));
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        items[i] = queue->ring[(head + i) & queue->mask];
+    }
+    unsigned spins = 0;
+    while (network_queue_load(&queue->cons_tail) != head) {
+        network_queue_backoff(&spins);
+    }
+    network_queue_store(&queue->cons_tail, head + n);
+    return n;
+}
+
+inline int network_queue_pop(network_queue_t *queue, void **item) {
+    return network_queue_pop_batch(queue, item, 1) == 1;
+}
+
+inline size_t network_queue_count(network_queue_t *queue) {
+    return network_queue_load(&queue->prod_tail) - network_queue_load(&queue->cons_tail);
+}
+
+// the eventfd is readable: hand everything over, then go idle unless more came in meanwhile
+static inline void network_queue_woken(network_loop_t *loop, network_watch_t *wake, uint32_t events) {
+    (void)events;
+    network_queue_t *queue = wake->user;
+#ifdef WINSOCK_IMPL
+    char drain[64];
+    while (recv(wake->fd, drain, sizeof(drain), 0) > 0) {
+    }
+#else
+    uint64_t value;
+    if (read(wake->fd, &value, sizeof(value)) < 0) {
+        // EAGAIN, a signal of our own that was read already
+    }
+#endif
+    void *items[NETWORK_QUEUE_BATCH];
+    size_t handled = 0, n;
+    while ((n = network_queue_pop_batch(queue, items, NETWORK_QUEUE_BATCH)) > 0) {
+        queue->on_items(loop, queue, items, n);
+        handled += n;
+        if (handled >= NETWORK_QUEUE_DRAIN) {
+            // not idle, no producer writes the eventfd, so the loop comes back here by itself
+            network_queue_signal(queue);
+            return;
+        }
+    }
+    network_queue_rest(queue);
+}
+
+#ifdef WINSOCK_IMPL
+// no eventfd here, a connected loopback pair does the same
+static inline int network_queue_pair(socket_t *rx, socket_t *tx) {
+    socket_t listener = network_listen_ex("127.0.0.1", "0", 1, 0);
+    if (listener == INVALID_SOCKET) {
+        return -1;
+    }
+    struct sockaddr_storage addr;
+    int len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+    *tx = network_connect_addr((struct sockaddr *)&addr, (socklen_t)len, 1000, 0);
+    *rx = *tx == INVALID_SOCKET ? INVALID_SOCKET : accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (*rx == INVALID_SOCKET || network_set_nonblocking(*rx) < 0 || network_set_nonblocking(*tx) < 0) {
+        NETWORK_ERROR("Wake socket pair for the queue failed. %d", WSAGetLastError());
+        if (*rx != INVALID_SOCKET) {
+            closesocket(*rx);
+        }
+        if (*tx != INVALID_SOCKET) {
+            closesocket(*tx);
+        }
+        *rx = *tx = INVALID_SOCKET;
+        return network_fail(SOCKET_CREATE_FAILED, WSAGetLastError());
+    }
+    return 0;
+}
+#endif
+
+inline int network_queue_attach(network_queue_t *queue, network_loop_t *loop, network_queue_cb on_items, void *user) {
+    if (queue->loop != NULL || on_items == NULL) {
+        NETWORK_ERROR("Queue is attached already or has no on_items.");
+        return network_fail(NETWORK_INVALID_ARGUMENT, EINVAL);
+    }
+#ifdef WINSOCK_IMPL
+    if (network_queue_pair(&queue->wake.fd, &queue->wake_tx) < 0) {
+        queue->wake.fd = -1;
+        return -1;
+    }
+#else
+    queue->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->wake.fd < 0) {
+        int err = errno;
+        NETWORK_ERROR("eventfd for the queue failed. %s", strerror(err));
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+#endif
+    queue->on_items = on_items;
+    queue->user = user;
+    queue->wake.on_readable = network_queue_woken;
+    queue->wake.user = queue;
+    if (network_loop_add(loop, &queue->wake, NETWORK_EV_READ) < 0) {
+        network_close(queue->wake.fd);
+        queue->wake.fd = -1;
+#ifdef WINSOCK_IMPL
+        closesocket(queue->wake_tx);
+        queue->wake_tx = INVALID_SOCKET;
+#endif
+        return -1;
+    }
+    queue->loop = loop;
+    network_queue_rest(queue); // whatever was pushed before this is picked up by the first wakeup
+    return 0;
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NETWORK_QUEUE_H
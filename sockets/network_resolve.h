@@ -0,0 +1,741 @@
+/**
+ * @file network_resolve.h
+ * @brief Name lookups off the event loop's thread, and a cache of what they returned
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * getaddrinfo blocks, for as long as the resolver takes to answer or time out, and a loop thread
+ * that calls it serves nobody meanwhile. A network_resolver_t runs the lookups on a few worker
+ * threads of its own and hands every result back on its loop's thread, through an eventfd the loop
+ * watches (a loopback socket pair on Windows), so callbacks run between events like any other.
+ *
+ * Every result, from the workers or from network_resolve(), goes into one cache for the whole
+ * process, kept for NETWORK_RESOLVE_TTL_MS (failures for NETWORK_RESOLVE_FAILED_TTL_MS, so a name
+ * that doesn't resolve isn't asked for on every connect). A lookup the cache has is answered right
+ * away, in the call, without a worker. The cache has NETWORK_RESOLVE_CACHE_SIZE entries, a new name
+ * pushes out the one closest to expiring among the few it would go in.
+ *
+ * Available APIs:
+ *   • network_resolver_create()  - Workers for one loop, network_resolver_destroy() stops them
+ *   • network_resolve_async()    - Looks a name up and calls back on the loop's thread
+ *   • network_resolver_connect() - Looks a name up and network_loop_connect()s to it, for clients in a loop
+ *   • network_resolve()          - Blocking lookup through the same cache, for threads without a loop
+ *   • network_resolve_set_ttl()  - How long results are kept, network_resolve_flush() forgets all of them
+ *
+ * @example
+ * network_resolver_t *resolver = network_resolver_create(loop, 0);
+ * conn->watch.on_connect = connected; conn->watch.on_close = failed;
+ * network_resolver_connect(resolver, &conn->watch, "example.com", "80", NETWORK_EV_READ, 5000);
+ */
+
+#ifndef NETWORK_RESOLVE_H
+#define NETWORK_RESOLVE_H
+
+#include "network_loop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_RESOLVE_ADDRS 8               // addresses kept per name, getaddrinfo's first ones
+#define NETWORK_RESOLVE_THREADS 2             // workers when network_resolver_create gets 0
+#define NETWORK_RESOLVE_TTL_MS 30000          // how long a result is used before looking it up again
+#define NETWORK_RESOLVE_FAILED_TTL_MS 1000    // same for a lookup that failed
+#define NETWORK_RESOLVE_CACHE_SIZE 1024       // names the cache holds, a power of two
+#define NETWORK_RESOLVE_KEY 320               // bytes of host and port together, DNS names stop at 253
+
+// on_close err of a network_resolver_connect whose name didn't resolve
+#ifdef WINSOCK_IMPL
+#define NETWORK_LOOP_UNRESOLVED WSAHOST_NOT_FOUND
+#else
+#define NETWORK_LOOP_UNRESOLVED EHOSTUNREACH
+#endif
+
+typedef struct network_resolved {
+    int count;
+    struct sockaddr_storage addrs[NETWORK_RESOLVE_ADDRS];
+    socklen_t addrlens[NETWORK_RESOLVE_ADDRS];
+} network_resolved;
+
+// err is 0 or getaddrinfo's EAI_ code, gai_strerror() has the text; res is only valid during the call
+typedef void (*network_resolve_cb)(network_loop_t *loop, const network_resolved *res, int err, void *user);
+
+struct network_resolve_job;
+
+typedef struct network_resolver {
+    network_loop_t *loop;
+    network_watch_t wake;                  // eventfd, readable once results are waiting
+#ifdef WINSOCK_IMPL
+    socket_t wake_tx;                      // the other end of the pair, the workers write here
+    HANDLE *threads;
+    SRWLOCK lock;
+    CONDITION_VARIABLE ready;
+#else
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+#endif
+    int nthreads;
+    int stopping;
+    struct network_resolve_job *queue;     // waiting for a worker, oldest first
+    struct network_resolve_job *queue_tail;
+    struct network_resolve_job *done;      // resolved, newest first, waiting for the loop
+    int woken;                             // wake was written and the loop didn't read it yet
+} network_resolver_t;
+
+// NULL on errors; threads 0 for NETWORK_RESOLVE_THREADS. Only the loop's thread may use it
+network_resolver_t *network_resolver_create(network_loop_t *loop, int threads);
+// waits for the workers, a lookup that's still in getaddrinfo holds this up; undelivered results
+// are dropped without their callbacks. Call it before network_loop_destroy and not from a callback of its own
+void network_resolver_destroy(network_resolver_t *resolver);
+/**
+ * Looks host:port up for a TCP connection, host NULL is this machine.
+ *
+ * @return 1 when the cache had it and cb was called already, 0 when a worker has it and cb is
+ * called from the loop later, -1 when out of memory
+ */
+int network_resolve_async(network_resolver_t *resolver, const char *host, const char *port,
+                          network_resolve_cb cb, void *user);
+/**
+ * network_loop_connect() to the first address host:port resolves to, and to the next one when a
+ * socket can't be made for it or the connect is refused or finds no route. A name that doesn't
+ * resolve closes the watch with NETWORK_LOOP_UNRESOLVED; the deadline starts once the name is
+ * resolved and covers all the addresses tried. While a name with more than one address connects,
+ * watch->user and its on_connect/on_close are the resolver's, they're back when either is called;
+ * queue nothing before on_connect, a connect to the next address starts without it.
+ *
+ * @return 0 when the connect is under way, on_connect or on_close follow; -1 when it failed
+ * right away, a name the cache knows doesn't resolve included, and nothing is called
+ */
+int network_resolver_connect(network_resolver_t *resolver, network_watch_t *watch, const char *host,
+                             const char *port, uint32_t events, int timeout_ms);
+// blocking lookup through the cache, 0 or -1 with network_last_errno() the EAI_ code
+int network_resolve(const char *host, const char *port, network_resolved *out);
+// ms results are kept for, 0 turns the cache off; applies to results from now on
+void network_resolve_set_ttl(int ttl_ms, int failed_ttl_ms);
+void network_resolve_flush(void);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+struct network_resolve_job {
+    struct network_resolve_job *next;
+    network_resolve_cb cb;
+    void *user;
+    network_watch_t *watch;     // network_resolver_connect, instead of cb
+    uint32_t events;
+    int timeout_ms;
+    int err;
+    network_resolved res;
+    char key[NETWORK_RESOLVE_KEY];
+    const char *host, *port;    // point into key
+};
+
+struct network_resolve_entry {
+    int64_t expires;
+    int err;
+    network_resolved res;
+    char key[NETWORK_RESOLVE_KEY];
+};
+
+#ifdef WINSOCK_IMPL
+static SRWLOCK network_resolve_lock = SRWLOCK_INIT;
+#define network_resolve_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define network_resolve_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#else
+static pthread_mutex_t network_resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+#define network_resolve_mutex_lock(m) pthread_mutex_lock(m)
+#define network_resolve_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
+// entries are allocated on first use, under network_resolve_lock like everything else here
+static struct network_resolve_entry *network_resolve_cache[NETWORK_RESOLVE_CACHE_SIZE];
+static int network_resolve_ttl_ms = NETWORK_RESOLVE_TTL_MS;
+static int network_resolve_failed_ttl_ms = NETWORK_RESOLVE_FAILED_TTL_MS;
+
+#define NETWORK_RESOLVE_PROBE 8 // slots a name may go in, from its hash on
+
+// "host\0port\0" into key, host "" for NULL; returns 0, or -1 when it doesn't fit
+static inline int network_resolve_key(char *key, const char *host, const char *port) {
+    size_t hlen = host ? strlen(host) : 0, plen = strlen(port);
+    if (hlen + plen + 2 > NETWORK_RESOLVE_KEY) {
+        return -1;
+    }
+    memcpy(key, host ? host : "", hlen + 1);
+    memcpy(key + hlen + 1, port, plen + 1);
+    return 0;
+}
+
+static inline size_t network_resolve_keylen(const char *key) {
+    size_t hlen = strlen(key);
+    return hlen + 1 + strlen(key + hlen + 1) + 1;
+}
+
+static inline uint32_t network_resolve_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+// 1 with res and err filled in when the cache has key and it hasn't expired
+static inline int network_resolve_lookup(const char *key, network_resolved *res, int *err) {
+    size_t len = network_resolve_keylen(key);
+    uint32_t h = network_resolve_hash(key, len);
+    int64_t now = network_now_ms();
+    int hit = 0;
+    network_resolve_mutex_lock(&network_resolve_lock);
+    for (int i = 0; i < NETWORK_RESOLVE_PROBE; i++) {
+        struct network_resolve_entry *e = network_resolve_cache[(h + i) & (NETWORK_RESOLVE_CACHE_SIZE - 1)];
+        if (e && e->expires > now && memcmp(e->key, key, len) == 0) {
+            *res = e->res;
+            *err = e->err;
+            hit = 1;
+            break;
+        }
+    }
+    network_resolve_mutex_unlock(&network_resolve_lock);
+    return hit;
+}
+
+static inline void network_resolve_store(const char *key, const network_resolved *res, int err) {
+    size_t len = network_resolve_keylen(key);
+    uint32_t h = network_resolve_hash(key, len);
+    int64_t now = network_now_ms();
+    network_resolve_mutex_lock(&network_resolve_lock);
+    int ttl = err ? network_resolve_failed_ttl_ms : network_resolve_ttl_ms;
+    if (ttl <= 0) {
+        network_resolve_mutex_unlock(&network_resolve_lock);
+        return;
+    }
+    // the same name, else an empty slot, else the one that expires first
+    struct network_resolve_entry **slot = NULL;
+    for (int i = 0; i < NETWORK_RESOLVE_PROBE; i++) {
+        struct network_resolve_entry **s = &network_resolve_cache[(h + i) & (NETWORK_RESOLVE_CACHE_SIZE - 1)];
+        if (*s && memcmp((*s)->key, key, len) == 0) {
+            slot = s;
+            break;
+        }
+        if (slot == NULL || (*slot && (*s == NULL || (*s)->expires < (*slot)->expires))) {
+            slot = s;
+        }
+    }
+    if (*slot == NULL) {
+        *slot = malloc(sizeof(**slot));
+    }
+    if (*slot) {
+        memcpy((*slot)->key, key, len);
+        (*slot)->res = *res;
+        (*slot)->err = err;
+        (*slot)->expires = now + ttl;
+    }
+    network_resolve_mutex_unlock(&network_resolve_lock);
+}
+
+// getaddrinfo, and the result into the cache; returns 0 or the EAI_ code
+static inline int network_resolve_run(const char *key, network_resolved *res) {
+    const char *host = key[0] ? key : NULL;
+    const char *port = key + strlen(key) + 1;
+    struct addrinfo hints, *ai_list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    res->count = 0;
+    int err = getaddrinfo(host, port, &hints, &ai_list);
+    if (err == 0) {
+        for (struct addrinfo *ai = ai_list; ai && res->count < NETWORK_RESOLVE_ADDRS; ai = ai->ai_next) {
+            if (ai->ai_addrlen <= sizeof(res->addrs[0])) {
+                memcpy(&res->addrs[res->count], ai->ai_addr, ai->ai_addrlen);
+                res->addrlens[res->count++] = (socklen_t)ai->ai_addrlen;
+            }
+        }
+        freeaddrinfo(ai_list);
+    }
+#ifdef EAI_SYSTEM
+    // the resolver itself failed (out of descriptors, say), nothing to remember about the name
+    if (err == EAI_SYSTEM) {
+        return err;
+    }
+#endif
+    network_resolve_store(key, res, err);
+    return err;
+}
+
+inline int network_resolve(const char *host, const char *port, network_resolved *out) {
+    char key[NETWORK_RESOLVE_KEY];
+    int err;
+    if (network_resolve_key(key, host, port) < 0) {
+        NETWORK_ERROR("Host name too long: %s", host);
+        return network_fail(NETWORK_INVALID_ARGUMENT, 0);
+    }
+    if (!network_resolve_lookup(key, out, &err)) {
+        err = network_resolve_run(key, out);
+    }
+    if (err != 0) {
+        NETWORK_ERROR("getaddrinfo failed for %s:%s. %s", host ? host : "localhost", port, gai_strerror(err));
+        return network_fail(NETWORK_ADDRESS_FAILED, err);
+    }
+    return 0;
+}
+
+inline void network_resolve_set_ttl(int ttl_ms, int failed_ttl_ms) {
+    network_resolve_mutex_lock(&network_resolve_lock);
+    network_resolve_ttl_ms = ttl_ms;
+    network_resolve_failed_ttl_ms = failed_ttl_ms;
+    network_resolve_mutex_unlock(&network_resolve_lock);
+}
+
+inline void network_resolve_flush(void) {
+    network_resolve_mutex_lock(&network_resolve_lock);
+    for (int i = 0; i < NETWORK_RESOLVE_CACHE_SIZE; i++) {
+        free(network_resolve_cache[i]);
+        network_resolve_cache[i] = NULL;
+    }
+    network_resolve_mutex_unlock(&network_resolve_lock);
+}
+
+#ifdef WINSOCK_IMPL
+#define network_resolver_lock(r) AcquireSRWLockExclusive(&(r)->lock)
+#define network_resolver_unlock(r) ReleaseSRWLockExclusive(&(r)->lock)
+#else
+#define network_resolver_lock(r) pthread_mutex_lock(&(r)->lock)
+#define network_resolver_unlock(r) pthread_mutex_unlock(&(r)->lock)
+#endif
+
+// called with the lock held
+static inline void network_resolver_signal(network_resolver_t *r) {
+    if (r->woken) {
+        return; // one write per batch of results, the loop takes all of them at once
+    }
+    r->woken = 1;
+#ifdef WINSOCK_IMPL
+    char one = 1;
+    if (send(r->wake_tx, &one, 1, 0) < 0) {
+        NETWORK_WARN("Waking the loop failed. %d", WSAGetLastError());
+    }
+#else
+    uint64_t one = 1;
+    if (write(r->wake.fd, &one, sizeof(one)) < 0) {
+        NETWORK_WARN("Waking the loop failed. %s", strerror(errno));
+    }
+#endif
+}
+
+#ifdef WINSOCK_IMPL
+static DWORD WINAPI network_resolver_work(LPVOID arg) {
+#else
+static void *network_resolver_work(void *arg) {
+#endif
+    network_resolver_t *r = arg;
+    network_resolver_lock(r);
+    for (;;) {
+        while (r->queue == NULL && !r->stopping) {
+#ifdef WINSOCK_IMPL
+            SleepConditionVariableSRW(&r->ready, &r->lock, INFINITE, 0);
+#else
+            pthread_cond_wait(&r->ready, &r->lock);
+#endif
+        }
+        if (r->stopping) {
+            break;
+        }
+        struct network_resolve_job *job = r->queue;
+        r->queue = job->next;
+        if (r->queue == NULL) {
+            r->queue_tail = NULL;
+        }
+        network_resolver_unlock(r);
+
+        // a burst of lookups for one name queues one job each, all but the first find it cached
+        if (!network_resolve_lookup(job->key, &job->res, &job->err)) {
+            job->err = network_resolve_run(job->key, &job->res);
+        }
+
+        network_resolver_lock(r);
+        job->next = r->done;
+        r->done = job;
+        network_resolver_signal(r);
+    }
+    network_resolver_unlock(r);
+#ifdef WINSOCK_IMPL
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// the addresses left to try while a watch connects to a name with more than one, watch->user meanwhile
+struct network_resolve_dial {
+    network_event_cb on_connect;
+    network_close_cb on_close;
+    void *user;
+    uint32_t events;
+    int64_t deadline;           // network_now_ms(), 0 without one
+    int next;                   // the address tried when this one fails
+    network_resolved res;
+};
+
+// connect errors another address of the same name can do better on
+static inline int network_resolve_retryable(int err) {
+#ifdef WINSOCK_IMPL
+    return err == WSAECONNREFUSED || err == WSAENETUNREACH || err == WSAEHOSTUNREACH;
+#else
+    return err == ECONNREFUSED || err == ENETUNREACH || err == EHOSTUNREACH;
+#endif
+}
+
+// connects to the first address from i on that a connect can be started for, 0 or -1
+static inline int network_resolver_try(network_loop_t *loop, network_watch_t *watch, const network_resolved *res,
+                                       int i, uint32_t events, int timeout_ms, int *next) {
+    for (; i < res->count; i++) {
+        if (network_loop_connect(loop, watch, (const struct sockaddr *)&res->addrs[i], res->addrlens[i],
+                                 events, timeout_ms) == 0) {
+            *next = i + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// the watch is the user's again, with its own callbacks
+static inline void network_resolver_release(network_watch_t *watch, struct network_resolve_dial *dial) {
+    watch->on_connect = dial->on_connect;
+    watch->on_close = dial->on_close;
+    watch->user = dial->user;
+    free(dial);
+}
+
+static inline void network_resolver_connected(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    network_resolver_release(watch, watch->user);
+    if (watch->on_connect) {
+        watch->on_connect(loop, watch, events);
+    }
+}
+
+// a connect failed, the next address gets what's left of the deadline
+static inline void network_resolver_refused(network_loop_t *loop, network_watch_t *watch, int err) {
+    struct network_resolve_dial *dial = watch->user;
+    if (network_resolve_retryable(err) && dial->next < dial->res.count) {
+        int64_t left = dial->deadline ? dial->deadline - network_now_ms() : 0;
+        if (dial->deadline && left <= 0) {
+            err = NETWORK_LOOP_TIMEDOUT;
+        } else {
+            NETWORK_DEBUG("Connect failed, %d of %d addresses left. %s", dial->res.count - dial->next,
+                          dial->res.count, strerror(err));
+            if (network_resolver_try(loop, watch, &dial->res, dial->next, dial->events, (int)left, &dial->next) == 0) {
+                return;
+            }
+            err = network_last_errno();
+        }
+    }
+    network_resolver_release(watch, dial);
+    if (watch->on_close) {
+        watch->on_close(loop, watch, err);
+    }
+}
+
+// connects the watch to the first address that takes it, 0 or -1
+static inline int network_resolver_dial(network_loop_t *loop, network_watch_t *watch, const network_resolved *res,
+                                        uint32_t events, int timeout_ms) {
+    if (res->count == 0) {
+        return network_fail(NETWORK_ADDRESS_FAILED, 0);
+    }
+    int next;
+    // one address has nothing to fall back to, and a dial that can't be allocated only tries them right away
+    struct network_resolve_dial *dial = res->count > 1 ? malloc(sizeof(*dial)) : NULL;
+    if (network_resolver_try(loop, watch, res, 0, events, timeout_ms, &next) < 0) {
+        free(dial);
+        return -1;
+    }
+    if (dial && next < res->count) {
+        dial->on_connect = watch->on_connect;
+        dial->on_close = watch->on_close;
+        dial->user = watch->user;
+        dial->events = events;
+        dial->deadline = timeout_ms > 0 ? network_now_ms() + timeout_ms : 0;
+        dial->next = next;
+        dial->res = *res;
+        watch->on_connect = network_resolver_connected;
+        watch->on_close = network_resolver_refused;
+        watch->user = dial;
+    } else {
+        free(dial);
+    }
+    return 0;
+}
+
+static inline void network_resolver_deliver(network_resolver_t *r, struct network_resolve_job *job) {
+    if (job->watch == NULL) {
+        job->cb(r->loop, &job->res, job->err, job->user);
+        return;
+    }
+    network_watch_t *watch = job->watch;
+    if (job->err != 0) {
+        NETWORK_ERROR("getaddrinfo failed for %s:%s. %s", job->host ? job->host : "localhost", job->port,
+                      gai_strerror(job->err));
+    }
+    if (job->err != 0 || network_resolver_dial(r->loop, watch, &job->res, job->events, job->timeout_ms) < 0) {
+        // the watch was never added, the loop has nothing to close
+        if (watch->on_close) {
+            watch->on_close(r->loop, watch, job->err ? NETWORK_LOOP_UNRESOLVED : network_last_errno());
+        }
+    }
+}
+
+// the wake watch is readable: every result that came in since the last time, oldest first
+static inline void network_resolver_woken(network_loop_t *loop, network_watch_t *wake, uint32_t events) {
+    (void)loop;
+    (void)events;
+    network_resolver_t *r = wake->user;
+#ifdef WINSOCK_IMPL
+    char drain[64];
+    while (recv(wake->fd, drain, sizeof(drain), 0) > 0) {
+    }
+#else
+    uint64_t value;
+    if (read(wake->fd, &value, sizeof(value)) < 0) {
+        // EAGAIN, nothing left to read
+    }
+#endif
+    network_resolver_lock(r);
+    struct network_resolve_job *done = r->done;
+    r->done = NULL;
+    r->woken = 0;
+    network_resolver_unlock(r);
+
+    struct network_resolve_job *ordered = NULL;
+    while (done) {
+        struct network_resolve_job *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+    while (ordered) {
+        struct network_resolve_job *job = ordered;
+        ordered = job->next;
+        network_resolver_deliver(r, job);
+        free(job);
+    }
+}
+
+#ifdef WINSOCK_IMPL
+// no eventfd here, a connected loopback pair does the same
+static inline int network_resolver_pair(socket_t *rx, socket_t *tx) {
+    socket_t listener = network_listen_ex("127.0.0.1", "0", 1, 0);
+    if (listener == INVALID_SOCKET) {
+        return -1;
+    }
+    struct sockaddr_storage addr;
+    int len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &len);
+    *tx = network_connect_addr((struct sockaddr *)&addr, (socklen_t)len, 1000, 0);
+    *rx = *tx == INVALID_SOCKET ? INVALID_SOCKET : accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (*rx == INVALID_SOCKET || network_set_nonblocking(*rx) < 0) {
+        NETWORK_ERROR("Wake socket pair for the resolver failed. %d", WSAGetLastError());
+        if (*rx != INVALID_SOCKET) {
+            closesocket(*rx);
+        }
+        if (*tx != INVALID_SOCKET) {
+            closesocket(*tx);
+        }
+        return network_fail(SOCKET_CREATE_FAILED, WSAGetLastError());
+    }
+    return 0;
+}
+#endif
+
+static inline void network_resolve_jobs_free(struct network_resolve_job *job) {
+    while (job) {
+        struct network_resolve_job *next = job->next;
+        free(job);
+        job = next;
+    }
+}
+
+// stops and joins the workers that were started, frees every job and the resolver
+static inline void network_resolver_free(network_resolver_t *r, int started) {
+    network_resolver_lock(r);
+    r->stopping = 1;
+    network_resolver_unlock(r);
+#ifdef WINSOCK_IMPL
+    WakeAllConditionVariable(&r->ready);
+    for (int i = 0; i < started; i++) {
+        WaitForSingleObject(r->threads[i], INFINITE);
+        CloseHandle(r->threads[i]);
+    }
+    if (r->wake_tx != INVALID_SOCKET) {
+        closesocket(r->wake_tx);
+    }
+#else
+    pthread_cond_broadcast(&r->ready);
+    for (int i = 0; i < started; i++) {
+        pthread_join(r->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->ready);
+#endif
+    network_resolve_jobs_free(r->queue);
+    network_resolve_jobs_free(r->done);
+    if (r->wake.fd != (socket_t)-1) {
+        network_close(r->wake.fd);
+    }
+    free(r->threads);
+    free(r);
+}
+
+inline network_resolver_t *network_resolver_create(network_loop_t *loop, int threads) {
+    network_resolver_t *r = calloc(1, sizeof(*r));
+    if (threads <= 0) {
+        threads = NETWORK_RESOLVE_THREADS;
+    }
+    if (r == NULL || (r->threads = calloc((size_t)threads, sizeof(*r->threads))) == NULL) {
+        NETWORK_ERROR("Resolver allocation failed.");
+        free(r);
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    r->loop = loop;
+    r->wake.on_readable = network_resolver_woken;
+    r->wake.user = r;
+#ifdef WINSOCK_IMPL
+    InitializeSRWLock(&r->lock);
+    InitializeConditionVariable(&r->ready);
+    r->wake_tx = INVALID_SOCKET;
+    if (network_resolver_pair(&r->wake.fd, &r->wake_tx) < 0) {
+        r->wake.fd = -1;
+        network_resolver_free(r, 0);
+        return NULL;
+    }
+#else
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    r->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake.fd < 0) {
+        int err = errno;
+        NETWORK_ERROR("eventfd for the resolver failed. %s", strerror(err));
+        network_resolver_free(r, 0);
+        network_fail(SOCKET_CREATE_FAILED, err);
+        return NULL;
+    }
+#endif
+
+    for (; r->nthreads < threads; r->nthreads++) {
+#ifdef WINSOCK_IMPL
+        r->threads[r->nthreads] = CreateThread(NULL, 0, network_resolver_work, r, 0, NULL);
+        int rc = r->threads[r->nthreads] == NULL ? (int)GetLastError() : 0;
+#else
+        int rc = pthread_create(&r->threads[r->nthreads], NULL, network_resolver_work, r);
+#endif
+        if (rc != 0) {
+            NETWORK_ERROR("Resolver thread creation failed. %d", rc);
+            network_resolver_free(r, r->nthreads);
+            network_fail(NETWORK_THREAD_FAILED, rc);
+            return NULL;
+        }
+    }
+    if (network_loop_add(loop, &r->wake, NETWORK_EV_READ) < 0) {
+        network_resolver_free(r, r->nthreads);
+        return NULL;
+    }
+    return r;
+}
+
+inline void network_resolver_destroy(network_resolver_t *resolver) {
+    if (resolver == NULL) {
+        return;
+    }
+    network_loop_del(resolver->loop, &resolver->wake);
+    network_resolver_free(resolver, resolver->nthreads);
+}
+
+// answers from the cache with the job itself, or queues it for a worker; 1, 0 or -1 like network_resolve_async
+static inline int network_resolver_submit(network_resolver_t *r, struct network_resolve_job *job) {
+    if (network_resolve_lookup(job->key, &job->res, &job->err)) {
+        return 1;
+    }
+    network_resolver_lock(r);
+    job->next = NULL;
+    if (r->queue_tail) {
+        r->queue_tail->next = job;
+    } else {
+        r->queue = job;
+    }
+    r->queue_tail = job;
+    network_resolver_unlock(r);
+#ifdef WINSOCK_IMPL
+    WakeConditionVariable(&r->ready);
+#else
+    pthread_cond_signal(&r->ready);
+#endif
+    return 0;
+}
+
+static inline struct network_resolve_job *network_resolve_job_new(const char *host, const char *port) {
+    struct network_resolve_job *job = malloc(sizeof(*job));
+    if (job == NULL) {
+        NETWORK_ERROR("Resolver job allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    if (network_resolve_key(job->key, host, port) < 0) {
+        NETWORK_ERROR("Host name too long: %s", host);
+        free(job);
+        network_fail(NETWORK_INVALID_ARGUMENT, 0);
+        return NULL;
+    }
+    job->host = job->key[0] ? job->key : NULL;
+    job->port = job->key + strlen(job->key) + 1;
+    job->watch = NULL;
+    job->cb = NULL;
+    return job;
+}
+
+inline int network_resolve_async(network_resolver_t *resolver, const char *host, const char *port,
+                                 network_resolve_cb cb, void *user) {
+    struct network_resolve_job *job = network_resolve_job_new(host, port);
+    if (job == NULL) {
+        return -1;
+    }
+    job->cb = cb;
+    job->user = user;
+    if (network_resolver_submit(resolver, job) == 0) {
+        return 0;
+    }
+    cb(resolver->loop, &job->res, job->err, user);
+    free(job);
+    return 1;
+}
+
+inline int network_resolver_connect(network_resolver_t *resolver, network_watch_t *watch, const char *host,
+                                    const char *port, uint32_t events, int timeout_ms) {
+    struct network_resolve_job *job = network_resolve_job_new(host, port);
+    if (job == NULL) {
+        return -1;
+    }
+    job->watch = watch;
+    job->events = events;
+    job->timeout_ms = timeout_ms;
+    if (network_resolver_submit(resolver, job) == 0) {
+        return 0;
+    }
+    int rc;
+    if (job->err != 0) {
+        NETWORK_ERROR("getaddrinfo failed for %s:%s. %s", host ? host : "localhost", port, gai_strerror(job->err));
+        rc = network_fail(NETWORK_ADDRESS_FAILED, job->err);
+    } else {
+        rc = network_resolver_dial(resolver->loop, watch, &job->res, events, timeout_ms);
+    }
+    free(job);
+    return rc;
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NETWORK_RESOLVE_H
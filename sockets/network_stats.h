@@ -0,0 +1,490 @@
+/**
+ * @file network_stats.h
+ * @brief Counters and latency histograms for network.h and network_loop.h
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h;
+ * network.h includes it, so everything in the library counts without anything to set up.
+ *
+ * Every thread counts into a block of its own, allocated the first time it touches a socket and
+ * never shared with another writer, so counting is a plain add with no atomic read-modify-write
+ * and no lock. network_stats_snapshot() adds up the blocks of every thread that ever counted,
+ * at any time and from any thread; the blocks stay around until exit, so the totals include
+ * threads that are gone.
+ *
+ * Histograms are HDR style: values below 32 get a bucket each, above that every power of two is
+ * split into NETWORK_HIST_SUB buckets, so a bucket is never more than 1/16 wider than the values in
+ * it; every value up to 2^64 - 1 fits, in NETWORK_HIST_BUCKETS buckets.
+ *
+ * Counted:
+ *   • bytes in and out, recv_calls and send_calls (or io_uring/IOCP completions), would_block for
+ *     the EAGAIN/WSAEWOULDBLOCK results among them, partial_writes for sends the socket took only part of,
+ *     errors for the ones that failed outright
+ *   • accepts, connects and closes
+ *   • loop_iterations, batches the event loop dispatched
+ *   • conn_lifetime_ns, from network_loop_add() to close for every socket network_loop_close() closed
+ *   • loop_iteration_ns and callback_ns, the time a batch spent dispatching (not waiting) and each event
+ *     or completion in it; these read the clock per event, so only after network_stats_set_timing(1)
+ *   A watch has the bytes the loop moved for its socket in watch->stats.
+ *   -DNETWORK_NO_STATS compiles all of it out, the snapshots are then all zeros.
+ *
+ * Available APIs:
+ *   • network_stats_snapshot()   - Totals of every thread right now
+ *   • network_stats_delta()      - What happened between two snapshots, e.g. per reporting interval
+ *   • network_hist_percentile()  - The value a percentile of a histogram's samples is at or below
+ *   • network_hist_add()         - Records into a histogram of your own, e.g. request latencies, merged with
+ *                                  network_hist_merge()
+ *   • network_stats_format()     - A snapshot as text or JSON, into a buffer, like snprintf
+ *   • network_stats_dump()       - Takes a snapshot and prints it
+ *   • network_stats_set_timing() - Turns the loop's latency histograms on or off, off by default
+ *
+ * @example
+ * network_stats_set_timing(1);
+ * ...
+ * network_stats_t stats;
+ * network_stats_snapshot(&stats);
+ * printf("p99 callback %llu ns\n", (unsigned long long)network_hist_percentile(&stats.hist[NETWORK_HIST_CALLBACK], 99.0));
+ */
+
+#ifndef NETWORK_STATS_H
+#define NETWORK_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_HIST_SUB_BITS 4
+#define NETWORK_HIST_SUB (1 << NETWORK_HIST_SUB_BITS) // buckets per power of two
+#define NETWORK_HIST_BUCKETS ((65 - NETWORK_HIST_SUB_BITS) * NETWORK_HIST_SUB)
+
+// network_stats_format formats
+#define NETWORK_STATS_TEXT 0 // one line per counter and histogram
+#define NETWORK_STATS_JSON 1 // one object, with the non-empty buckets of every histogram
+
+typedef enum {
+    NETWORK_STAT_BYTES_IN,
+    NETWORK_STAT_BYTES_OUT,
+    NETWORK_STAT_RECV_CALLS,
+    NETWORK_STAT_SEND_CALLS,
+    NETWORK_STAT_WOULD_BLOCK,
+    NETWORK_STAT_PARTIAL_WRITES,
+    NETWORK_STAT_ERRORS,
+    NETWORK_STAT_ACCEPTS,
+    NETWORK_STAT_CONNECTS,
+    NETWORK_STAT_CLOSES,
+    NETWORK_STAT_LOOP_ITERATIONS,
+    NETWORK_STAT_COUNT
+} network_stat;
+
+// all in nanoseconds
+typedef enum {
+    NETWORK_HIST_LOOP_ITERATION,
+    NETWORK_HIST_CALLBACK,
+    NETWORK_HIST_CONN_LIFETIME,
+    NETWORK_HIST_COUNT
+} network_hist;
+
+typedef struct network_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[NETWORK_HIST_BUCKETS];
+} network_histogram_t;
+
+typedef struct network_stats {
+    uint64_t counters[NETWORK_STAT_COUNT]; // indexed by network_stat
+    network_histogram_t hist[NETWORK_HIST_COUNT];
+} network_stats_t;
+
+// what the loop moved for one socket, reset by network_loop_add and network_loop_connect
+typedef struct network_watch_stats {
+    uint64_t bytes_in;   // read by the loop itself, what on_data got; on_readable reads aren't counted
+    uint64_t bytes_out;  // sent by network_loop_send and network_loop_send_file
+    uint64_t opened_ns;  // when it was added, on network_stats' clock
+} network_watch_stats;
+
+// adds up every thread's counters, a few counts of the threads still counting may not be in yet
+void network_stats_snapshot(network_stats_t *out);
+// now minus then for the counters and histograms; max can't be taken apart, it's now's
+void network_stats_delta(network_stats_t *out, const network_stats_t *now, const network_stats_t *then);
+// percentile in [0, 100], 0 for an empty histogram; exact below 32, within 1/16 above
+uint64_t network_hist_percentile(const network_histogram_t *hist, double percentile);
+// one sample into a zeroed network_histogram_t of the caller's, not safe to share between threads
+void network_hist_add(network_histogram_t *hist, uint64_t value);
+// adds from's samples to into
+void network_hist_merge(network_histogram_t *into, const network_histogram_t *from);
+// writes stats as NETWORK_STATS_TEXT or NETWORK_STATS_JSON, returns the length the whole of it needs
+// without the NUL; it's cut off like snprintf when that's size or more
+size_t network_stats_format(const network_stats_t *stats, int format, char *buf, size_t size);
+// snapshots and writes it to out
+void network_stats_dump(FILE *out, int format);
+// 1 turns on the loop_iteration_ns and callback_ns histograms, for every loop
+void network_stats_set_timing(int on);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#ifdef __cplusplus
+#define NETWORK_STATS_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define NETWORK_STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define NETWORK_STATS_THREAD_LOCAL _Thread_local
+#endif
+
+// one thread's counts, only that thread writes to it
+struct network_stats_block {
+    network_stats_t stats;
+    struct network_stats_block *next;
+};
+
+static const char *const network_stat_names[NETWORK_STAT_COUNT] = {
+    "bytes_in", "bytes_out", "recv_calls", "send_calls", "would_block", "partial_writes", "errors",
+    "accepts", "connects", "closes", "loop_iterations",
+};
+static const char *const network_hist_names[NETWORK_HIST_COUNT] = {
+    "loop_iteration_ns", "callback_ns", "conn_lifetime_ns",
+};
+
+static struct network_stats_block *network_stats_blocks; // every thread's, pushed lock-free
+static NETWORK_STATS_THREAD_LOCAL struct network_stats_block *network_stats_self;
+static struct network_stats_block network_stats_lost;     // where a thread counts when its block couldn't be allocated
+static int network_stats_timing;
+
+// nanoseconds on a clock that doesn't jump with the wall clock
+static inline uint64_t network_stats_now_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000u +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000u / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// a counter is only written by its own thread, relaxed loads and stores keep the snapshot reads
+// race-free and still compile to a plain add
+static inline uint64_t network_stats_load(const uint64_t *counter) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#else
+    return *(const volatile uint64_t *)counter;
+#endif
+}
+
+static inline void network_stats_store(uint64_t *counter, uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+#else
+    *(volatile uint64_t *)counter = value;
+#endif
+}
+
+static inline void network_stats_push(struct network_stats_block *block) {
+#if defined(__GNUC__) || defined(__clang__)
+    block->next = __atomic_load_n(&network_stats_blocks, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&network_stats_blocks, &block->next, block, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+    }
+#else
+    do {
+        block->next = network_stats_blocks;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&network_stats_blocks, block, block->next) != block->next);
+#endif
+}
+
+// this thread's block, allocated on first use
+static inline network_stats_t *network_stats_local(void) {
+    struct network_stats_block *block = network_stats_self;
+    if (block == NULL) {
+        int saved = errno; // callers look at errno of the call they count after this
+        block = calloc(1, sizeof(*block));
+        errno = saved;
+        if (block) {
+            network_stats_push(block);
+        } else {
+            block = &network_stats_lost; // not in the totals, more than one thread may write to it
+        }
+        network_stats_self = block;
+    }
+    return &block->stats;
+}
+
+static inline unsigned network_hist_bucket(uint64_t value) {
+    if (value < 2 * NETWORK_HIST_SUB) {
+        return (unsigned)value;
+    }
+#ifdef _MSC_VER
+    unsigned long msb;
+    _BitScanReverse64(&msb, value);
+#else
+    unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+#endif
+    // the top NETWORK_HIST_SUB_BITS + 1 bits, the highest of them always set
+    unsigned shift = (unsigned)msb - NETWORK_HIST_SUB_BITS;
+    return (shift * NETWORK_HIST_SUB) + (unsigned)(value >> shift);
+}
+
+// smallest value that lands in bucket
+static inline uint64_t network_hist_bucket_low(unsigned bucket) {
+    if (bucket < 2 * NETWORK_HIST_SUB) {
+        return bucket;
+    }
+    unsigned shift = bucket / NETWORK_HIST_SUB - 1;
+    return (uint64_t)(bucket % NETWORK_HIST_SUB + NETWORK_HIST_SUB) << shift;
+}
+
+static inline uint64_t network_hist_bucket_high(unsigned bucket) {
+    return bucket + 1 < NETWORK_HIST_BUCKETS ? network_hist_bucket_low(bucket + 1) - 1 : UINT64_MAX;
+}
+
+#ifdef NETWORK_NO_STATS
+static inline void network_stats_add(network_stat counter, uint64_t n) {
+    (void)counter;
+    (void)n;
+}
+static inline void network_stats_record(network_hist hist, uint64_t value) {
+    (void)hist;
+    (void)value;
+}
+#else
+static inline void network_stats_add(network_stat counter, uint64_t n) {
+    uint64_t *c = &network_stats_local()->counters[counter];
+    network_stats_store(c, network_stats_load(c) + n);
+}
+
+static inline void network_stats_record(network_hist hist, uint64_t value) {
+    network_histogram_t *h = &network_stats_local()->hist[hist];
+    uint64_t *bucket = &h->buckets[network_hist_bucket(value)];
+    network_stats_store(bucket, network_stats_load(bucket) + 1);
+    network_stats_store(&h->sum, network_stats_load(&h->sum) + value);
+    if (value > network_stats_load(&h->max)) {
+        network_stats_store(&h->max, value);
+    }
+    // count last, a snapshot never sees more samples than buckets filled
+    network_stats_store(&h->count, network_stats_load(&h->count) + 1);
+}
+#endif
+
+// the clock conn_lifetime_ns counts on, 0 with NETWORK_NO_STATS
+static inline uint64_t network_stats_clock(void) {
+#ifdef NETWORK_NO_STATS
+    return 0;
+#else
+    return network_stats_now_ns();
+#endif
+}
+
+// the start of something the timing histograms measure, 0 while timing is off
+static inline uint64_t network_stats_start(void) {
+#ifdef NETWORK_NO_STATS
+    return 0;
+#else
+    return network_stats_timing ? network_stats_now_ns() : 0;
+#endif
+}
+
+// records the time since *since into hist and starts the next lap; nothing when *since is 0
+static inline void network_stats_lap(network_hist hist, uint64_t *since) {
+    if (*since) {
+        uint64_t now = network_stats_now_ns();
+        network_stats_record(hist, now - *since);
+        *since = now;
+    }
+}
+
+inline void network_stats_set_timing(int on) {
+    network_stats_timing = on;
+}
+
+inline void network_stats_snapshot(network_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+#if defined(__GNUC__) || defined(__clang__)
+    struct network_stats_block *block = __atomic_load_n(&network_stats_blocks, __ATOMIC_ACQUIRE);
+#else
+    struct network_stats_block *block = *(struct network_stats_block *volatile *)&network_stats_blocks;
+#endif
+    for (; block; block = block->next) {
+        const network_stats_t *stats = &block->stats;
+        for (int i = 0; i < NETWORK_STAT_COUNT; i++) {
+            out->counters[i] += network_stats_load(&stats->counters[i]);
+        }
+        for (int i = 0; i < NETWORK_HIST_COUNT; i++) {
+            const network_histogram_t *from = &stats->hist[i];
+            network_histogram_t *to = &out->hist[i];
+            // count first, the writer bumps it last
+            uint64_t count = network_stats_load(&from->count);
+            if (count == 0) {
+                continue;
+            }
+            to->count += count;
+            to->sum += network_stats_load(&from->sum);
+            uint64_t max = network_stats_load(&from->max);
+            if (max > to->max) {
+                to->max = max;
+            }
+            for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+                to->buckets[b] += network_stats_load(&from->buckets[b]);
+            }
+        }
+    }
+}
+
+inline void network_stats_delta(network_stats_t *out, const network_stats_t *now, const network_stats_t *then) {
+    for (int i = 0; i < NETWORK_STAT_COUNT; i++) {
+        out->counters[i] = now->counters[i] - then->counters[i];
+    }
+    for (int i = 0; i < NETWORK_HIST_COUNT; i++) {
+        network_histogram_t *h = &out->hist[i];
+        h->count = now->hist[i].count - then->hist[i].count;
+        h->sum = now->hist[i].sum - then->hist[i].sum;
+        h->max = now->hist[i].max;
+        for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+            h->buckets[b] = now->hist[i].buckets[b] - then->hist[i].buckets[b];
+        }
+    }
+}
+
+inline uint64_t network_hist_percentile(const network_histogram_t *hist, double percentile) {
+    uint64_t total = 0;
+    for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+        total += hist->buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    if (percentile < 0) percentile = 0;
+    if (percentile > 100) percentile = 100;
+    // the sample at that rank, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            // the highest value of the bucket, but never above the largest sample
+            uint64_t high = network_hist_bucket_high(b);
+            return hist->max && high > hist->max ? hist->max : high;
+        }
+    }
+    return hist->max;
+}
+
+inline void network_hist_add(network_histogram_t *hist, uint64_t value) {
+    hist->buckets[network_hist_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+inline void network_hist_merge(network_histogram_t *into, const network_histogram_t *from) {
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+        into->buckets[b] += from->buckets[b];
+    }
+}
+
+// snprintf onto the end of buf, len keeps counting once it's full
+static inline void network_stats_append(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        *len += (size_t)n;
+    }
+}
+
+inline size_t network_stats_format(const network_stats_t *stats, int format, char *buf, size_t size) {
+    size_t len = 0;
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+    int json = format == NETWORK_STATS_JSON;
+    network_stats_append(buf, size, &len, json ? "{\"counters\":{" : "");
+    for (int i = 0; i < NETWORK_STAT_COUNT; i++) {
+        network_stats_append(buf, size, &len, json ? "%s\"%s\":%llu" : "%s%-18s %llu\n",
+                             json && i ? "," : "", network_stat_names[i], (unsigned long long)stats->counters[i]);
+    }
+    network_stats_append(buf, size, &len, json ? "},\"histograms\":{" : "");
+    for (int i = 0; i < NETWORK_HIST_COUNT; i++) {
+        const network_histogram_t *h = &stats->hist[i];
+        unsigned long long p50 = network_hist_percentile(h, 50), p90 = network_hist_percentile(h, 90);
+        unsigned long long p99 = network_hist_percentile(h, 99), p999 = network_hist_percentile(h, 99.9);
+        unsigned long long mean = h->count ? h->sum / h->count : 0;
+        if (!json) {
+            network_stats_append(buf, size, &len,
+                                 "%-18s count %llu mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+                                 network_hist_names[i], (unsigned long long)h->count, mean, p50, p90, p99, p999,
+                                 (unsigned long long)h->max);
+            continue;
+        }
+        network_stats_append(buf, size, &len,
+                             "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,"
+                             "\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[",
+                             i ? "," : "", network_hist_names[i], (unsigned long long)h->count,
+                             (unsigned long long)h->sum, mean, p50, p90, p99, p999, (unsigned long long)h->max);
+        // [lowest value, samples] of every bucket that has any
+        int first = 1;
+        for (unsigned b = 0; b < NETWORK_HIST_BUCKETS; b++) {
+            if (h->buckets[b]) {
+                network_stats_append(buf, size, &len, "%s[%llu,%llu]", first ? "" : ",",
+                                     (unsigned long long)network_hist_bucket_low(b), (unsigned long long)h->buckets[b]);
+                first = 0;
+            }
+        }
+        network_stats_append(buf, size, &len, "]}");
+    }
+    network_stats_append(buf, size, &len, json ? "}}\n" : "");
+    return len;
+}
+
+inline void network_stats_dump(FILE *out, int format) {
+    network_stats_t *stats = malloc(sizeof(*stats)); // too big to be nice on the stack
+    if (stats == NULL) {
+        return;
+    }
+    network_stats_snapshot(stats);
+    size_t len = network_stats_format(stats, format, NULL, 0);
+    char *text = malloc(len + 1);
+    if (text) {
+        network_stats_format(stats, format, text, len + 1);
+        fputs(text, out);
+        free(text);
+    }
+    free(stats);
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_STATS_H
@@ -0,0 +1,825 @@
+/**
+ * @file network_tls.h
+ * @brief TLS on network_loop_t connections, with OpenSSL or BoringSSL, kernel TLS and session resumption
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ * Optional: only programs that include it need OpenSSL (or BoringSSL) and link libssl and libcrypto.
+ *
+ * A network_tls_conn_t wraps a network_watch_t the way a watch wraps a socket: the handshake, reads
+ * and writes are driven by the loop's readiness events, so a TLS connection costs the loop's thread
+ * no more waiting than a plain one. The library reads and writes the socket itself, through a socket
+ * BIO; plaintext comes out in on_data and goes in with network_tls_send().
+ *
+ * Kernel TLS: on Linux, with an OpenSSL built with it (3.0 and later, not BoringSSL), every context
+ * asks for it, and OpenSSL sets TCP_ULP "tls" on the socket and hands the kernel the keys when the
+ * handshake switches to them. Once the kernel encrypts, network_tls_send() is network_loop_send() and
+ * network_tls_send_file() is network_loop_send_file(), so bulk data and sendfile go out without a copy
+ * through user space; conn->ktls_send and conn->ktls_recv say what the kernel took over. OpenSSL 3.0
+ * only hands over receiving for TLS 1.2. Where the kernel doesn't have the tls module, or the cipher
+ * isn't one it does, everything stays in OpenSSL and files are read through a buffer.
+ *
+ * Session resumption: servers keep sessions in OpenSSL's cache and hand out tickets, clients keep
+ * the last session of every server name and port in their context, NETWORK_TLS_SESSIONS of them, and
+ * offer it on the next connect. A resumed handshake skips the certificate and the key exchange's
+ * signature, which is most of a full handshake's CPU on both ends, when a server restart or a network
+ * blip makes every client reconnect at once.
+ *
+ * Available APIs:
+ *   • network_tls_server()       - Context with a certificate and key for accepted connections
+ *   • network_tls_client()       - Context that verifies servers against a CA file or the system's CAs
+ *   • network_tls_ctx_free()     - Frees a context once no connection uses it anymore
+ *   • network_tls_accept()       - TLS on an accepted socket, watched by the loop from now on
+ *   • network_tls_connect()      - network_loop_connect() and a TLS handshake, resuming when it can
+ *   • network_tls_send()         - Plaintext in, encrypted by the kernel or queued through OpenSSL
+ *   • network_tls_send_file()    - Part of a file, with sendfile when the kernel does the encrypting
+ *   • network_tls_close()        - Sends what's queued and close_notify, closes the socket, calls on_close
+ *
+ * @example
+ * network_tls_ctx_t *tls = network_tls_server("cert.pem", "key.pem", 0);
+ * // in on_accept:
+ * conn->tls.on_data = request; conn->tls.on_close = release; conn->tls.user = conn;
+ * network_tls_accept(loop, &conn->tls, tls, fd);
+ */
+
+#ifndef NETWORK_TLS_H
+#define NETWORK_TLS_H
+
+#include "network_loop.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#ifdef LINUX_SOCKETS_IMPL
+#include <arpa/inet.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(LINUX_SOCKETS_IMPL) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define NETWORK_TLS_KTLS
+#endif
+
+#define NETWORK_TLS_HANDSHAKE_MS 10000      // accepted and connected sockets get this long to finish the handshake
+#define NETWORK_TLS_CLOSE_MS 10000          // and network_tls_close this long to send what's still queued
+#define NETWORK_TLS_READ_SIZE (16 * 1024)   // one record, the most SSL_read returns at a time
+#define NETWORK_TLS_FILE_CHUNK (64 * 1024)  // bytes of a file read at a time when OpenSSL encrypts
+#define NETWORK_TLS_SESSIONS 256            // client sessions a context keeps, a power of two
+#define NETWORK_TLS_SERVER_SESSIONS 20480   // sessions in OpenSSL's server cache, its default
+#define NETWORK_TLS_KEY 272                 // bytes of server name and port, DNS names stop at 253
+
+// network_tls_server/client flags
+#define NETWORK_TLS_NO_VERIFY 0x1 // clients take any certificate, for tests against self-signed servers
+#define NETWORK_TLS_NO_KTLS   0x2 // keep encryption in OpenSSL even where the kernel could do it
+#define NETWORK_TLS_NO_RESUME 0x4 // every handshake is a full one
+
+// on_close err when the handshake or a record failed, OpenSSL's error queue is logged at info level
+#ifdef WINSOCK_IMPL
+#define NETWORK_LOOP_TLS_FAILED WSAECONNABORTED
+#else
+#define NETWORK_LOOP_TLS_FAILED EPROTO
+#endif
+
+typedef struct network_tls_ctx network_tls_ctx_t;
+typedef struct network_tls_conn network_tls_conn_t;
+
+typedef void (*network_tls_data_cb)(network_loop_t *loop, network_tls_conn_t *conn, const char *data, size_t len);
+typedef void (*network_tls_close_cb)(network_loop_t *loop, network_tls_conn_t *conn, int err);
+typedef void (*network_tls_event_cb)(network_loop_t *loop, network_tls_conn_t *conn);
+
+struct network_tls_session {
+    char key[NETWORK_TLS_KEY];    // "name:port", empty for a free slot
+    SSL_SESSION *session;
+};
+
+struct network_tls_ctx {
+    SSL_CTX *ssl;                 // OpenSSL's, for settings this header doesn't have
+    int flags;
+    int server;
+#ifdef WINSOCK_IMPL
+    SRWLOCK lock;
+#else
+    pthread_mutex_t lock;
+#endif
+    struct network_tls_session sessions[NETWORK_TLS_SESSIONS]; // clients only
+};
+
+// a network_tls_send_file segment waiting behind the bytes queued before it
+struct network_tls_file {
+    int fd;
+    int flags;
+    int64_t offset;
+    size_t left;
+    size_t ahead;                 // queued bytes that go out between the previous segment and this one
+    struct network_tls_file *next;
+};
+
+// embedded in the caller's connection struct and zeroed before network_tls_accept/connect
+struct network_tls_conn {
+    network_tls_data_cb on_data;        // plaintext received, valid until the callback returns
+    network_tls_close_cb on_close;      // closed, the connection can be freed here
+    network_tls_event_cb on_handshake;  // optional, the handshake is done and the peer verified
+    void *user;
+
+    // owned by the TLS layer
+    network_watch_t watch;        // the loop's, its callbacks are this header's
+    network_tls_ctx_t *ctx;
+    SSL *ssl;
+    int established;              // handshake done
+    int write_wanted;             // EV_WRITE was added for OpenSSL
+    int closing;                  // network_tls_close waits for the queue to go out
+    int ktls_send, ktls_recv;     // the kernel encrypts, decrypts
+    char *out;                    // plaintext queued before the handshake or that OpenSSL couldn't write yet
+    size_t out_off, out_len, out_cap;
+    struct network_tls_file *files;
+    char session_key[NETWORK_TLS_KEY]; // clients, the sessions cache slot this connection's sessions go to
+};
+
+// cert_file and key_file are PEM; pass NULL for both to set a certificate on ctx->ssl yourself
+network_tls_ctx_t *network_tls_server(const char *cert_file, const char *key_file, int flags);
+// ca_file is a PEM bundle to verify servers against, NULL for the system's
+network_tls_ctx_t *network_tls_client(const char *ca_file, int flags);
+void network_tls_ctx_free(network_tls_ctx_t *ctx);
+// fd is an accepted non-blocking socket, the handshake runs in the loop; 0 or -1 (fd is closed then)
+int network_tls_accept(network_loop_t *loop, network_tls_conn_t *conn, network_tls_ctx_t *ctx, socket_t fd);
+// connects like network_loop_connect, server_name is sent as SNI, verified and keys the session cache;
+// with a NULL server_name the certificate has to be for addr's IP address
+int network_tls_connect(network_loop_t *loop, network_tls_conn_t *conn, network_tls_ctx_t *ctx,
+                        const struct sockaddr *addr, socklen_t addrlen, const char *server_name, int timeout_ms);
+// sends or queues all len bytes, returns 0 or -1 when the connection failed and got closed
+int network_tls_send(network_loop_t *loop, network_tls_conn_t *conn, const void *data, size_t len);
+// queues len bytes of fd from offset like network_loop_send_file, flags takes NETWORK_FILE_CLOSE
+int network_tls_send_file(network_loop_t *loop, network_tls_conn_t *conn, int fd, int64_t offset, size_t len, int flags);
+// bytes sent with network_tls_send/send_file that haven't gone out yet
+size_t network_tls_pending(const network_tls_conn_t *conn);
+// 1 when the handshake resumed a session
+int network_tls_resumed(const network_tls_conn_t *conn);
+// with err 0 what's queued goes out first and on_data still gets what arrives meanwhile, sends fail;
+// with an err the queue is dropped and the socket closed right away
+void network_tls_close(network_loop_t *loop, network_tls_conn_t *conn, int err);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+#ifdef WINSOCK_IMPL
+#define network_tls_lock(ctx) AcquireSRWLockExclusive(&(ctx)->lock)
+#define network_tls_unlock(ctx) ReleaseSRWLockExclusive(&(ctx)->lock)
+#else
+#define network_tls_lock(ctx) pthread_mutex_lock(&(ctx)->lock)
+#define network_tls_unlock(ctx) pthread_mutex_unlock(&(ctx)->lock)
+#endif
+
+// what OpenSSL's error queue has on why, logged and cleared
+static inline void network_tls_log_errors(const char *what) {
+    unsigned long code;
+    char text[256];
+    while ((code = ERR_get_error()) != 0) {
+        ERR_error_string_n(code, text, sizeof(text));
+        NETWORK_INFO("%s: %s", what, text);
+    }
+}
+
+static inline uint32_t network_tls_hash(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    }
+    return hash;
+}
+
+// the slot that has key, else the one to put it in: a free one or the oldest session of the four
+static inline struct network_tls_session *network_tls_slot(network_tls_ctx_t *ctx, const char *key) {
+    uint32_t hash = network_tls_hash(key);
+    struct network_tls_session *victim = NULL;
+    for (uint32_t i = 0; i < 4; i++) {
+        struct network_tls_session *slot = &ctx->sessions[(hash + i) & (NETWORK_TLS_SESSIONS - 1)];
+        if (strcmp(slot->key, key) == 0) {
+            return slot;
+        }
+        if (victim == NULL || (victim->session && (slot->session == NULL ||
+            SSL_SESSION_get_time(slot->session) < SSL_SESSION_get_time(victim->session)))) {
+            victim = slot;
+        }
+    }
+    return victim;
+}
+
+// OpenSSL has a new session for a client connection: a ticket, or the session of a TLS 1.2 handshake
+static inline int network_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+    network_tls_conn_t *conn = SSL_get_app_data(ssl);
+    if (conn == NULL || conn->session_key[0] == '\0') {
+        return 0;
+    }
+    network_tls_ctx_t *ctx = conn->ctx;
+    network_tls_lock(ctx);
+    struct network_tls_session *slot = network_tls_slot(ctx, conn->session_key);
+    if (slot->session) {
+        SSL_SESSION_free(slot->session);
+    }
+    snprintf(slot->key, sizeof(slot->key), "%s", conn->session_key);
+    slot->session = session;
+    network_tls_unlock(ctx);
+    return 1; // the cache keeps OpenSSL's reference
+}
+
+// the session stays for the connections after this one too, until a newer one replaces it: RFC 8446
+// only suggests tickets be used once, and a storm of connections to one server needs them all to resume;
+// a server that does take each ticket once just makes those a full handshake
+static inline SSL_SESSION *network_tls_take_session(network_tls_ctx_t *ctx, const char *key) {
+    SSL_SESSION *session = NULL;
+    network_tls_lock(ctx);
+    struct network_tls_session *slot = network_tls_slot(ctx, key);
+    if (strcmp(slot->key, key) == 0 && slot->session) {
+        if (SSL_SESSION_is_resumable(slot->session)) {
+            session = slot->session;
+            SSL_SESSION_up_ref(session);
+        } else {
+            SSL_SESSION_free(slot->session);
+            slot->key[0] = '\0';
+            slot->session = NULL;
+        }
+    }
+    network_tls_unlock(ctx);
+    return session;
+}
+
+static inline network_tls_ctx_t *network_tls_ctx_new(const SSL_METHOD *method, int flags, int server) {
+    network_tls_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        NETWORK_ERROR("TLS context allocation failed.");
+        network_fail(NETWORK_OUT_OF_MEMORY, ENOMEM);
+        return NULL;
+    }
+    ctx->ssl = SSL_CTX_new(method);
+    if (ctx->ssl == NULL) {
+        network_tls_log_errors("SSL_CTX_new");
+        NETWORK_ERROR("TLS context creation failed.");
+        free(ctx);
+        network_fail(NETWORK_TLS_FAILED, 0);
+        return NULL;
+    }
+    ctx->flags = flags;
+    ctx->server = server;
+#ifdef WINSOCK_IMPL
+    InitializeSRWLock(&ctx->lock);
+#else
+    pthread_mutex_init(&ctx->lock, NULL);
+#endif
+    SSL_CTX_set_min_proto_version(ctx->ssl, TLS1_2_VERSION);
+    // network_tls_send keeps its queue in place until OpenSSL took it, but the queue may move when it grows
+    SSL_CTX_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef NETWORK_TLS_KTLS
+    if (!(flags & NETWORK_TLS_NO_KTLS)) {
+        SSL_CTX_set_options(ctx->ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    return ctx;
+}
+
+inline network_tls_ctx_t *network_tls_server(const char *cert_file, const char *key_file, int flags) {
+    network_tls_ctx_t *ctx = network_tls_ctx_new(TLS_server_method(), flags, 1);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (cert_file && (SSL_CTX_use_certificate_chain_file(ctx->ssl, cert_file) != 1 ||
+                      SSL_CTX_use_PrivateKey_file(ctx->ssl, key_file ? key_file : cert_file, SSL_FILETYPE_PEM) != 1 ||
+                      SSL_CTX_check_private_key(ctx->ssl) != 1)) {
+        network_tls_log_errors(cert_file);
+        NETWORK_ERROR("TLS certificate or key %s couldn't be loaded.", cert_file);
+        network_tls_ctx_free(ctx);
+        network_fail(NETWORK_TLS_FAILED, 0);
+        return NULL;
+    }
+    if (flags & NETWORK_TLS_NO_RESUME) {
+        SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_TICKET);
+#ifndef OPENSSL_IS_BORINGSSL
+        SSL_CTX_set_num_tickets(ctx->ssl, 0);
+#endif
+    } else {
+        static const unsigned char id[] = "network_tls";
+        SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx->ssl, NETWORK_TLS_SERVER_SESSIONS);
+        SSL_CTX_set_session_id_context(ctx->ssl, id, sizeof(id) - 1);
+#ifndef OPENSSL_IS_BORINGSSL
+        SSL_CTX_set_num_tickets(ctx->ssl, 1); // clients keep one per server anyway
+#endif
+    }
+    return ctx;
+}
+
+inline network_tls_ctx_t *network_tls_client(const char *ca_file, int flags) {
+    network_tls_ctx_t *ctx = network_tls_ctx_new(TLS_client_method(), flags, 0);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (!(flags & NETWORK_TLS_NO_VERIFY)) {
+        int loaded = ca_file ? SSL_CTX_load_verify_locations(ctx->ssl, ca_file, NULL) : SSL_CTX_set_default_verify_paths(ctx->ssl);
+        if (loaded != 1) {
+            network_tls_log_errors(ca_file ? ca_file : "default CAs");
+            NETWORK_ERROR("TLS CAs %s couldn't be loaded.", ca_file ? ca_file : "of the system");
+            network_tls_ctx_free(ctx);
+            network_fail(NETWORK_TLS_FAILED, 0);
+            return NULL;
+        }
+        SSL_CTX_set_verify(ctx->ssl, SSL_VERIFY_PEER, NULL);
+    }
+    if (!(flags & NETWORK_TLS_NO_RESUME)) {
+        SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx->ssl, network_tls_new_session);
+    }
+    return ctx;
+}
+
+inline void network_tls_ctx_free(network_tls_ctx_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    for (int i = 0; i < NETWORK_TLS_SESSIONS; i++) {
+        if (ctx->sessions[i].session) {
+            SSL_SESSION_free(ctx->sessions[i].session);
+        }
+    }
+    SSL_CTX_free(ctx->ssl);
+#ifndef WINSOCK_IMPL
+    pthread_mutex_destroy(&ctx->lock);
+#endif
+    free(ctx);
+}
+
+static inline void network_tls_fail(network_loop_t *loop, network_tls_conn_t *conn, const char *what) {
+    network_tls_log_errors(what);
+    network_loop_close(loop, &conn->watch, NETWORK_LOOP_TLS_FAILED);
+}
+
+// EV_WRITE on while OpenSSL waits for the socket to take more, off again once it's written
+static inline int network_tls_want_write(network_loop_t *loop, network_tls_conn_t *conn, int want) {
+    if (conn->write_wanted == want) {
+        return 0;
+    }
+    conn->write_wanted = want;
+    if (network_loop_mod(loop, &conn->watch, NETWORK_EV_READ | (want ? NETWORK_EV_WRITE : 0)) < 0) {
+        network_loop_close(loop, &conn->watch, network_last_errno());
+        return -1;
+    }
+    return 0;
+}
+
+// close_notify, if the socket takes it right away; a peer that closes first doesn't wait for it
+static inline void network_tls_shutdown(network_loop_t *loop, network_tls_conn_t *conn, int err) {
+    if (conn->established && err == 0 && !(SSL_get_shutdown(conn->ssl) & SSL_SENT_SHUTDOWN)) {
+        if (SSL_shutdown(conn->ssl) < 0) {
+            ERR_clear_error();
+        }
+    }
+    network_loop_close(loop, &conn->watch, err);
+}
+
+// a network_tls_close waiting for the queue: closes once it's all out, until then EV_WRITE says when;
+// returns -1 after closing
+static inline int network_tls_drained(network_loop_t *loop, network_tls_conn_t *conn) {
+    if (!conn->closing) {
+        return 0;
+    }
+    if (network_tls_pending(conn) > 0) {
+        return network_tls_want_write(loop, conn, 1);
+    }
+    network_tls_shutdown(loop, conn, 0);
+    return -1;
+}
+
+// what a failed SSL_ call wants; returns 0 when it only has to wait for the socket, -1 after closing
+static inline int network_tls_retry(network_loop_t *loop, network_tls_conn_t *conn, int rc, const char *what) {
+    switch (SSL_get_error(conn->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return 0; // EV_READ is always on
+    case SSL_ERROR_WANT_WRITE:
+        return network_tls_want_write(loop, conn, 1);
+    case SSL_ERROR_ZERO_RETURN:
+        network_tls_shutdown(loop, conn, 0); // close_notify from the peer, nothing queued is read anymore
+        return -1;
+    case SSL_ERROR_SYSCALL: {
+#ifdef WINSOCK_IMPL
+        int err = WSAGetLastError();
+#else
+        int err = errno;
+#endif
+        ERR_clear_error();
+        network_loop_close(loop, &conn->watch, err ? err : ECONNRESET);
+        return -1;
+    }
+    default:
+        network_tls_fail(loop, conn, what);
+        return -1;
+    }
+}
+
+// room for size queued bytes from the front of the buffer on, moving what's queued there first
+static inline int network_tls_reserve(network_loop_t *loop, network_tls_conn_t *conn, size_t size) {
+    if (conn->out_off > 0) {
+        memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if (size <= conn->out_cap) {
+        return 0;
+    }
+    size_t cap = conn->out_cap ? conn->out_cap * 2 : 4096;
+    while (cap < size) {
+        cap *= 2;
+    }
+    char *out = realloc(conn->out, cap);
+    if (out == NULL) {
+        NETWORK_ERROR("TLS send queue allocation failed.");
+        network_loop_close(loop, &conn->watch, ENOMEM);
+        return -1;
+    }
+    conn->out = out;
+    conn->out_cap = cap;
+    return 0;
+}
+
+static inline int network_tls_queue(network_loop_t *loop, network_tls_conn_t *conn, const void *data, size_t len) {
+    if (conn->out_len + len > conn->out_cap && network_tls_reserve(loop, conn, conn->out_len - conn->out_off + len) < 0) {
+        return -1;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+// the head file has nothing queued ahead of it: its next chunk goes in at the front of the queue
+static inline int network_tls_file_chunk(network_loop_t *loop, network_tls_conn_t *conn) {
+    struct network_tls_file *file = conn->files;
+    size_t chunk = file->left < NETWORK_TLS_FILE_CHUNK ? file->left : NETWORK_TLS_FILE_CHUNK;
+    size_t behind = conn->out_len - conn->out_off;
+    if (network_tls_reserve(loop, conn, behind + chunk) < 0) {
+        return -1;
+    }
+    memmove(conn->out + chunk, conn->out, behind);
+#ifdef WINSOCK_IMPL
+    int n = _lseeki64(file->fd, file->offset, SEEK_SET) < 0 ? -1 : _read(file->fd, conn->out, (unsigned)chunk);
+#else
+    ssize_t n = pread(file->fd, conn->out, chunk, (off_t)file->offset);
+#endif
+    if (n <= 0) {
+        int err = n < 0 ? errno : EIO; // the file got shorter than what was asked for
+        memmove(conn->out, conn->out + chunk, behind);
+        NETWORK_ERROR("Reading the file to send failed. %s", strerror(err));
+        network_loop_close(loop, &conn->watch, err);
+        return -1;
+    }
+    if ((size_t)n < chunk) {
+        memmove(conn->out + n, conn->out + chunk, behind);
+    }
+    conn->out_len = behind + (size_t)n;
+    file->offset += n;
+    file->left -= (size_t)n;
+    file->ahead = (size_t)n;
+    return 0;
+}
+
+static inline void network_tls_file_pop(network_tls_conn_t *conn) {
+    struct network_tls_file *file = conn->files;
+    conn->files = file->next;
+    if (conn->files) {
+        conn->files->ahead += file->ahead;
+    }
+    if (file->flags & NETWORK_FILE_CLOSE) {
+        close(file->fd);
+    }
+    free(file);
+}
+
+// writes the queue through OpenSSL as far as the socket takes it, returns -1 after closing
+static inline int network_tls_flush(network_loop_t *loop, network_tls_conn_t *conn) {
+    for (;;) {
+        while (conn->files && conn->files->ahead == 0 && conn->files->left == 0) {
+            network_tls_file_pop(conn);
+        }
+        if (conn->files && conn->files->ahead == 0 && network_tls_file_chunk(loop, conn) < 0) {
+            return -1;
+        }
+        size_t len = conn->files ? conn->files->ahead : conn->out_len - conn->out_off;
+        if (len == 0) {
+            break;
+        }
+        // a retry after WANT_WRITE has to start with the same bytes, they stay at the front until taken
+        int rc = SSL_write(conn->ssl, conn->out + conn->out_off, len > INT_MAX ? INT_MAX : (int)len);
+        if (rc <= 0) {
+            return network_tls_retry(loop, conn, rc, "SSL_write");
+        }
+        conn->out_off += (size_t)rc;
+        if (conn->files) {
+            conn->files->ahead -= (size_t)rc;
+        }
+    }
+    conn->out_off = conn->out_len = 0;
+    if (network_tls_want_write(loop, conn, 0) < 0) {
+        return -1;
+    }
+    return network_tls_drained(loop, conn);
+}
+
+// the kernel encrypts from here: whatever was queued before goes to the loop's queue, in order
+static inline int network_tls_hand_over(network_loop_t *loop, network_tls_conn_t *conn) {
+    while (conn->files) {
+        struct network_tls_file *file = conn->files;
+        if (file->ahead && network_loop_send(loop, &conn->watch, conn->out + conn->out_off, file->ahead) < 0) {
+            return -1;
+        }
+        conn->out_off += file->ahead;
+        conn->files = file->next;
+        int rc = network_loop_send_file(loop, &conn->watch, file->fd, file->offset, file->left, file->flags);
+        free(file);
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    size_t len = conn->out_len - conn->out_off;
+    conn->out_off = conn->out_len = 0;
+    return len ? network_loop_send(loop, &conn->watch, conn->out, len) : 0;
+}
+
+static inline void network_tls_read(network_loop_t *loop, network_tls_conn_t *conn) {
+    static NETWORK_STATS_THREAD_LOCAL char buf[NETWORK_TLS_READ_SIZE];
+    for (;;) {
+        int n = SSL_read(conn->ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            network_tls_retry(loop, conn, n, "SSL_read");
+            return;
+        }
+        if (conn->on_data) {
+            conn->on_data(loop, conn, buf, (size_t)n);
+        }
+        if (conn->watch.closed) {
+            return;
+        }
+    }
+}
+
+static inline void network_tls_handshake(network_loop_t *loop, network_tls_conn_t *conn) {
+    int rc = SSL_do_handshake(conn->ssl);
+    if (rc != 1) {
+        network_tls_retry(loop, conn, rc, "TLS handshake");
+        return;
+    }
+    conn->established = 1;
+    if (!conn->closing) {
+        network_loop_set_timeout(loop, &conn->watch, 0);
+    }
+    if (network_tls_want_write(loop, conn, 0) < 0) {
+        return;
+    }
+#ifdef NETWORK_TLS_KTLS
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? 1 : 0;
+    conn->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) ? 1 : 0;
+#endif
+    NETWORK_DEBUG("TLS handshake done, %s %s%s, kernel TLS send %d recv %d.", SSL_get_version(conn->ssl),
+                  SSL_get_cipher_name(conn->ssl), SSL_session_reused(conn->ssl) ? " resumed" : "",
+                  conn->ktls_send, conn->ktls_recv);
+    if (conn->on_handshake) {
+        conn->on_handshake(loop, conn);
+        if (conn->watch.closed) {
+            return;
+        }
+    }
+    if (conn->ktls_send ? network_tls_hand_over(loop, conn) < 0 || network_tls_drained(loop, conn) < 0
+                        : network_tls_flush(loop, conn) < 0) {
+        return;
+    }
+    // records that came in with the last handshake message are in OpenSSL's buffer, not the socket's
+    network_tls_read(loop, conn);
+}
+
+static inline void network_tls_readable(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    (void)events;
+    network_tls_conn_t *conn = watch->user;
+    if (!conn->established) {
+        network_tls_handshake(loop, conn);
+    } else if (!conn->write_wanted || network_tls_flush(loop, conn) == 0) {
+        // a read can have been what OpenSSL's last write was waiting for
+        network_tls_read(loop, conn);
+    }
+    // an error OpenSSL didn't get to see yet would be reported again and again
+    if ((events & NETWORK_EV_ERROR) && !watch->closed) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+        network_loop_close(loop, watch, err ? err : ECONNRESET);
+    }
+}
+
+static inline void network_tls_writable(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    (void)events;
+    network_tls_conn_t *conn = watch->user;
+    if (!conn->established) {
+        network_tls_handshake(loop, conn);
+    } else if (network_tls_flush(loop, conn) == 0 && !conn->watch.closed) {
+        network_tls_read(loop, conn); // SSL_read can have wanted the write
+    }
+}
+
+static inline void network_tls_closed(network_loop_t *loop, network_watch_t *watch, int err) {
+    network_tls_conn_t *conn = watch->user;
+    while (conn->files) {
+        conn->files->ahead = 0;
+        network_tls_file_pop(conn);
+    }
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_off = conn->out_len = conn->out_cap = 0;
+    if (conn->ssl) {
+        SSL_free(conn->ssl); // the socket was closed by the loop, SSL_set_fd doesn't own it
+        conn->ssl = NULL;
+    }
+    if (conn->on_close) {
+        conn->on_close(loop, conn, err);
+    }
+}
+
+static inline int network_tls_start(network_tls_conn_t *conn, network_tls_ctx_t *ctx) {
+    conn->ctx = ctx;
+    conn->ssl = SSL_new(ctx->ssl);
+    if (conn->ssl == NULL) {
+        network_tls_log_errors("SSL_new");
+        NETWORK_ERROR("TLS connection setup failed.");
+        return network_fail(NETWORK_TLS_FAILED, 0);
+    }
+    SSL_set_app_data(conn->ssl, conn);
+    conn->watch.user = conn;
+    conn->watch.on_readable = network_tls_readable;
+    conn->watch.on_writable = network_tls_writable;
+    conn->watch.on_close = network_tls_closed;
+    return 0;
+}
+
+inline int network_tls_accept(network_loop_t *loop, network_tls_conn_t *conn, network_tls_ctx_t *ctx, socket_t fd) {
+    if (network_tls_start(conn, ctx) < 0 || SSL_set_fd(conn->ssl, (int)fd) != 1) {
+        if (conn->ssl) {
+            network_tls_log_errors("SSL_set_fd");
+            NETWORK_ERROR("TLS connection setup failed.");
+            SSL_free(conn->ssl);
+            conn->ssl = NULL;
+            network_fail(NETWORK_TLS_FAILED, 0);
+        }
+        network_close(fd);
+        return -1;
+    }
+    SSL_set_accept_state(conn->ssl);
+    conn->watch.fd = fd;
+    if (network_loop_add(loop, &conn->watch, NETWORK_EV_READ) < 0) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+        network_close(fd);
+        return -1;
+    }
+    network_loop_set_timeout(loop, &conn->watch, NETWORK_TLS_HANDSHAKE_MS); // the client speaks first
+    return 0;
+}
+
+// the TCP connect got through, the client's hello goes out from here
+static inline void network_tls_connected(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    (void)events;
+    network_tls_conn_t *conn = watch->user;
+    network_loop_set_timeout(loop, watch, NETWORK_TLS_HANDSHAKE_MS);
+    network_tls_handshake(loop, conn);
+}
+
+inline int network_tls_connect(network_loop_t *loop, network_tls_conn_t *conn, network_tls_ctx_t *ctx,
+                               const struct sockaddr *addr, socklen_t addrlen, const char *server_name, int timeout_ms) {
+    // the SSL is set up before the socket exists, so a failure here leaves nothing to close
+    if (network_tls_start(conn, ctx) < 0) {
+        return -1;
+    }
+    SSL_set_connect_state(conn->ssl);
+    int port = addr->sa_family == AF_INET6 ? ntohs(((const struct sockaddr_in6 *)addr)->sin6_port)
+                                           : ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    const void *ip = addr->sa_family == AF_INET6 ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+                                                 : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+    char host[INET6_ADDRSTRLEN] = "";
+    inet_ntop(addr->sa_family, ip, host, sizeof(host));
+    if (server_name) {
+        SSL_set_tlsext_host_name(conn->ssl, server_name);
+    }
+    // the certificate has to be for server_name, or without one for the address connected to
+    if (!(ctx->flags & NETWORK_TLS_NO_VERIFY) &&
+        (server_name ? SSL_set1_host(conn->ssl, server_name)
+                     : X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), host)) != 1) {
+        network_tls_log_errors("TLS peer name");
+        NETWORK_ERROR("No name to verify the server's certificate against, %s.", server_name ? server_name : host);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+        return network_fail(NETWORK_TLS_FAILED, 0);
+    }
+    if (!(ctx->flags & NETWORK_TLS_NO_RESUME)) {
+        snprintf(conn->session_key, sizeof(conn->session_key), "%s:%d", server_name ? server_name : host, port);
+        SSL_SESSION *session = network_tls_take_session(ctx, conn->session_key);
+        if (session) {
+            SSL_set_session(conn->ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+    conn->watch.on_connect = network_tls_connected;
+    if (network_loop_connect(loop, &conn->watch, addr, addrlen, NETWORK_EV_READ, timeout_ms) < 0) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+        return -1;
+    }
+    if (SSL_set_fd(conn->ssl, (int)conn->watch.fd) != 1) {
+        network_tls_fail(loop, conn, "SSL_set_fd"); // on_close is called for it, the socket exists
+    }
+    return 0;
+}
+
+inline int network_tls_send(network_loop_t *loop, network_tls_conn_t *conn, const void *data, size_t len) {
+    if (conn->watch.closed || conn->closing) {
+        return -1;
+    }
+    if (conn->ktls_send) {
+        return network_loop_send(loop, &conn->watch, data, len);
+    }
+    if (network_tls_queue(loop, conn, data, len) < 0) {
+        return -1;
+    }
+    // before the handshake is done, and while OpenSSL waits for the socket, it stays queued
+    if (!conn->established || conn->write_wanted) {
+        return 0;
+    }
+    return network_tls_flush(loop, conn);
+}
+
+inline int network_tls_send_file(network_loop_t *loop, network_tls_conn_t *conn, int fd, int64_t offset, size_t len, int flags) {
+    if (conn->watch.closed || conn->closing) {
+        if (flags & NETWORK_FILE_CLOSE) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (conn->ktls_send) {
+        return network_loop_send_file(loop, &conn->watch, fd, offset, len, flags);
+    }
+    struct network_tls_file *file = calloc(1, sizeof(*file));
+    if (file == NULL) {
+        NETWORK_ERROR("TLS file segment allocation failed.");
+        if (flags & NETWORK_FILE_CLOSE) {
+            close(fd);
+        }
+        network_loop_close(loop, &conn->watch, ENOMEM);
+        return -1;
+    }
+    file->fd = fd;
+    file->flags = flags;
+    file->offset = offset;
+    file->left = len;
+    // goes behind everything queued, so ahead is what's queued after the last segment
+    file->ahead = conn->out_len - conn->out_off;
+    struct network_tls_file **link = &conn->files;
+    while (*link) {
+        file->ahead -= (*link)->ahead;
+        link = &(*link)->next;
+    }
+    *link = file;
+    if (!conn->established || conn->write_wanted) {
+        return 0;
+    }
+    return network_tls_flush(loop, conn);
+}
+
+inline size_t network_tls_pending(const network_tls_conn_t *conn) {
+    size_t pending = conn->out_len - conn->out_off + network_loop_pending(&conn->watch);
+    for (const struct network_tls_file *file = conn->files; file; file = file->next) {
+        pending += file->left;
+    }
+    return pending;
+}
+
+inline int network_tls_resumed(const network_tls_conn_t *conn) {
+    return conn->ssl && SSL_session_reused(conn->ssl);
+}
+
+inline void network_tls_close(network_loop_t *loop, network_tls_conn_t *conn, int err) {
+    if (conn->watch.closed) {
+        return;
+    }
+    // network_loop_close would drop the queue, so the close waits for it; a handshake in progress
+    // finishes first, and a peer that doesn't read gets it closed with NETWORK_LOOP_TIMEDOUT
+    if (err == 0 && network_tls_pending(conn) > 0) {
+        if (!conn->closing) {
+            conn->closing = 1;
+            network_loop_set_timeout(loop, &conn->watch, NETWORK_TLS_CLOSE_MS);
+        }
+        if (conn->established) {
+            network_tls_drained(loop, conn);
+        }
+        return;
+    }
+    network_tls_shutdown(loop, conn, err);
+}
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NETWORK_TLS_H
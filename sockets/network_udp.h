@@ -0,0 +1,472 @@
+/**
+ * @file network_udp.h
+ * @brief UDP sockets, many datagrams per syscall
+ * @version 0.1
+ *
+ * Header-only, define NETWORK_IMPLEMENTATION in one file before including it, same as network.h.
+ *
+ * At a million packets per second the syscall per datagram is most of the cost, so datagrams come
+ * and go in batches: network_udp_recv_batch() is one recvmmsg for up to NETWORK_UDP_BATCH of them
+ * and network_udp_send_batch() one sendmmsg per NETWORK_UDP_BATCH. A received datagram is stored
+ * in a block of a network_buffer_pool_t (see network_buffer.h), one block each, and stays there
+ * until network_udp_release() gives it back; blocks should be as big as the largest datagram, a
+ * longer one is cut off and marked truncated.
+ *
+ * Two offloads on Linux make a batch cheaper still:
+ *   • GSO (UDP_SEGMENT, Linux 4.18): a datagram sent with segment set goes through the stack as
+ *     one buffer and is only cut into segment-sized datagrams at the device, up to 64 of them and
+ *     64KB in all. Every datagram but the last must be exactly segment bytes.
+ *   • GRO (UDP_GRO, Linux 5.0): with NETWORK_UDP_GRO the kernel hands consecutive datagrams of the
+ *     same flow and size over as one, with segment set to their size; datagram i is
+ *     data[i * segment, (i + 1) * segment), the last one may be shorter. Blocks have to hold 64KB
+ *     for this, anything smaller gets coalesced datagrams truncated.
+ *
+ * On Windows a batch is a loop of recvfrom/sendto and there's no offload, segment is always 0 on
+ * receive and a send with segment is cut into datagrams here.
+ *
+ * Available APIs:
+ *   • network_udp_bind()        - UDP socket bound to an address, port "0" for any port (e.g. to send from)
+ *   • network_udp_recv_batch()  - Every datagram waiting, up to max, in blocks of a pool
+ *   • network_udp_send_batch()  - Sends datagrams, each to its own address
+ *   • network_udp_release()     - Gives the blocks of received datagrams back to the pool
+ *
+ * @example
+ * network_datagram batch[NETWORK_UDP_BATCH];
+ * socket_t fd = network_udp_bind(NULL, "9000", NETWORK_UDP_GRO);
+ * for (;;) {
+ *     int n = network_udp_recv_batch(fd, pool, batch, NETWORK_UDP_BATCH);
+ *     network_udp_send_batch(fd, batch, n); // echo, to the address each one came from
+ *     network_udp_release(pool, batch, n);
+ * }
+ */
+
+#ifndef NETWORK_UDP_H
+#define NETWORK_UDP_H
+
+#include "network_buffer.h"
+
+#ifdef LINUX_SOCKETS_IMPL
+#include <netinet/udp.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETWORK_UDP_BATCH 64    // datagrams per recvmmsg/sendmmsg, larger batches take more calls
+#define NETWORK_UDP_MAX 65507   // largest IPv4 UDP payload
+
+// network_udp_bind flags
+#define NETWORK_UDP_NONBLOCK  0x1 // for an event loop, network_udp_recv_batch returns 0 when nothing is waiting
+#define NETWORK_UDP_REUSEPORT 0x2 // one socket per thread on the same port, the kernel spreads flows over them
+#define NETWORK_UDP_GRO       0x4 // receive coalesced datagrams, see above; ignored where it isn't supported
+
+typedef struct network_datagram {
+    char *data;                   // payload, received ones point into block
+    size_t len;
+    struct sockaddr_storage addr; // where it came from, or where to send it
+    socklen_t addrlen;            // 0 sends to the address the socket is connected to
+    size_t segment;               // GSO/GRO segment size, 0 for a single datagram
+    int truncated;                // it didn't fit in a block, the rest is lost
+    network_buffer_block *block;  // storage of a received datagram, NULL for ones the caller filled in
+} network_datagram;
+
+/**
+ * Binds a UDP socket, ip NULL for every IPv4 interface.
+ *
+ * @return the socket, or -1 on errors
+ */
+socket_t network_udp_bind(const char *ip, const char *port, int flags);
+/**
+ * Receives up to max datagrams, each into a block taken from pool. A blocking socket waits for
+ * the first one only, then takes what else is already there. max blocks are taken up front,
+ * the ones left over go straight back.
+ *
+ * @return datagrams received, 0 when a non-blocking socket has none, -1 on errors
+ */
+int network_udp_recv_batch(socket_t sockfd, network_buffer_pool_t *pool, network_datagram *out, int max);
+/**
+ * Sends count datagrams in order, each to its addr. Stops at the first one the socket doesn't
+ * take right now (a full send buffer on a non-blocking socket) or that fails.
+ *
+ * @return datagrams sent, count when all of them went out; -1 when the first one failed
+ */
+int network_udp_send_batch(socket_t sockfd, const network_datagram *msgs, int count);
+// gives the blocks of count received datagrams back to pool, their data is gone after this
+void network_udp_release(network_buffer_pool_t *pool, network_datagram *msgs, int count);
+
+#ifdef NETWORK_IMPLEMENTATION
+
+#ifdef LINUX_SOCKETS_IMPL
+// older headers don't have them
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// struct mmsghdr and recvmmsg/sendmmsg are _GNU_SOURCE, when it came too late a batch is a loop of recvmsg/sendmsg
+#if !defined(__GLIBC__) || defined(__USE_GNU)
+#define NETWORK_UDP_MMSG
+#endif
+
+// room for the UDP_GRO/UDP_SEGMENT control message of one datagram
+#define NETWORK_UDP_CONTROL CMSG_SPACE(sizeof(int))
+
+// one datagram's control buffer, aligned for the struct cmsghdr CMSG_FIRSTHDR puts at its start
+typedef union network_udp_control {
+    struct cmsghdr align;
+    char buf[NETWORK_UDP_CONTROL];
+} network_udp_control;
+#endif
+
+inline socket_t network_udp_bind(const char *ip, const char *port, int flags) {
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = ip ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int err = getaddrinfo(ip, port, &hints, &res);
+    if (err != 0) {
+        NETWORK_ERROR("getaddrinfo failed at UDP bind. %s", gai_strerror(err));
+        return network_fail(NETWORK_ADDRESS_FAILED, err);
+    }
+
+    socket_t sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd == (socket_t)-1) {
+        int err = network_os_error();
+        NETWORK_ERROR("Socket creation failed at UDP bind. %s", strerror(err));
+        freeaddrinfo(res);
+        return network_fail(SOCKET_CREATE_FAILED, err);
+    }
+
+    if (flags & NETWORK_UDP_REUSEPORT) {
+#ifdef SO_REUSEPORT
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on)) < 0) {
+            int err = network_os_error();
+            NETWORK_ERROR("setsockopt SO_REUSEPORT failed. %s", strerror(err));
+            freeaddrinfo(res);
+            network_close(sockfd);
+            return network_fail(SOCKET_OPTION_FAILED, err);
+        }
+#else
+        NETWORK_ERROR("SO_REUSEPORT is not supported on this platform.");
+        freeaddrinfo(res);
+        network_close(sockfd);
+        return network_fail(NETWORK_NOT_SUPPORTED, 0);
+#endif
+    }
+#ifdef LINUX_SOCKETS_IMPL
+    // a kernel without it just doesn't coalesce, segment stays 0
+    int on = 1;
+    if ((flags & NETWORK_UDP_GRO) && setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        NETWORK_WARN("setsockopt UDP_GRO failed. %s", strerror(errno));
+    }
+#endif
+
+    if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+        int err = network_os_error();
+        NETWORK_ERROR("UDP bind has failed! %s", strerror(err));
+        freeaddrinfo(res);
+        network_close(sockfd);
+        return network_fail(SOCKET_BIND_FAILED, err);
+    }
+    freeaddrinfo(res);
+
+    if ((flags & NETWORK_UDP_NONBLOCK) && network_set_nonblocking(sockfd) < 0) {
+        network_close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+inline void network_udp_release(network_buffer_pool_t *pool, network_datagram *msgs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (msgs[i].block) {
+            network_buffer_block_put(pool, msgs[i].block);
+            msgs[i].block = NULL;
+        }
+    }
+}
+
+// counts a batch call that moved n datagrams and bytes of them, errno still from it when n < 0
+static inline void network_udp_count(network_stat calls, network_stat bytes_stat, int n, size_t bytes) {
+    network_stats_add(calls, 1);
+    if (n > 0) {
+        network_stats_add(bytes_stat, (uint64_t)bytes);
+    } else if (n < 0) {
+        network_stats_add(network_send_would_block() ? NETWORK_STAT_WOULD_BLOCK : NETWORK_STAT_ERRORS, 1);
+    }
+}
+
+#ifdef LINUX_SOCKETS_IMPL
+
+// the size of one segment from the UDP_GRO message, 0 when the kernel didn't coalesce
+static inline size_t network_udp_gro_size(struct msghdr *msg) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(c), sizeof(size));
+            return (size_t)size;
+        }
+    }
+    return 0;
+}
+
+static inline void network_udp_msghdr(struct msghdr *msg, struct iovec *iov, network_datagram *d, char *control) {
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &d->addr;
+    msg->msg_namelen = d->addrlen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = control;
+    msg->msg_controllen = NETWORK_UDP_CONTROL;
+}
+
+inline int network_udp_recv_batch(socket_t sockfd, network_buffer_pool_t *pool, network_datagram *out, int max) {
+    struct iovec iov[NETWORK_UDP_BATCH];
+    network_udp_control control[NETWORK_UDP_BATCH];
+    if (max > NETWORK_UDP_BATCH) {
+        max = NETWORK_UDP_BATCH;
+    }
+    int ready = 0;
+    for (; ready < max; ready++) {
+        network_datagram *d = &out[ready];
+        d->block = network_buffer_block_get(pool);
+        if (d->block == NULL) {
+            break;
+        }
+        d->addrlen = sizeof(d->addr);
+        iov[ready].iov_base = d->block->data;
+        iov[ready].iov_len = pool->block_size;
+    }
+    if (ready == 0) {
+        return -1;
+    }
+
+    int n;
+#ifdef NETWORK_UDP_MMSG
+    struct mmsghdr msgs[NETWORK_UDP_BATCH];
+    for (int i = 0; i < ready; i++) {
+        network_udp_msghdr(&msgs[i].msg_hdr, &iov[i], &out[i], control[i].buf);
+    }
+    // MSG_WAITFORONE: a blocking socket waits for the first datagram, not for all of them
+    do {
+        n = recvmmsg(sockfd, msgs, (unsigned)ready, MSG_WAITFORONE, NULL);
+    } while (n < 0 && errno == EINTR);
+#else
+    struct msghdr msgs[NETWORK_UDP_BATCH];
+    for (n = 0; n < ready; n++) {
+        network_udp_msghdr(&msgs[n], &iov[n], &out[n], control[n].buf);
+        ssize_t got = recvmsg(sockfd, &msgs[n], n ? MSG_DONTWAIT : 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                n--;
+                continue;
+            }
+            if (n == 0) {
+                n = -1;
+            }
+            break;
+        }
+        iov[n].iov_len = (size_t)got;
+    }
+#endif
+
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        network_datagram *d = &out[i];
+#ifdef NETWORK_UDP_MMSG
+        struct msghdr *msg = &msgs[i].msg_hdr;
+        d->len = msgs[i].msg_len;
+#else
+        struct msghdr *msg = &msgs[i];
+        d->len = iov[i].iov_len;
+#endif
+        d->addrlen = msg->msg_namelen;
+        d->truncated = (msg->msg_flags & MSG_TRUNC) != 0;
+        d->segment = network_udp_gro_size(msg);
+        d->data = d->block->data;
+        d->block->end = d->len;
+        bytes += d->len;
+    }
+    network_udp_count(NETWORK_STAT_RECV_CALLS, NETWORK_STAT_BYTES_IN, n, bytes);
+    int err = errno;
+    network_udp_release(pool, out + (n > 0 ? n : 0), ready - (n > 0 ? n : 0));
+    if (n < 0) {
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            return 0;
+        }
+        NETWORK_ERROR("UDP receive failed. %s", strerror(err));
+        return network_fail(SOCKET_RECV_FAILED, err);
+    }
+    return n;
+}
+
+// fills in one msghdr to send d, with a UDP_SEGMENT message when it's to be cut up
+static inline void network_udp_send_msghdr(struct msghdr *msg, struct iovec *iov, const network_datagram *d, char *control) {
+    memset(msg, 0, sizeof(*msg));
+    iov->iov_base = d->data;
+    iov->iov_len = d->len;
+    msg->msg_name = d->addrlen ? (void *)&d->addr : NULL;
+    msg->msg_namelen = d->addrlen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    if (d->segment && d->segment < d->len) {
+        // the kernel takes a u16 here, not an int
+        uint16_t segment = (uint16_t)d->segment;
+        msg->msg_control = control;
+        msg->msg_controllen = CMSG_SPACE(sizeof(segment));
+        struct cmsghdr *c = CMSG_FIRSTHDR(msg);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+    }
+}
+
+inline int network_udp_send_batch(socket_t sockfd, const network_datagram *msgs, int count) {
+    struct iovec iov[NETWORK_UDP_BATCH];
+    network_udp_control control[NETWORK_UDP_BATCH];
+    int sent = 0;
+    while (sent < count) {
+        int batch = count - sent < NETWORK_UDP_BATCH ? count - sent : NETWORK_UDP_BATCH;
+        size_t bytes = 0;
+        int n;
+#ifdef NETWORK_UDP_MMSG
+        struct mmsghdr hdrs[NETWORK_UDP_BATCH];
+        for (int i = 0; i < batch; i++) {
+            network_udp_send_msghdr(&hdrs[i].msg_hdr, &iov[i], &msgs[sent + i], control[i].buf);
+        }
+        do {
+            n = sendmmsg(sockfd, hdrs, (unsigned)batch, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+#else
+        for (n = 0; n < batch; n++) {
+            struct msghdr hdr;
+            network_udp_send_msghdr(&hdr, &iov[n], &msgs[sent + n], control[n].buf);
+            if (sendmsg(sockfd, &hdr, MSG_NOSIGNAL) < 0) {
+                if (errno == EINTR) {
+                    n--;
+                    continue;
+                }
+                if (n == 0) {
+                    n = -1;
+                }
+                break;
+            }
+        }
+#endif
+        for (int i = 0; i < n; i++) {
+            bytes += msgs[sent + i].len;
+        }
+        network_udp_count(NETWORK_STAT_SEND_CALLS, NETWORK_STAT_BYTES_OUT, n, bytes);
+        if (n < 0) {
+            int err = errno;
+            if (err == EAGAIN || err == EWOULDBLOCK || sent > 0) {
+                return sent;
+            }
+            NETWORK_ERROR("UDP send failed. %s", strerror(err));
+            return network_fail(SOCKET_SEND_FAILED, err);
+        }
+        sent += n;
+        if (n < batch) {
+            break; // the socket took only some, the rest would fail or block
+        }
+    }
+    return sent;
+}
+
+#endif // LINUX_SOCKETS_IMPL
+
+#ifdef WINSOCK_IMPL
+
+inline int network_udp_recv_batch(socket_t sockfd, network_buffer_pool_t *pool, network_datagram *out, int max) {
+    if (max > NETWORK_UDP_BATCH) {
+        max = NETWORK_UDP_BATCH;
+    }
+    int n = 0;
+    size_t bytes = 0;
+    u_long waiting = 1;
+    // a blocking socket waits for the first datagram only, FIONREAD says whether there's another
+    while (n < max && (n == 0 || (ioctlsocket(sockfd, FIONREAD, &waiting) == 0 && waiting > 0))) {
+        network_datagram *d = &out[n];
+        d->block = network_buffer_block_get(pool);
+        if (d->block == NULL) {
+            break;
+        }
+        int addrlen = sizeof(d->addr);
+        int got = recvfrom(sockfd, d->block->data, (int)pool->block_size, 0, (struct sockaddr *)&d->addr, &addrlen);
+        d->truncated = got < 0 && WSAGetLastError() == WSAEMSGSIZE;
+        if (got < 0 && !d->truncated) {
+            int err = WSAGetLastError();
+            network_buffer_block_put(pool, d->block);
+            d->block = NULL;
+            if (n > 0) {
+                break;
+            }
+            network_udp_count(NETWORK_STAT_RECV_CALLS, NETWORK_STAT_BYTES_IN, -1, 0);
+            if (err == WSAEWOULDBLOCK) {
+                return 0;
+            }
+            NETWORK_ERROR("UDP receive failed. %d", err);
+            return network_fail(SOCKET_RECV_FAILED, err);
+        }
+        d->len = d->truncated ? pool->block_size : (size_t)got;
+        d->addrlen = addrlen;
+        d->segment = 0;
+        d->data = d->block->data;
+        d->block->end = d->len;
+        bytes += d->len;
+        n++;
+    }
+    if (n > 0) {
+        network_udp_count(NETWORK_STAT_RECV_CALLS, NETWORK_STAT_BYTES_IN, n, bytes);
+    }
+    return n;
+}
+
+inline int network_udp_send_batch(socket_t sockfd, const network_datagram *msgs, int count) {
+    size_t bytes = 0;
+    int sent = 0;
+    for (; sent < count; sent++) {
+        const network_datagram *d = &msgs[sent];
+        const struct sockaddr *to = d->addrlen ? (const struct sockaddr *)&d->addr : NULL;
+        size_t step = d->segment && d->segment < d->len ? d->segment : d->len;
+        size_t off = 0;
+        // no GSO here, the segments go out one by one
+        do {
+            int len = (int)(d->len - off < step ? d->len - off : step);
+            if (sendto(sockfd, d->data + off, len, 0, to, d->addrlen) < 0) {
+                int err = WSAGetLastError();
+                network_udp_count(NETWORK_STAT_SEND_CALLS, NETWORK_STAT_BYTES_OUT, sent ? sent : -1, bytes);
+                if (sent > 0 || err == WSAEWOULDBLOCK) {
+                    return sent;
+                }
+                NETWORK_ERROR("UDP send failed. %d", err);
+                return network_fail(SOCKET_SEND_FAILED, err);
+            }
+            off += (size_t)len;
+        } while (off < d->len);
+        bytes += d->len;
+    }
+    network_udp_count(NETWORK_STAT_SEND_CALLS, NETWORK_STAT_BYTES_OUT, sent, bytes);
+    return sent;
+}
+
+#endif // WINSOCK_IMPL
+
+#endif // NETWORK_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NETWORK_UDP_H
@@ -0,0 +1,307 @@
+/**
+ * @file network_uring.h
+ * @brief Thin io_uring layer for network_loop.h, raw syscalls and no liburing
+ * @version 0.1
+ *
+ * Only what the loop's io_uring backend needs: setting up a ring, getting and submitting
+ * SQEs, reaping CQEs and one ring of provided buffers for multishot recv. Everything is
+ * static inline, network_loop.h includes it when NETWORK_LOOP_IO_URING is defined.
+ *
+ * Needs Linux 5.19 for provided buffer rings and multishot accept, 6.0 for multishot recv.
+ * network_loop_create() falls back to epoll when the ring can't be set up.
+ *
+ * Available APIs:
+ *   • network_uring_init()      - Maps a ring with entries SQEs, network_uring_exit() unmaps it
+ *   • network_uring_get_sqe()   - Next free SQE, zeroed, or NULL when the SQ is full until the next submit
+ *   • network_uring_submit()    - Hands the prepared SQEs to the kernel and waits for CQEs, one syscall
+ *   • network_uring_peek_cqe()  - Next CQE or NULL, network_uring_cqe_seen() to consume it
+ *   • network_uring_bufs_init() - Registers a group of equal sized buffers the kernel picks from
+ *   • network_uring_bufs_put()  - Gives a buffer back, network_uring_bufs_publish() makes it visible
+ */
+
+#ifndef NETWORK_URING_H
+#define NETWORK_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct network_uring {
+    int fd;
+    unsigned flags;              // IORING_SETUP_* the ring got
+    unsigned features;           // IORING_FEAT_*
+    int enabled;                 // 0 while IORING_SETUP_R_DISABLED holds it back
+
+    // submission queue; sqe_tail runs ahead of the shared tail until submit
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;
+    unsigned sq_entries;
+
+    // completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    struct __kernel_timespec wait_ts; // the IORING_OP_TIMEOUT a wait queues without IORING_FEAT_EXT_ARG
+} network_uring_t;
+
+// nbufs buffers of size bytes each, one buffer group
+typedef struct network_uring_bufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    size_t size;
+    unsigned entries;
+    uint16_t bgid;
+    uint16_t tail;              // local tail, published by network_uring_bufs_publish
+    size_t ring_size;
+} network_uring_bufs_t;
+
+static inline int network_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int network_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                                      const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int network_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void network_uring_exit(network_uring_t *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// returns 0, or -1 with errno set; cq_entries = 0 leaves the CQ at twice the SQ
+static inline int network_uring_init(network_uring_t *ring, unsigned entries, unsigned cq_entries, unsigned flags) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    if (cq_entries) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+    ring->fd = network_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->flags = params.flags;
+    ring->features = params.features;
+    ring->enabled = !(params.flags & IORING_SETUP_R_DISABLED);
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        int err = errno;
+        network_uring_exit(ring);
+        errno = err;
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int err = errno;
+        network_uring_exit(ring);
+        errno = err;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // SQ slot i always holds SQE i, so submitting is only moving the tail
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+// SQEs prepared and not submitted yet
+static inline unsigned network_uring_sq_ready(const network_uring_t *ring) {
+    return ring->sqe_tail - *ring->sq_tail;
+}
+
+static inline struct io_uring_sqe *network_uring_get_sqe(network_uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// submits what's prepared and waits for wait_nr CQEs, at most timeout_ms (-1 forever);
+// returns how many SQEs the kernel took, or -1 with errno set (ETIME when the wait timed out).
+// Kernels before 5.11 can't take a timeout with the wait: a timeout SQE goes in with the batch then,
+// its CQE has user_data 0 and ends the wait, counting as one of the wait_nr
+static inline int network_uring_submit(network_uring_t *ring, unsigned wait_nr, int timeout_ms) {
+    if (!ring->enabled) {
+        // the thread enabling the ring is the one that owns it under IORING_SETUP_SINGLE_ISSUER
+        if (network_uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+            return -1;
+        }
+        ring->enabled = 1;
+    }
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    const void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0 && (ring->features & IORING_FEAT_EXT_ARG)) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        } else if (timeout_ms >= 0) {
+            // off = wait_nr completes it early once the wait is over anyway, so none pile up
+            struct io_uring_sqe *sqe = network_uring_get_sqe(ring);
+            if (sqe == NULL) {
+                wait_nr = 0; // a full SQ has work to hand in, the caller comes back after it
+            } else {
+                ring->wait_ts.tv_sec = timeout_ms / 1000;
+                ring->wait_ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&ring->wait_ts;
+                sqe->len = 1;
+                sqe->off = wait_nr;
+            }
+        }
+    } else if (ring->flags & IORING_SETUP_DEFER_TASKRUN) {
+        // completions are only run in io_uring_enter with GETEVENTS, even when not waiting
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    unsigned submit = network_uring_sq_ready(ring);
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (submit == 0 && flags == 0) {
+        return 0;
+    }
+    return network_uring_enter(ring->fd, submit, wait_nr, flags, argp, argsz);
+}
+
+static inline struct io_uring_cqe *network_uring_peek_cqe(network_uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static inline void network_uring_cqe_seen(network_uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// entries must be a power of two; returns 0, or -1 with errno set
+static inline int network_uring_bufs_init(network_uring_t *ring, network_uring_bufs_t *bufs, uint16_t bgid,
+                                          unsigned entries, size_t size) {
+    memset(bufs, 0, sizeof(*bufs));
+    bufs->ring_size = entries * sizeof(struct io_uring_buf);
+    bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->ring == MAP_FAILED) {
+        bufs->ring = NULL;
+        return -1;
+    }
+    bufs->base = malloc(entries * size);
+    if (bufs->base == NULL) {
+        munmap(bufs->ring, bufs->ring_size);
+        bufs->ring = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufs->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (network_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        free(bufs->base);
+        munmap(bufs->ring, bufs->ring_size);
+        memset(bufs, 0, sizeof(*bufs));
+        errno = err;
+        return -1;
+    }
+    bufs->size = size;
+    bufs->entries = entries;
+    bufs->bgid = bgid;
+    return 0;
+}
+
+static inline void network_uring_bufs_exit(network_uring_bufs_t *bufs) {
+    if (bufs->ring) {
+        munmap(bufs->ring, bufs->ring_size);
+    }
+    free(bufs->base);
+    memset(bufs, 0, sizeof(*bufs));
+}
+
+static inline char *network_uring_bufs_get(const network_uring_bufs_t *bufs, uint16_t bid) {
+    return bufs->base + (size_t)bid * bufs->size;
+}
+
+static inline void network_uring_bufs_put(network_uring_bufs_t *bufs, uint16_t bid) {
+    struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)network_uring_bufs_get(bufs, bid);
+    buf->len = (uint32_t)bufs->size;
+    buf->bid = bid;
+    bufs->tail++;
+}
+
+static inline void network_uring_bufs_publish(network_uring_bufs_t *bufs) {
+    __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //NETWORK_URING_H
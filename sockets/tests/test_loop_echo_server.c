@@ -0,0 +1,64 @@
+#define NETWORK_IMPLEMENTATION
+#include "../network_loop.h"
+#include "../../memory/pool.h"
+
+// a connection that sends nothing for this long is dropped, a client can't hold a socket forever
+#define IDLE_TIMEOUT_MS 30000
+
+// every connection is just its watch, they come from a pool so accepting never mallocs
+struct conn {
+    network_watch_t watch;
+};
+
+static struct f_pool *conns;
+
+static void echo(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    network_loop_send(loop, watch, data, len);
+    network_loop_set_timeout(loop, watch, IDLE_TIMEOUT_MS);
+}
+
+static void release(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    if (err) {
+        printf("Connection dropped. %s\n", strerror(err));
+    }
+    f_poolFree(conns, watch->user);
+}
+
+// the loop accepts, on every backend; IOCP has no readiness for a listener to drain by hand
+static void accepted(network_loop_t *loop, network_watch_t *listener, socket_t fd, const struct sockaddr_storage *addr) {
+    (void)listener;
+    (void)addr;
+    struct conn *conn = f_poolAlloc(conns);
+    memset(conn, 0, sizeof(*conn));
+    conn->watch.fd = fd;
+    conn->watch.on_data = echo;
+    conn->watch.on_close = release;
+    conn->watch.user = conn;
+    if (network_loop_add(loop, &conn->watch, NETWORK_EV_READ | NETWORK_EV_EDGE) < 0) {
+        network_close(fd);
+        f_poolFree(conns, conn);
+        return;
+    }
+    network_loop_set_timeout(loop, &conn->watch, IDLE_TIMEOUT_MS);
+}
+
+int main() {
+    network_watch_t listener;
+    network_init();
+    network_loop_t *loop = network_loop_create(0);
+    conns = f_poolCreate("connections", sizeof(struct conn), 0);
+
+    memset(&listener, 0, sizeof(listener));
+    listener.fd = network_listen_ex(NULL, "8080", BACKLOG, NETWORK_LISTEN_REUSEADDR | NETWORK_LISTEN_NONBLOCK);
+    listener.on_accept = accepted;
+    network_loop_add(loop, &listener, NETWORK_EV_READ | NETWORK_EV_EDGE);
+
+    printf("Echoing on port 8080.\n");
+    network_loop_run(loop);
+
+    network_close(listener.fd);
+    network_loop_destroy(loop);
+    f_poolDestroy(conns);
+    network_cleanup();
+}
@@ -0,0 +1,143 @@
+#define NETWORK_IMPLEMENTATION
+#include "../network_loop.h"
+
+// A connection over loopback that sends bytes, part of a file, more bytes, another part and a last
+// few bytes with network_loop_send/send_file, sendfile on Linux and TransmitFile on Windows; the
+// other end checks it got all of it, in that order. Exits with 0 when it did.
+
+#define FILE_SIZE (512 * 1024)
+
+static unsigned char file_byte(size_t i) {
+    return (unsigned char)(i * 7 + 1);
+}
+
+static char expected[FILE_SIZE * 2];
+static size_t expected_len;
+static char received[FILE_SIZE * 2];
+static size_t received_len;
+static int file_fd;
+static int failed;
+static network_watch_t server, client;
+
+static void expect_bytes(const char *data, size_t len) {
+    memcpy(expected + expected_len, data, len);
+    expected_len += len;
+}
+
+static void expect_file(size_t offset, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        expected[expected_len++] = (char)file_byte(offset + i);
+    }
+}
+
+static void server_closed(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)loop;
+    (void)watch;
+    if (err) {
+        printf("Server end closed. %s\n", strerror(err));
+        failed = 1;
+    }
+}
+
+static void accepted(network_loop_t *loop, network_watch_t *listener, socket_t fd, const struct sockaddr_storage *addr) {
+    (void)listener;
+    (void)addr;
+    server.fd = fd;
+    server.on_close = server_closed;
+    if (network_loop_add(loop, &server, NETWORK_EV_READ) < 0) {
+        network_close(fd);
+        failed = 1;
+        network_loop_stop(loop);
+        return;
+    }
+    network_loop_send(loop, &server, "head", 4);
+    network_loop_send_file(loop, &server, file_fd, 0, FILE_SIZE - 4096, 0);
+    network_loop_send(loop, &server, "middle", 6);
+    network_loop_send_file(loop, &server, file_fd, 1000, 5000, 0);
+    network_loop_send(loop, &server, "tail", 4);
+}
+
+static void client_data(network_loop_t *loop, network_watch_t *watch, const char *data, size_t len) {
+    (void)watch;
+    if (received_len + len > expected_len) {
+        printf("Got %zu bytes more than were sent.\n", received_len + len - expected_len);
+        failed = 1;
+        network_loop_stop(loop);
+        return;
+    }
+    memcpy(received + received_len, data, len);
+    received_len += len;
+    if (received_len == expected_len) {
+        network_loop_stop(loop);
+    }
+}
+
+// a stalled transfer fails the test instead of hanging it
+static void client_connected(network_loop_t *loop, network_watch_t *watch, uint32_t events) {
+    (void)events;
+    network_loop_set_timeout(loop, watch, 10000);
+}
+
+static void client_closed(network_loop_t *loop, network_watch_t *watch, int err) {
+    (void)watch;
+    printf("Client end closed after %zu of %zu bytes. %s\n", received_len, expected_len, err ? strerror(err) : "");
+    failed = 1;
+    network_loop_stop(loop);
+}
+
+int main() {
+    network_init();
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        printf("No temporary file.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        fputc(file_byte(i), file);
+    }
+    fflush(file);
+#ifdef WINSOCK_IMPL
+    file_fd = _fileno(file);
+#else
+    file_fd = fileno(file);
+#endif
+    expect_bytes("head", 4);
+    expect_file(0, FILE_SIZE - 4096);
+    expect_bytes("middle", 6);
+    expect_file(1000, 5000);
+    expect_bytes("tail", 4);
+
+    network_loop_t *loop = network_loop_create(0);
+    network_watch_t listener;
+    memset(&listener, 0, sizeof(listener));
+    listener.fd = network_listen_ex("127.0.0.1", "0", BACKLOG, NETWORK_LISTEN_NONBLOCK);
+    if (loop == NULL || listener.fd == (socket_t)-1) {
+        return 1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(listener.fd, (struct sockaddr *)&addr, &addrlen);
+    listener.on_accept = accepted;
+    client.on_data = client_data;
+    client.on_connect = client_connected;
+    client.on_close = client_closed;
+    if (network_loop_add(loop, &listener, NETWORK_EV_READ) < 0 ||
+        network_loop_connect(loop, &client, (struct sockaddr *)&addr, addrlen, NETWORK_EV_READ, 5000) < 0) {
+        return 1;
+    }
+    network_loop_run(loop);
+
+    if (!failed && memcmp(received, expected, expected_len) != 0) {
+        printf("The bytes came out of order.\n");
+        failed = 1;
+    }
+    printf("%s backend: %zu of %zu bytes %s\n", network_loop_backend_name(loop), received_len, expected_len,
+           failed ? "FAILED" : "ok");
+    client.on_close = server.on_close = NULL;
+    network_loop_close(loop, &client, 0);
+    network_loop_close(loop, &server, 0);
+    network_loop_close(loop, &listener, 0);
+    network_loop_destroy(loop);
+    fclose(file);
+    return failed;
+}
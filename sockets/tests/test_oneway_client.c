@@ -1,23 +1,29 @@
 #define NETWORK_IMPLEMENTATION
 #include <stdlib.h>
 
-#include "../network.h"
+#include "../network_frame.h"
 
 int main() {
     struct addrinfo *clientdata = NULL;
     int n = 1024;
     char *buffer = malloc(n);
+    network_buffer_pool_t *pool = network_buffer_pool_create(1024, 0);
+    network_framer_t framer;
+    network_framer_init(&framer, pool, NETWORK_FRAME_VARINT, 0);
 
     socket_t sockfd = network_connect(clientdata);
-    while(1) {
-        fgets(buffer, sizeof(buffer), stdin);
-        int bytes = network_send(sockfd, buffer);
+    while(fgets(buffer, n, stdin)) {
+        // one frame per line, the server doesn't depend on how TCP splits them up
+        network_frame_write(&framer, buffer, strlen(buffer));
+        if (network_frame_flush(sockfd, &framer) < 0) {
+            break;
+        }
         if (strcmp(buffer, ".exit\n") == 0) {
             break;
         }
-
-        memset(buffer, '\0', n);
     }
+    network_framer_free(&framer);
+    network_buffer_pool_destroy(pool);
     free(buffer);
     network_close(sockfd);
-}
\ No newline at end of file
+}
@@ -1,29 +1,44 @@
 #define NETWORK_IMPLEMENTATION
-#include "../network.h"
+#include "../network_frame.h"
 
 int main() {
     struct sockaddr_storage client_storage;
 
-    size_t buffer_size = 1024;
-    char data[buffer_size];
+    // blocks are only taken while bytes are waiting to be printed
+    network_buffer_pool_t *pool = network_buffer_pool_create(1024, 0);
+    network_framer_t framer;
+    network_framer_init(&framer, pool, NETWORK_FRAME_VARINT, 0);
+
     socket_t socket = network_listen("8080");
     socket_t newsocket =  network_accept(socket, &client_storage);
-    while(1) {
+    int done = 0;
+    while(!done) {
 
-        int bytes_recv = network_recv(newsocket, data, buffer_size);
-        if (strcmp(data, ".exit\n") == 0) {
+        ssize_t bytes_recv = network_frame_recv(newsocket, &framer);
+        if(bytes_recv == 0) {
+            printf("Connection closed\n");
             break;
         }
-        if(bytes_recv > 0) {
-            printf("%s\n", data);
+        else if(bytes_recv < 0) {
+            break;
         }
-        else if(bytes_recv == 0) {
-            printf("Connection closed\n");
+        // a read can hold part of a line or several of them, each frame is one line
+        data line;
+        int got;
+        while ((got = network_frame_next(&framer, &line)) == 1) {
+            if (line.size == 6 && memcmp(line.buffer, ".exit\n", 6) == 0) {
+                done = 1;
+                break;
+            }
+            printf("%.*s\n", (int)line.size, line.buffer);
+        }
+        if (got < 0) {
             break;
         }
-        memset(data, '\0', buffer_size);
     }
 
+    network_framer_free(&framer);
+    network_buffer_pool_destroy(pool);
     network_close(newsocket);
     network_close(socket);
-}
\ No newline at end of file
+}
@@ -0,0 +1,171 @@
+#define NETWORK_IMPLEMENTATION
+#include "../network_tls.h"
+#include <openssl/x509v3.h>
+#include <time.h>
+
+// TLS connections over loopback to a server in the same loop with a certificate for "localhost":
+// the client waits for the server's hello, sends more than the socket buffers hold and closes right
+// away, and the server has to get all of it followed by close_notify. The second connect has to
+// resume the first one's session; connecting by address only, or with another name, has to fail the
+// certificate check. Exits with 0 when all of that held.
+
+#define PAYLOAD_SIZE (4 * 1024 * 1024)
+
+static unsigned char payload_byte(size_t i) {
+    return (unsigned char)(i * 13 + 5);
+}
+
+static char payload[PAYLOAD_SIZE];
+static size_t received;
+static int server_err, client_err, closed, resumed;
+static network_tls_conn_t server, client;
+static network_tls_ctx_t *server_ctx, *client_ctx;
+
+// a throwaway P-256 key and a certificate for localhost, signed by itself; the client trusts it
+static int make_certificate(void) {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (keygen == NULL || EVP_PKEY_keygen_init(keygen) != 1 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1) != 1 || EVP_PKEY_keygen(keygen, &key) != 1) {
+        EVP_PKEY_CTX_free(keygen);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(keygen);
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_set_pubkey(cert, key);
+    X509_EXTENSION *san = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, "DNS:localhost");
+    int ok = san && X509_add_ext(cert, san, -1) == 1 && X509_sign(cert, key, EVP_sha256()) > 0 &&
+             SSL_CTX_use_certificate(server_ctx->ssl, cert) == 1 && SSL_CTX_use_PrivateKey(server_ctx->ssl, key) == 1 &&
+             X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx->ssl), cert) == 1;
+    X509_EXTENSION_free(san);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok ? 0 : -1;
+}
+
+static void server_handshake(network_loop_t *loop, network_tls_conn_t *conn) {
+    network_tls_send(loop, conn, "hello", 5);
+}
+
+static void server_data(network_loop_t *loop, network_tls_conn_t *conn, const char *data, size_t len) {
+    if (received + len > PAYLOAD_SIZE || memcmp(payload + received, data, len) != 0) {
+        printf("The server got bytes that weren't sent, at %zu.\n", received);
+        network_tls_close(loop, conn, EIO);
+        return;
+    }
+    received += len;
+}
+
+static void server_closed(network_loop_t *loop, network_tls_conn_t *conn, int err) {
+    (void)conn;
+    server_err = err;
+    if (++closed == 2) {
+        network_loop_stop(loop);
+    }
+}
+
+static void client_data(network_loop_t *loop, network_tls_conn_t *conn, const char *data, size_t len) {
+    if (len != 5 || memcmp(data, "hello", 5) != 0) {
+        network_tls_close(loop, conn, EIO);
+        return;
+    }
+    // the session ticket came before the hello, so the close doesn't lose it
+    resumed = network_tls_resumed(conn);
+    network_tls_send(loop, conn, payload, PAYLOAD_SIZE);
+    network_tls_close(loop, conn, 0);
+}
+
+static void client_closed(network_loop_t *loop, network_tls_conn_t *conn, int err) {
+    (void)conn;
+    client_err = err;
+    if (++closed == 2) {
+        network_loop_stop(loop);
+    }
+}
+
+static void server_accept(network_loop_t *loop, network_watch_t *listener, socket_t fd, const struct sockaddr_storage *addr) {
+    (void)listener;
+    (void)addr;
+    memset(&server, 0, sizeof(server));
+    server.on_data = server_data;
+    server.on_handshake = server_handshake;
+    server.on_close = server_closed;
+    if (network_tls_accept(loop, &server, server_ctx, fd) < 0) {
+        closed++;
+        server_err = -1;
+    }
+}
+
+// one connection to the server, 0 when it went the way expect_err says
+static int run_case(network_loop_t *loop, const struct sockaddr_in *addr, const char *server_name, int expect_err,
+                    int expect_resumed) {
+    received = 0;
+    closed = resumed = 0;
+    server_err = client_err = 0;
+    memset(&client, 0, sizeof(client));
+    client.on_data = client_data;
+    client.on_close = client_closed;
+    if (network_tls_connect(loop, &client, client_ctx, (const struct sockaddr *)addr, sizeof(*addr), server_name, 5000) < 0) {
+        printf("%s: connect failed\n", server_name ? server_name : "no name");
+        return 1;
+    }
+    // every way of getting stuck ends in one of the handshake, close or connect timeouts
+    network_loop_run(loop);
+
+    int failed;
+    if (expect_err) {
+        failed = client_err != expect_err;
+    } else {
+        failed = client_err != 0 || server_err != 0 || received != PAYLOAD_SIZE || resumed != expect_resumed;
+    }
+    printf("%s: client %s, server %s, %zu of %d bytes, %s, kernel TLS %d, %s\n", server_name ? server_name : "no name",
+           client_err ? strerror(client_err) : "closed", server_err ? strerror(server_err) : "closed", received,
+           PAYLOAD_SIZE, resumed ? "resumed" : "full handshake", client.ktls_send, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main() {
+    network_init();
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+        payload[i] = (char)payload_byte(i);
+    }
+    server_ctx = network_tls_server(NULL, NULL, 0);
+    client_ctx = network_tls_client(NULL, 0);
+    if (server_ctx == NULL || client_ctx == NULL || make_certificate() < 0) {
+        printf("TLS context setup failed.\n");
+        return 1;
+    }
+    network_loop_t *loop = network_loop_create(0);
+    network_watch_t listener;
+    memset(&listener, 0, sizeof(listener));
+    listener.fd = network_listen_ex("127.0.0.1", "0", BACKLOG, NETWORK_LISTEN_NONBLOCK);
+    if (loop == NULL || listener.fd == (socket_t)-1) {
+        return 1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(listener.fd, (struct sockaddr *)&addr, &addrlen);
+    listener.on_accept = server_accept;
+    if (network_loop_add(loop, &listener, NETWORK_EV_READ) < 0) {
+        return 1;
+    }
+
+    int failed = 0;
+    failed |= run_case(loop, &addr, "localhost", 0, 0);
+    failed |= run_case(loop, &addr, "localhost", 0, 1);
+    failed |= run_case(loop, &addr, NULL, NETWORK_LOOP_TLS_FAILED, 0);    // the certificate has no IP address
+    failed |= run_case(loop, &addr, "example.com", NETWORK_LOOP_TLS_FAILED, 0);
+
+    network_loop_close(loop, &listener, 0);
+    network_loop_destroy(loop);
+    network_tls_ctx_free(client_ctx);
+    network_tls_ctx_free(server_ctx);
+    return failed;
+}